@@ -0,0 +1,170 @@
+#!/bin/sh
+#
+# fwsim.sh -- Simulate punching through stateful firewalls
+#
+# Usage: fwsim.sh punchsim tunwall synergy.d [punchsim options]
+#
+# This builds two sites in network namespaces, each behind a stateful
+# firewall, and joins them with a chain of routers that stands in for the
+# Internet.  It then runs punchsim from the local site against the remote
+# site, and prints its lines of JSON, followed by the counters of the
+# firewalls.  A private synergy.d runs in the local site, for punchsim -D.
+#
+#   a -- s1 .. sN -- fwa -- i1 .. iM -- fwb -- b
+#
+# The shape is set in the environment:
+#  SITEHOPS   The number of routers between a and its firewall (1)
+#  NETHOPS    The number of routers between the firewalls (3)
+#  FIREWALL   Either tun for tunwall, or nft for nftables with conntrack
+#  REMOTE     What fwb does with unsolicited packets; drop them, reject
+#             them with a RST or ICMPv6 error, or be open as a plain router
+#
+# A punch passes fwa with a hop limit of SITEHOPS+2 or more, and reaches
+# fwb from SITEHOPS+NETHOPS+3.  Options for synergy.d can be set in
+# $SYNERGYD_OPTS.
+#
+# From: Rick van Rein <rick@openfortress.nl>
+
+
+if [ $# -lt 3 ]
+then
+	echo >&2 "Usage: $0 punchsim tunwall synergy.d [punchsim options]"
+	exit 1
+fi
+
+exec unshare --net --mount sh -e -s "$@" <<'NETNS'
+SIM="$(readlink -f "$1")"
+WALL="$(readlink -f "$2")"
+DAEMON="$(readlink -f "$3")"
+shift 3
+
+SITEHOPS=${SITEHOPS:-1}
+NETHOPS=${NETHOPS:-3}
+FIREWALL=${FIREWALL:-tun}
+REMOTE=${REMOTE:-drop}
+
+case "$FIREWALL" in
+tun)	;;
+nft)	command -v nft >/dev/null || { echo >&2 "No nft command for FIREWALL=nft" ; exit 1 ; } ;;
+*)	echo >&2 "FIREWALL should be tun or nft, not $FIREWALL" ; exit 1 ;;
+esac
+case "$REMOTE" in
+drop|reject|open)	;;
+*)	echo >&2 "REMOTE should be drop, reject or open, not $REMOTE" ; exit 1 ;;
+esac
+
+mount --make-rprivate /
+mount -t tmpfs none "$(readlink -f /var/run)"
+mkdir -p /var/run/netns
+
+# The chain of nodes, and the prefix of the link to the right of each;
+# the local site, the Internet and the remote site each have a /48
+NODES="a"
+PREFIXES="2001:db8:a:0"
+i=1
+while [ $i -le $SITEHOPS ]
+do
+	NODES="$NODES s$i"
+	PREFIXES="$PREFIXES 2001:db8:a:$i"
+	i=$((i+1))
+done
+NODES="$NODES fwa"
+PREFIXES="$PREFIXES 2001:db8:f:0"
+i=1
+while [ $i -le $NETHOPS ]
+do
+	NODES="$NODES i$i"
+	PREFIXES="$PREFIXES 2001:db8:f:$i"
+	i=$((i+1))
+done
+NODES="$NODES fwb b"
+PREFIXES="$PREFIXES 2001:db8:b:0 -"
+
+for node in $NODES
+do
+	ip netns add $node
+	ip -n $node link set lo up
+	ip netns exec $node sh -c 'echo 1 > /proc/sys/net/ipv6/conf/all/forwarding ;
+				echo 0 > /proc/sys/net/ipv6/conf/default/accept_dad'
+done
+
+# Link every node to the next, as ::1 on the left and ::2 on the right
+link () {
+	LEFT=""
+	for node in $NODES
+	do
+		if [ -n "$LEFT" ]
+		then
+			ip link add r0 netns $LEFT type veth peer name l0 netns $node
+			ip -n $LEFT link set r0 up
+			ip -n $node link set l0 up
+			ip -n $LEFT addr add $PREFIX::1/64 dev r0 nodad
+			ip -n $node addr add $PREFIX::2/64 dev l0 nodad
+			ip -n $LEFT route add default via $PREFIX::2
+			ip -n $node route add 2001:db8:a::/48 via $PREFIX::1
+		fi
+		LEFT=$node
+		PREFIX=$1
+		shift
+	done
+}
+
+link $PREFIXES
+ip -n b route add default via 2001:db8:b:0::1
+
+# Route the traffic of a firewall through tunwall, or filter it with nft
+firewall () {
+	node=$1 inside=$2 outside=$3 policy=$4
+	if [ "$FIREWALL" = tun ]
+	then
+		ip netns exec $node "$WALL" $policy $node-in $node-out > /var/run/$node.json &
+		echo $! > /var/run/$node.pid
+		while ! ip -n $node link show $node-out >/dev/null 2>&1
+		do
+			sleep 0.1
+		done
+		ip -n $node link set $node-in up
+		ip -n $node link set $node-out up
+		ip -6 -n $node rule add iif $inside table 100
+		ip -6 -n $node route add default dev $node-in table 100
+		ip -6 -n $node rule add iif $outside table 101
+		ip -6 -n $node route add default dev $node-out table 101
+	else
+		if [ -n "$policy" ]
+		then
+			policy="meta l4proto tcp reject with tcp reset ; reject with icmpv6 type admin-prohibited"
+		fi
+		ip netns exec $node nft -f - <<NFT
+table ip6 fwsim {
+	chain forward {
+		type filter hook forward priority 0; policy drop;
+		ct state established,related accept
+		iifname "$inside" accept
+		$policy
+	}
+}
+NFT
+	fi
+}
+
+firewall fwa l0 r0 ""
+case "$REMOTE" in
+drop)	firewall fwb r0 l0 "" ;;
+reject)	firewall fwb r0 l0 -r ;;
+esac
+
+ip netns exec a "$DAEMON" $SYNERGYD_OPTS 2>/dev/null
+sleep 0.5
+ip netns exec a "$SIM" -l 2001:db8:a:0::1 -r 2001:db8:b:0::2 -n /var/run/netns/b "$@" || STATUS=$?
+kill "$(cat /var/run/synergy.pid)" 2>/dev/null || true
+for node in fwa fwb
+do
+	if [ -r /var/run/$node.pid ]
+	then
+		kill "$(cat /var/run/$node.pid)"
+		wait "$(cat /var/run/$node.pid)" || true
+		cat /var/run/$node.json
+	fi
+done
+exit ${STATUS:-0}
+NETNS
@@ -0,0 +1,55 @@
+#!/bin/sh
+#
+# netns.sh -- Run synergybench in a throwaway network namespace
+#
+# Usage: netns.sh synergybench synergy.d [benchmark options]
+#
+# The benchmark runs in fresh network and mount namespaces, so punches
+# never leave the machine, and synergy.d gets a private /run for its
+# sockets and pidfile.  The punches go out on a dummy interface or, when
+# that is not available, on a veth pair whose peer stays in the namespace.
+# The next hop is a permanent neighbour, so no Neighbour Discovery gets
+# in the way.  Options for synergy.d can be set in $SYNERGYD_OPTS.
+#
+# The output is one line of JSON per benchmark.
+#
+# From: Rick van Rein <rick@openfortress.nl>
+
+
+if [ $# -lt 2 ]
+then
+	echo >&2 "Usage: $0 synergybench synergy.d [benchmark options]"
+	exit 1
+fi
+
+exec unshare --net --mount sh -e -s "$@" <<'NETNS'
+BENCH="$1"
+DAEMON="$2"
+shift 2
+
+mount --make-rprivate /
+mount -t tmpfs none "$(readlink -f /var/run)"
+if [ ! -r /sys/kernel/tracing/events/raw_syscalls/sys_enter/id ]
+then
+	mount -t tracefs none /sys/kernel/tracing 2>/dev/null || true
+fi
+
+ip link set lo up
+if ip link add bench0 type dummy 2>/dev/null
+then
+	:
+else
+	ip link add bench0 type veth peer name bench1
+	ip link set bench1 up
+fi
+ip link set bench0 up
+ip addr add 2001:db8:b::1/64 dev bench0 nodad
+ip neigh add 2001:db8:b::2 lladdr 02:00:00:00:00:02 dev bench0 nud permanent
+ip route add 2001:db8::/64 via 2001:db8:b::2
+
+"$DAEMON" $SYNERGYD_OPTS 2>/dev/null
+sleep 0.5
+"$BENCH" -l 2001:db8:b::1 -r 2001:db8::5 "$@" || STATUS=$?
+kill "$(cat /var/run/synergy.pid)" 2>/dev/null || true
+exit ${STATUS:-0}
+NETNS
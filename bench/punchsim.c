@@ -0,0 +1,517 @@
+/* punchsim.c -- Measure how punches fare through simulated firewalls
+ *
+ * This plays both peers of the quickstart demo, across the firewalls that
+ * bench/fwsim.sh sets up in network namespaces.  The local peer binds a
+ * socket, punches with synergy() and waits for the connection; the remote
+ * peer runs in a child process in the network namespace of the other site,
+ * and connects once the punch is out.  That is repeated for every protocol
+ * and every hop limit in a range, with fresh ports for each trial.
+ *
+ * A trial succeeds when the connection is accepted, or for UDP when the
+ * datagram of the remote peer arrives, before the timeout.  Failed trials
+ * are attributed to a TCP RST or SCTP ABORT from the remote site, which
+ * tears down the hole, or to an ICMPv6 Destination Unreachable, or else to
+ * the timeout.  Time Exceeded messages for the punch are counted as well.
+ *
+ * The output is one line of JSON per protocol and hop limit, with the
+ * outcomes and the latency from the call to synergy() to the connection,
+ * followed by one line per protocol with the range of hop limits that
+ * always succeeded.  That range is what SYNERGY_HOPLIMIT_GUESS and the
+ * hop limits of synergy.d should fall in.
+ *
+ * Options:
+ *  -l address   The local IPv6 address, required
+ *  -r address   The remote IPv6 address, required
+ *  -n path      The network namespace of the remote peer, required
+ *  -p list      The comma-separated protocols to try (tcp,udp,sctp)
+ *  -h min-max   The range of hop limits to try (1-12)
+ *  -t trials    The number of trials per hop limit (10)
+ *  -w ms        The wait between the punch and the connection (10)
+ *  -T ms        The time to wait for the connection (500)
+ *  -P port      The first port to use on either side (20000)
+ *  -D           Punch through synergy.d, with synergy_daemonised()
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+#include <netinet/tcp.h>
+
+#include <sys/socketsynergy.h>
+
+
+/* The most trials per hop limit, which bounds the latency arrays.
+ */
+#define SIM_TRIALS_MAX 1000
+
+/* The SCTP chunk type of an ABORT.
+ */
+#define SCTP_CHUNK_ABORT 6
+
+
+/* The outcome of a trial.
+ */
+enum outcome {
+	SIM_SUCCESS,
+	SIM_RST,
+	SIM_UNREACH,
+	SIM_TIMEOUT,
+	SIM_ERROR,
+	SIM_OUTCOMES
+};
+
+static const char *outcomes [SIM_OUTCOMES] = {
+	"success", "rst", "unreach", "timeout", "error"
+};
+
+
+/* A request from the local peer to the remote peer, which answers with
+ * an int that is 0 or an errno value.
+ */
+struct connreq {
+	int type;
+	int proto;
+	uint16_t port;
+	uint16_t peerport;
+};
+
+
+/* The signals of failure that arrived for a trial.
+ */
+struct signals {
+	int rst;
+	int unreach;
+	int exceeded;
+};
+
+
+static struct sockaddr_in6 local, remot;
+static int (*punch) (int sockfd, uint8_t hoplimit, struct sockaddr_in6 *symcli) = synergy;
+static int minhop = 1, maxhop = 12;
+static int trials = 10;
+static int wait_ms = 10;
+static int timeout_ms = 500;
+static uint16_t nextport = 20000;
+static int rawtcp = -1, rawsctp = -1, rawicmp = -1;
+
+
+static uint64_t sim_now_us (void) {
+	struct timespec now;
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return ((uint64_t) now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
+
+
+static void sim_sleep_ms (int ms) {
+	struct timespec ts;
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000L;
+	while (nanosleep (&ts, &ts) == -1) {
+		if (errno != EINTR) {
+			break;
+		}
+	}
+}
+
+
+static int sim_socket (int type, int proto, struct sockaddr_in6 *addr, uint16_t port) {
+	struct sockaddr_in6 sin6 = *addr;
+	int one = 1;
+	int sox = socket (AF_INET6, type | SOCK_NONBLOCK | SOCK_CLOEXEC, proto);
+	if (sox == -1) {
+		return -1;
+	}
+	setsockopt (sox, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+	sin6.sin6_port = htons (port);
+	if (bind (sox, (struct sockaddr *) &sin6, sizeof (sin6)) == -1) {
+		int sverr = errno;
+		close (sox);
+		errno = sverr;
+		return -1;
+	}
+	return sox;
+}
+
+
+/* The remote peer serves connection requests until the local peer hangs
+ * up.  It runs in the network namespace of the remote site.
+ */
+static void sim_remote (int ctl, const char *netns) {
+	struct connreq req;
+	struct pollfd pfd;
+	int nsfd, sox, err;
+	socklen_t errlen;
+	nsfd = open (netns, O_RDONLY | O_CLOEXEC);
+	if ((nsfd == -1) || (setns (nsfd, CLONE_NEWNET) == -1)) {
+		fprintf (stderr, "Failed to enter network namespace %s: %s\n", netns, strerror (errno));
+		exit (1);
+	}
+	close (nsfd);
+	while (read (ctl, &req, sizeof (req)) == sizeof (req)) {
+		err = 0;
+		sox = sim_socket (req.type, req.proto, &remot, req.port);
+		if (sox == -1) {
+			err = errno;
+		} else {
+			local.sin6_port = htons (req.peerport);
+			if (req.type == SOCK_DGRAM) {
+				if (sendto (sox, "synergy", 7, 0, (struct sockaddr *) &local, sizeof (local)) == -1) {
+					err = errno;
+				}
+			} else if (connect (sox, (struct sockaddr *) &local, sizeof (local)) == -1) {
+				err = errno;
+			}
+		}
+		if (err == EINPROGRESS) {
+			pfd.fd = sox;
+			pfd.events = POLLOUT;
+			err = ETIMEDOUT;
+			if (poll (&pfd, 1, timeout_ms) == 1) {
+				errlen = sizeof (err);
+				getsockopt (sox, SOL_SOCKET, SO_ERROR, &err, &errlen);
+			}
+		}
+		if (sox != -1) {
+			close (sox);
+		}
+		if (write (ctl, &err, sizeof (err)) != sizeof (err)) {
+			break;
+		}
+	}
+	exit (0);
+}
+
+
+/* Collect the signals of failure for a trial from the RAW sockets.
+ */
+static void sim_signals (int proto, uint16_t port, uint16_t peerport, struct signals *sig) {
+	uint8_t buf [1500];
+	struct sockaddr_in6 from;
+	socklen_t fromlen;
+	ssize_t len;
+	uint16_t sport, dport;
+	while (fromlen = sizeof (from),
+			(len = recvfrom (rawicmp, buf, sizeof (buf), 0, (struct sockaddr *) &from, &fromlen)) >= 0) {
+		struct ip6_hdr *inner = (struct ip6_hdr *) (buf + 8);
+		if ((len < 48 + 4) || (inner->ip6_nxt != proto) || (memcmp (&inner->ip6_dst, &remot.sin6_addr, 16) != 0)) {
+			continue;
+		}
+		sport = (buf [48] << 8) | buf [49];
+		dport = (buf [50] << 8) | buf [51];
+		if ((sport != port) || (dport != peerport)) {
+			continue;
+		}
+		if (buf [0] == ICMP6_TIME_EXCEEDED) {
+			sig->exceeded++;
+		} else if (buf [0] == ICMP6_DST_UNREACH) {
+			sig->unreach++;
+		}
+	}
+	while (fromlen = sizeof (from),
+			(len = recvfrom (rawtcp, buf, sizeof (buf), 0, (struct sockaddr *) &from, &fromlen)) >= 0) {
+		if (len < 20) {
+			continue;
+		}
+		sport = (buf [0] << 8) | buf [1];
+		dport = (buf [2] << 8) | buf [3];
+		if ((proto == IPPROTO_TCP) && (sport == peerport) && (dport == port) && (buf [13] & TH_RST)) {
+			sig->rst++;
+		}
+	}
+	while ((rawsctp != -1) && (fromlen = sizeof (from),
+			(len = recvfrom (rawsctp, buf, sizeof (buf), 0, (struct sockaddr *) &from, &fromlen)) >= 0)) {
+		if (len < 13) {
+			continue;
+		}
+		sport = (buf [0] << 8) | buf [1];
+		dport = (buf [2] << 8) | buf [3];
+		if ((proto == IPPROTO_SCTP) && (sport == peerport) && (dport == port) && (buf [12] == SCTP_CHUNK_ABORT)) {
+			sig->rst++;
+		}
+	}
+}
+
+
+/* Run one trial, and return its outcome with the latency in *latency.
+ */
+static enum outcome sim_trial (int ctl, int type, int proto, uint8_t hoplimit,
+				uint64_t *latency, struct signals *sig) {
+	struct connreq req;
+	struct pollfd pfd;
+	uint8_t buf [64];
+	uint64_t t0, deadline, now;
+	int sox, cnx, err;
+	int connected = 0;
+	req.type = type;
+	req.proto = proto;
+	req.port = nextport;
+	req.peerport = nextport;
+	nextport = (nextport < 65000) ? nextport + 1 : 20000;
+	//
+	// Setup the local socket and punch with it
+	sox = sim_socket (type, proto, &local, req.peerport);
+	if (sox == -1) {
+		return SIM_ERROR;
+	}
+	remot.sin6_port = htons (req.port);
+	if (type == SOCK_DGRAM) {
+		err = connect (sox, (struct sockaddr *) &remot, sizeof (remot));
+	} else {
+		err = listen (sox, 5);
+	}
+	if (err == -1) {
+		close (sox);
+		return SIM_ERROR;
+	}
+	t0 = sim_now_us ();
+	if (punch (sox, hoplimit, &remot) == -1) {
+		close (sox);
+		return SIM_ERROR;
+	}
+	//
+	// Have the remote peer connect, and wait for it
+	sim_sleep_ms (wait_ms);
+	if ((write (ctl, &req, sizeof (req)) != sizeof (req))
+			|| (read (ctl, &err, sizeof (err)) != sizeof (err))) {
+		close (sox);
+		return SIM_ERROR;
+	}
+	deadline = t0 + (wait_ms + timeout_ms) * 1000ULL;
+	pfd.fd = sox;
+	pfd.events = POLLIN;
+	while (!connected && ((now = sim_now_us ()) < deadline)) {
+		if (poll (&pfd, 1, (deadline - now + 999) / 1000) <= 0) {
+			continue;
+		}
+		if (type == SOCK_DGRAM) {
+			connected = (recv (sox, buf, sizeof (buf), 0) >= 0);
+		} else {
+			cnx = accept (sox, NULL, NULL);
+			if (cnx != -1) {
+				close (cnx);
+				connected = 1;
+			}
+		}
+	}
+	*latency = sim_now_us () - t0;
+	close (sox);
+	//
+	// Attribute failure to the first signal that explains it
+	sim_signals (proto, req.peerport, req.port, sig);
+	if (connected) {
+		return SIM_SUCCESS;
+	} else if (sig->rst) {
+		return SIM_RST;
+	} else if (sig->unreach) {
+		return SIM_UNREACH;
+	} else {
+		return SIM_TIMEOUT;
+	}
+}
+
+
+static int sim_cmp (const void *a, const void *b) {
+	uint64_t x = * (const uint64_t *) a;
+	uint64_t y = * (const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+
+/* Run all trials for one protocol, and print a line per hop limit.
+ */
+static void sim_proto (int ctl, const char *name) {
+	static uint64_t latency [SIM_TRIALS_MAX];
+	unsigned int outcome [SIM_OUTCOMES];
+	struct signals sig, total;
+	int type, proto, sox;
+	int hop, t, o, n;
+	int lowest = 0, highest = 0;
+	uint64_t sum;
+	if (strcmp (name, "tcp") == 0) {
+		type = SOCK_STREAM;
+		proto = IPPROTO_TCP;
+	} else if (strcmp (name, "udp") == 0) {
+		type = SOCK_DGRAM;
+		proto = IPPROTO_UDP;
+	} else if (strcmp (name, "sctp") == 0) {
+		type = SOCK_STREAM;
+		proto = IPPROTO_SCTP;
+	} else {
+		printf ("{\"proto\":\"%s\",\"error\":\"Unknown protocol\"}\n", name);
+		return;
+	}
+	sox = socket (AF_INET6, type, proto);
+	if (sox == -1) {
+		printf ("{\"proto\":\"%s\",\"error\":\"%s\"}\n", name, strerror (errno));
+		return;
+	}
+	close (sox);
+	for (hop = minhop; hop <= maxhop; hop++) {
+		memset (outcome, 0, sizeof (outcome));
+		memset (&total, 0, sizeof (total));
+		n = 0;
+		sum = 0;
+		for (t = 0; t < trials; t++) {
+			uint64_t lat = 0;
+			memset (&sig, 0, sizeof (sig));
+			o = sim_trial (ctl, type, proto, hop, &lat, &sig);
+			outcome [o]++;
+			total.exceeded += sig.exceeded;
+			if (o == SIM_SUCCESS) {
+				latency [n++] = lat;
+				sum += lat;
+			}
+		}
+		qsort (latency, n, sizeof (uint64_t), sim_cmp);
+		printf ("{\"proto\":\"%s\",\"hoplimit\":%d,\"trials\":%d", name, hop, trials);
+		for (o = 0; o < SIM_OUTCOMES; o++) {
+			printf (",\"%s\":%u", outcomes [o], outcome [o]);
+		}
+		printf (",\"exceeded\":%d", total.exceeded);
+		if (n > 0) {
+			printf (",\"latency_us\":{\"mean\":%llu,\"p50\":%llu,\"p99\":%llu,\"max\":%llu}}\n",
+					(unsigned long long) (sum / n),
+					(unsigned long long) latency [(n * 50) / 100],
+					(unsigned long long) latency [(n * 99) / 100],
+					(unsigned long long) latency [n - 1]);
+		} else {
+			printf (",\"latency_us\":null}\n");
+		}
+		fflush (stdout);
+		if (outcome [SIM_SUCCESS] == (unsigned int) trials) {
+			if (lowest == 0) {
+				lowest = hop;
+				highest = hop;
+			} else if (highest == hop - 1) {
+				highest = hop;
+			}
+		}
+	}
+	printf ("{\"proto\":\"%s\",\"reliable_hoplimits\":", name);
+	if (lowest > 0) {
+		printf ("{\"min\":%d,\"max\":%d}", lowest, highest);
+	} else {
+		printf ("null");
+	}
+	printf (",\"hoplimit_guess\":%d}\n", SYNERGY_HOPLIMIT_GUESS);
+	fflush (stdout);
+}
+
+
+int main (int argc, char *argv []) {
+	char allprotos [] = "tcp,udp,sctp";
+	char *protos = allprotos;
+	char *proto, *saveptr;
+	const char *netns = NULL;
+	int have_local = 0, have_remot = 0;
+	int ctl [2];
+	pid_t child;
+	int opt;
+	//
+	// Parse the options
+	memset (&local, 0, sizeof (local));
+	memset (&remot, 0, sizeof (remot));
+	local.sin6_family = AF_INET6;
+	remot.sin6_family = AF_INET6;
+	while ((opt = getopt (argc, argv, "l:r:n:p:h:t:w:T:P:D")) != -1) {
+		switch (opt) {
+		case 'l':
+			have_local = (inet_pton (AF_INET6, optarg, &local.sin6_addr) > 0);
+			break;
+		case 'r':
+			have_remot = (inet_pton (AF_INET6, optarg, &remot.sin6_addr) > 0);
+			break;
+		case 'n':
+			netns = optarg;
+			break;
+		case 'p':
+			protos = optarg;
+			break;
+		case 'h':
+			if (sscanf (optarg, "%d-%d", &minhop, &maxhop) != 2) {
+				argc = 0;
+			}
+			break;
+		case 't':
+			trials = atoi (optarg);
+			break;
+		case 'w':
+			wait_ms = atoi (optarg);
+			break;
+		case 'T':
+			timeout_ms = atoi (optarg);
+			break;
+		case 'P':
+			nextport = atoi (optarg);
+			break;
+		case 'D':
+			punch = synergy_daemonised;
+			break;
+		default:
+			argc = 0;
+			break;
+		}
+	}
+	if ((argc == 0) || (optind != argc) || !have_local || !have_remot || (netns == NULL)
+			|| (minhop < 1) || (maxhop > 255) || (minhop > maxhop)
+			|| (trials < 1) || (trials > SIM_TRIALS_MAX)
+			|| (wait_ms < 0) || (timeout_ms < 1) || (nextport < 1024)) {
+		fprintf (stderr, "Usage: %s -l local-addr -r remote-addr -n remote-netns [-p proto,...] [-h minhop-maxhop] [-t trials] [-w wait-ms] [-T timeout-ms] [-P port] [-D]\n", argv [0]);
+		exit (1);
+	}
+	//
+	// Open the RAW sockets that pick up the signals of failure
+	rawicmp = socket (AF_INET6, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_ICMPV6);
+	rawtcp  = socket (AF_INET6, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+	rawsctp = socket (AF_INET6, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_SCTP);
+	if ((rawicmp == -1) || (rawtcp == -1)) {
+		fprintf (stderr, "%s: Failed to open RAW sockets, run as root: %s\n", argv [0], strerror (errno));
+		exit (1);
+	}
+	//
+	// Start the remote peer in its own network namespace
+	if (socketpair (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, ctl) == -1) {
+		fprintf (stderr, "%s: Failed to create a socket pair: %s\n", argv [0], strerror (errno));
+		exit (1);
+	}
+	child = fork ();
+	if (child == -1) {
+		fprintf (stderr, "%s: Failed to fork: %s\n", argv [0], strerror (errno));
+		exit (1);
+	}
+	if (child == 0) {
+		close (ctl [0]);
+		sim_remote (ctl [1], netns);
+	}
+	close (ctl [1]);
+	//
+	// Run the trials for each protocol in the order given
+	for (proto = strtok_r (protos, ",", &saveptr); proto != NULL;
+				proto = strtok_r (NULL, ",", &saveptr)) {
+		sim_proto (ctl [0], proto);
+	}
+	close (ctl [0]);
+	waitpid (child, NULL, 0);
+	return 0;
+}
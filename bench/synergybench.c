@@ -0,0 +1,609 @@
+/* synergybench.c -- Benchmark the hot paths of punching
+ *
+ * This measures the latency and throughput of the API calls that punch,
+ * and of synergy.d under concurrent clients.  Every benchmark prints one
+ * line of JSON, with latency percentiles and the system calls and CPU time
+ * per punch, both in this process and in synergy.d.  Figures that cannot
+ * be measured are null.
+ *
+ * The benchmarks are:
+ *  - privileged, for synergy_privileged() in this process;
+ *  - daemonised, for synergy_daemonised(), which relays to synergy.d;
+ *  - synergy, for synergy() in this process, which needs root;
+ *  - synergy-user, for synergy() in a process without privileges;
+ *  - concurrent, for clients without privileges that each submit their
+ *    share of punches to synergy.d with synergy_submit(), and reap them.
+ *
+ * System calls are counted with the raw_syscalls:sys_enter tracepoint, so
+ * tracefs must be mounted.  Punches really go out, so this should run in
+ * a throwaway network namespace; bench/netns.sh sets one up.
+ *
+ * Options:
+ *  -n punches   The number of punches per benchmark (default 100000)
+ *  -c clients   The number of clients for the concurrent benchmark (4)
+ *  -b list      The comma-separated benchmarks to run (all)
+ *  -l address   The local IPv6 address (::)
+ *  -r address   The remote IPv6 address (2001:db8::5)
+ *  -p port      The remote port (5555)
+ *  -H hoplimit  The hop limit of the punches (1)
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <grp.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <linux/perf_event.h>
+
+#include <sys/socketsynergy.h>
+
+
+/* The user and group to run unprivileged benchmarks as.
+ */
+#define BENCH_NOBODY 65534
+
+/* The most threads of synergy.d whose system calls are counted.
+ */
+#define BENCH_THREADS 256
+
+/* The time that synergy.d gets to finish relayed punches, and the time
+ * that it must stay idle to be considered finished.
+ */
+#define BENCH_SETTLE_MS 2000
+#define BENCH_IDLE_MS 50
+
+/* The number of asynchronous punches that a client keeps in flight; more
+ * would risk the loss of completions.
+ */
+#define BENCH_WINDOW 256
+
+
+static struct sockaddr_in6 local, remot;
+static uint8_t hoplimit = 1;
+static unsigned int punches = 100000;
+static int clients = 4;
+
+
+/* The results of one benchmark.  Latencies are in a shared mapping, so
+ * that child processes can fill them in.
+ */
+struct result {
+	const char *name;
+	unsigned int count;
+	unsigned int errors;
+	uint64_t *latency;
+	uint64_t wall_ns;
+	int64_t client_syscalls;
+	int64_t daemon_syscalls;
+	int64_t client_cpu_ns;
+	int64_t daemon_cpu_ns;
+};
+
+
+static uint64_t bench_now_ns (void) {
+	struct timespec now;
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return ((uint64_t) now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+
+static int64_t bench_cpu_ns (void) {
+	struct timespec now;
+	struct rusage ru;
+	clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &now);
+	getrusage (RUSAGE_CHILDREN, &ru);
+	return ((int64_t) now.tv_sec) * 1000000000 + now.tv_nsec
+		+ (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000LL
+		+ (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000LL;
+}
+
+
+/* Find the process of synergy.d from its pidfile, or return 0.
+ */
+static pid_t bench_daemon (void) {
+	char buf [16];
+	ssize_t len;
+	pid_t pid;
+	int fd = open (SYNERGY_DAEMON_PID_FILE, O_RDONLY);
+	if (fd == -1) {
+		return 0;
+	}
+	len = read (fd, buf, sizeof (buf) - 1);
+	close (fd);
+	if (len <= 0) {
+		return 0;
+	}
+	buf [len] = '\0';
+	pid = atoi (buf);
+	if ((pid <= 0) || (kill (pid, 0) == -1)) {
+		return 0;
+	}
+	return pid;
+}
+
+
+/* Sum the CPU time of all threads of synergy.d from their schedstat.
+ */
+static int64_t bench_daemon_cpu_ns (pid_t pid) {
+	char path [320];
+	struct dirent *de;
+	int64_t total = 0;
+	DIR *dir;
+	if (pid == 0) {
+		return -1;
+	}
+	snprintf (path, sizeof (path), "/proc/%d/task", pid);
+	dir = opendir (path);
+	if (dir == NULL) {
+		return -1;
+	}
+	while ((de = readdir (dir)) != NULL) {
+		long long ns;
+		FILE *f;
+		if (de->d_name [0] == '.') {
+			continue;
+		}
+		snprintf (path, sizeof (path), "/proc/%d/task/%s/schedstat", pid, de->d_name);
+		f = fopen (path, "r");
+		if (f == NULL) {
+			continue;
+		}
+		if (fscanf (f, "%lld", &ns) == 1) {
+			total += ns;
+		}
+		fclose (f);
+	}
+	closedir (dir);
+	return total;
+}
+
+
+/* Wait until synergy.d has been idle for a while, so the work that was
+ * relayed to it is included in its figures.
+ */
+static void bench_daemon_settle (pid_t pid) {
+	uint64_t deadline = bench_now_ns () + BENCH_SETTLE_MS * 1000000ULL;
+	int64_t before = bench_daemon_cpu_ns (pid);
+	int64_t after;
+	while ((pid != 0) && (bench_now_ns () < deadline)) {
+		usleep (BENCH_IDLE_MS * 1000);
+		after = bench_daemon_cpu_ns (pid);
+		if (after == before) {
+			break;
+		}
+		before = after;
+	}
+}
+
+
+/* Counters of the system calls that a process or its threads enter.  The
+ * counter for this process is inherited by the children it forks, and
+ * their counts are added when they exit.
+ */
+struct syscount {
+	int fds [BENCH_THREADS];
+	int numfds;
+};
+
+
+static int bench_tracepoint (void) {
+	static const char *paths [] = {
+		"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+		"/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+	};
+	int i, id;
+	for (i = 0; i < 2; i++) {
+		FILE *f = fopen (paths [i], "r");
+		if (f == NULL) {
+			continue;
+		}
+		if (fscanf (f, "%d", &id) != 1) {
+			id = -1;
+		}
+		fclose (f);
+		return id;
+	}
+	return -1;
+}
+
+
+static void syscount_open (struct syscount *sc, pid_t pid) {
+	struct perf_event_attr pea;
+	char path [64];
+	struct dirent *de;
+	DIR *dir;
+	int id = bench_tracepoint ();
+	int fd;
+	sc->numfds = 0;
+	if (id < 0) {
+		return;
+	}
+	memset (&pea, 0, sizeof (pea));
+	pea.type = PERF_TYPE_TRACEPOINT;
+	pea.size = sizeof (pea);
+	pea.config = id;
+	if (pid == 0) {
+		pea.inherit = 1;
+		fd = syscall (__NR_perf_event_open, &pea, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+		if (fd >= 0) {
+			sc->fds [sc->numfds++] = fd;
+		}
+		return;
+	}
+	snprintf (path, sizeof (path), "/proc/%d/task", pid);
+	dir = opendir (path);
+	if (dir == NULL) {
+		return;
+	}
+	while (((de = readdir (dir)) != NULL) && (sc->numfds < BENCH_THREADS)) {
+		if (de->d_name [0] == '.') {
+			continue;
+		}
+		fd = syscall (__NR_perf_event_open, &pea, atoi (de->d_name), -1, -1, PERF_FLAG_FD_CLOEXEC);
+		if (fd >= 0) {
+			sc->fds [sc->numfds++] = fd;
+		}
+	}
+	closedir (dir);
+}
+
+
+static int64_t syscount_read (struct syscount *sc) {
+	int64_t total = 0;
+	uint64_t count;
+	int i;
+	if (sc->numfds == 0) {
+		return -1;
+	}
+	for (i = 0; i < sc->numfds; i++) {
+		if (read (sc->fds [i], &count, sizeof (count)) == sizeof (count)) {
+			total += count;
+		}
+	}
+	return total;
+}
+
+
+static void syscount_close (struct syscount *sc) {
+	int i;
+	for (i = 0; i < sc->numfds; i++) {
+		close (sc->fds [i]);
+	}
+	sc->numfds = 0;
+}
+
+
+/* Open a socket to punch for, bound to the local address.
+ */
+static int bench_socket (void) {
+	int sox = socket (AF_INET6, SOCK_DGRAM, 0);
+	if (sox == -1) {
+		return -1;
+	}
+	if (bind (sox, (struct sockaddr *) &local, sizeof (local)) == -1) {
+		close (sox);
+		return -1;
+	}
+	return sox;
+}
+
+
+/* Give up privileges, and forget that the library had them.
+ */
+static int bench_unprivileged (void) {
+	synergy_fini ();
+	if ((setgroups (0, NULL) == -1) || (setgid (BENCH_NOBODY) == -1)
+			|| (setuid (BENCH_NOBODY) == -1)) {
+		return -1;
+	}
+	return 0;
+}
+
+
+/* Time every call to a punching function.
+ */
+static unsigned int bench_calls (int (*punch) (int, uint8_t, struct sockaddr_in6 *), uint64_t *latency, unsigned int count) {
+	unsigned int errors = 0;
+	unsigned int i;
+	uint64_t t0;
+	int sox = bench_socket ();
+	if (sox == -1) {
+		return count;
+	}
+	for (i = 0; i < count; i++) {
+		t0 = bench_now_ns ();
+		if (punch (sox, hoplimit, &remot) == -1) {
+			errors++;
+		}
+		latency [i] = bench_now_ns () - t0;
+	}
+	close (sox);
+	return errors;
+}
+
+
+/* Submit punches asynchronously and reap their completions, which takes
+ * a round trip through synergy.d.  The latency runs from the submission
+ * to the reaping of the completion.
+ */
+static unsigned int bench_async (uint64_t *latency, unsigned int count) {
+	struct synergy_completion done [64];
+	struct pollfd pfd;
+	unsigned int errors = 0;
+	unsigned int sent = 0;
+	unsigned int reaped = 0;
+	uint64_t *submitted;
+	int got, i;
+	int sox = bench_socket ();
+	submitted = calloc (count, sizeof (uint64_t));
+	if ((sox == -1) || (submitted == NULL)) {
+		return count;
+	}
+	while (reaped < count) {
+		while ((sent < count) && (sent - reaped < BENCH_WINDOW)) {
+			submitted [sent] = bench_now_ns ();
+			if (synergy_submit (sox, hoplimit, &remot, sent) == -1) {
+				if (errno != EAGAIN) {
+					latency [sent] = 0;
+					errors++;
+					reaped++;
+					sent++;
+				}
+				break;
+			}
+			sent++;
+		}
+		pfd.fd = synergy_completion_fd ();
+		pfd.events = POLLIN;
+		if ((pfd.fd == -1) || (poll (&pfd, 1, BENCH_SETTLE_MS) <= 0)) {
+			errors += count - reaped;
+			break;
+		}
+		got = synergy_reap (done, 64);
+		for (i = 0; i < got; i++) {
+			uint64_t tag = done [i].tag;
+			if (tag < count) {
+				latency [tag] = bench_now_ns () - submitted [tag];
+			}
+			if (done [i].error != 0) {
+				errors++;
+			}
+		}
+		if (got > 0) {
+			reaped += got;
+		}
+	}
+	free (submitted);
+	close (sox);
+	return errors;
+}
+
+
+/* Run a benchmark in child processes without privileges.  When a punch
+ * function is given, there is one child that calls it; otherwise there are as many children
+ * as clients, each submitting its share of punches.
+ */
+static unsigned int bench_children (int (*punch) (int, uint8_t, struct sockaddr_in6 *), struct result *res, int children) {
+	unsigned int *errors;
+	unsigned int share, first;
+	pid_t pid;
+	int c, status;
+	errors = mmap (NULL, sizeof (unsigned int) * children, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (errors == MAP_FAILED) {
+		return res->count;
+	}
+	for (c = 0; c < children; c++) {
+		first = (res->count * (uint64_t) c) / children;
+		share = (res->count * (uint64_t) (c + 1)) / children - first;
+		errors [c] = share;
+		pid = fork ();
+		if (pid == -1) {
+			continue;
+		}
+		if (pid == 0) {
+			if (bench_unprivileged () == -1) {
+				_exit (1);
+			}
+			if (punch != NULL) {
+				errors [c] = bench_calls (punch, res->latency + first, share);
+			} else {
+				errors [c] = bench_async (res->latency + first, share);
+			}
+			_exit (0);
+		}
+	}
+	while (wait (&status) > 0) {
+		;
+	}
+	res->errors = 0;
+	for (c = 0; c < children; c++) {
+		res->errors += errors [c];
+	}
+	munmap (errors, sizeof (unsigned int) * children);
+	return res->errors;
+}
+
+
+static int bench_cmp (const void *a, const void *b) {
+	uint64_t x = * (const uint64_t *) a;
+	uint64_t y = * (const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+
+static void bench_per_punch (const char *name, int64_t total, unsigned int count, int comma) {
+	if ((total < 0) || (count == 0)) {
+		printf ("\"%s\":null%s", name, comma ? "," : "");
+	} else {
+		printf ("\"%s\":%.3f%s", name, ((double) total) / count, comma ? "," : "");
+	}
+}
+
+
+/* Print the results of a benchmark as one line of JSON.
+ */
+static void bench_report (struct result *res) {
+	uint64_t *lat = res->latency;
+	unsigned int n = res->count;
+	double secs = res->wall_ns / 1e9;
+	qsort (lat, n, sizeof (uint64_t), bench_cmp);
+	printf ("{\"bench\":\"%s\",\"punches\":%u,\"clients\":%d,\"errors\":%u,"
+			"\"seconds\":%.6f,\"punches_per_sec\":%.1f,",
+			res->name, n, (strcmp (res->name, "concurrent") == 0) ? clients : 1,
+			res->errors, secs, (secs > 0) ? n / secs : 0.0);
+	printf ("\"latency_ns\":{\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu},",
+			(unsigned long long) lat [(n * 50ULL) / 100],
+			(unsigned long long) lat [(n * 90ULL) / 100],
+			(unsigned long long) lat [(n * 99ULL) / 100],
+			(unsigned long long) lat [(n * 999ULL) / 1000],
+			(unsigned long long) lat [n - 1]);
+	printf ("\"syscalls_per_punch\":{");
+	bench_per_punch ("client", res->client_syscalls, n, 1);
+	bench_per_punch ("daemon", res->daemon_syscalls, n, 0);
+	printf ("},\"cpu_ns_per_punch\":{");
+	bench_per_punch ("client", res->client_cpu_ns, n, 1);
+	bench_per_punch ("daemon", res->daemon_cpu_ns, n, 0);
+	printf ("}}\n");
+	fflush (stdout);
+}
+
+
+/* Run one benchmark by name, measuring around it.
+ */
+static int bench_run (const char *name) {
+	struct syscount client, daemon;
+	struct result res;
+	pid_t dpid = bench_daemon ();
+	int64_t csys, dsys, ccpu, dcpu;
+	uint64_t t0;
+	memset (&res, 0, sizeof (res));
+	res.name = name;
+	res.count = punches;
+	res.latency = mmap (NULL, sizeof (uint64_t) * punches, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (res.latency == MAP_FAILED) {
+		return -1;
+	}
+	syscount_open (&client, 0);
+	syscount_open (&daemon, dpid);
+	csys = syscount_read (&client);
+	dsys = syscount_read (&daemon);
+	ccpu = bench_cpu_ns ();
+	dcpu = bench_daemon_cpu_ns (dpid);
+	t0 = bench_now_ns ();
+	if (strcmp (name, "privileged") == 0) {
+		res.errors = bench_calls (synergy_privileged, res.latency, punches);
+	} else if (strcmp (name, "daemonised") == 0) {
+		res.errors = bench_calls (synergy_daemonised, res.latency, punches);
+	} else if (strcmp (name, "synergy") == 0) {
+		res.errors = bench_calls (synergy, res.latency, punches);
+	} else if (strcmp (name, "synergy-user") == 0) {
+		bench_children (synergy, &res, 1);
+	} else if (strcmp (name, "concurrent") == 0) {
+		bench_children (NULL, &res, clients);
+	} else {
+		fprintf (stderr, "Unknown benchmark: %s\n", name);
+		munmap (res.latency, sizeof (uint64_t) * punches);
+		return -1;
+	}
+	res.wall_ns = bench_now_ns () - t0;
+	bench_daemon_settle (dpid);
+	res.client_syscalls = (csys < 0) ? -1 : syscount_read (&client) - csys;
+	res.daemon_syscalls = (dsys < 0) ? -1 : syscount_read (&daemon) - dsys;
+	res.client_cpu_ns = bench_cpu_ns () - ccpu;
+	res.daemon_cpu_ns = (dcpu < 0) ? -1 : bench_daemon_cpu_ns (dpid) - dcpu;
+	syscount_close (&client);
+	syscount_close (&daemon);
+	bench_report (&res);
+	munmap (res.latency, sizeof (uint64_t) * punches);
+	return 0;
+}
+
+
+int main (int argc, char *argv []) {
+	char allbenches [] = "privileged,daemonised,synergy,synergy-user,concurrent";
+	char *benches = allbenches;
+	char *bench, *saveptr;
+	int failed = 0;
+	int opt;
+	//
+	// Parse the options
+	memset (&local, 0, sizeof (local));
+	memset (&remot, 0, sizeof (remot));
+	local.sin6_family = AF_INET6;
+	remot.sin6_family = AF_INET6;
+	inet_pton (AF_INET6, "2001:db8::5", &remot.sin6_addr);
+	remot.sin6_port = htons (5555);
+	while ((opt = getopt (argc, argv, "n:c:b:l:r:p:H:")) != -1) {
+		switch (opt) {
+		case 'n':
+			punches = atoi (optarg);
+			break;
+		case 'c':
+			clients = atoi (optarg);
+			break;
+		case 'b':
+			benches = optarg;
+			break;
+		case 'l':
+			if (inet_pton (AF_INET6, optarg, &local.sin6_addr) <= 0) {
+				argc = 0;
+			}
+			break;
+		case 'r':
+			if (inet_pton (AF_INET6, optarg, &remot.sin6_addr) <= 0) {
+				argc = 0;
+			}
+			break;
+		case 'p':
+			remot.sin6_port = htons (atoi (optarg));
+			break;
+		case 'H':
+			hoplimit = atoi (optarg);
+			break;
+		default:
+			argc = 0;
+			break;
+		}
+	}
+	if ((argc == 0) || (optind != argc) || (punches < 1) || (clients < 1)) {
+		fprintf (stderr, "Usage: %s [-n punches] [-c clients] [-b bench,...] [-l local-addr] [-r remote-addr] [-p remote-port] [-H hoplimit]\n", argv [0]);
+		exit (1);
+	}
+	if (geteuid () != 0) {
+		fprintf (stderr, "%s: Run as root, in a throwaway network namespace\n", argv [0]);
+		exit (1);
+	}
+	//
+	// Run the benchmarks in the order given
+	for (bench = strtok_r (benches, ",", &saveptr); bench != NULL;
+				bench = strtok_r (NULL, ",", &saveptr)) {
+		if (bench_run (bench) == -1) {
+			failed = 1;
+		}
+	}
+	return failed;
+}
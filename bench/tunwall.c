@@ -0,0 +1,521 @@
+/* tunwall.c -- A stateful firewall on TUN devices, to simulate punching
+ *
+ * This is the kind of firewall that synergy punches through, modelled on
+ * the filtering behaviour of RFC 4787 and RFC 5382, but without NAT.  It
+ * runs in a network namespace that routes packets from the inside into one
+ * TUN device and packets from the outside into another; bench/fwsim.sh
+ * sets that up.  Packets are written back into the device they came from,
+ * after which the kernel forwards them as usual.
+ *
+ * Outgoing packets are always passed.  A TCP SYN and any UDP or SCTP packet
+ * create a flow, keyed by protocol, addresses and ports.  Incoming packets
+ * only pass when they match a flow, and so do incoming ICMPv6 errors about
+ * a flow.  An incoming TCP RST or SCTP ABORT tears down its flow, unless
+ * the -k option is given.  Other incoming packets are dropped or, with the
+ * -r option, rejected with a TCP RST or an ICMPv6 Administratively
+ * Prohibited message.
+ *
+ * The kernel decrements the hop limit twice on the way through, once into
+ * the TUN device and once out of it.  The firewall increments it when it
+ * writes a packet back, so the namespace counts as a single hop.  Punches
+ * whose hop limit runs out on the way into the TUN device do not reach the
+ * firewall, just like they would not reach the connection tracking of a
+ * real one.
+ *
+ * The counters are printed as one line of JSON on SIGUSR1 and on exit.
+ *
+ * Options:
+ *  -r           Reject incoming packets instead of dropping them
+ *  -k           Keep flows when an incoming RST or ABORT arrives
+ *  -t seconds   Idle timeout of TCP and SCTP flows (240)
+ *  -u seconds   Idle timeout of UDP flows (120)
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+
+#include <net/if.h>
+#include <linux/if_tun.h>
+
+
+/* The number of hash buckets for flows, and the largest packet handled.
+ */
+#define TUNWALL_BUCKETS 4096
+#define TUNWALL_MTU 2048
+
+/* The minimum MTU of IPv6, which bounds the ICMPv6 messages we send.
+ */
+#define TUNWALL_MINMTU 1280
+
+/* Established TCP flows live much longer than half-open ones.
+ */
+#define TUNWALL_ESTABLISHED 7440
+
+/* The SCTP chunk type of an ABORT.
+ */
+#define SCTP_CHUNK_ABORT 6
+
+
+/* A flow is stored with the inside endpoint first.
+ */
+struct flow {
+	struct flow *next;
+	struct in6_addr inaddr;
+	struct in6_addr outaddr;
+	uint16_t inport;
+	uint16_t outport;
+	uint8_t proto;
+	uint8_t established;
+	time_t expiry;
+};
+
+static struct flow *flows [TUNWALL_BUCKETS];
+
+static struct {
+	unsigned long outgoing;
+	unsigned long incoming;
+	unsigned long dropped;
+	unsigned long rejected;
+	unsigned long teardowns;
+	unsigned long created;
+	unsigned long expired;
+	unsigned long active;
+} count;
+
+static const char *name = "tunwall";
+static int reject = 0;
+static int keepflows = 0;
+static int tcp_timeout = 240;
+static int udp_timeout = 120;
+static volatile sig_atomic_t report = 0;
+static volatile sig_atomic_t stop = 0;
+
+
+static void tunwall_signal (int sig) {
+	if (sig == SIGUSR1) {
+		report = 1;
+	} else {
+		stop = 1;
+	}
+}
+
+
+/* Open a TUN device by name, creating it when it does not exist yet.
+ */
+static int tunwall_open (const char *ifname) {
+	struct ifreq ifr;
+	int fd = open ("/dev/net/tun", O_RDWR | O_CLOEXEC);
+	if (fd == -1) {
+		return -1;
+	}
+	memset (&ifr, 0, sizeof (ifr));
+	ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+	strncpy (ifr.ifr_name, ifname, IFNAMSIZ - 1);
+	if (ioctl (fd, TUNSETIFF, &ifr) == -1) {
+		int sverr = errno;
+		close (fd);
+		errno = sverr;
+		return -1;
+	}
+	return fd;
+}
+
+
+/* The Internet checksum over the pseudo header and an upper layer.
+ */
+static uint16_t tunwall_csum (struct ip6_hdr *ip6, uint8_t proto, const void *data, size_t len) {
+	const uint8_t *p;
+	uint32_t sum = 0;
+	size_t i;
+	p = (const uint8_t *) &ip6->ip6_src;
+	for (i = 0; i < 32; i += 2) {
+		sum += (p [i] << 8) | p [i + 1];
+	}
+	sum += len >> 16;
+	sum += len & 0xffff;
+	sum += proto;
+	p = data;
+	for (i = 0; i + 1 < len; i += 2) {
+		sum += (p [i] << 8) | p [i + 1];
+	}
+	if (len & 1) {
+		sum += p [len - 1] << 8;
+	}
+	while (sum >> 16) {
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+	return htons (~sum & 0xffff);
+}
+
+
+static unsigned int tunwall_hash (uint8_t proto, const struct in6_addr *inaddr, uint16_t inport,
+				const struct in6_addr *outaddr, uint16_t outport) {
+	const uint32_t *a = (const uint32_t *) inaddr->s6_addr;
+	const uint32_t *b = (const uint32_t *) outaddr->s6_addr;
+	uint32_t h = proto ^ (inport << 16) ^ outport;
+	int i;
+	for (i = 0; i < 4; i++) {
+		h = (h ^ a [i]) * 0x9e3779b1;
+		h = (h ^ b [i]) * 0x9e3779b1;
+	}
+	return (h >> 8) % TUNWALL_BUCKETS;
+}
+
+
+/* Find a flow, and create it when asked to.  Expired flows are removed
+ * on the way.  Returns NULL when there is no such flow.
+ */
+static struct flow *tunwall_flow (uint8_t proto, const struct in6_addr *inaddr, uint16_t inport,
+				const struct in6_addr *outaddr, uint16_t outport, int create) {
+	struct flow **pf = &flows [tunwall_hash (proto, inaddr, inport, outaddr, outport)];
+	time_t now = time (NULL);
+	struct flow *f;
+	while ((f = *pf) != NULL) {
+		if (f->expiry < now) {
+			*pf = f->next;
+			free (f);
+			count.expired++;
+			count.active--;
+			continue;
+		}
+		if ((f->proto == proto) && (f->inport == inport) && (f->outport == outport)
+				&& (memcmp (&f->inaddr, inaddr, 16) == 0)
+				&& (memcmp (&f->outaddr, outaddr, 16) == 0)) {
+			return f;
+		}
+		pf = &f->next;
+	}
+	if (!create) {
+		return NULL;
+	}
+	f = calloc (1, sizeof (struct flow));
+	if (f == NULL) {
+		return NULL;
+	}
+	f->proto = proto;
+	f->inaddr = *inaddr;
+	f->outaddr = *outaddr;
+	f->inport = inport;
+	f->outport = outport;
+	f->next = *pf;
+	*pf = f;
+	count.created++;
+	count.active++;
+	return f;
+}
+
+
+static void tunwall_remove (struct flow *gone) {
+	struct flow **pf = &flows [tunwall_hash (gone->proto, &gone->inaddr, gone->inport,
+					&gone->outaddr, gone->outport)];
+	while (*pf != NULL) {
+		if (*pf == gone) {
+			*pf = gone->next;
+			free (gone);
+			count.teardowns++;
+			count.active--;
+			return;
+		}
+		pf = &(*pf)->next;
+	}
+}
+
+
+static void tunwall_refresh (struct flow *f) {
+	int timeout = (f->proto == IPPROTO_UDP) ? udp_timeout : tcp_timeout;
+	if (f->established && (f->proto != IPPROTO_UDP)) {
+		timeout = TUNWALL_ESTABLISHED;
+	}
+	f->expiry = time (NULL) + timeout;
+}
+
+
+/* Return the ports of a TCP, UDP or SCTP packet, which all start with
+ * them, or -1 for other packets.
+ */
+static int tunwall_ports (const uint8_t *pkt, size_t len, uint16_t *src, uint16_t *dst) {
+	const struct ip6_hdr *ip6 = (const struct ip6_hdr *) pkt;
+	uint8_t nxt = ip6->ip6_nxt;
+	if ((nxt != IPPROTO_TCP) && (nxt != IPPROTO_UDP) && (nxt != IPPROTO_SCTP)) {
+		return -1;
+	}
+	if (len < sizeof (struct ip6_hdr) + 4) {
+		return -1;
+	}
+	*src = (pkt [40] << 8) | pkt [41];
+	*dst = (pkt [42] << 8) | pkt [43];
+	return 0;
+}
+
+
+/* Handle a packet from the inside, which is always passed.
+ */
+static void tunwall_outgoing (uint8_t *pkt, size_t len) {
+	struct ip6_hdr *ip6 = (struct ip6_hdr *) pkt;
+	uint16_t sport, dport;
+	struct flow *f;
+	int create;
+	count.outgoing++;
+	if (tunwall_ports (pkt, len, &sport, &dport) == -1) {
+		return;
+	}
+	create = 1;
+	if (ip6->ip6_nxt == IPPROTO_TCP) {
+		create = (len >= 40 + 14) && ((pkt [53] & (TH_SYN | TH_ACK)) == TH_SYN);
+	}
+	f = tunwall_flow (ip6->ip6_nxt, &ip6->ip6_src, sport, &ip6->ip6_dst, dport, create);
+	if (f != NULL) {
+		tunwall_refresh (f);
+	}
+}
+
+
+/* Handle a packet from the outside, and return whether it may pass.
+ */
+static int tunwall_incoming (uint8_t *pkt, size_t len) {
+	struct ip6_hdr *ip6 = (struct ip6_hdr *) pkt;
+	struct ip6_hdr *inner;
+	uint16_t sport, dport;
+	struct flow *f;
+	//
+	// ICMPv6 errors pass when the packet they quote matches a flow
+	if (ip6->ip6_nxt == IPPROTO_ICMPV6) {
+		if ((len < 40 + 8 + 40 + 4) || (pkt [40] >= 128)) {
+			return 0;
+		}
+		inner = (struct ip6_hdr *) (pkt + 48);
+		if (tunwall_ports (pkt + 48, len - 48, &sport, &dport) == -1) {
+			return 0;
+		}
+		f = tunwall_flow (inner->ip6_nxt, &inner->ip6_src, sport, &inner->ip6_dst, dport, 0);
+		return (f != NULL);
+	}
+	//
+	// Other packets pass when they match a flow from the outside
+	if (tunwall_ports (pkt, len, &sport, &dport) == -1) {
+		return 0;
+	}
+	f = tunwall_flow (ip6->ip6_nxt, &ip6->ip6_dst, dport, &ip6->ip6_src, sport, 0);
+	if (f == NULL) {
+		return 0;
+	}
+	if (ip6->ip6_nxt == IPPROTO_TCP) {
+		if ((len >= 40 + 14) && (pkt [53] & TH_RST) && !keepflows) {
+			tunwall_remove (f);
+			return 1;
+		}
+	} else if (ip6->ip6_nxt == IPPROTO_SCTP) {
+		if ((len >= 40 + 13) && (pkt [52] == SCTP_CHUNK_ABORT) && !keepflows) {
+			tunwall_remove (f);
+			return 1;
+		}
+	}
+	f->established = 1;
+	tunwall_refresh (f);
+	return 1;
+}
+
+
+/* Reject a packet from the outside with a TCP RST, or otherwise with an
+ * ICMPv6 Administratively Prohibited message, sent on behalf of the host
+ * that it was meant for.  Neither RSTs nor ICMPv6 errors are answered.
+ */
+static void tunwall_reject (int fd, uint8_t *pkt, size_t len) {
+	uint8_t out [TUNWALL_MINMTU];
+	struct ip6_hdr *ip6 = (struct ip6_hdr *) pkt;
+	struct ip6_hdr *rip6 = (struct ip6_hdr *) out;
+	size_t rlen;
+	memset (out, 0, 40);
+	rip6->ip6_flow = htonl (6 << 28);
+	rip6->ip6_hlim = 64;
+	rip6->ip6_src = ip6->ip6_dst;
+	rip6->ip6_dst = ip6->ip6_src;
+	if ((ip6->ip6_nxt == IPPROTO_TCP) && (len >= 40 + 20)) {
+		struct tcphdr *tcp = (struct tcphdr *) (pkt + 40);
+		struct tcphdr *rst = (struct tcphdr *) (out + 40);
+		if (tcp->th_flags & TH_RST) {
+			return;
+		}
+		memset (rst, 0, sizeof (struct tcphdr));
+		rst->th_sport = tcp->th_dport;
+		rst->th_dport = tcp->th_sport;
+		rst->th_off = 5;
+		if (tcp->th_flags & TH_ACK) {
+			rst->th_seq = tcp->th_ack;
+			rst->th_flags = TH_RST;
+		} else {
+			size_t seglen = len - 40 - 4 * tcp->th_off;
+			if (tcp->th_flags & TH_SYN) {
+				seglen++;
+			}
+			if (tcp->th_flags & TH_FIN) {
+				seglen++;
+			}
+			rst->th_ack = htonl (ntohl (tcp->th_seq) + seglen);
+			rst->th_flags = TH_RST | TH_ACK;
+		}
+		rip6->ip6_nxt = IPPROTO_TCP;
+		rlen = sizeof (struct tcphdr);
+		rip6->ip6_plen = htons (rlen);
+		rst->th_sum = tunwall_csum (rip6, IPPROTO_TCP, rst, rlen);
+	} else {
+		struct icmp6_hdr *icmp = (struct icmp6_hdr *) (out + 40);
+		if ((ip6->ip6_nxt == IPPROTO_ICMPV6) && ((len < 41) || (pkt [40] < 128))) {
+			return;
+		}
+		rlen = len;
+		if (rlen > sizeof (out) - 48) {
+			rlen = sizeof (out) - 48;
+		}
+		memset (icmp, 0, sizeof (struct icmp6_hdr));
+		icmp->icmp6_type = ICMP6_DST_UNREACH;
+		icmp->icmp6_code = ICMP6_DST_UNREACH_ADMIN;
+		memcpy (out + 48, pkt, rlen);
+		rlen += 8;
+		rip6->ip6_nxt = IPPROTO_ICMPV6;
+		rip6->ip6_plen = htons (rlen);
+		icmp->icmp6_cksum = tunwall_csum (rip6, IPPROTO_ICMPV6, icmp, rlen);
+	}
+	if (write (fd, out, 40 + rlen) == -1) {
+		fprintf (stderr, "%s: Failed to reject a packet: %s\n", name, strerror (errno));
+		return;
+	}
+	count.rejected++;
+}
+
+
+/* Pass a packet by writing it back, with the hop limit that the kernel
+ * took off on the way into the TUN device restored.
+ */
+static void tunwall_pass (int fd, uint8_t *pkt, size_t len) {
+	struct ip6_hdr *ip6 = (struct ip6_hdr *) pkt;
+	if (ip6->ip6_hlim < 255) {
+		ip6->ip6_hlim++;
+	}
+	if (write (fd, pkt, len) == -1) {
+		fprintf (stderr, "%s: Failed to pass a packet: %s\n", name, strerror (errno));
+	}
+}
+
+
+static void tunwall_report (void) {
+	printf ("{\"firewall\":\"%s\",\"outgoing\":%lu,\"incoming\":%lu,\"dropped\":%lu,"
+			"\"rejected\":%lu,\"teardowns\":%lu,\"flows_created\":%lu,"
+			"\"flows_expired\":%lu,\"flows_active\":%lu}\n",
+			name, count.outgoing, count.incoming, count.dropped,
+			count.rejected, count.teardowns, count.created,
+			count.expired, count.active);
+	fflush (stdout);
+}
+
+
+int main (int argc, char *argv []) {
+	struct pollfd pfd [2];
+	struct sigaction sa;
+	uint8_t pkt [TUNWALL_MTU];
+	ssize_t len;
+	int opt;
+	int i;
+	//
+	// Parse the options
+	while ((opt = getopt (argc, argv, "rkt:u:")) != -1) {
+		switch (opt) {
+		case 'r':
+			reject = 1;
+			break;
+		case 'k':
+			keepflows = 1;
+			break;
+		case 't':
+			tcp_timeout = atoi (optarg);
+			break;
+		case 'u':
+			udp_timeout = atoi (optarg);
+			break;
+		default:
+			argc = 0;
+			break;
+		}
+	}
+	if ((argc == 0) || (optind + 2 != argc) || (tcp_timeout < 1) || (udp_timeout < 1)) {
+		fprintf (stderr, "Usage: %s [-r] [-k] [-t tcp-timeout] [-u udp-timeout] inside-tun outside-tun\n", argv [0]);
+		exit (1);
+	}
+	name = argv [optind];
+	//
+	// Open the TUN devices for both sides
+	for (i = 0; i < 2; i++) {
+		pfd [i].fd = tunwall_open (argv [optind + i]);
+		if (pfd [i].fd == -1) {
+			fprintf (stderr, "%s: Failed to open TUN device %s: %s\n",
+					argv [0], argv [optind + i], strerror (errno));
+			exit (1);
+		}
+		pfd [i].events = POLLIN;
+	}
+	memset (&sa, 0, sizeof (sa));
+	sa.sa_handler = tunwall_signal;
+	sigaction (SIGUSR1, &sa, NULL);
+	sigaction (SIGTERM, &sa, NULL);
+	sigaction (SIGINT,  &sa, NULL);
+	//
+	// Filter packets until told to stop
+	while (!stop) {
+		if (report) {
+			report = 0;
+			tunwall_report ();
+		}
+		if (poll (pfd, 2, -1) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf (stderr, "%s: Failed to poll: %s\n", argv [0], strerror (errno));
+			exit (1);
+		}
+		for (i = 0; i < 2; i++) {
+			if (!(pfd [i].revents & POLLIN)) {
+				continue;
+			}
+			len = read (pfd [i].fd, pkt, sizeof (pkt));
+			if ((len < (ssize_t) sizeof (struct ip6_hdr)) || ((pkt [0] >> 4) != 6)) {
+				continue;
+			}
+			if (i == 0) {
+				tunwall_outgoing (pkt, len);
+				tunwall_pass (pfd [0].fd, pkt, len);
+			} else if (tunwall_incoming (pkt, len)) {
+				count.incoming++;
+				tunwall_pass (pfd [1].fd, pkt, len);
+			} else {
+				count.dropped++;
+				if (reject) {
+					tunwall_reject (pfd [1].fd, pkt, len);
+				}
+			}
+		}
+	}
+	tunwall_report ();
+	return 0;
+}
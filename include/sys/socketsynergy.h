@@ -5,6 +5,8 @@
 
 
 #include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
 #include <netinet/in.h>
 
 
@@ -14,15 +16,292 @@
 int synergy (int sockfd, uint8_t hoplimit, struct sockaddr_in6 *symcli);
 
 
+/* The two variants that synergy() chooses from can also be called directly.
+ * The privileged variant constructs RAW packets, so it needs root or the
+ * CAP_NET_RAW capability; this is also what synergy.d uses.  The daemonised
+ * variant relays the request to synergy.d and runs without privileges.
+ */
+int synergy_privileged (int sockfd, uint8_t hoplimit, struct sockaddr_in6 *symcli);
+int synergy_daemonised (int sockfd, uint8_t hoplimit, struct sockaddr_in6 *symcli);
+
+
+/* Punching for many sockets and peers at once is done with an array of
+ * the following structure.  Each entry gets its status filled in, which
+ * is 0 on success or an errno value on failure.  The symcli may be NULL
+ * for connected sockets, just like in synergy().  The protocol of the punch
+ * is filled in when the packet was constructed in this process, and is 0
+ * otherwise.
+ */
+struct synergy_punch {
+	int sockfd;
+	uint8_t hoplimit;
+	struct sockaddr_in6 *symcli;
+	int status;
+	uint8_t proto;
+};
+
+
+/* The batch API call sends all punch packets in as few system calls as
+ * possible, or passes them to synergy.d in as few messages as possible.
+ * It returns 0 when all entries succeeded, or otherwise -1 with errno
+ * set to the status of the first failed entry.
+ */
+int synergy_many (struct synergy_punch *punches, unsigned int count);
+int synergy_privileged_many (struct synergy_punch *punches, unsigned int count);
+int synergy_daemonised_many (struct synergy_punch *punches, unsigned int count);
+
+
+/* Punches that are of no use after a while, such as those for a rendezvous
+ * that the peer gives up on, can be given a deadline in milliseconds from
+ * the moment synergy.d takes them in.  Under load, the daemon sends the
+ * punches with the earliest deadlines first, ahead of those without one,
+ * and it drops those that it could not send in time, which then fail with
+ * ETIMEDOUT where the outcome is reported.  A deadline of 0 means none.
+ * Privileged processes send right away, so they ignore the deadline.
+ */
+int synergy_many_deadline (struct synergy_punch *punches, unsigned int count, uint16_t deadline_ms);
+
+
+/* The library keeps RAW sockets open between calls, one per protocol.
+ * These are opened on first use, or upfront with synergy_init(), and
+ * they are closed by synergy_fini().  Both calls are optional.  Only
+ * call synergy_fini() when no other threads are using synergy().
+ */
+int synergy_init (void);
+void synergy_fini (void);
+
+
+/* The RAW sockets normally have the kernel construct the IPv6 header, with
+ * the hop limit and source address passed as ancillary data.  With the
+ * SYNERGY_INIT_HDRINCL flag, the library writes the IPv6 header itself and
+ * sends it over IPPROTO_RAW sockets, which skips the ancillary data.  The
+ * flags apply to the process-wide sockets and to rawsets opened afterwards.
+ */
+#define SYNERGY_INIT_HDRINCL 0x01
+
+int synergy_init_flags (unsigned int flags);
+
+
+/* A private set of RAW sockets, one for each of TCP, UDP and SCTP.  This is
+ * for threads that want to send without sharing the process-wide cache,
+ * such as the workers in synergy.d.  The sockets may be set non-blocking.
+ */
+struct synergy_rawset {
+	int sox [3];
+};
+
+int synergy_rawset_open (struct synergy_rawset *rs);
+void synergy_rawset_close (struct synergy_rawset *rs);
+int synergy_rawset_many (struct synergy_rawset *rs, struct synergy_punch *punches, unsigned int count);
+
+
+/* Build a punch as a complete IPv6 packet, header included, without sending
+ * it.  This serves transmit paths that bypass the RAW sockets, such as the
+ * packet rings of synergy.d.  The buffer must hold SYNERGY_PACKET_MAX bytes.
+ * Returns the length of the packet, or -1 with errno set.
+ */
+#define SYNERGY_PACKET_MAX 128
+
+ssize_t synergy_packet (int sockfd, uint8_t hoplimit, struct sockaddr_in6 *symcli, void *buf, size_t buflen);
+
+
+/* The asynchronous API submits requests without waiting for them, and
+ * reports on their outcome later.  Every request carries a tag that is
+ * chosen by the caller and returned in its completion record, along with
+ * 0 for success or the errno value of the failed operation.
+ *
+ * Non-root processes share one persistent session with synergy.d, which
+ * reports the outcome of its own RAW send.  The completion fd becomes
+ * readable when completions are waiting; it can be used with poll(),
+ * select() or epoll.  Completions should be reaped regularly, as they may
+ * be lost when too many pile up.  A submission that cannot be queued
+ * fails with EAGAIN; reaping completions then makes room for more.  When
+ * synergy.d restarts, synergy_reap() fails once with ECONNRESET and the
+ * completion fd must be fetched again.
+ */
+struct synergy_completion {
+	uint64_t tag;
+	int32_t error;
+	uint32_t latency_us;
+	uint8_t lower;
+	uint8_t upper;
+	uint8_t reserved [6];
+};
+
+int synergy_submit (int sockfd, uint8_t hoplimit, struct sockaddr_in6 *symcli, uint64_t tag);
+
+
+/* Holes in firewalls close when no traffic passes them for a while, which
+ * may take only tens of seconds for UDP.  Instead of punching again from
+ * a timer of its own, an application can register its socket with the
+ * refresh service of synergy.d, which punches again every interval_ms.
+ * The registration punches right away, and that punch completes with the
+ * tag; refreshes do not complete.  The registration ends when the socket
+ * is closed, which is noticed when the next refresh is due, or when the
+ * process exits, or when the socket is registered with interval_ms 0.
+ * Registering a socket again changes its hop limit and interval.
+ *
+ * Refreshes are always scheduled by synergy.d, also for privileged
+ * processes, whose completion fd then includes the session.
+ */
+int synergy_submit_refresh (int sockfd, uint8_t hoplimit, struct sockaddr_in6 *symcli, uint64_t tag, uint32_t interval_ms);
+int synergy_completion_fd (void);
+int synergy_reap (struct synergy_completion *done, unsigned int maxdone);
+
+
+/* Services that punch at a high rate can skip the system call per punch
+ * by registering their sockets with synergy.d once, and then submitting
+ * punches through a ring in memory that they share with the daemon.  The
+ * doorbell is only rung when the daemon has gone idle.  Registering returns
+ * a handle, or -1 with errno set.  Submitting fails with EAGAIN when the
+ * ring is full.  The symcli may be NULL for sockets that were connected
+ * when they were registered.  Punches through the ring do not complete,
+ * and failures show up in the metrics of synergy.d only.
+ */
+int synergy_ring_register (int sockfd);
+int synergy_ring_submit (int handle, uint8_t hoplimit, struct sockaddr_in6 *symcli);
+int synergy_ring_unregister (int handle);
+
+
+/* A punch can be confirmed by the ICMPv6 Time Exceeded message that it draws
+ * from the router where its hop limit runs out.  Once that has arrived, the
+ * punch has passed the local firewalls and the hole exists.
+ *
+ * The confirmed submission completes when the Time Exceeded message comes
+ * in, with the latency since sending in microseconds, or when the timeout
+ * expires, with error ETIMEDOUT.  The blocking call punches and waits for
+ * confirmation, and returns the latency in the same way.
+ */
+int synergy_submit_confirm (int sockfd, uint8_t hoplimit, struct sockaddr_in6 *symcli, uint64_t tag, int timeout_ms);
+int synergy_confirmed (int sockfd, uint8_t hoplimit, struct sockaddr_in6 *symcli, int timeout_ms, uint32_t *latency_us);
+
+
+/* Replies that punches draw from the network can be received on a RAW
+ * ICMPv6 socket that is opened by synergy_reply_open().  A kernel filter
+ * lets only Time Exceeded and Destination Unreachable messages through
+ * that quote a TCP, UDP or SCTP packet.  These are read with
+ * synergy_reply_read(), which returns 1 for a reply, 0 when no more
+ * replies are waiting, or -1 on error.  This is used by synergy.d, but
+ * may also be used by other tools.
+ *
+ * Addresses are those of the punch, so local is the quoted source; the
+ * reporter is the node that sent the reply.  Ports are in network byte
+ * order.  The marker is that of a probe sent by synergy_probe(), or 0.
+ * Probes also learn from TCP RST replies, which are reported with the
+ * remote end as the reporter.
+ */
+#define SYNERGY_REPLY_TIMEEXCEEDED 1
+#define SYNERGY_REPLY_UNREACHABLE 2
+#define SYNERGY_REPLY_RST 3
+
+struct synergy_reply {
+	int kind;
+	int proto;
+	struct in6_addr local;
+	struct in6_addr remote;
+	struct in6_addr reporter;
+	uint16_t localport;
+	uint16_t remoteport;
+	uint32_t marker;
+};
+
+int synergy_reply_open (void);
+int synergy_reply_read (int sox, struct synergy_reply *reply);
+
+
+/* The hop limit range for a destination can be learned explicitly, by
+ * sending a burst of marked probes with every hop limit from 1 to maxhop,
+ * and matching the replies to the probes.  The lower bound is the lowest
+ * hop limit whose Time Exceeded message comes from a router outside the
+ * local site, so that all local firewalls have been passed.  The upper
+ * bound is one below the lowest hop limit that reached the remote end,
+ * as shown by a TCP RST or by a Destination Unreachable message.  Either
+ * bound is 0 when it could not be learned.
+ *
+ * The probes are sent from the given socket, so they also punch holes for
+ * it, and they may draw a RST from the remote end; a fresh socket is best.
+ * The call waits for the replies for at most timeout_ms, and fails with
+ * ETIMEDOUT when neither bound was learned.
+ */
+#define SYNERGY_PROBE_MAXHOP 32
+#define SYNERGY_PROBE_SITEPREFIX 48
+
+int synergy_probe (int sockfd, struct sockaddr_in6 *symcli, uint8_t maxhop, int timeout_ms, uint8_t *lower, uint8_t *upper);
+
+
+/* Peers that both sit behind a firewall can meet at an instant on the wall
+ * clock that they agreed on.  Each side calls synergy_connect() with the
+ * same rendezvous, punches lead_us before the instant, and connects at the
+ * instant: TCP and one-to-one SCTP sockets with a non-blocking connect(),
+ * which may be a simultaneous open, and UDP sockets with connect() and an
+ * empty hello datagram, after which a datagram from the peer is awaited.
+ * An instant of zero means lead_us from now.  The socket must be bound to
+ * the port that the peer was told, or the call fails with EINVAL; retries
+ * start from that same port.
+ *
+ * Each attempt has timeout_ms from its instant.  After a failure that a
+ * retry may overcome, the next instant follows after a backoff, which
+ * doubles up to backoff_max_ms.  Both sides compute the same schedule, and
+ * a late caller skips the attempts that are over.  Fields that are 0 take
+ * the defaults below.  The socket is connected on success, and the call
+ * fails with the error of the last attempt otherwise.
+ *
+ * The timing of the last attempt is relative to its instant, in ns, so
+ * the punch shows up as a negative offset.  The sent_ns is when a UDP hello
+ * left according to the kernel, and 0 when this is not known.
+ */
+#define SYNERGY_CONNECT_LEAD_US 2000
+#define SYNERGY_CONNECT_TIMEOUT_MS 2000
+#define SYNERGY_CONNECT_BACKOFF_MS 250
+#define SYNERGY_CONNECT_ATTEMPTS 4
+
+struct synergy_rendezvous {
+	struct timespec instant;
+	uint32_t lead_us;
+	uint32_t timeout_ms;
+	uint32_t backoff_ms;
+	uint32_t backoff_max_ms;
+	uint8_t attempts;
+};
+
+struct synergy_connect_timing {
+	uint32_t attempts;
+	int64_t punch_ns;
+	int64_t connect_ns;
+	int64_t sent_ns;
+	int64_t established_ns;
+	uint64_t total_ns;
+};
+
+int synergy_connect (int sockfd, uint8_t hoplimit, struct sockaddr_in6 *peer, const struct synergy_rendezvous *rv, struct synergy_connect_timing *timing);
+
+
 /* No more than a guess, the following hoplimit is likely to work in most
  * places -- but it does not guarantee anything, so it is a default at best.
  */
 #define SYNERGY_HOPLIMIT_GUESS 3
 
 
+/* The hop limits that synergy.d learns, from probes and from the TCP RST
+ * replies to punches, are kept per destination prefix in a cache file that
+ * survives restarts, and that every process maps to read them without
+ * asking the daemon.  synergy() and synergy_many() replace a hoplimit of 0
+ * with the learned maximum for the peer, or else its learned minimum.  When
+ * nothing was learned, synergy.d applies its own minimum, and processes
+ * that send punches themselves use SYNERGY_HOPLIMIT_GUESS.
+ *
+ * synergy_hoprange() looks up the learned range for an address, with 0 for
+ * a bound that was not learned, and returns -1 with errno ENOENT when the
+ * cache has no range for it.  $SYNERGY_HOPCACHE overrides the path.
+ */
+int synergy_hoprange (const struct in6_addr *addr, uint8_t *minhop, uint8_t *maxhop);
+
+
 /* The following request format is relayed to a socket running synergy.d
  * service.  The socket is a connection-less UNIX domain socket, which sends
- * no response, so the request is fully asynchronous.
+ * no response, so the request is fully asynchronous.  This is the first
+ * version of the format, which the library no longer sends, but which
+ * synergy.d still accepts from older binaries.
  *
  * Along with the request, the socket to influence must be sent as ancillary
  * data, which is a portable POSIX technique.  Doing it this way means that
@@ -36,13 +315,196 @@ struct synergy_request_message {
 };
 
 
+/* A batch of requests is sent as an array of request messages in a single
+ * datagram, with the sockets as one SCM_RIGHTS array in the same order.
+ * The kernel does not pass more than this many descriptors in one message.
+ */
+#define SYNERGY_BATCH_MAX 253
+
+
+/* The second version of the request format starts with a header, which
+ * tells it apart from the first version, whose datagrams start with the
+ * address family of a peer.  The header is followed by count requests of
+ * entsize bytes each, so later versions can extend the requests; the
+ * daemon ignores the bytes that it does not know.  Requests refer to the
+ * sockets in the SCM_RIGHTS array by their index, so several requests may
+ * share a socket.
+ *
+ * Requests hint at the protocol, local address and local port of their
+ * socket, so synergy.d does not have to look them up; a proto of 0 means
+ * that there are no hints.  An unbound socket is hinted with the
+ * unspecified address.  The daemon checks the hints against the socket,
+ * unless it was started to trust them.
+ *
+ * With SYNERGY_WIRE_REPLY in the header, the daemon responds with a single
+ * datagram that holds a header with the same flag, followed by a struct
+ * synergy_completion per request, in the same order and tagged with the
+ * reqid.  The sender must be bound to an address to receive it.  Datagrams
+ * without the flag get no response.
+ *
+ * The same format is accepted over sessions, where every request completes
+ * on its own, tagged with its reqid.  The flags and timeout_ms then work as
+ * in struct synergy_session_request, for SYNERGY_SESSION_CONFIRM only.
+ *
+ * A request with a deadline_ms expires when the daemon could not send it
+ * within that many milliseconds after it took it in, and completes with
+ * ETIMEDOUT; see synergy_many_deadline().
+ */
+#define SYNERGY_WIRE_MAGIC 0x5357
+#define SYNERGY_WIRE_VERSION 2
+#define SYNERGY_WIRE_REPLY 0x01
+
+struct synergy_wire_header {
+	uint16_t magic;
+	uint8_t version;
+	uint8_t flags;
+	uint16_t count;
+	uint16_t entsize;
+};
+
+struct synergy_wire_request {
+	uint64_t reqid;
+	struct sockaddr_in6 symcli;
+	struct in6_addr local;
+	uint16_t localport;
+	uint8_t proto;
+	uint8_t hoplimit;
+	uint16_t fdindex;
+	uint8_t flags;
+	uint8_t reserved;
+	uint16_t timeout_ms;
+	uint16_t deadline_ms;
+};
+
+#define SYNERGY_WIRE_MAX (sizeof (struct synergy_wire_header) \
+		+ SYNERGY_BATCH_MAX * sizeof (struct synergy_wire_request))
+
+
+/* Asynchronous requests are sent over a persistent session, which is a
+ * SOCK_SEQPACKET connection to synergy.d.  Every request is one message,
+ * with the socket to influence as SCM_RIGHTS ancillary data.  The daemon
+ * responds to each with a struct synergy_completion message.
+ *
+ * With the SYNERGY_SESSION_CONFIRM flag, the daemon only completes after
+ * the Time Exceeded confirmation, or after timeout_ms with ETIMEDOUT.
+ *
+ * With the SYNERGY_SESSION_PROBE flag, the daemon runs synergy_probe()
+ * on the socket, with hoplimit as the maximum hop limit, and returns the
+ * bounds in the lower and upper fields of the completion.
+ */
+struct synergy_session_request {
+	uint64_t tag;
+	struct sockaddr_in6 symcli;
+	uint8_t hoplimit;
+	uint8_t flags;
+	uint16_t timeout_ms;
+};
+
+#define SYNERGY_SESSION_CONFIRM 0x01
+#define SYNERGY_SESSION_PROBE 0x02
+#define SYNERGY_SESSION_REFRESH 0x04
+
+
+/* With the SYNERGY_SESSION_REFRESH flag, the request is extended with the
+ * number of the socket in the client, which identifies the registration
+ * and lets the daemon notice when it is closed, and the refresh interval.
+ * An interval of 0 cancels the registration, and completes with ENOENT
+ * when there was none; it does not punch.
+ */
+struct synergy_refresh_request {
+	struct synergy_session_request req;
+	int32_t sockfd;
+	uint32_t interval_ms;
+};
+
+
+/* With the SYNERGY_SESSION_RING flag, the request manages a ring of punch
+ * requests in shared memory, on a session of its own.  The op attaches the
+ * ring, with the memfd that holds it and an eventfd for the doorbell as
+ * SCM_RIGHTS; or it registers the socket that it passes, and completes with
+ * the handle as its tag; or it unregisters the given handle, without a
+ * socket.  The memfd must be sealed against shrinking, and the eventfd must
+ * not block.  The ring lasts as long as its session.
+ *
+ * The ring is a bounded queue for many producers, the threads of the client,
+ * and one consumer, the daemon.  Every entry has a sequence number, which
+ * is its position when free and its position plus one when filled in.  A
+ * producer claims a position by advancing the tail, fills in the entry, and
+ * then sets its sequence number.  The daemon sets it to the position plus
+ * the number of entries when it has taken the entry.  The daemon sets the
+ * idle flag before it waits, and clears it when it finds an entry after
+ * all; otherwise, the producer that clears it rings the doorbell.  The
+ * entries name their socket by handle, and a symcli with family 0 stands
+ * for the peer that the socket was connected to when it was registered.
+ */
+#define SYNERGY_SESSION_RING 0x08
+
+#define SYNERGY_RING_ATTACH 1
+#define SYNERGY_RING_REGISTER 2
+#define SYNERGY_RING_UNREGISTER 3
+
+struct synergy_ring_request {
+	struct synergy_session_request req;
+	uint32_t op;
+	uint32_t handle;
+};
+
+#define SYNERGY_RING_MAGIC 0x53595247
+#define SYNERGY_RING_ENTRIES 4096
+
+struct synergy_ring_entry {
+	uint64_t seq;
+	uint32_t handle;
+	uint8_t hoplimit;
+	uint8_t reserved [3];
+	struct sockaddr_in6 symcli;
+	uint8_t padding [20];
+};
+
+struct synergy_ring {
+	uint32_t magic;
+	uint32_t entries;
+	uint64_t tail __attribute__ ((aligned (64)));
+	uint32_t idle __attribute__ ((aligned (64)));
+	struct synergy_ring_entry entry [] __attribute__ ((aligned (64)));
+};
+
+
+/* Processes in a cgroup to which synergy.d attached its eBPF program, with
+ * its -B option, can ask for a punch with a single setsockopt() on the
+ * socket, which the kernel passes to the daemon without involving the
+ * process any further.  The socket must be bound to a port.  A symcli
+ * with family 0 stands for the peer that the socket is connected to, and
+ * a hoplimit of 0 asks for the hop limit that the daemon has for the peer.
+ * Outside such a cgroup, the option fails with ENOPROTOOPT; when the daemon
+ * cannot take the request, it fails with EPERM.  synergy() tries this
+ * before it sends to the daemon socket.
+ */
+#define SOL_SYNERGY 0x5359
+#define SYNERGY_SO_PUNCH 1
+
+struct synergy_sockopt_punch {
+	struct sockaddr_in6 symcli;
+	uint8_t hoplimit;
+	uint8_t reserved [3];
+};
+
+
 /* The path leading to the synergy daemon socket.
  */
 #define SYNERGY_DAEMON_SOCKET_PATH "/var/run/synergy.sock"
 
+/* The path leading to the synergy daemon socket for sessions.
+ */
+#define SYNERGY_DAEMON_SESSION_PATH "/var/run/synergy-session.sock"
+
 /* The path leading to the synergy daemon pidfile.
  */
 #define SYNERGY_DAEMON_PID_FILE "/var/run/synergy.pid"
 
+/* The path leading to the hop cache that synergy.d maintains.
+ */
+#define SYNERGY_HOPCACHE_PATH "/var/cache/synergy.hops"
+
 
 #endif /* SYS_SOCKETSYNERGY_H */
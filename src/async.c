@@ -0,0 +1,603 @@
+/* async.c -- Asynchronous synergy requests with completion records
+ *
+ * Processes without RAW privileges hold one persistent SOCK_SEQPACKET
+ * session with synergy.d.  Requests are pipelined over this session, each
+ * tagged by the caller, and the daemon returns a completion record with
+ * the outcome of its RAW send.  The session socket itself is the pollable
+ * completion fd, so no helper thread is needed.
+ *
+ * Privileged processes send the punch immediately, and queue the completion
+ * locally.  An epoll instance then serves as the pollable completion fd,
+ * so that applications need not know which of the two paths is taken.  It
+ * holds an eventfd for queued completions and, once confirmations are
+ * requested, the socket for ICMPv6 replies and a timerfd for timeouts.
+ *
+ * Refreshes are scheduled by synergy.d for all processes, so privileged
+ * processes that register them also connect the session, and add it to
+ * their epoll instance.
+ *
+ * The session is per process.  After fork() the child drops the session
+ * and local completions that it inherited, and sets up its own when it
+ * submits a request.  When synergy.d goes away, the completions that it
+ * still owed are lost; synergy_reap() then fails once with ECONNRESET,
+ * after which synergy_completion_fd() returns the fd of a new session.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+
+#include <netinet/in.h>
+
+#include <sys/socketsynergy.h>
+
+#include "libsynergy.h"
+
+
+
+
+/* The number of completions that can be queued or awaiting confirmation
+ * locally for privileged processes.  When it is full, submissions fail
+ * with EAGAIN.
+ */
+#define SYNERGY_LOCAL_COMPLETIONS 1024
+
+
+/* A punch sent by a privileged process, awaiting its confirmation.
+ */
+struct pending {
+	uint64_t tag;
+	struct in6_addr remote;
+	uint16_t remoteport;
+	uint16_t localport;
+	struct timespec sent;
+	struct timespec deadline;
+};
+
+
+static pthread_mutex_t asynclock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t asynconce = PTHREAD_ONCE_INIT;
+static int sessfd = -1;
+static int sesslost = 0;
+static int localep = -1;
+static int localfd = -1;
+static int replyfd = -1;
+static int timerfd = -1;
+static struct synergy_completion localq [SYNERGY_LOCAL_COMPLETIONS];
+static unsigned int localhead = 0;
+static unsigned int localcount = 0;
+static struct pending pendq [SYNERGY_LOCAL_COMPLETIONS];
+static unsigned int pendcount = 0;
+
+
+/* Close all descriptors and drop all completions.  This is called with
+ * asynclock held, or in the child after fork().
+ */
+static void synergy_async_reset (void) {
+	int *fds [] = { &sessfd, &localep, &localfd, &replyfd, &timerfd };
+	unsigned int i;
+	for (i = 0; i < sizeof (fds) / sizeof (fds [0]); i++) {
+		if (*fds [i] >= 0) {
+			close (*fds [i]);
+			*fds [i] = -1;
+		}
+	}
+	sesslost = 0;
+	localhead = 0;
+	localcount = 0;
+	pendcount = 0;
+}
+
+
+static void asynclock_prepare (void) {
+	pthread_mutex_lock (&asynclock);
+}
+
+static void asynclock_parent (void) {
+	pthread_mutex_unlock (&asynclock);
+}
+
+static void asynclock_child (void) {
+	synergy_async_reset ();
+	pthread_mutex_unlock (&asynclock);
+}
+
+static void asynclock_setup (void) {
+	pthread_atfork (asynclock_prepare, asynclock_parent, asynclock_child);
+}
+
+
+int synergy_session_connect (int sockflags) {
+	struct sockaddr_un socket_path;
+	int sox = socket (PF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | sockflags, 0);
+	if (sox == -1) {
+		return -1;
+	}
+	memset (&socket_path, 0, sizeof (socket_path));
+	socket_path.sun_family = PF_UNIX;
+	strncpy (socket_path.sun_path, SYNERGY_DAEMON_SESSION_PATH,
+				sizeof (socket_path.sun_path));
+	if (connect (sox, (struct sockaddr *) &socket_path,
+				sizeof (socket_path)) == -1) {
+		int err = errno;
+		close (sox);
+		errno = err;
+		return -1;
+	}
+	return sox;
+}
+
+
+int synergy_session_message (int sox, const void *msg, size_t len, int sockfd) {
+	char anc [CMSG_SPACE (sizeof (int))];
+	struct iovec iov;
+	struct msghdr mgh;
+	struct cmsghdr *cmg;
+	memset (&anc, 0, sizeof (anc));
+	memset (&iov, 0, sizeof (iov));
+	memset (&mgh, 0, sizeof (mgh));
+	iov.iov_len = len;
+	iov.iov_base = (void *) msg;
+	mgh.msg_iovlen = 1;
+	mgh.msg_iov = &iov;
+	mgh.msg_controllen = sizeof (anc);
+	mgh.msg_control = &anc;
+	cmg = CMSG_FIRSTHDR (&mgh);
+	cmg->cmsg_level = SOL_SOCKET;
+	cmg->cmsg_type = SCM_RIGHTS;
+	cmg->cmsg_len = CMSG_LEN (sizeof (int));
+	* (int *) CMSG_DATA (cmg) = sockfd;
+	if (sendmsg (sox, &mgh, MSG_NOSIGNAL) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+
+int synergy_session_request (int sox, struct synergy_session_request *req, int sockfd) {
+	if (req->flags & SYNERGY_SESSION_REFRESH) {
+		return synergy_session_message (sox, req, sizeof (struct synergy_refresh_request), sockfd);
+	} else {
+		return synergy_session_message (sox, req, sizeof (*req), sockfd);
+	}
+}
+
+
+/* Return the session with synergy.d, connecting it when needed.  When
+ * privileged processes use it for refreshes, it is added to their local
+ * completion fd.  This is called with asynclock held.
+ */
+static int synergy_session (void) {
+	struct epoll_event ev;
+	if (sessfd == -1) {
+		sessfd = synergy_session_connect (SOCK_NONBLOCK);
+		if ((sessfd >= 0) && (localep >= 0)) {
+			memset (&ev, 0, sizeof (ev));
+			ev.events = EPOLLIN;
+			epoll_ctl (localep, EPOLL_CTL_ADD, sessfd, &ev);
+		}
+	}
+	return sessfd;
+}
+
+
+/* Send a message over the session.  When the daemon has gone away, one
+ * attempt is made to reconnect.  This is called with asynclock held.
+ */
+static int synergy_session_send (const void *msg, size_t len, int sockfd) {
+	int retry;
+	for (retry = 0; retry < 2; retry++) {
+		int sox = synergy_session ();
+		if (sox == -1) {
+			return -1;
+		}
+		if (synergy_session_message (sox, msg, len, sockfd) == 0) {
+			return 0;
+		}
+		if ((errno != EPIPE) && (errno != ECONNRESET) && (errno != ENOTCONN)) {
+			return -1;
+		}
+		close (sessfd);
+		sessfd = -1;
+		sesslost = 1;
+	}
+	return -1;
+}
+
+
+/* Return the epoll instance that serves as the completion fd for privileged
+ * processes, creating it with its eventfd when needed.  This is called with
+ * asynclock held.
+ */
+static int synergy_localep (void) {
+	struct epoll_event ev;
+	if (localep >= 0) {
+		return localep;
+	}
+	localep = epoll_create1 (EPOLL_CLOEXEC);
+	localfd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	memset (&ev, 0, sizeof (ev));
+	ev.events = EPOLLIN;
+	if ((localep == -1) || (localfd == -1)
+			|| (epoll_ctl (localep, EPOLL_CTL_ADD, localfd, &ev) == -1)) {
+		int err = errno;
+		synergy_async_reset ();
+		errno = err;
+		return -1;
+	}
+	return localep;
+}
+
+
+/* Add the reply socket and the timerfd to the completion fd, when they are
+ * not there yet.  This is called with asynclock held.
+ */
+static int synergy_localconfirm (void) {
+	struct epoll_event ev;
+	memset (&ev, 0, sizeof (ev));
+	ev.events = EPOLLIN;
+	if (replyfd == -1) {
+		int sox = synergy_reply_open ();
+		if (sox == -1) {
+			return -1;
+		}
+		if (epoll_ctl (localep, EPOLL_CTL_ADD, sox, &ev) == -1) {
+			close (sox);
+			return -1;
+		}
+		replyfd = sox;
+	}
+	if (timerfd == -1) {
+		int tfd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (tfd == -1) {
+			return -1;
+		}
+		if (epoll_ctl (localep, EPOLL_CTL_ADD, tfd, &ev) == -1) {
+			close (tfd);
+			return -1;
+		}
+		timerfd = tfd;
+	}
+	return 0;
+}
+
+
+/* Queue a completion locally.  This is called with asynclock held, after
+ * checking that there is room.
+ */
+static void synergy_local_complete (uint64_t tag, int error, uint32_t latency_us) {
+	struct synergy_completion *cpl;
+	cpl = &localq [(localhead + localcount) % SYNERGY_LOCAL_COMPLETIONS];
+	memset (cpl, 0, sizeof (*cpl));
+	cpl->tag = tag;
+	cpl->error = error;
+	cpl->latency_us = latency_us;
+	localcount++;
+	eventfd_write (localfd, 1);
+}
+
+
+static int timespec_before (const struct timespec *a, const struct timespec *b) {
+	return (a->tv_sec < b->tv_sec) || ((a->tv_sec == b->tv_sec) && (a->tv_nsec < b->tv_nsec));
+}
+
+
+/* Arm the timerfd for the earliest deadline of the pending confirmations,
+ * or disarm it when none are pending.  This is called with asynclock held.
+ */
+static void synergy_local_timer (void) {
+	struct itimerspec its;
+	unsigned int i;
+	memset (&its, 0, sizeof (its));
+	for (i = 0; i < pendcount; i++) {
+		if ((i == 0) || timespec_before (&pendq [i].deadline, &its.it_value)) {
+			its.it_value = pendq [i].deadline;
+		}
+	}
+	timerfd_settime (timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+
+/* Match incoming replies and passed deadlines against the pending
+ * confirmations, and turn them into completions.  This is called with
+ * asynclock held.
+ */
+static void synergy_local_confirms (void) {
+	struct synergy_reply reply;
+	struct timespec now;
+	uint64_t ticks;
+	unsigned int i;
+	if (timerfd == -1) {
+		return;
+	}
+	while (synergy_reply_read (replyfd, &reply) > 0) {
+		if (reply.kind != SYNERGY_REPLY_TIMEEXCEEDED) {
+			continue;
+		}
+		clock_gettime (CLOCK_MONOTONIC, &now);
+		for (i = 0; i < pendcount; i++) {
+			struct pending *p = &pendq [i];
+			if ((p->localport != reply.localport) || (p->remoteport != reply.remoteport)
+					|| (memcmp (&p->remote, &reply.remote, sizeof (p->remote)) != 0)) {
+				continue;
+			}
+			synergy_local_complete (p->tag, 0,
+					(now.tv_sec  - p->sent.tv_sec ) * 1000000 +
+					(now.tv_nsec - p->sent.tv_nsec) / 1000);
+			*p = pendq [--pendcount];
+			break;
+		}
+	}
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	i = 0;
+	while (i < pendcount) {
+		if (timespec_before (&now, &pendq [i].deadline)) {
+			i++;
+			continue;
+		}
+		synergy_local_complete (pendq [i].tag, ETIMEDOUT, 0);
+		pendq [i] = pendq [--pendcount];
+	}
+	read (timerfd, &ticks, sizeof (ticks));
+	synergy_local_timer ();
+}
+
+
+/* Privileged processes punch now.  The completion is queued locally right
+ * away or, with a timeout for confirmation, when the reply arrives or the
+ * timeout expires.
+ */
+static int synergy_submit_privileged (int sockfd, uint8_t hoplimit, struct sockaddr_in6 *symcli, uint64_t tag, int timeout_ms) {
+	struct sockaddr_in6 local, remot;
+	socklen_t namesz;
+	struct pending *p;
+	int retval = -1;
+	int err = 0;
+	pthread_mutex_lock (&asynclock);
+	if (localcount + pendcount >= SYNERGY_LOCAL_COMPLETIONS) {
+		err = EAGAIN;
+		goto unlock;
+	}
+	if (synergy_localep () == -1) {
+		err = errno;
+		goto unlock;
+	}
+	if (timeout_ms <= 0) {
+		synergy_local_complete (tag,
+				synergy_privileged (sockfd, hoplimit, symcli) ? errno : 0, 0);
+		retval = 0;
+		goto unlock;
+	}
+	//
+	// Confirmation matches the reply on the local port and remote address
+	if (synergy_localconfirm () == -1) {
+		err = errno;
+		goto unlock;
+	}
+	retval = 0;
+	namesz = sizeof (local);
+	if (getsockname (sockfd, (struct sockaddr *) &local, &namesz)) {
+		synergy_local_complete (tag, errno, 0);
+		goto unlock;
+	}
+	if (symcli == NULL) {
+		namesz = sizeof (remot);
+		if (getpeername (sockfd, (struct sockaddr *) &remot, &namesz)) {
+			synergy_local_complete (tag, errno, 0);
+			goto unlock;
+		}
+		symcli = &remot;
+	}
+	p = &pendq [pendcount];
+	p->tag = tag;
+	memcpy (&p->remote, &symcli->sin6_addr, sizeof (p->remote));
+	p->remoteport = symcli->sin6_port;
+	p->localport = local.sin6_port;
+	clock_gettime (CLOCK_MONOTONIC, &p->sent);
+	p->deadline.tv_sec  = p->sent.tv_sec  + timeout_ms / 1000;
+	p->deadline.tv_nsec = p->sent.tv_nsec + (timeout_ms % 1000) * 1000000;
+	if (p->deadline.tv_nsec >= 1000000000) {
+		p->deadline.tv_sec++;
+		p->deadline.tv_nsec -= 1000000000;
+	}
+	if (synergy_privileged (sockfd, hoplimit, symcli) == -1) {
+		synergy_local_complete (tag, errno, 0);
+		goto unlock;
+	}
+	pendcount++;
+	synergy_local_timer ();
+unlock:
+	pthread_mutex_unlock (&asynclock);
+	errno = err;
+	return retval;
+}
+
+
+/* Others pass the request over the session with synergy.d, in the second
+ * version of the request format, so it comes with hints about the socket.
+ */
+static int synergy_submit_daemonised (int sockfd, uint8_t hoplimit, struct sockaddr_in6 *symcli, uint64_t tag, int timeout_ms) {
+	struct {
+		struct synergy_wire_header hdr;
+		struct synergy_wire_request req;
+	} msg;
+	int retval;
+	int err;
+	memset (&msg.hdr, 0, sizeof (msg.hdr));
+	if (synergy_wire_fill (&msg.req, sockfd, hoplimit, symcli) == -1) {
+		return -1;
+	}
+	msg.hdr.magic = SYNERGY_WIRE_MAGIC;
+	msg.hdr.version = SYNERGY_WIRE_VERSION;
+	msg.hdr.count = 1;
+	msg.hdr.entsize = sizeof (msg.req);
+	msg.req.reqid = tag;
+	if (timeout_ms > 0) {
+		msg.req.flags = SYNERGY_SESSION_CONFIRM;
+		msg.req.timeout_ms = (timeout_ms > 65535) ? 65535 : timeout_ms;
+	}
+	pthread_mutex_lock (&asynclock);
+	retval = synergy_session_send (&msg, sizeof (msg), sockfd);
+	err = errno;
+	pthread_mutex_unlock (&asynclock);
+	synergy_trace (SYNERGY_TRACE_DAEMONISED, NULL, 0, &msg.req.symcli.sin6_addr, msg.req.symcli.sin6_port,
+			0, hoplimit, retval ? err : 0);
+	errno = err;
+	return retval;
+}
+
+
+/* Submit a request without waiting for it to be handled.  The outcome is
+ * reported later as a completion with the given tag.
+ */
+int synergy_submit (int sockfd, uint8_t hoplimit, struct sockaddr_in6 *symcli, uint64_t tag) {
+	pthread_once (&asynconce, asynclock_setup);
+	if (synergy_rawable ()) {
+		return synergy_submit_privileged (sockfd, hoplimit, symcli, tag, 0);
+	} else {
+		return synergy_submit_daemonised (sockfd, hoplimit, symcli, tag, 0);
+	}
+}
+
+
+/* Submit a request whose completion waits for the Time Exceeded reply that
+ * confirms the punch, or for the timeout to expire.
+ */
+int synergy_submit_confirm (int sockfd, uint8_t hoplimit, struct sockaddr_in6 *symcli, uint64_t tag, int timeout_ms) {
+	if (timeout_ms <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	pthread_once (&asynconce, asynclock_setup);
+	if (synergy_rawable ()) {
+		return synergy_submit_privileged (sockfd, hoplimit, symcli, tag, timeout_ms);
+	} else {
+		return synergy_submit_daemonised (sockfd, hoplimit, symcli, tag, timeout_ms);
+	}
+}
+
+
+/* Register a socket for refreshes by synergy.d, or cancel that with an
+ * interval of 0.  Privileged processes get a local completion fd first,
+ * so the session is added to it.
+ */
+int synergy_submit_refresh (int sockfd, uint8_t hoplimit, struct sockaddr_in6 *symcli, uint64_t tag, uint32_t interval_ms) {
+	struct synergy_refresh_request rr;
+	struct sockaddr_in6 remot;
+	socklen_t namesz = sizeof (remot);
+	int retval = -1;
+	int err;
+	pthread_once (&asynconce, asynclock_setup);
+	memset (&rr, 0, sizeof (rr));
+	if ((symcli == NULL) && (interval_ms > 0)) {
+		if (getpeername (sockfd, (struct sockaddr *) &remot, &namesz)) {
+			return -1;
+		}
+		symcli = &remot;
+	}
+	if (symcli != NULL) {
+		memcpy (&rr.req.symcli, symcli, sizeof (rr.req.symcli));
+	}
+	rr.req.tag = tag;
+	rr.req.hoplimit = hoplimit;
+	rr.req.flags = SYNERGY_SESSION_REFRESH;
+	rr.sockfd = sockfd;
+	rr.interval_ms = interval_ms;
+	pthread_mutex_lock (&asynclock);
+	if (!synergy_rawable () || (synergy_localep () >= 0)) {
+		retval = synergy_session_send (&rr, sizeof (rr), sockfd);
+	}
+	err = errno;
+	pthread_mutex_unlock (&asynclock);
+	errno = err;
+	return retval;
+}
+
+
+/* Return the file descriptor that becomes readable when completions are
+ * available for synergy_reap().
+ */
+int synergy_completion_fd (void) {
+	int fd;
+	int err;
+	pthread_once (&asynconce, asynclock_setup);
+	pthread_mutex_lock (&asynclock);
+	if (synergy_rawable ()) {
+		fd = synergy_localep ();
+	} else {
+		fd = synergy_session ();
+	}
+	err = errno;
+	pthread_mutex_unlock (&asynclock);
+	errno = err;
+	return fd;
+}
+
+
+/* Collect up to maxdone completions, without waiting.  Returns the number
+ * of completions collected, which may be 0, or -1 on error.
+ */
+int synergy_reap (struct synergy_completion *done, unsigned int maxdone) {
+	unsigned int got = 0;
+	eventfd_t dummy;
+	pthread_once (&asynconce, asynclock_setup);
+	pthread_mutex_lock (&asynclock);
+	//
+	// Locally queued completions, from the privileged path
+	synergy_local_confirms ();
+	while ((got < maxdone) && (localcount > 0)) {
+		done [got++] = localq [localhead];
+		localhead = (localhead + 1) % SYNERGY_LOCAL_COMPLETIONS;
+		localcount--;
+	}
+	if ((localfd >= 0) && (localcount == 0)) {
+		eventfd_read (localfd, &dummy);
+	}
+	//
+	// Completions sent by synergy.d over the session
+	while ((got < maxdone) && (sessfd >= 0)) {
+		ssize_t len = recv (sessfd, &done [got], sizeof (done [got]), MSG_DONTWAIT);
+		if (len == sizeof (done [got])) {
+			got++;
+		} else if (len == -1) {
+			break;
+		} else if (len == 0) {
+			/* The daemon hung up; reconnect on the next submit */
+			close (sessfd);
+			sessfd = -1;
+			sesslost = 1;
+		}
+	}
+	//
+	// Report a lost session once, so the caller can fetch the new fd
+	if ((got == 0) && sesslost) {
+		sesslost = 0;
+		pthread_mutex_unlock (&asynclock);
+		errno = ECONNRESET;
+		return -1;
+	}
+	pthread_mutex_unlock (&asynclock);
+	return got;
+}
+
+
+void synergy_async_fini (void) {
+	pthread_once (&asynconce, asynclock_setup);
+	pthread_mutex_lock (&asynclock);
+	synergy_async_reset ();
+	pthread_mutex_unlock (&asynclock);
+}
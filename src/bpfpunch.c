@@ -0,0 +1,434 @@
+/* bpfpunch.c -- Punch requests that the kernel passes on with eBPF
+ *
+ * Processes that are not privileged pass their requests to synergy.d over
+ * its socket, which costs a message with a socket for every punch.  When
+ * the daemon is started with a cgroup, it attaches an eBPF program to the
+ * setsockopt() calls of the processes in there.  The program picks up the
+ * option SYNERGY_SO_PUNCH, takes the local address, port and protocol from
+ * the socket itself, so they need no checking, and writes the request into
+ * a ring buffer that the main loop reads.  The calling process makes one
+ * system call, and passes no socket.
+ *
+ * A punch cannot be sent from within the kernel.  The sock_ops programs
+ * have no helper to emit a packet, and TC programs can only redirect or
+ * clone packets that pass them, which listen() does not produce.  So the
+ * packet is still sent by the workers, but the hop limit is looked up by
+ * the program, in a longest prefix match map that the daemon fills with
+ * what it learns.  Requests with hop limit 0 get the learned hop limit.
+ *
+ * The program is assembled here, so there is no need for a compiler or
+ * a loader library.  It is attached through a link, which is detached
+ * when the daemon exits.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+
+#include <netinet/in.h>
+
+#include <linux/bpf.h>
+
+#include <sys/socketsynergy.h>
+
+#include "daemon.h"
+
+
+/* The size of the ring buffer, the number of prefixes with a hop limit,
+ * and the room for the program and the labels that it jumps to.
+ */
+#define BPFPUNCH_RINGSIZE (256 * 1024)
+#define BPFPUNCH_PREFIXES 4096
+#define BPFPUNCH_INSNS 128
+#define BPFPUNCH_LOGSIZE 65536
+
+
+/* A request as the program writes it into the ring buffer.  Addresses and
+ * ports are in network byte order.
+ */
+struct bpfpunch_record {
+	struct in6_addr local;
+	struct in6_addr remote;
+	uint16_t localport;
+	uint16_t remoteport;
+	uint8_t proto;
+	uint8_t hoplimit;
+	uint16_t reserved;
+	uint32_t uid;
+};
+
+/* The key to the map with hop limits.
+ */
+struct bpfpunch_key {
+	uint32_t prefixlen;
+	struct in6_addr prefix;
+};
+
+
+/* The program keeps a record on its stack, and a key below it.
+ */
+#define REC (-48)
+#define KEY (REC - 24)
+#define RECOFF(f) (REC + (int) offsetof (struct bpfpunch_record, f))
+
+_Static_assert (sizeof (struct bpfpunch_record) <= -REC, "Records fit on the stack");
+_Static_assert (sizeof (struct bpfpunch_key) <= REC - KEY, "Keys fit on the stack");
+
+
+enum bpfpunch_label {
+	L_PASS,
+	L_REJECT,
+	L_FROMOPT,
+	L_PORT,
+	L_SEND,
+	L_COUNT
+};
+
+
+static struct bpf_insn prog [BPFPUNCH_INSNS];
+static int progjump [BPFPUNCH_INSNS];
+static int proglabel [L_COUNT];
+static int proglen;
+
+static struct evhandler ringbuf = { .fd = -1 };
+static int hopfd = -1;
+static uint64_t *consumer;
+static uint64_t *producer;
+static uint8_t *ringdata;
+
+
+static int bpf (int cmd, union bpf_attr *attr) {
+	return syscall (__NR_bpf, cmd, attr, sizeof (*attr));
+}
+
+
+/* Assemble instructions, with jumps forward to labels.
+ */
+static void emit (uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm) {
+	struct bpf_insn *insn = &prog [proglen];
+	insn->code = code;
+	insn->dst_reg = dst;
+	insn->src_reg = src;
+	insn->off = off;
+	insn->imm = imm;
+	progjump [proglen++] = -1;
+}
+
+static void emit_jump (uint8_t code, uint8_t dst, uint8_t src, int32_t imm, enum bpfpunch_label label) {
+	emit (code, dst, src, 0, imm);
+	progjump [proglen - 1] = label;
+}
+
+static void emit_label (enum bpfpunch_label label) {
+	proglabel [label] = proglen;
+}
+
+static void emit_map (uint8_t dst, int mapfd) {
+	emit (BPF_LD | BPF_DW | BPF_IMM, dst, BPF_PSEUDO_MAP_FD, 0, mapfd);
+	emit (0, 0, 0, 0, 0);
+}
+
+#define LDX(sz,d,s,o)   emit (BPF_LDX | BPF_MEM | (sz), (d), (s), (o), 0)
+#define STX(sz,d,s,o)   emit (BPF_STX | BPF_MEM | (sz), (d), (s), (o), 0)
+#define MOV(d,s)        emit (BPF_ALU64 | BPF_MOV | BPF_X, (d), (s), 0, 0)
+#define MOVI(d,i)       emit (BPF_ALU64 | BPF_MOV | BPF_K, (d), 0, 0, (i))
+#define ADDI(d,i)       emit (BPF_ALU64 | BPF_ADD | BPF_K, (d), 0, 0, (i))
+#define RSHI(d,i)       emit (BPF_ALU64 | BPF_RSH | BPF_K, (d), 0, 0, (i))
+#define BE16(d)         emit (BPF_ALU | BPF_END | BPF_TO_BE, (d), 0, 0, 16)
+#define CALL(fn)        emit (BPF_JMP | BPF_CALL, 0, 0, 0, (fn))
+#define EXIT()          emit (BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+#define JA(l)           emit_jump (BPF_JMP | BPF_JA, 0, 0, 0, (l))
+#define JEQI(d,i,l)     emit_jump (BPF_JMP | BPF_JEQ | BPF_K, (d), 0, (i), (l))
+#define JNEI(d,i,l)     emit_jump (BPF_JMP | BPF_JNE | BPF_K, (d), 0, (i), (l))
+#define JGT(d,s,l)      emit_jump (BPF_JMP | BPF_JGT | BPF_X, (d), (s), 0, (l))
+
+#define SOCKOPT(f)      ((int) offsetof (struct bpf_sockopt, f))
+#define SOCK(f)         ((int) offsetof (struct bpf_sock, f))
+#define PUNCH(f)        ((int) offsetof (struct synergy_sockopt_punch, f))
+
+
+/* Assemble the program for the given maps.  It passes other options to the
+ * kernel, and rejects requests that it cannot take with EPERM.
+ */
+static void bpfpunch_assemble (int ringfd) {
+	int i;
+	proglen = 0;
+	//
+	// Only handle our own option; others go to the kernel
+	MOV (BPF_REG_6, BPF_REG_1);
+	LDX (BPF_W, BPF_REG_2, BPF_REG_6, SOCKOPT (level));
+	JNEI (BPF_REG_2, SOL_SYNERGY, L_PASS);
+	LDX (BPF_W, BPF_REG_2, BPF_REG_6, SOCKOPT (optname));
+	JNEI (BPF_REG_2, SYNERGY_SO_PUNCH, L_PASS);
+	MOVI (BPF_REG_1, 0);
+	for (i = KEY; i < 0; i += 8) {
+		STX (BPF_DW, BPF_REG_10, BPF_REG_1, i);
+	}
+	LDX (BPF_DW, BPF_REG_7, BPF_REG_6, SOCKOPT (sk));
+	LDX (BPF_DW, BPF_REG_8, BPF_REG_6, SOCKOPT (optval));
+	LDX (BPF_DW, BPF_REG_3, BPF_REG_6, SOCKOPT (optval_end));
+	MOV (BPF_REG_4, BPF_REG_8);
+	ADDI (BPF_REG_4, sizeof (struct synergy_sockopt_punch));
+	JGT (BPF_REG_4, BPF_REG_3, L_REJECT);
+	//
+	// Take the local end and protocol from the socket
+	LDX (BPF_W, BPF_REG_4, BPF_REG_7, SOCK (family));
+	JNEI (BPF_REG_4, AF_INET6, L_REJECT);
+	for (i = 0; i < 16; i += 4) {
+		LDX (BPF_W, BPF_REG_4, BPF_REG_7, SOCK (src_ip6) + i);
+		STX (BPF_W, BPF_REG_10, BPF_REG_4, RECOFF (local) + i);
+	}
+	LDX (BPF_W, BPF_REG_4, BPF_REG_7, SOCK (src_port));
+	JEQI (BPF_REG_4, 0, L_REJECT);
+	BE16 (BPF_REG_4);
+	STX (BPF_H, BPF_REG_10, BPF_REG_4, RECOFF (localport));
+	LDX (BPF_W, BPF_REG_4, BPF_REG_7, SOCK (protocol));
+	STX (BPF_B, BPF_REG_10, BPF_REG_4, RECOFF (proto));
+	//
+	// Take the remote end from the option, or from the socket
+	LDX (BPF_H, BPF_REG_4, BPF_REG_8, PUNCH (symcli.sin6_family));
+	JEQI (BPF_REG_4, AF_INET6, L_FROMOPT);
+	for (i = 0; i < 16; i += 4) {
+		LDX (BPF_W, BPF_REG_4, BPF_REG_7, SOCK (dst_ip6) + i);
+		STX (BPF_W, BPF_REG_10, BPF_REG_4, RECOFF (remote) + i);
+	}
+	LDX (BPF_H, BPF_REG_4, BPF_REG_7, SOCK (dst_port));
+	JA (L_PORT);
+	emit_label (L_FROMOPT);
+	for (i = 0; i < 16; i += 4) {
+		LDX (BPF_W, BPF_REG_4, BPF_REG_8, PUNCH (symcli.sin6_addr) + i);
+		STX (BPF_W, BPF_REG_10, BPF_REG_4, RECOFF (remote) + i);
+	}
+	LDX (BPF_H, BPF_REG_4, BPF_REG_8, PUNCH (symcli.sin6_port));
+	emit_label (L_PORT);
+	JEQI (BPF_REG_4, 0, L_REJECT);
+	STX (BPF_H, BPF_REG_10, BPF_REG_4, RECOFF (remoteport));
+	//
+	// Without a hop limit, look up what was learned for the remote end
+	LDX (BPF_B, BPF_REG_4, BPF_REG_8, PUNCH (hoplimit));
+	STX (BPF_B, BPF_REG_10, BPF_REG_4, RECOFF (hoplimit));
+	JNEI (BPF_REG_4, 0, L_SEND);
+	MOVI (BPF_REG_4, 128);
+	STX (BPF_W, BPF_REG_10, BPF_REG_4, KEY);
+	for (i = 0; i < 16; i += 4) {
+		LDX (BPF_W, BPF_REG_4, BPF_REG_10, RECOFF (remote) + i);
+		STX (BPF_W, BPF_REG_10, BPF_REG_4, KEY + (int) offsetof (struct bpfpunch_key, prefix) + i);
+	}
+	emit_map (BPF_REG_1, hopfd);
+	MOV (BPF_REG_2, BPF_REG_10);
+	ADDI (BPF_REG_2, KEY);
+	CALL (BPF_FUNC_map_lookup_elem);
+	JEQI (BPF_REG_0, 0, L_SEND);
+	LDX (BPF_B, BPF_REG_4, BPF_REG_0, 0);
+	STX (BPF_B, BPF_REG_10, BPF_REG_4, RECOFF (hoplimit));
+	//
+	// Pass the request to the daemon, and skip the kernel
+	emit_label (L_SEND);
+	CALL (BPF_FUNC_get_current_uid_gid);
+	STX (BPF_W, BPF_REG_10, BPF_REG_0, RECOFF (uid));
+	emit_map (BPF_REG_1, ringfd);
+	MOV (BPF_REG_2, BPF_REG_10);
+	ADDI (BPF_REG_2, REC);
+	MOVI (BPF_REG_3, sizeof (struct bpfpunch_record));
+	MOVI (BPF_REG_4, 0);
+	CALL (BPF_FUNC_ringbuf_output);
+	JNEI (BPF_REG_0, 0, L_REJECT);
+	MOVI (BPF_REG_1, -1);
+	STX (BPF_W, BPF_REG_6, BPF_REG_1, SOCKOPT (optlen));
+	emit_label (L_PASS);
+	MOVI (BPF_REG_0, 1);
+	EXIT ();
+	emit_label (L_REJECT);
+	MOVI (BPF_REG_0, 0);
+	EXIT ();
+	//
+	// Resolve the jumps
+	for (i = 0; i < proglen; i++) {
+		if (progjump [i] >= 0) {
+			prog [i].off = proglabel [progjump [i]] - i - 1;
+		}
+	}
+}
+
+
+/* Hand the requests of a batch to the queues of their users.
+ */
+static void bpfpunch_flush (struct job *jobs, uid_t *uids, int count) {
+	struct metrics_shard *metrics = metrics_shard (0);
+	int start, end, accepted;
+	metrics_add (&metrics->received, count);
+	for (start = 0; start < count; start = end) {
+		end = start + 1;
+		while ((end < count) && (uids [end] == uids [start])) {
+			end++;
+		}
+		accepted = fairq_submit (uids [start], jobs + start, end - start);
+		if (accepted < end - start) {
+			metrics_add (&metrics->dropped, end - start - accepted);
+		}
+	}
+}
+
+
+/* Read the requests from the ring buffer, until it is empty.
+ */
+static void bpfpunch_handle (struct evhandler *evh, uint32_t events) {
+	struct job jobs [SYNERGY_BATCH_MAX];
+	uid_t uids [SYNERGY_BATCH_MAX];
+	uint64_t cons, prod;
+	uint64_t now = metrics_now ();
+	int count = 0;
+	cons = __atomic_load_n (consumer, __ATOMIC_RELAXED);
+	while (cons < (prod = __atomic_load_n (producer, __ATOMIC_ACQUIRE))) {
+		while (cons < prod) {
+			uint32_t *hdr = (uint32_t *) (ringdata + (cons & (BPFPUNCH_RINGSIZE - 1)));
+			uint32_t len = __atomic_load_n (hdr, __ATOMIC_ACQUIRE);
+			struct bpfpunch_record *rec = (struct bpfpunch_record *) (hdr + 2);
+			struct job *job = &jobs [count];
+			if (len & BPF_RINGBUF_BUSY_BIT) {
+				break;
+			}
+			cons += ((len & ~BPF_RINGBUF_DISCARD_BIT) + BPF_RINGBUF_HDR_SZ + 7) & ~7;
+			if ((len & BPF_RINGBUF_DISCARD_BIT) || (len != sizeof (*rec))) {
+				continue;
+			}
+			memset (job, 0, sizeof (*job));
+			job->symcli.sin6_family = AF_INET6;
+			job->symcli.sin6_port = rec->remoteport;
+			memcpy (&job->symcli.sin6_addr, &rec->remote, sizeof (job->symcli.sin6_addr));
+			job->sockfd = -1;
+			job->hoplimit = hoplearn_apply (&job->symcli, rec->hoplimit);
+			job->received = now;
+			memcpy (&job->hint.local, &rec->local, sizeof (job->hint.local));
+			job->hint.localport = rec->localport;
+			job->hint.proto = rec->proto;
+			uids [count++] = rec->uid;
+			if (count == SYNERGY_BATCH_MAX) {
+				bpfpunch_flush (jobs, uids, count);
+				count = 0;
+			}
+		}
+		__atomic_store_n (consumer, cons, __ATOMIC_RELEASE);
+		if (cons < prod) {
+			//
+			// A record is still being written; look again later
+			break;
+		}
+	}
+	if (count > 0) {
+		bpfpunch_flush (jobs, uids, count);
+	}
+}
+
+
+void bpfpunch_learned (const struct in6_addr *prefix, int prefixlen, uint8_t maxhop) {
+	struct bpfpunch_key key;
+	union bpf_attr attr;
+	if (hopfd == -1) {
+		return;
+	}
+	memset (&key, 0, sizeof (key));
+	key.prefixlen = prefixlen;
+	memcpy (&key.prefix, prefix, sizeof (key.prefix));
+	memset (&attr, 0, sizeof (attr));
+	attr.map_fd = hopfd;
+	attr.key = (uintptr_t) &key;
+	if (maxhop == 0) {
+		bpf (BPF_MAP_DELETE_ELEM, &attr);
+	} else {
+		attr.value = (uintptr_t) &maxhop;
+		attr.flags = BPF_ANY;
+		bpf (BPF_MAP_UPDATE_ELEM, &attr);
+	}
+}
+
+
+int bpfpunch_start (const char *cgroup) {
+	static char log [BPFPUNCH_LOGSIZE];
+	union bpf_attr attr;
+	long pagesz = sysconf (_SC_PAGESIZE);
+	int ringfd, progfd, cgfd, linkfd;
+	//
+	// Create the maps, and map the ring buffer to read it
+	memset (&attr, 0, sizeof (attr));
+	attr.map_type = BPF_MAP_TYPE_RINGBUF;
+	attr.max_entries = BPFPUNCH_RINGSIZE;
+	ringfd = bpf (BPF_MAP_CREATE, &attr);
+	if (ringfd == -1) {
+		return -1;
+	}
+	memset (&attr, 0, sizeof (attr));
+	attr.map_type = BPF_MAP_TYPE_LPM_TRIE;
+	attr.key_size = sizeof (struct bpfpunch_key);
+	attr.value_size = sizeof (uint8_t);
+	attr.max_entries = BPFPUNCH_PREFIXES;
+	attr.map_flags = BPF_F_NO_PREALLOC;
+	hopfd = bpf (BPF_MAP_CREATE, &attr);
+	if (hopfd == -1) {
+		return -1;
+	}
+	consumer = mmap (NULL, pagesz, PROT_READ | PROT_WRITE, MAP_SHARED, ringfd, 0);
+	if (consumer == MAP_FAILED) {
+		return -1;
+	}
+	producer = mmap (NULL, pagesz + 2 * BPFPUNCH_RINGSIZE, PROT_READ, MAP_SHARED, ringfd, pagesz);
+	if (producer == MAP_FAILED) {
+		return -1;
+	}
+	ringdata = (uint8_t *) producer + pagesz;
+	//
+	// Load the program, with the verifier's complaints when it fails
+	bpfpunch_assemble (ringfd);
+	memset (&attr, 0, sizeof (attr));
+	attr.prog_type = BPF_PROG_TYPE_CGROUP_SOCKOPT;
+	attr.expected_attach_type = BPF_CGROUP_SETSOCKOPT;
+	attr.insns = (uintptr_t) prog;
+	attr.insn_cnt = proglen;
+	attr.license = (uintptr_t) "BSD";
+	progfd = bpf (BPF_PROG_LOAD, &attr);
+	if (progfd == -1) {
+		int err = errno;
+		attr.log_buf = (uintptr_t) log;
+		attr.log_size = sizeof (log);
+		attr.log_level = 1;
+		if (bpf (BPF_PROG_LOAD, &attr) == -1) {
+			fprintf (stderr, "The eBPF program of synergy.d was rejected:\n%s", log);
+		}
+		errno = err;
+		return -1;
+	}
+	//
+	// Attach the program to the cgroup for as long as we live
+	cgfd = open (cgroup, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (cgfd == -1) {
+		return -1;
+	}
+	memset (&attr, 0, sizeof (attr));
+	attr.link_create.prog_fd = progfd;
+	attr.link_create.target_fd = cgfd;
+	attr.link_create.attach_type = BPF_CGROUP_SETSOCKOPT;
+	linkfd = bpf (BPF_LINK_CREATE, &attr);
+	close (cgfd);
+	if (linkfd == -1) {
+		return -1;
+	}
+	ringbuf.handle = bpfpunch_handle;
+	ringbuf.fd = ringfd;
+	return evloop_add (&ringbuf, EPOLLIN);
+}
@@ -0,0 +1,170 @@
+/* checksum.c -- Checksums for the punches that we send over RAW sockets
+ *
+ * The kernel does not fill in the checksums of TCP, UDP or SCTP packets
+ * that are sent over a RAW IPv6 socket, and firewalls that validate them
+ * would silently drop our punches.  So they are computed here.
+ *
+ * TCP and UDP use the Internet checksum, which covers the IPv6 pseudo
+ * header.  The partial sum over the pair of addresses is the same for all
+ * punches between two hosts, so it is cached per thread.  The constant
+ * parts of the packets are summed once, in their templates.  SCTP uses the
+ * CRC32c, which is computed with the SSE4.2 instruction when the CPU has
+ * it, or with a table otherwise.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <pthread.h>
+
+#include <netinet/in.h>
+
+#include "libsynergy.h"
+
+
+/* The number of address pairs whose partial sums are cached per thread.
+ */
+#define SYNERGY_CSUM_CACHE 64
+
+
+struct csumcache {
+	struct in6_addr src;
+	struct in6_addr dst;
+	uint32_t sum;
+	int valid;
+};
+
+static __thread struct csumcache csumcache [SYNERGY_CSUM_CACHE];
+
+
+/* Add 16-bit words in network byte order to a running sum.  An odd last
+ * byte is padded with a zero byte.  The sum is kept wide and folded later.
+ */
+uint64_t synergy_csum_add (uint64_t sum, const void *data, size_t len) {
+	const uint8_t *p = data;
+	while (len >= 4) {
+		sum += ((uint32_t) p [0] << 24) | ((uint32_t) p [1] << 16)
+		     | ((uint32_t) p [2] <<  8) |  (uint32_t) p [3];
+		p += 4;
+		len -= 4;
+	}
+	if (len >= 2) {
+		sum += ((uint32_t) p [0] << 8) | p [1];
+		p += 2;
+		len -= 2;
+	}
+	if (len > 0) {
+		sum += (uint32_t) p [0] << 8;
+	}
+	return sum;
+}
+
+
+uint16_t synergy_csum_fold (uint64_t sum) {
+	while (sum >> 16) {
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+	return sum;
+}
+
+
+uint32_t synergy_csum_addrs (const struct in6_addr *src, const struct in6_addr *dst) {
+	const uint32_t *s = (const uint32_t *) src->s6_addr;
+	const uint32_t *d = (const uint32_t *) dst->s6_addr;
+	struct csumcache *cc;
+	uint32_t h = 0;
+	int i;
+	for (i = 0; i < 4; i++) {
+		h = (h ^ s [i] ^ d [i]) * 0x9e3779b1;
+	}
+	cc = &csumcache [(h >> 16) % SYNERGY_CSUM_CACHE];
+	if (cc->valid && (memcmp (&cc->src, src, sizeof (*src)) == 0)
+			&& (memcmp (&cc->dst, dst, sizeof (*dst)) == 0)) {
+		return cc->sum;
+	}
+	memcpy (&cc->src, src, sizeof (*src));
+	memcpy (&cc->dst, dst, sizeof (*dst));
+	cc->sum = synergy_csum_fold (synergy_csum_add (synergy_csum_add (0, src, 16), dst, 16));
+	cc->valid = 1;
+	return cc->sum;
+}
+
+
+/* The portable CRC32c uses a table for the reflected Castagnoli polynomial,
+ * which is filled on first use.
+ */
+static uint32_t crc32c_table [256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static uint32_t (*crc32c_impl) (uint32_t crc, const uint8_t *p, size_t len);
+
+
+static uint32_t synergy_crc32c_table (uint32_t crc, const uint8_t *p, size_t len) {
+	while (len-- > 0) {
+		crc = crc32c_table [(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+
+#if defined (__x86_64__) || defined (__i386__)
+
+#include <nmmintrin.h>
+
+__attribute__ ((target ("sse4.2")))
+static uint32_t synergy_crc32c_sse42 (uint32_t crc, const uint8_t *p, size_t len) {
+#if defined (__x86_64__)
+	while (len >= 8) {
+		uint64_t w;
+		memcpy (&w, p, 8);
+		crc = _mm_crc32_u64 (crc, w);
+		p += 8;
+		len -= 8;
+	}
+#endif
+	while (len >= 4) {
+		uint32_t w;
+		memcpy (&w, p, 4);
+		crc = _mm_crc32_u32 (crc, w);
+		p += 4;
+		len -= 4;
+	}
+	while (len-- > 0) {
+		crc = _mm_crc32_u8 (crc, *p++);
+	}
+	return crc;
+}
+
+#endif
+
+
+static void synergy_crc32c_setup (void) {
+	uint32_t i, j, crc;
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++) {
+			crc = (crc >> 1) ^ ((crc & 1) ? 0x82f63b78 : 0);
+		}
+		crc32c_table [i] = crc;
+	}
+	crc32c_impl = synergy_crc32c_table;
+#if defined (__x86_64__) || defined (__i386__)
+	__builtin_cpu_init ();
+	if (__builtin_cpu_supports ("sse4.2")) {
+		crc32c_impl = synergy_crc32c_sse42;
+	}
+#endif
+}
+
+
+uint32_t synergy_crc32c (const void *data, size_t len) {
+	pthread_once (&crc32c_once, synergy_crc32c_setup);
+	return ~crc32c_impl (~0U, data, len);
+}
+
+uint32_t synergy_crc32c_portable (const void *data, size_t len) {
+	pthread_once (&crc32c_once, synergy_crc32c_setup);
+	return ~synergy_crc32c_table (~0U, data, len);
+}
@@ -0,0 +1,191 @@
+/* confirm.c -- Punch and wait for the confirmation from the network
+ *
+ * The blocking form of confirmation.  Privileged processes open their own
+ * reply socket before punching, so the Time Exceeded message cannot slip
+ * by.  Other processes open a private session with synergy.d, and wait
+ * for the completion of a request with confirmation.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#include <sys/socketsynergy.h>
+
+#include "libsynergy.h"
+
+
+/* The extra time that synergy.d is given to send its completion, beyond
+ * the timeout for the confirmation itself.
+ */
+#define SYNERGY_CONFIRM_GRACE_MS 1000
+
+
+static int64_t synergy_now_us (void) {
+	struct timespec now;
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return ((int64_t) now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
+
+
+/* Privileged processes punch themselves, and wait for the reply.
+ */
+static int synergy_confirmed_privileged (int sockfd, uint8_t hoplimit, struct sockaddr_in6 *symcli, int timeout_ms, uint32_t *latency_us) {
+	struct sockaddr_in6 local, remot;
+	socklen_t namesz;
+	struct synergy_reply reply;
+	struct pollfd pfd;
+	int64_t sent, deadline, now;
+	int got;
+	int err;
+	namesz = sizeof (local);
+	if (getsockname (sockfd, (struct sockaddr *) &local, &namesz)) {
+		return -1;
+	}
+	if (symcli == NULL) {
+		namesz = sizeof (remot);
+		if (getpeername (sockfd, (struct sockaddr *) &remot, &namesz)) {
+			return -1;
+		}
+		symcli = &remot;
+	}
+	pfd.fd = synergy_reply_open ();
+	pfd.events = POLLIN;
+	if (pfd.fd == -1) {
+		return -1;
+	}
+	sent = synergy_now_us ();
+	deadline = sent + ((int64_t) timeout_ms) * 1000;
+	if (synergy_privileged (sockfd, hoplimit, symcli) == -1) {
+		goto fail;
+	}
+	//
+	// Wait for a reply that quotes our punch, or for the deadline
+	while ((now = synergy_now_us ()) < deadline) {
+		if (poll (&pfd, 1, (deadline - now + 999) / 1000) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			goto fail;
+		}
+		while ((got = synergy_reply_read (pfd.fd, &reply)) > 0) {
+			if ((reply.kind == SYNERGY_REPLY_TIMEEXCEEDED)
+					&& (reply.localport == local.sin6_port)
+					&& (reply.remoteport == symcli->sin6_port)
+					&& (memcmp (&reply.remote, &symcli->sin6_addr, sizeof (reply.remote)) == 0)) {
+				if (latency_us != NULL) {
+					*latency_us = synergy_now_us () - sent;
+				}
+				close (pfd.fd);
+				return 0;
+			}
+		}
+		if (got == -1) {
+			goto fail;
+		}
+	}
+	errno = ETIMEDOUT;
+fail:
+	err = errno;
+	close (pfd.fd);
+	errno = err;
+	return -1;
+}
+
+
+/* Send one request over a private session with synergy.d, and wait for its
+ * completion.  The daemon completes the request itself when it times out;
+ * the grace only guards against a daemon that has gone astray.
+ */
+int synergy_session_call (struct synergy_session_request *req, int sockfd, int timeout_ms, struct synergy_completion *cpl) {
+	struct pollfd pfd;
+	ssize_t len;
+	int err;
+	pfd.fd = synergy_session_connect (0);
+	pfd.events = POLLIN;
+	if (pfd.fd == -1) {
+		return -1;
+	}
+	if (synergy_session_request (pfd.fd, req, sockfd) == -1) {
+		goto fail;
+	}
+	switch (poll (&pfd, 1, timeout_ms + SYNERGY_CONFIRM_GRACE_MS)) {
+	case -1:
+		goto fail;
+	case 0:
+		errno = ETIMEDOUT;
+		goto fail;
+	}
+	len = recv (pfd.fd, cpl, sizeof (*cpl), 0);
+	if (len != sizeof (*cpl)) {
+		errno = (len == -1) ? errno : ECONNRESET;
+		goto fail;
+	}
+	close (pfd.fd);
+	if (cpl->error != 0) {
+		errno = cpl->error;
+		return -1;
+	}
+	return 0;
+fail:
+	err = errno;
+	close (pfd.fd);
+	errno = err;
+	return -1;
+}
+
+
+/* Others ask synergy.d over a private session, and wait for the completion.
+ */
+static int synergy_confirmed_daemonised (int sockfd, uint8_t hoplimit, struct sockaddr_in6 *symcli, int timeout_ms, uint32_t *latency_us) {
+	struct synergy_session_request req;
+	struct synergy_completion cpl;
+	struct sockaddr_in6 remot;
+	socklen_t namesz = sizeof (remot);
+	if (symcli == NULL) {
+		if (getpeername (sockfd, (struct sockaddr *) &remot, &namesz)) {
+			return -1;
+		}
+		symcli = &remot;
+	}
+	if (timeout_ms > 65535) {
+		timeout_ms = 65535;
+	}
+	memset (&req, 0, sizeof (req));
+	req.hoplimit = hoplimit;
+	req.flags = SYNERGY_SESSION_CONFIRM;
+	req.timeout_ms = timeout_ms;
+	memcpy (&req.symcli, symcli, sizeof (req.symcli));
+	if (synergy_session_call (&req, sockfd, timeout_ms, &cpl) == -1) {
+		return -1;
+	}
+	if (latency_us != NULL) {
+		*latency_us = cpl.latency_us;
+	}
+	return 0;
+}
+
+
+int synergy_confirmed (int sockfd, uint8_t hoplimit, struct sockaddr_in6 *symcli, int timeout_ms, uint32_t *latency_us) {
+	if (timeout_ms <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (synergy_rawable ()) {
+		return synergy_confirmed_privileged (sockfd, hoplimit, symcli, timeout_ms, latency_us);
+	} else {
+		return synergy_confirmed_daemonised (sockfd, hoplimit, symcli, timeout_ms, latency_us);
+	}
+}
@@ -0,0 +1,276 @@
+/* confirms.c -- Confirmation of punches for sessions of synergy.d
+ *
+ * Session requests with the SYNERGY_SESSION_CONFIRM flag are completed when
+ * the ICMPv6 Time Exceeded message for the punch comes in, or when their
+ * timeout expires.  The main loop keeps the pending confirmations in a
+ * hash table on the remote address and port, and matches the replies from
+ * one RAW ICMPv6 socket against them.  They are also kept in a list in the
+ * order of their deadlines, which is mostly the order in which they came,
+ * and a timerfd is set for the first deadline, to expire them without
+ * looking at those that are not due.
+ *
+ * A confirmation is shared between the main loop and the worker that sends
+ * the punch, so it is reference counted.  Its state moves from waiting to
+ * done exactly once, by whoever completes it first: the worker when the
+ * send fails, or the main loop on a reply or timeout.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include <netinet/in.h>
+
+#include <sys/socketsynergy.h>
+
+#include "daemon.h"
+
+
+/* The number of hash buckets for pending confirmations.
+ */
+#define CONFIRMS_BUCKETS 4096
+
+
+#define CONFIRM_WAITING 0
+#define CONFIRM_DONE 1
+
+
+struct confirm {
+	struct confirm *next;
+	struct confirm *dnext;
+	struct confirm *dprev;
+	struct session *session;
+	uint64_t tag;
+	struct in6_addr remote;
+	uint16_t remoteport;
+	uint16_t localport;
+	int state;
+	int refs;
+	int64_t sent_us;
+	int64_t deadline_us;
+};
+
+
+static struct confirm *buckets [CONFIRMS_BUCKETS];
+static struct confirm *dhead = NULL;
+static struct confirm *dtail = NULL;
+static struct evhandler replies = { .fd = -1 };
+static struct evhandler ticker;
+
+
+static int64_t confirms_now_us (void) {
+	struct timespec now;
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return ((int64_t) now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
+
+
+static unsigned int confirms_hash (const struct in6_addr *addr, uint16_t port) {
+	const uint32_t *w = (const uint32_t *) addr->s6_addr;
+	uint32_t h = port;
+	int i;
+	for (i = 0; i < 4; i++) {
+		h = (h ^ w [i]) * 0x9e3779b1;
+	}
+	return (h ^ (h >> 16)) % CONFIRMS_BUCKETS;
+}
+
+
+static void confirm_release (struct confirm *c) {
+	if (__atomic_sub_fetch (&c->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		free (c);
+	}
+}
+
+
+/* Complete a confirmation, unless someone else already did.  This consumes
+ * the job's reference to the session.
+ */
+static void confirm_finish (struct confirm *c, int error, uint32_t latency_us) {
+	int waiting = CONFIRM_WAITING;
+	if (__atomic_compare_exchange_n (&c->state, &waiting, CONFIRM_DONE, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		session_complete (c->session, c->tag, error, latency_us);
+	}
+}
+
+
+/* Set the timer for the first deadline, or stop it when none is pending.
+ */
+static void confirms_timer (void) {
+	struct itimerspec its;
+	memset (&its, 0, sizeof (its));
+	if (dhead != NULL) {
+		its.it_value.tv_sec  = dhead->deadline_us / 1000000;
+		its.it_value.tv_nsec = (dhead->deadline_us % 1000000) * 1000 + 1;
+	}
+	timerfd_settime (ticker.fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+
+/* Insert a confirmation into the list of deadlines, searching from the end.
+ */
+static void confirms_schedule (struct confirm *c) {
+	struct confirm *after = dtail;
+	while ((after != NULL) && (after->deadline_us > c->deadline_us)) {
+		after = after->dprev;
+	}
+	c->dprev = after;
+	c->dnext = (after != NULL) ? after->dnext : dhead;
+	if (c->dnext != NULL) {
+		c->dnext->dprev = c;
+	} else {
+		dtail = c;
+	}
+	if (after != NULL) {
+		after->dnext = c;
+	} else {
+		dhead = c;
+	}
+}
+
+
+/* Remove a confirmation from the hash table and the list of deadlines, and
+ * drop the reference of the main loop.
+ */
+static void confirms_remove (struct confirm *c) {
+	struct confirm **cp = &buckets [confirms_hash (&c->remote, c->remoteport)];
+	while (*cp != c) {
+		cp = &(*cp)->next;
+	}
+	*cp = c->next;
+	if (c->dprev != NULL) {
+		c->dprev->dnext = c->dnext;
+	} else {
+		dhead = c->dnext;
+	}
+	if (c->dnext != NULL) {
+		c->dnext->dprev = c->dprev;
+	} else {
+		dtail = c->dprev;
+	}
+	confirm_release (c);
+}
+
+
+struct confirm *confirm_new (struct session *ses, uint64_t tag, int sockfd, struct sockaddr_in6 *symcli, int timeout_ms) {
+	struct sockaddr_in6 local;
+	socklen_t namesz = sizeof (local);
+	struct confirm *c;
+	unsigned int h;
+	if (replies.fd == -1) {
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+	if (getsockname (sockfd, (struct sockaddr *) &local, &namesz) == -1) {
+		return NULL;
+	}
+	c = calloc (1, sizeof (struct confirm));
+	if (c == NULL) {
+		return NULL;
+	}
+	c->session = ses;
+	c->tag = tag;
+	memcpy (&c->remote, &symcli->sin6_addr, sizeof (c->remote));
+	c->remoteport = symcli->sin6_port;
+	c->localport = local.sin6_port;
+	c->state = CONFIRM_WAITING;
+	c->refs = 2;
+	c->sent_us = confirms_now_us ();
+	c->deadline_us = c->sent_us + ((int64_t) timeout_ms) * 1000;
+	h = confirms_hash (&c->remote, c->remoteport);
+	c->next = buckets [h];
+	buckets [h] = c;
+	confirms_schedule (c);
+	if (dhead == c) {
+		confirms_timer ();
+	}
+	return c;
+}
+
+
+void confirm_sent (struct confirm *c, int error) {
+	if (error != 0) {
+		confirm_finish (c, error, 0);
+	} else {
+		__atomic_store_n (&c->sent_us, confirms_now_us (), __ATOMIC_RELEASE);
+	}
+	confirm_release (c);
+}
+
+
+/* Match the Time Exceeded replies against pending confirmations, and
+ * remove those that they complete.  The timer may then go off for a
+ * deadline that is gone, which does no harm.
+ */
+static void replies_handle (struct evhandler *evh, uint32_t events) {
+	struct synergy_reply reply;
+	struct confirm *c;
+	while (synergy_reply_read (evh->fd, &reply) > 0) {
+		if (reply.kind != SYNERGY_REPLY_TIMEEXCEEDED) {
+			continue;
+		}
+		c = buckets [confirms_hash (&reply.remote, reply.remoteport)];
+		while (c != NULL) {
+			if ((c->localport == reply.localport) && (c->remoteport == reply.remoteport)
+					&& (memcmp (&c->remote, &reply.remote, sizeof (c->remote)) == 0)
+					&& (__atomic_load_n (&c->state, __ATOMIC_ACQUIRE) == CONFIRM_WAITING)) {
+				int64_t sent = __atomic_load_n (&c->sent_us, __ATOMIC_ACQUIRE);
+				confirm_finish (c, 0, confirms_now_us () - sent);
+				confirms_remove (c);
+				break;
+			}
+			c = c->next;
+		}
+	}
+}
+
+
+/* Expire the confirmations whose deadline passed.  Those that a worker
+ * completed after a failed send stay until their deadline, and are only
+ * removed here.
+ */
+static void ticker_handle (struct evhandler *evh, uint32_t events) {
+	uint64_t expirations;
+	int64_t now;
+	read (evh->fd, &expirations, sizeof (expirations));
+	now = confirms_now_us ();
+	while ((dhead != NULL) && (dhead->deadline_us <= now)) {
+		struct confirm *c = dhead;
+		confirm_finish (c, ETIMEDOUT, 0);
+		confirms_remove (c);
+	}
+	confirms_timer ();
+}
+
+
+int confirms_start (void) {
+	replies.handle = replies_handle;
+	replies.fd = synergy_reply_open ();
+	if (replies.fd == -1) {
+		return -1;
+	}
+	ticker.handle = ticker_handle;
+	ticker.fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (ticker.fd == -1) {
+		return -1;
+	}
+	if ((evloop_add (&replies, EPOLLIN) == -1) || (evloop_add (&ticker, EPOLLIN) == -1)) {
+		return -1;
+	}
+	return 0;
+}
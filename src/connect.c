@@ -0,0 +1,390 @@
+/* connect.c -- Punch and connect at an instant agreed with the peer
+ *
+ * Both peers call synergy_connect() with the same rendezvous: an instant
+ * on the wall clock, which they agreed on through some signaling channel,
+ * and the parameters for retries.  Each side punches a little before the
+ * instant, so that its own firewall has opened when the other side's first
+ * packet arrives, and then starts the connection at the instant itself.
+ *
+ * For TCP and one-to-one SCTP sockets, that is a non-blocking connect(),
+ * which meets the connect() of the other side as a simultaneous open, or
+ * the accept() of a listening peer.  For UDP, the socket is connected to
+ * the peer, and an empty datagram is sent as a hello.  The connection is
+ * established when a datagram of the peer arrives; its empty hellos are
+ * taken off the socket, but other datagrams are left for the caller.
+ * The kernel reports when the hello left, as a software timestamp.
+ *
+ * Every attempt has a window of timeout_ms from its instant.  When it
+ * fails on something that a retry may overcome, the next instant follows
+ * after a backoff that doubles with each attempt, up to a maximum.  The
+ * schedule depends on nothing but the rendezvous, so both sides retry at
+ * the same instants without talking again.  A call that comes late skips
+ * the attempts whose window has passed.
+ *
+ * The punch and the connection are timed with sleeps until an absolute
+ * time, rather than with SO_TXTIME; the SYN of connect() cannot carry a
+ * launch time, and SO_TXTIME only holds packets back under the etf and
+ * fq queueing disciplines.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+
+#include <sys/socketsynergy.h>
+
+#include "libsynergy.h"
+
+
+static int64_t synergy_wallclock_ns (void) {
+	struct timespec now;
+	clock_gettime (CLOCK_REALTIME, &now);
+	return ((int64_t) now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+
+static int64_t synergy_monotonic_ns (void) {
+	struct timespec now;
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return ((int64_t) now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+
+/* Sleep until an instant on the wall clock, if it is still ahead.
+ */
+static void synergy_sleep_until (int64_t instant) {
+	struct timespec ts;
+	ts.tv_sec = instant / 1000000000;
+	ts.tv_nsec = instant % 1000000000;
+	while (clock_nanosleep (CLOCK_REALTIME, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+		;
+	}
+}
+
+
+/* Wait for events on the socket until the deadline on the wall clock.
+ * Returns the events, 0 at the deadline, or -1 with errno set.
+ */
+static int synergy_poll_until (int sockfd, short events, int64_t deadline) {
+	struct pollfd pfd;
+	int64_t left;
+	int got;
+	pfd.fd = sockfd;
+	pfd.events = events;
+	while (1) {
+		left = deadline - synergy_wallclock_ns ();
+		if (left <= 0) {
+			return 0;
+		}
+		got = poll (&pfd, 1, (left + 999999) / 1000000);
+		if (got > 0) {
+			return pfd.revents;
+		}
+		if ((got == -1) && (errno != EINTR)) {
+			return -1;
+		}
+	}
+}
+
+
+/* Errors that another attempt may overcome, because the peer was not
+ * ready yet, or a firewall was not open yet.
+ */
+static int synergy_retryable (int err) {
+	switch (err) {
+	case ETIMEDOUT:
+	case ECONNREFUSED:
+	case ECONNRESET:
+	case ECONNABORTED:
+	case EHOSTUNREACH:
+	case ENETUNREACH:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+
+/* Connect a TCP or SCTP socket without blocking, and wait until the end
+ * of the window.  A connection attempt that timed out is taken down, so
+ * the next one starts afresh from the same local port.
+ */
+static int synergy_connect_stream (int sockfd, struct sockaddr_in6 *peer, int64_t deadline) {
+	struct sockaddr unspec;
+	socklen_t errsz = sizeof (int);
+	int err = 0;
+	int ev;
+	if (connect (sockfd, (struct sockaddr *) peer, sizeof (*peer)) == 0) {
+		return 0;
+	}
+	if (errno == EISCONN) {
+		return 0;
+	}
+	if ((errno != EINPROGRESS) && (errno != EALREADY)) {
+		return -1;
+	}
+	ev = synergy_poll_until (sockfd, POLLOUT, deadline);
+	if (ev == -1) {
+		return -1;
+	}
+	if (ev == 0) {
+		memset (&unspec, 0, sizeof (unspec));
+		unspec.sa_family = AF_UNSPEC;
+		connect (sockfd, &unspec, sizeof (unspec));
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	if (getsockopt (sockfd, SOL_SOCKET, SO_ERROR, &err, &errsz) == -1) {
+		return -1;
+	}
+	if (err != 0) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+
+/* Pick up the software timestamp of the hello from the error queue, as
+ * an offset from the instant.  Returns 0 when there is none.
+ */
+static int synergy_hello_sent (int sockfd, int64_t instant, int64_t *sent_ns) {
+	char anc [CMSG_SPACE (sizeof (struct scm_timestamping)) + CMSG_SPACE (sizeof (struct sock_extended_err) + sizeof (struct sockaddr_in6))];
+	struct msghdr mgh;
+	struct cmsghdr *cmg;
+	struct scm_timestamping *tss;
+	memset (&mgh, 0, sizeof (mgh));
+	mgh.msg_control = anc;
+	mgh.msg_controllen = sizeof (anc);
+	if (recvmsg (sockfd, &mgh, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+		return 0;
+	}
+	for (cmg = CMSG_FIRSTHDR (&mgh); cmg != NULL; cmg = CMSG_NXTHDR (&mgh, cmg)) {
+		if ((cmg->cmsg_level == SOL_SOCKET) && (cmg->cmsg_type == SCM_TIMESTAMPING)) {
+			tss = (struct scm_timestamping *) CMSG_DATA (cmg);
+			*sent_ns = ((int64_t) tss->ts [0].tv_sec) * 1000000000 + tss->ts [0].tv_nsec - instant;
+		}
+	}
+	return 1;
+}
+
+
+/* Send an empty hello to the peer of a UDP socket, with a request for a
+ * software timestamp when it leaves, and wait until the end of the window
+ * for a datagram of the peer.  Its empty hellos are taken off the socket.
+ */
+static int synergy_connect_dgram (int sockfd, int64_t instant, int64_t deadline, int64_t *sent_ns) {
+	char anc [CMSG_SPACE (sizeof (uint32_t))];
+	struct msghdr mgh;
+	struct cmsghdr *cmg;
+	socklen_t errsz = sizeof (int);
+	char peek;
+	ssize_t len;
+	int err;
+	int ev;
+	memset (&mgh, 0, sizeof (mgh));
+	memset (anc, 0, sizeof (anc));
+	mgh.msg_control = anc;
+	mgh.msg_controllen = sizeof (anc);
+	cmg = CMSG_FIRSTHDR (&mgh);
+	cmg->cmsg_level = SOL_SOCKET;
+	cmg->cmsg_type = SO_TIMESTAMPING;
+	cmg->cmsg_len = CMSG_LEN (sizeof (uint32_t));
+	*(uint32_t *) CMSG_DATA (cmg) = SOF_TIMESTAMPING_TX_SOFTWARE;
+	if (sendmsg (sockfd, &mgh, MSG_DONTWAIT) == -1) {
+		return -1;
+	}
+	while (1) {
+		ev = synergy_poll_until (sockfd, POLLIN, deadline);
+		if (ev == -1) {
+			return -1;
+		}
+		if (ev == 0) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		//
+		// The error queue holds the timestamp, or the socket an ICMPv6 error
+		if ((ev & POLLERR) && !synergy_hello_sent (sockfd, instant, sent_ns)) {
+			err = 0;
+			getsockopt (sockfd, SOL_SOCKET, SO_ERROR, &err, &errsz);
+			if (err != 0) {
+				errno = err;
+				return -1;
+			}
+		}
+		if (!(ev & POLLIN)) {
+			continue;
+		}
+		len = recv (sockfd, &peek, 1, MSG_PEEK | MSG_DONTWAIT);
+		if ((len == -1) && (errno != EAGAIN)) {
+			return -1;
+		}
+		if (len > 0) {
+			return 0;
+		}
+		if (len == 0) {
+			recv (sockfd, &peek, 1, MSG_DONTWAIT);
+			return 0;
+		}
+	}
+}
+
+
+int synergy_connect (int sockfd, uint8_t hoplimit, struct sockaddr_in6 *peer, const struct synergy_rendezvous *rv, struct synergy_connect_timing *timing) {
+	struct synergy_rendezvous defaults;
+	struct synergy_connect_timing dummy;
+	struct sockaddr_in6 local;
+	socklen_t namesz = sizeof (local);
+	int type, proto;
+	socklen_t optsz = sizeof (int);
+	int flags, oldstamp = 0, stamping = 0;
+	int64_t started, deadline, backoff;
+	int64_t instant = 0;
+	unsigned int attempt;
+	int retval = -1;
+	int err = ETIMEDOUT;
+	//
+	// Fill in the defaults, and start from a clean timing
+	memset (&defaults, 0, sizeof (defaults));
+	if (rv != NULL) {
+		memcpy (&defaults, rv, sizeof (defaults));
+	}
+	rv = &defaults;
+	if (defaults.lead_us == 0) {
+		defaults.lead_us = SYNERGY_CONNECT_LEAD_US;
+	}
+	if (defaults.timeout_ms == 0) {
+		defaults.timeout_ms = SYNERGY_CONNECT_TIMEOUT_MS;
+	}
+	if (defaults.backoff_ms == 0) {
+		defaults.backoff_ms = SYNERGY_CONNECT_BACKOFF_MS;
+	}
+	if (defaults.backoff_max_ms < defaults.backoff_ms) {
+		defaults.backoff_max_ms = defaults.backoff_ms * 8;
+	}
+	if (defaults.attempts == 0) {
+		defaults.attempts = SYNERGY_CONNECT_ATTEMPTS;
+	}
+	if (timing == NULL) {
+		timing = &dummy;
+	}
+	memset (timing, 0, sizeof (*timing));
+	started = synergy_monotonic_ns ();
+	//
+	// Learn the kind of socket, which must be bound to the port that the
+	// peer was told; the kernel keeps such a port when an attempt fails
+	if ((getsockopt (sockfd, SOL_SOCKET, SO_TYPE, &type, &optsz) == -1)
+			|| (getsockopt (sockfd, SOL_SOCKET, SO_PROTOCOL, &proto, &optsz) == -1)
+			|| (getsockname (sockfd, (struct sockaddr *) &local, &namesz) == -1)) {
+		return -1;
+	}
+	if ((local.sin6_family != AF_INET6) || (peer == NULL) || (peer->sin6_family != AF_INET6)) {
+		errno = EAFNOSUPPORT;
+		return -1;
+	}
+	if ((type != SOCK_STREAM) && !((type == SOCK_DGRAM) && (proto == IPPROTO_UDP))) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	if (local.sin6_port == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	//
+	// Stream sockets connect without blocking; UDP sockets connect now,
+	// and report the departure of their hello
+	flags = fcntl (sockfd, F_GETFL);
+	if ((flags == -1) || (fcntl (sockfd, F_SETFL, flags | O_NONBLOCK) == -1)) {
+		return -1;
+	}
+	if (type == SOCK_DGRAM) {
+		optsz = sizeof (oldstamp);
+		getsockopt (sockfd, SOL_SOCKET, SO_TIMESTAMPING, &oldstamp, &optsz);
+		stamping = oldstamp | SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_TSONLY;
+		setsockopt (sockfd, SOL_SOCKET, SO_TIMESTAMPING, &stamping, sizeof (stamping));
+		if (connect (sockfd, (struct sockaddr *) peer, sizeof (*peer)) == -1) {
+			err = errno;
+			goto done;
+		}
+	}
+	namesz = sizeof (local);
+	getsockname (sockfd, (struct sockaddr *) &local, &namesz);
+	//
+	// Run the attempts on their schedule, skipping those already past
+	instant = (rv->instant.tv_sec != 0) ? ((int64_t) rv->instant.tv_sec) * 1000000000 + rv->instant.tv_nsec
+			: synergy_wallclock_ns () + ((int64_t) rv->lead_us) * 1000;
+	backoff = ((int64_t) rv->backoff_ms) * 1000000;
+	for (attempt = 0; attempt < rv->attempts; attempt++) {
+		if (attempt > 0) {
+			instant += ((int64_t) rv->timeout_ms) * 1000000 + backoff;
+			backoff *= 2;
+			if (backoff > ((int64_t) rv->backoff_max_ms) * 1000000) {
+				backoff = ((int64_t) rv->backoff_max_ms) * 1000000;
+			}
+		}
+		deadline = instant + ((int64_t) rv->timeout_ms) * 1000000;
+		if (deadline <= synergy_wallclock_ns ()) {
+			continue;
+		}
+		timing->attempts++;
+		timing->sent_ns = 0;
+		timing->established_ns = 0;
+		//
+		// Punch just before the instant, then connect on it
+		synergy_sleep_until (instant - ((int64_t) rv->lead_us) * 1000);
+		timing->punch_ns = synergy_wallclock_ns () - instant;
+		if (synergy (sockfd, hoplimit, peer) == -1) {
+			err = errno;
+			break;
+		}
+		synergy_sleep_until (instant);
+		timing->connect_ns = synergy_wallclock_ns () - instant;
+		if (type == SOCK_DGRAM) {
+			retval = synergy_connect_dgram (sockfd, instant, deadline, &timing->sent_ns);
+		} else {
+			retval = synergy_connect_stream (sockfd, peer, deadline);
+		}
+		err = (retval == -1) ? errno : 0;
+		synergy_trace (SYNERGY_TRACE_CONNECT, &local.sin6_addr, local.sin6_port,
+				&peer->sin6_addr, peer->sin6_port, proto, hoplimit, err);
+		if (retval == 0) {
+			timing->established_ns = synergy_wallclock_ns () - instant;
+			break;
+		}
+		if (!synergy_retryable (err)) {
+			break;
+		}
+	}
+	//
+	// Restore the socket as the caller had it
+done:
+	if (type == SOCK_DGRAM) {
+		if ((retval == 0) && (timing->sent_ns == 0)) {
+			synergy_hello_sent (sockfd, instant, &timing->sent_ns);
+		}
+		setsockopt (sockfd, SOL_SOCKET, SO_TIMESTAMPING, &oldstamp, sizeof (oldstamp));
+	}
+	fcntl (sockfd, F_SETFL, flags);
+	timing->total_ns = synergy_monotonic_ns () - started;
+	if (retval == -1) {
+		errno = err;
+	}
+	return retval;
+}
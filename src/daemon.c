@@ -5,10 +5,41 @@
  * process.  This does only the work that requires root privileges, namely
  * sending a RAW packet with manually crafted content.
  *
+ * The main loop waits for the socket with epoll, and then drains it with
+ * recvmmsg() until it would block.  The requests are handed to a pool of
+ * worker threads, which do the actual sending.  Nothing in the main loop
+ * blocks, so a slow request never holds up the others.
+ *
+ * With -U, the datagram requests are instead received and punched through
+ * an io_uring, which also polls the epoll instance; see uring.c.  When the
+ * kernel cannot offer that, the main loop is used.
+ *
+ * Requests come in two versions of their format.  The second version hints
+ * at the protocol and local address of each socket, which workers check
+ * cheaply, or not at all when -t says that the clients are trusted; it can
+ * also ask for a reply with the outcome of the punches.  See wire.c.
+ *
+ * Sessions may also register sockets to be punched again at an interval,
+ * which the main loop does from a timer wheel; see refresh.c.
+ *
+ * Jobs wait for the workers in a queue per user, and users take turns, so
+ * one user cannot starve the others.  Options -r and -b limit the rate and
+ * burst of every user, -W gives a user a larger share, and -p paces the
+ * punches of all users together; see fairq.c.
+ *
+ * With -B, processes in the given cgroup can also pass requests through
+ * an eBPF program on setsockopt(), without a message; see bpfpunch.c.
+ *
+ * Failures are not logged per punch, but counted in shared memory along
+ * with the other metrics of the daemon; synergystat shows them.  The
+ * punches themselves are traced by default, for synergytrace to show.
+ *
  * From: Rick van Rein <rick@openfortress.nl>
  */
 
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -17,16 +48,49 @@
 #include <errno.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <sys/un.h>
 
 #include <sys/socketsynergy.h>
 
+#include "daemon.h"
+
+
+/* The number of datagrams drained from the socket with one recvmmsg() call,
+ * the length of the queue of each worker and each user, and the number of
+ * users that can be given a weight.
+ */
+#define RECV_BATCH 16
+#define WORKER_QUEUE 4096
+#define WEIGHTS_MAX 16
+
+
+/* The buffers for recvmmsg() are large, so they are kept out of the stack.
+ */
+static uint64_t reqbuf [RECV_BATCH] [(SYNERGY_WIRE_MAX + 7) / 8];
+static struct sockaddr_un namebuf [RECV_BATCH];
+static char ancbuf [RECV_BATCH] [CMSG_SPACE (sizeof (struct ucred)) + CMSG_SPACE (sizeof (int) * SYNERGY_BATCH_MAX)];
+static struct iovec iovbuf [RECV_BATCH];
+static struct mmsghdr mmbuf [RECV_BATCH];
+
+static uint8_t minhoplim = 1;
+static uint8_t maxhoplim = 254;
+
+static int epfd = -1;
+static struct evhandler dgram;
+static int useuring = 0;
+static struct metrics_shard *metrics;
+
 
 void cleanup_socket (void) {
 	unlink (SYNERGY_DAEMON_SOCKET_PATH);
+	unlink (SYNERGY_DAEMON_SESSION_PATH);
 }
 
 void cleanup_pidfile (void) {
@@ -34,21 +98,282 @@ void cleanup_pidfile (void) {
 }
 
 
+int evloop_add (struct evhandler *evh, uint32_t events) {
+	struct epoll_event ev;
+	memset (&ev, 0, sizeof (ev));
+	ev.events = events;
+	ev.data.ptr = evh;
+	return epoll_ctl (epfd, EPOLL_CTL_ADD, evh->fd, &ev);
+}
+
+
+void evloop_del (struct evhandler *evh) {
+	epoll_ctl (epfd, EPOLL_CTL_DEL, evh->fd, NULL);
+}
+
+
+void evloop_poll (int timeout_ms) {
+	struct epoll_event evs [8];
+	int evcnt;
+	int i;
+	if ((timeout_ms != 0) && !shmrings_idle ()) {
+		timeout_ms = 0;
+	}
+	evcnt = epoll_wait (epfd, evs, 8, timeout_ms);
+	for (i = 0; i < evcnt; i++) {
+		struct evhandler *evh = evs [i].data.ptr;
+		evh->handle (evh, evs [i].events);
+	}
+	shmrings_poll ();
+	fairq_dispatch ();
+}
+
+
+uint8_t clamp_hoplimit (uint8_t hoplimit) {
+	if (hoplimit < minhoplim) {
+		return minhoplim;
+	} else if (hoplimit > maxhoplim) {
+		return maxhoplim;
+	} else {
+		return hoplimit;
+	}
+}
+
+
+/* Handle one received datagram with one or more requests.  The sockets
+ * are taken in first, so they will be closed even if the message is not
+ * acceptable.  The credentials of the sender tell the queue that its jobs
+ * wait in; jobs that do not fit are dropped, and so counted in the metrics.
+ * Datagrams in the second version of the request format start with its
+ * header, and are parsed by wire.c.
+ */
+void handle_datagram (struct msghdr *mgh, ssize_t len) {
+	struct synergy_request_message *req = mgh->msg_iov->iov_base;
+	struct synergy_wire_header *hdr = mgh->msg_iov->iov_base;
+	struct job jobs [SYNERGY_BATCH_MAX];
+	int todo [SYNERGY_BATCH_MAX];
+	int todocnt = 0;
+	int reqcnt;
+	int accepted = 0;
+	uid_t uid = (uid_t) -1;
+	uint64_t now;
+	int i;
+	//
+	// Parse the message, validate its structure
+	struct cmsghdr *cmg;
+	struct ucred cred;
+	for (cmg = CMSG_FIRSTHDR (mgh); cmg != NULL; cmg = CMSG_NXTHDR (mgh, cmg)) {
+		if (cmg->cmsg_level != SOL_SOCKET) {
+			continue;
+		}
+		if ((cmg->cmsg_type == SCM_CREDENTIALS) && (cmg->cmsg_len == CMSG_LEN (sizeof (cred)))) {
+			memcpy (&cred, CMSG_DATA (cmg), sizeof (cred));
+			uid = cred.uid;
+		} else if ((cmg->cmsg_type == SCM_RIGHTS) && (todocnt == 0)) {
+			todocnt = (cmg->cmsg_len - CMSG_LEN (0)) / sizeof (int);
+			memcpy (todo, CMSG_DATA (cmg), sizeof (int) * todocnt);
+		}
+	}
+	if (todocnt == 0) {
+		metrics_add (&metrics->malformed, 1);
+		return;
+	}
+	if ((mgh->msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || (len <= 0)) {
+		metrics_add (&metrics->malformed, 1);
+		goto close_todo;
+	}
+	if ((len >= sizeof (*hdr)) && (hdr->magic == SYNERGY_WIRE_MAGIC)) {
+		reqcnt = wire_jobs (mgh, len, todo, todocnt, jobs);
+		if (reqcnt == -1) {
+			if (errno == EPROTO) {
+				metrics_add (&metrics->malformed, 1);
+			} else {
+				metrics_add (&metrics->dropped, 1);
+			}
+			return;
+		}
+		metrics_add (&metrics->received, reqcnt);
+	} else {
+		if ((len % sizeof (req [0]) != 0) || (len / sizeof (req [0]) != todocnt)) {
+			metrics_add (&metrics->malformed, 1);
+			goto close_todo;
+		}
+		reqcnt = todocnt;
+		metrics_add (&metrics->received, reqcnt);
+		//
+		// Apply minhoplim and maxhoplim, and what we learned about the route
+		now = metrics_now ();
+		for (i = 0; i < reqcnt; i++) {
+			memcpy (&jobs [i].symcli, &req [i].symcli, sizeof (jobs [i].symcli));
+			jobs [i].sockfd = todo [i];
+			jobs [i].hoplimit = hoplearn_apply (&jobs [i].symcli, req [i].hoplimit);
+			jobs [i].session = NULL;
+			jobs [i].confirm = NULL;
+			jobs [i].reply = NULL;
+			jobs [i].tag = 0;
+			jobs [i].received = now;
+			jobs [i].deadline = 0;
+			jobs [i].marker = 0;
+			jobs [i].hint.proto = 0;
+		}
+	}
+	//
+	// Queue the jobs for the workers or the ring, who will close the sockets
+	accepted = fairq_submit (uid, jobs, reqcnt);
+	if (accepted < reqcnt) {
+		metrics_add (&metrics->dropped, reqcnt - accepted);
+	}
+	//
+	// Close the sockets of the jobs that were not taken
+	for (i = accepted; i < reqcnt; i++) {
+		close (jobs [i].sockfd);
+		if (jobs [i].reply != NULL) {
+			wire_complete (jobs [i].reply, jobs [i].replyidx, EAGAIN);
+		}
+	}
+	return;
+close_todo:
+	//
+	// Close the sockets of a malformed message
+	for (i = 0; i < todocnt; i++) {
+		close (todo [i]);
+	}
+}
+
+
+/* Drain the socket with recvmmsg() until it would block.
+ */
+static void drain_socket (struct evhandler *evh, uint32_t events) {
+	int sox = evh->fd;
+	int got;
+	int i;
+	do {
+		for (i = 0; i < RECV_BATCH; i++) {
+			iovbuf [i].iov_base = reqbuf [i];
+			iovbuf [i].iov_len = sizeof (reqbuf [i]);
+			memset (&mmbuf [i], 0, sizeof (mmbuf [i]));
+			mmbuf [i].msg_hdr.msg_name = &namebuf [i];
+			mmbuf [i].msg_hdr.msg_namelen = sizeof (namebuf [i]);
+			mmbuf [i].msg_hdr.msg_iov = &iovbuf [i];
+			mmbuf [i].msg_hdr.msg_iovlen = 1;
+			mmbuf [i].msg_hdr.msg_control = ancbuf [i];
+			mmbuf [i].msg_hdr.msg_controllen = sizeof (ancbuf [i]);
+		}
+		got = recvmmsg (sox, mmbuf, RECV_BATCH, MSG_DONTWAIT, NULL);
+		for (i = 0; i < got; i++) {
+			handle_datagram (&mmbuf [i].msg_hdr, mmbuf [i].msg_len);
+		}
+	} while (got == RECV_BATCH);
+}
+
+
 int main (int argc, char *argv []) {
-	uint8_t minhoplim = 1;
-	uint8_t maxhoplim = 254;
+	int numworkers = WORKERS_DEFAULT;
+	int learnpfx = HOPLEARN_PREFIXLEN_DEFAULT;
+	unsigned int initflags = 0;
+	int txbackend = TXBACKEND_RAW;
+	int trusted = 0;
+	unsigned long rate = 0;
+	unsigned long burst = FAIRQ_BURST_DEFAULT;
+	unsigned long pace = 0;
+	uid_t wuids [WEIGHTS_MAX];
+	unsigned int weights [WEIGHTS_MAX];
+	int numweights = 0;
+	char *colon;
+	char *cgroup = NULL;
+	char *hopcachepath = SYNERGY_HOPCACHE_PATH;
+	int opt;
+	int i;
 	//
 	// Sanity checks
-	if (argc > 3) {
-		fprintf (stderr, "USAGE: %s [minhoplimit [maxhoplimit]]\n",
+	while ((opt = getopt (argc, argv, "w:l:c:HT:Utr:b:p:W:B:")) != -1) {
+		switch (opt) {
+		case 'B':
+			cgroup = optarg;
+			break;
+		case 'r':
+			rate = strtoul (optarg, NULL, 10);
+			break;
+		case 'b':
+			burst = strtoul (optarg, NULL, 10);
+			break;
+		case 'p':
+			pace = strtoul (optarg, NULL, 10);
+			break;
+		case 'W':
+			colon = strchr (optarg, ':');
+			if ((colon == NULL) || (numweights >= WEIGHTS_MAX)) {
+				argc = 0;
+				break;
+			}
+			wuids [numweights] = strtoul (optarg, NULL, 10);
+			weights [numweights] = strtoul (colon + 1, NULL, 10);
+			numweights++;
+			break;
+		case 't':
+			trusted = 1;
+			break;
+		case 'H':
+			initflags |= SYNERGY_INIT_HDRINCL;
+			break;
+		case 'U':
+			useuring = 1;
+			break;
+		case 'T':
+			if (strcmp (optarg, "raw") == 0) {
+				txbackend = TXBACKEND_RAW;
+			} else if (strcmp (optarg, "ring") == 0) {
+				txbackend = TXBACKEND_RING;
+			} else if (strcmp (optarg, "xdp") == 0) {
+				txbackend = TXBACKEND_XDP;
+			} else {
+				argc = 0;
+			}
+			break;
+		case 'w':
+			numworkers = atoi (optarg);
+			break;
+		case 'l':
+			learnpfx = atoi (optarg);
+			break;
+		case 'c':
+			hopcachepath = optarg;
+			break;
+		default:
+			argc = 0;
+			break;
+		}
+	}
+	if ((argc == 0) || (argc - optind > 2)) {
+		fprintf (stderr, "USAGE: %s [-H] [-T raw|ring|xdp] [-U] [-t] [-w workers] [-l learnprefixlen] [-c hopcache] [-r rate] [-b burst] [-p pace] [-W uid:weight]... [-B cgroup] [minhoplimit [maxhoplimit]]\n",
 				argv [0]);
 		exit (1);
 	}
-	if (argc > 1) {
-		minhoplim = atoi (argv [1]);
+	if (argc - optind > 0) {
+		minhoplim = atoi (argv [optind]);
+	}
+	if (argc - optind > 1) {
+		maxhoplim = atoi (argv [optind + 1]);
 	}
-	if (argc > 2) {
-		maxhoplim = atoi (argv [2]);
+	if ((numworkers < 1) || (numworkers > WORKERS_MAX)) {
+		fprintf (stderr, "SILLY: workers set to %d\n", WORKERS_DEFAULT);
+		numworkers = WORKERS_DEFAULT;
+	}
+	if ((learnpfx < 0) || (learnpfx > 128)) {
+		fprintf (stderr, "SILLY: learnprefixlen set to %d\n", HOPLEARN_PREFIXLEN_DEFAULT);
+		learnpfx = HOPLEARN_PREFIXLEN_DEFAULT;
+	}
+	if ((burst < 1) || (burst > 1000000)) {
+		fprintf (stderr, "SILLY: burst set to %d\n", FAIRQ_BURST_DEFAULT);
+		burst = FAIRQ_BURST_DEFAULT;
+	}
+	if (rate > 1000000000) {
+		fprintf (stderr, "SILLY: rate set to unlimited\n");
+		rate = 0;
+	}
+	if (pace > 1000000000) {
+		fprintf (stderr, "SILLY: pace set to unlimited\n");
+		pace = 0;
 	}
 	if (minhoplim < 1) {
 		fprintf (stderr, "SILLY: minhoplimit set to 1\n");
@@ -91,7 +416,7 @@ int main (int argc, char *argv []) {
 	}
 	//
 	// Open socket
-	int sox = socket (PF_UNIX, SOCK_DGRAM, 0);
+	int sox = socket (PF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0);
 	if (sox == -1) {
 		perror ("Could not obtain a socket for synergy.d");
 		exit (1);
@@ -101,6 +426,11 @@ int main (int argc, char *argv []) {
 	socket_path.sun_family = PF_UNIX;
 	strncpy (socket_path.sun_path, SYNERGY_DAEMON_SOCKET_PATH,
 				sizeof (socket_path.sun_path));
+	int one = 1;
+	if (setsockopt (sox, SOL_SOCKET, SO_PASSCRED, &one, sizeof (one)) == -1) {
+		perror ("Could not ask for the credentials of synergy.d clients");
+		exit (1);
+	}
 	if (bind (sox, (struct sockaddr *) &socket_path,
 				sizeof (socket_path)) == -1) {
 		if (errno == EADDRINUSE) {
@@ -117,6 +447,14 @@ int main (int argc, char *argv []) {
 		exit (1);
 	}
 	//
+	// Open the session socket, also generally available
+	int lsox = sessions_open ();
+	if (lsox == -1) {
+		perror ("Could not open synergy.d session socket");
+		cleanup_socket ();
+		exit (1);
+	}
+	//
 	// Fork daemon process / cleanup and exit master
 	pid_t child = fork ();
 	switch (child) {
@@ -124,12 +462,14 @@ int main (int argc, char *argv []) {
 		/* Failed to fork; report and exit in agony */
 		perror ("Failed to fork synergy.d daemon process");
 		close (sox);
+		close (lsox);
 		cleanup_socket ();
 		exit (1);
 	default:
 		/* Parent with successful child forked; cleanup and exit */
 		fprintf (stderr, "Successfully forked synergy.d child process %d\n", child);
 		close (sox);
+		close (lsox);
 		exit (0);
 	case 0:
 		/* Child was forked properly, detach and continue below */
@@ -151,70 +491,94 @@ int main (int argc, char *argv []) {
 		break;
 	}
 	//
-	// Prepare for nice cleanup
-	//
-	// Run the service loop forever and ever
-	char anc [CMSG_SPACE (sizeof (int))];
-	struct synergy_request_message req;
-	struct iovec iov;
-	struct msghdr mgh;
-handler_init:
-	memset (&anc, 0, sizeof (anc));
-	memset (&req, 0, sizeof (req));
-	memset (&iov, 0, sizeof (iov));
-	memset (&mgh, 0, sizeof (mgh));
-	iov.iov_len = sizeof (req);
-	iov.iov_base = &req;
-	mgh.msg_iovlen = 1;
-	mgh.msg_iov = &iov;
-	mgh.msg_controllen = sizeof (anc);
-	mgh.msg_control = &anc;
-	ssize_t len;
-	int todo = -1;
-handler_loop:
-	//
-	// Close any open socket in todo -- we got it as a duplicate file handle
-	if (todo >= 0) {
-		close (todo);
-		todo = -1;
-	}
-	//
-	// Read a new message (block on it, it's all we do anyway)
-	len = recvmsg (sox, &mgh, 0);
-	if (len != sizeof (req)) {
-		goto handler_loop;
+	// Count in shared memory, where synergystat can find the metrics
+	if (metrics_open (numworkers) == -1) {
+		fprintf (stderr, "No shared memory for the metrics of synergy.d: %s\n",
+				strerror (errno));
 	}
+	metrics = metrics_shard (0);
 	//
-	// Parse the message, validate its structure
-	struct cmsghdr *cmg;
-	cmg = CMSG_FIRSTHDR (&mgh);
-	if (cmg->cmsg_len != CMSG_LEN (sizeof (int))) {
-		goto handler_loop;
+	// Queue the jobs per user, with the given weights, rates and pacing
+	if (fairq_config (rate, burst, pace, WORKER_QUEUE) == -1) {
+		perror ("Failed to configure the queues of synergy.d");
+		exit (1);
 	}
-	if ((cmg->cmsg_level != SOL_SOCKET) || (cmg->cmsg_type != SCM_RIGHTS)) {
-		goto handler_loop;
+	for (i = 0; i < numweights; i++) {
+		if (fairq_weight (wuids [i], weights [i]) == -1) {
+			fprintf (stderr, "Failed to set weight %u for uid %u: %s\n",
+					weights [i], (unsigned int) wuids [i], strerror (errno));
+			exit (1);
+		}
 	}
-	todo = * (int *) CMSG_DATA (cmg);
-	if (todo < 0) {
-		goto handler_loop;
+	//
+	// Start the workers, each with their own RAW sockets and rings
+	if (synergy_init_flags (initflags) == -1) {
+		perror ("Failed to setup RAW sockets for synergy.d");
+		exit (1);
+	}
+	if (workers_start (numworkers, WORKER_QUEUE, txbackend) == -1) {
+		perror ("Failed to start workers for synergy.d");
+		exit (1);
 	}
 	//
-	// Apply minhoplim and maxhoplim
-	if (req.hoplimit < minhoplim) {
-		req.hoplimit = minhoplim;
-	} else if (req.hoplimit > maxhoplim) {
-		req.hoplimit = maxhoplim;
+	// Prepare the event loop, with the socket and the session listener
+	epfd = epoll_create1 (EPOLL_CLOEXEC);
+	if (epfd == -1) {
+		perror ("Failed to create epoll instance for synergy.d");
+		exit (1);
+	}
+	dgram.handle = drain_socket;
+	dgram.fd = sox;
+	wire_start (sox, trusted);
+	if (useuring && (uring_start (sox, epfd) == -1)) {
+		fprintf (stderr, "No io_uring for synergy.d, using the main loop: %s\n",
+				strerror (errno));
+		useuring = 0;
+	}
+	if ((!useuring && (evloop_add (&dgram, EPOLLIN) == -1)) || (sessions_start (lsox) == -1)) {
+		perror ("Failed to add synergy.d sockets to epoll");
+		exit (1);
+	}
+	if (fairq_start (useuring ? uring_submit : workers_submit) == -1) {
+		perror ("Failed to start the queues of synergy.d");
+		exit (1);
 	}
 	//
-	// Invoke the synergy library operation with our root privileges
-	if (synergy_privileged (todo, req.hoplimit, &req.symcli) != 0) {
-		perror ("Privileged synergy operation failed");
-		goto handler_loop;
+	// Share learned hop limits with all processes, and over restarts
+	if (hopcache_open (hopcachepath, learnpfx) == -1) {
+		fprintf (stderr, "No hop cache for synergy.d in %s: %s\n",
+				hopcachepath, strerror (errno));
 	}
 	//
-	// Report positively
-	fprintf (stderr, "Succeeded synergy operation\n");
+	// Listen for TCP RST replies that teach us about hop limits
+	if (hoplearn_start (learnpfx) == -1) {
+		perror ("Failed to start hop limit learning in synergy.d");
+		exit (1);
+	}
+	//
+	// Listen for ICMPv6 Time Exceeded replies that confirm punches
+	if (confirms_start () == -1) {
+		perror ("Failed to start confirmation of punches in synergy.d");
+		exit (1);
+	}
+	//
+	// Refresh the punches of the sockets that sessions register
+	if (refresh_start () == -1) {
+		perror ("Failed to start the refresh service of synergy.d");
+		exit (1);
+	}
+	//
+	// Take requests from the eBPF program in the cgroup, if any
+	if ((cgroup != NULL) && (bpfpunch_start (cgroup) == -1)) {
+		perror ("Failed to attach the eBPF program of synergy.d");
+		exit (1);
+	}
 	//
-	// Continue the service loop
-	goto handler_loop;
+	// Run the service loop forever and ever, in the ring if we have one
+	if (useuring) {
+		uring_run ();
+	}
+	while (1) {
+		evloop_poll (-1);
+	}
 }
@@ -0,0 +1,396 @@
+/* daemon.h -- Internal interfaces between the parts of synergy.d
+ *
+ * The daemon is split into a main loop that takes in requests, and a pool
+ * of workers that send the punches with their own RAW sockets.  The main
+ * loop never waits for the workers; it hands over jobs and moves on.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+#ifndef SYNERGY_DAEMON_H
+#define SYNERGY_DAEMON_H
+
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <sys/socketsynergy.h>
+
+#include "libsynergy.h"
+
+
+/* Everything that the main loop waits for is described by an event handler,
+ * which is usually embedded at the start of a larger structure.  The main
+ * loop calls the handler with the epoll events that occurred.
+ */
+struct evhandler {
+	void (*handle) (struct evhandler *evh, uint32_t events);
+	int fd;
+};
+
+int evloop_add (struct evhandler *evh, uint32_t events);
+void evloop_del (struct evhandler *evh);
+
+/* Handle the events that are ready, waiting up to the given time for them.
+ */
+void evloop_poll (int timeout_ms);
+
+
+/* A refresh registration of a socket is private to refresh.c.
+ */
+struct refresh;
+
+
+/* A session is a persistent connection from a client process.  It is
+ * reference counted, because jobs refer to it until their completion has
+ * been sent; the main loop holds one reference until the client hangs up.
+ * The process id of the client is used to see whether the sockets that it
+ * registered for refreshes are still open there, and its user id decides
+ * the queue that its jobs wait in.
+ */
+struct session {
+	struct evhandler evh;
+	int refs;
+	pid_t pid;
+	uid_t uid;
+	struct refresh *refreshes;
+	struct shmring *ring;
+};
+
+
+/* A confirmation that a punch drew its Time Exceeded reply is awaited
+ * for session requests that ask for it.  It is private to confirms.c.
+ */
+struct confirm;
+
+
+/* The reply to a datagram that asked for one is private to wire.c.
+ */
+struct wire_reply;
+
+
+/* A job is a single punch request to be handled by a worker.  The socket
+ * was received from the client and is closed by the worker when done.
+ * Jobs that arrived over a session hold a reference to it, and a tag to
+ * return in the completion.  When a confirmation is awaited, the job holds
+ * a reference to that instead, and it completes the session request.
+ * Jobs from a datagram that asked for a reply hold a reference to it, and
+ * their index in it.  The hint comes from the client, and has proto 0 when
+ * it did not send any.  Jobs that the kernel passed on from the eBPF
+ * program or from a shared ring have no socket, and hints that need no
+ * check.  The receipt and the deadline are in the time of metrics_now();
+ * a job that was not sent by its deadline expires, and a deadline of 0
+ * means none.  Probes have a marker, and are sent with nothing to
+ * complete; normal punches have a marker of 0.
+ */
+struct job {
+	struct sockaddr_in6 symcli;
+	int sockfd;
+	uint8_t hoplimit;
+	struct session *session;
+	struct confirm *confirm;
+	struct wire_reply *reply;
+	uint16_t replyidx;
+	uint64_t tag;
+	uint64_t received;
+	uint64_t deadline;
+	uint32_t marker;
+	struct synergy_hint hint;
+};
+
+
+/* The maximum number of workers, and the default number to start.
+ */
+#define WORKERS_MAX 64
+#define WORKERS_DEFAULT 2
+
+
+/* Workers send with their own RAW sockets, or through memory-mapped rings
+ * that take complete Ethernet frames, on AF_PACKET or AF_XDP sockets.
+ */
+#define TXBACKEND_RAW  0
+#define TXBACKEND_RING 1
+#define TXBACKEND_XDP  2
+
+
+/* Start the given number of worker threads, each with their own RAW sockets,
+ * a queue of the given length and rings for the given transmit backend.
+ * Returns 0 on success, or -1 with errno.
+ */
+int workers_start (int count, int queuelen, int txbackend);
+
+/* Hand over jobs to the workers, without ever blocking.  Returns the number
+ * of jobs that were accepted, counted from the start of the array; the
+ * caller should close the sockets of the remaining jobs.
+ */
+int workers_submit (struct job *jobs, int count);
+
+
+/* Jobs wait for the workers in a queue per client, identified by its user
+ * id, and the clients take turns by deficit round robin, in proportion to
+ * their weight.  The rate of every client is limited by a token bucket, and
+ * the punches of all clients by a global pacer; a rate of 0 is unlimited.
+ * Configure before the workers start, so they can apply the pacer to their
+ * sockets with fairq_pace(), and start with the function that takes jobs,
+ * after the main loop was setup.
+ *
+ * Submitting jobs returns the number that was queued, like workers_submit()
+ * does.  Within the turn of a client, jobs with a deadline go first, the
+ * earliest first, and those that passed it expire with ETIMEDOUT.  The
+ * main loop calls fairq_dispatch() after every round of events, and a
+ * timer calls it while jobs are waiting.
+ */
+#define FAIRQ_BURST_DEFAULT 64
+
+int fairq_config (uint32_t rate, uint32_t burst, uint32_t pace, int queuelen);
+int fairq_weight (uid_t uid, unsigned int weight);
+void fairq_pace (int sox);
+int fairq_start (int (*submit) (struct job *jobs, int count));
+int fairq_submit (uid_t uid, struct job *jobs, int count);
+void fairq_dispatch (void);
+
+
+/* The rings of one worker, for TXBACKEND_RING or TXBACKEND_XDP.  AF_XDP
+ * sends on the given queue, and falls back to AF_PACKET.  Opening fails
+ * with errno when neither is possible.  Punches come in with the status
+ * TXRING_FALLBACK, and others are skipped.  The punches that txring_many()
+ * cannot send keep that status, and they should be sent with the RAW
+ * sockets instead.  The hints, if any, run parallel to the punches.
+ */
+#define TXRING_FALLBACK -1
+
+struct txring;
+
+struct txring *txring_open (int backend, int queue);
+void txring_many (struct txring *txr, struct synergy_punch *punches, const struct synergy_hint *hints, unsigned int count);
+
+
+/* Handle one datagram with requests from the daemon socket.  The sockets
+ * that it carries are always taken care of.
+ */
+void handle_datagram (struct msghdr *mgh, ssize_t len);
+
+
+/* The second version of the request format is parsed by wire.c, which
+ * also sends the replies on the daemon socket.  Parsing takes over all the
+ * sockets, and duplicates those that are shared by several requests, so
+ * that every job has its own.  It fills in the jobs with their tag set to
+ * the reqid, and a copy of every request.  It returns the number of jobs,
+ * or -1 with all sockets closed and errno set to EPROTO for a malformed
+ * message.
+ *
+ * Datagrams are turned into jobs by wire_jobs(), which also sets up their
+ * reply.  Every job with a reply must be completed with wire_complete(),
+ * also when it is dropped.
+ *
+ * Workers call wire_check() on their jobs before they punch.  It fails
+ * with EINVAL when the hints do not match the socket, unless the daemon
+ * was started to trust them.  The check is cached per thread by the inode
+ * of the socket, so a socket that is punched again costs only an fstat().
+ */
+void wire_start (int sox, int trusted);
+int wire_parse (const void *msg, size_t len, int *fds, int fdcnt,
+			struct job *jobs, struct synergy_wire_request *reqs, uint8_t *flags);
+int wire_jobs (struct msghdr *mgh, ssize_t len, int *fds, int fdcnt, struct job *jobs);
+void wire_complete (struct wire_reply *wr, uint16_t idx, int error);
+int wire_check (struct job *job);
+
+
+/* The io_uring engine receives datagrams, and sends their punches, through
+ * a ring instead of the main loop and the workers.  It polls the epoll
+ * instance of the main loop, and runs its handlers.  Starting fails with
+ * errno when the kernel lacks io_uring or some of its features.  Jobs are
+ * submitted like with workers_submit(), and they overflow into the workers,
+ * which also take the jobs of sessions.
+ */
+int uring_start (int sox, int epfd);
+void uring_run (void);
+int uring_submit (struct job *jobs, int count);
+
+
+/* Metrics are counted in a shared memory segment, which synergystat maps
+ * to read them without disturbing the daemon.  Every thread that handles
+ * requests has a shard of its own, and it is the only writer of that
+ * shard, so counting needs no locks or atomic read-modify-write; readers
+ * add up the shards.  Shard 0 is the main loop, including the io_uring
+ * engine, and shard 1 onwards are the workers.
+ *
+ * The main loop counts the requests that come in, and those that are
+ * malformed, dropped, clamped to the command line range or lowered by
+ * hop limit learning.  It also counts refresh registrations as they come
+ * and go, and the refresh punches that it hands to the workers.  Turns of
+ * clients that their rate limit cut short are counted as throttled, and
+ * rounds that the global pacer ended as paced.  Jobs that passed their
+ * deadline are counted as expired, by the queues or by the workers that
+ * took them, and not as punches.  The threads that send count
+ * punches by protocol, failures by errno, and the latency from receipt to
+ * send in buckets of powers of two nanoseconds.
+ */
+#define METRICS_SHM_NAME "/synergy.metrics"
+#define METRICS_MAGIC 0x53594e4d
+#define METRICS_VERSION 4
+
+#define METRICS_SHARDS (1 + WORKERS_MAX)
+#define METRICS_ERRNOS 136
+#define METRICS_LATENCY_BUCKETS 40
+
+#define METRICS_PROTO_TCP   0
+#define METRICS_PROTO_UDP   1
+#define METRICS_PROTO_SCTP  2
+#define METRICS_PROTO_OTHER 3
+#define METRICS_PROTOS      4
+
+struct metrics_shard {
+	uint64_t received;
+	uint64_t malformed;
+	uint64_t dropped;
+	uint64_t clamped;
+	uint64_t learned;
+	uint64_t registered;
+	uint64_t unregistered;
+	uint64_t refreshed;
+	uint64_t throttled;
+	uint64_t paced;
+	uint64_t expired;
+	uint64_t sent;
+	uint64_t failed;
+	uint64_t proto_sent [METRICS_PROTOS];
+	uint64_t proto_failed [METRICS_PROTOS];
+	uint64_t errors [METRICS_ERRNOS];
+	uint64_t latency [METRICS_LATENCY_BUCKETS];
+	uint64_t latency_ns;
+} __attribute__ ((aligned (64)));
+
+struct metrics {
+	uint32_t magic;
+	uint32_t version;
+	int32_t pid;
+	uint32_t shards;
+	int64_t started;
+	struct metrics_shard shard [METRICS_SHARDS];
+};
+
+/* Create the segment for the given number of workers.  Without it, the
+ * shards are private memory, so counting always works.
+ */
+int metrics_open (int numworkers);
+struct metrics_shard *metrics_shard (int idx);
+
+/* The time in nanoseconds, for the receipt of jobs and their latency.
+ */
+uint64_t metrics_now (void);
+
+/* Count a punch that was sent, or that failed with the given errno.
+ */
+void metrics_punch (struct metrics_shard *ms, uint8_t proto, int error, uint64_t latency_ns);
+
+/* Count for a single writer.  The store is atomic, so readers never see
+ * a torn value.
+ */
+static inline void metrics_add (uint64_t *ctr, uint64_t n) {
+	__atomic_store_n (ctr, __atomic_load_n (ctr, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+
+/* The hop limits are clamped to the range set on the command line.
+ */
+uint8_t clamp_hoplimit (uint8_t hoplimit);
+
+
+/* Learn maximum hop limits per destination prefix from TCP RST replies
+ * to our punches.  A prefix length of 0 disables learning.  The hop limit
+ * for a request is determined by hoplearn_apply(), which also applies the
+ * range set on the command line, and logs the punch for learning.  A hop
+ * limit of 0 takes what was learned, here or in the hop cache.
+ */
+#define HOPLEARN_PREFIXLEN_DEFAULT 48
+
+int hoplearn_start (int prefixlen);
+uint8_t hoplearn_apply (struct sockaddr_in6 *symcli, uint8_t hoplimit);
+
+
+/* Keep the hop limit ranges that were learned per destination prefix in
+ * the hop cache file, which libsynergy maps to look them up itself.  The
+ * prefix length is that of learning, or the default when learning is off.
+ * A bound of 0 in hopcache_learned() was not learned.  Without a cache,
+ * learning does nothing, and lookups fail with ENOENT.  The main loop and
+ * the probe threads may all call these.
+ */
+int hopcache_open (const char *path, int prefixlen);
+int hopcache_lookup (const struct in6_addr *addr, uint8_t *minhop, uint8_t *maxhop);
+void hopcache_learned (const struct in6_addr *addr, uint8_t minhop, uint8_t maxhop);
+
+
+/* Take punch requests from an eBPF program that is attached to setsockopt()
+ * in the given cgroup, and that looks up hop limits in a map.  The map is
+ * filled with bpfpunch_learned(), which removes a prefix for a maxhop of 0,
+ * and does nothing until the program was started.
+ */
+int bpfpunch_start (const char *cgroup);
+void bpfpunch_learned (const struct in6_addr *prefix, int prefixlen, uint8_t maxhop);
+
+
+/* Open the listening socket for sessions, before forking, and start to
+ * accept sessions on it from the main loop, after forking.
+ */
+int sessions_open (void);
+int sessions_start (int lsox);
+
+/* Send the completion of a job to its session, and release the job's
+ * reference to the session.
+ */
+void session_complete (struct session *ses, uint64_t tag, int error, uint32_t latency_us);
+void session_deliver (struct session *ses, struct synergy_completion *cpl);
+void session_release (struct session *ses);
+
+
+/* Confirm punches with the Time Exceeded replies that they draw.  A new
+ * confirmation takes over the job's reference to the session, and holds
+ * a reference for the job.  The worker reports the outcome of its send
+ * with confirm_sent(), which drops that reference; on error, the session
+ * request is completed right away.  Returns NULL with errno on failure.
+ */
+int confirms_start (void);
+struct confirm *confirm_new (struct session *ses, uint64_t tag, int sockfd, struct sockaddr_in6 *symcli, int timeout_ms);
+void confirm_sent (struct confirm *c, int error);
+
+
+/* Refresh the punches for sockets that sessions register, from a timer
+ * wheel in the main loop.  A registration keeps its own duplicate of the
+ * socket, and is dropped when the client closed its socket or the session
+ * ends.  Registering takes over the socket; it replaces an existing
+ * registration of the same client socket number.  Both registering and
+ * cancelling return -1 with errno on failure, or ENOENT when there was
+ * nothing to cancel.  All of this runs on the main loop.
+ */
+int refresh_start (void);
+int refresh_register (struct session *ses, int sockfd, int clientfd, struct sockaddr_in6 *symcli, uint8_t hoplimit, uint32_t interval_ms);
+int refresh_cancel (struct session *ses, int clientfd);
+void refresh_end (struct session *ses);
+
+
+/* Take punch requests from rings in memory that sessions share with the
+ * daemon.  A ring request attaches the ring, or registers or unregisters
+ * a socket, and closes the descriptors that it did not take over; it
+ * returns a handle, 0 or -1 with errno.  The main loop drains the rings
+ * with shmrings_poll() before fairq_dispatch(), and only waits when
+ * shmrings_idle() found no entries.  All of this runs on the main loop.
+ */
+int shmrings_request (struct session *ses, struct synergy_ring_request *req, int *fds, int fdcnt);
+void shmrings_poll (void);
+int shmrings_idle (void);
+void shmrings_end (struct session *ses);
+
+
+/* Run a hop limit probe for a session.  The probes are queued under the
+ * user id of the session like other punches, and the replies are collected
+ * on a thread of its own.  This takes over the socket and a reference to
+ * the session, unless it fails, which it does with EAGAIN when too many
+ * probes are running or the queue of the user is full.
+ */
+int probe_start (struct session *ses, uint64_t tag, int sockfd, struct sockaddr_in6 *symcli, uint8_t maxhop, int timeout_ms);
+
+
+#endif /* SYNERGY_DAEMON_H */
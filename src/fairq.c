@@ -0,0 +1,465 @@
+/* fairq.c -- Fair queuing of jobs between the clients of synergy.d
+ *
+ * The daemon socket is open to every local user, so a single client that
+ * floods it could starve all others.  Jobs are therefore queued per client,
+ * and handed to the workers by deficit round robin: every client with jobs
+ * waiting gets a turn, in which it passes up to a quantum of jobs times its
+ * weight, after which the next client goes.  A client is a user id, which
+ * the kernel attaches to every datagram as SCM_CREDENTIALS, and which the
+ * sessions learn with SO_PEERCRED when they connect.  The processes of a
+ * user share their queue, so forking does not buy a larger share.
+ *
+ * Every client also has a token bucket that limits the rate of its punches,
+ * with a burst on top, and all clients together are held to the rate of a
+ * global pacer, so bursts are spread out before they reach the firewall.
+ * Jobs wait in the queue of their client while the workers are full or the
+ * tokens are out, and a timerfd ticks while any are waiting.  Only jobs
+ * that do not fit in the queue of their client are dropped.
+ *
+ * Jobs with a deadline wait in a heap of their own, and are passed on,
+ * earliest deadline first, before the jobs without one, which keep their
+ * order of arrival in a ring.  A job that is still waiting when its
+ * deadline passes expires without being sent, so a backlog does not
+ * hold up fresh punches with stale ones.
+ *
+ * The pacer also sets SO_MAX_PACING_RATE on the sockets that send punches
+ * through the queueing discipline.  When that is fq, it evens out the
+ * batches that the workers send; otherwise it does no harm.
+ *
+ * All of this runs on the main loop.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include <sys/socketsynergy.h>
+
+#include "daemon.h"
+
+
+/* The jobs that a client of weight 1 may pass in one turn, the number of
+ * jobs with a deadline that are passed at once, the number of hash buckets
+ * to find clients by user id, and the tick of the timer while jobs are
+ * waiting.  The pacer may save up credit for a few ticks, so that
+ * a late tick does not slow it down.
+ */
+#define FAIRQ_QUANTUM 64
+#define FAIRQ_BATCH 64
+#define FAIRQ_BUCKETS 256
+#define FAIRQ_TICK_NS 1000000
+#define FAIRQ_PACE_TICKS 4
+
+
+/* A client has a ring of waiting jobs, a heap of waiting jobs with a
+ * deadline, and a token bucket that holds the nanoseconds of credit that
+ * it built up.  While jobs are waiting, it is on the list of active
+ * clients, which take turns from its head.  Together, the ring and the
+ * heap hold no more than the length of the queue.
+ */
+struct client {
+	struct client *hnext;
+	struct client *anext;
+	uid_t uid;
+	unsigned int weight;
+	int active;
+	int turn;
+	unsigned int deficit;
+	uint64_t credit;
+	uint64_t refilled;
+	struct job *queue;
+	unsigned int head;
+	unsigned int count;
+	struct job *heap;
+	unsigned int heapcount;
+};
+
+
+static struct client *buckets [FAIRQ_BUCKETS];
+static struct client *acthead = NULL;
+static struct client *acttail = NULL;
+static unsigned int numactive = 0;
+static unsigned int queuelen = 0;
+static int (*submitter) (struct job *jobs, int count) = NULL;
+static struct evhandler ticker = { .fd = -1 };
+static int ticking = 0;
+//
+// The token bucket of every client, and of the pacer, in nanoseconds
+static uint64_t cost = 0;
+static uint64_t maxcredit = 0;
+static uint32_t pacerate = 0;
+static uint64_t pacecost = 0;
+static uint64_t pacemax = 0;
+static uint64_t pacecredit = 0;
+static uint64_t pacerefilled = 0;
+
+
+static struct client *client_find (uid_t uid) {
+	struct client **hp = &buckets [(uid * 0x9e3779b1U) >> 24];
+	struct client *c = *hp;
+	while ((c != NULL) && (c->uid != uid)) {
+		c = c->hnext;
+	}
+	if (c != NULL) {
+		return c;
+	}
+	c = calloc (1, sizeof (struct client));
+	if (c == NULL) {
+		return NULL;
+	}
+	c->uid = uid;
+	c->weight = 1;
+	c->credit = maxcredit;
+	c->refilled = metrics_now ();
+	c->hnext = *hp;
+	*hp = c;
+	return c;
+}
+
+
+/* Add credit for the time that passed, up to the burst.
+ */
+static void fairq_refill (uint64_t *credit, uint64_t *refilled, uint64_t max, uint64_t now) {
+	*credit += now - *refilled;
+	if (*credit > max) {
+		*credit = max;
+	}
+	*refilled = now;
+}
+
+
+/* Run the timer while jobs are waiting, and stop it otherwise.
+ */
+static void fairq_timer (int run) {
+	struct itimerspec its;
+	if (run == ticking) {
+		return;
+	}
+	memset (&its, 0, sizeof (its));
+	if (run) {
+		its.it_value.tv_nsec = FAIRQ_TICK_NS;
+		its.it_interval.tv_nsec = FAIRQ_TICK_NS;
+	}
+	timerfd_settime (ticker.fd, 0, &its, NULL);
+	ticking = run;
+}
+
+
+static void fairq_tick (struct evhandler *evh, uint32_t events) {
+	uint64_t expirations;
+	read (evh->fd, &expirations, sizeof (expirations));
+	fairq_dispatch ();
+}
+
+
+int fairq_config (uint32_t rate, uint32_t burst, uint32_t pace, int qlen) {
+	if ((qlen < 1) || (burst < 1)) {
+		errno = EINVAL;
+		return -1;
+	}
+	queuelen = qlen;
+	if (rate > 0) {
+		cost = 1000000000ULL / rate;
+		maxcredit = cost * burst;
+	}
+	if (pace > 0) {
+		pacerate = pace;
+		pacecost = 1000000000ULL / pace;
+		pacemax = (pacecost > FAIRQ_PACE_TICKS * FAIRQ_TICK_NS) ? pacecost : FAIRQ_PACE_TICKS * FAIRQ_TICK_NS;
+	}
+	return 0;
+}
+
+
+int fairq_weight (uid_t uid, unsigned int weight) {
+	struct client *c;
+	if (weight < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+	c = client_find (uid);
+	if (c == NULL) {
+		return -1;
+	}
+	c->weight = weight;
+	return 0;
+}
+
+
+void fairq_pace (int sox) {
+	uint64_t bytes = (uint64_t) pacerate * SYNERGY_PACKET_MAX;
+	uint32_t maxrate = (bytes > 0xffffffffULL) ? 0xffffffffU : bytes;
+	if (pacerate > 0) {
+		setsockopt (sox, SOL_SOCKET, SO_MAX_PACING_RATE, &maxrate, sizeof (maxrate));
+	}
+}
+
+
+int fairq_start (int (*submit) (struct job *jobs, int count)) {
+	submitter = submit;
+	pacerefilled = metrics_now ();
+	pacecredit = pacemax;
+	ticker.handle = fairq_tick;
+	ticker.fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (ticker.fd == -1) {
+		return -1;
+	}
+	return evloop_add (&ticker, EPOLLIN);
+}
+
+
+/* Add a job to the heap of a client, or take out the one with the earliest
+ * deadline.
+ */
+static void fairq_push (struct client *c, const struct job *job) {
+	unsigned int i = c->heapcount++;
+	unsigned int parent;
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (c->heap [parent].deadline <= job->deadline) {
+			break;
+		}
+		memcpy (&c->heap [i], &c->heap [parent], sizeof (struct job));
+		i = parent;
+	}
+	memcpy (&c->heap [i], job, sizeof (struct job));
+}
+
+static void fairq_pop (struct client *c, struct job *job) {
+	struct job *last;
+	unsigned int i = 0;
+	unsigned int child;
+	memcpy (job, &c->heap [0], sizeof (struct job));
+	last = &c->heap [--c->heapcount];
+	while ((child = 2 * i + 1) < c->heapcount) {
+		if ((child + 1 < c->heapcount) && (c->heap [child + 1].deadline < c->heap [child].deadline)) {
+			child++;
+		}
+		if (last->deadline <= c->heap [child].deadline) {
+			break;
+		}
+		memcpy (&c->heap [i], &c->heap [child], sizeof (struct job));
+		i = child;
+	}
+	if (i < c->heapcount) {
+		memcpy (&c->heap [i], last, sizeof (struct job));
+	}
+}
+
+
+/* Complete a job that passed its deadline, as a failure to send it.
+ */
+static void fairq_expire (struct client *c, uint64_t now, struct metrics_shard *metrics) {
+	struct job job;
+	while ((c->heapcount > 0) && (c->heap [0].deadline <= now)) {
+		fairq_pop (c, &job);
+		metrics_add (&metrics->expired, 1);
+		if (job.sockfd != -1) {
+			close (job.sockfd);
+		}
+		if (job.reply != NULL) {
+			wire_complete (job.reply, job.replyidx, ETIMEDOUT);
+		} else if (job.confirm != NULL) {
+			confirm_sent (job.confirm, ETIMEDOUT);
+		} else if (job.session != NULL) {
+			session_complete (job.session, job.tag, ETIMEDOUT, 0);
+		}
+	}
+}
+
+
+/* Pass up to the wanted number of jobs of a client to the workers, those
+ * with a deadline first, and the others in at most two pieces around the
+ * end of their ring.  Jobs that the workers did not take are put back, and
+ * full is set.  Returns the number of jobs passed.
+ */
+static unsigned int fairq_pass (struct client *c, unsigned int want, int *full) {
+	static struct job batch [FAIRQ_BATCH];
+	unsigned int passed = 0;
+	unsigned int n, got, i;
+	while ((passed < want) && (c->heapcount > 0)) {
+		n = want - passed;
+		if (n > c->heapcount) {
+			n = c->heapcount;
+		}
+		if (n > FAIRQ_BATCH) {
+			n = FAIRQ_BATCH;
+		}
+		for (i = 0; i < n; i++) {
+			fairq_pop (c, &batch [i]);
+		}
+		got = submitter (batch, n);
+		for (i = got; i < n; i++) {
+			fairq_push (c, &batch [i]);
+		}
+		passed += got;
+		if (got < n) {
+			*full = 1;
+			return passed;
+		}
+	}
+	while ((passed < want) && (c->count > 0)) {
+		n = want - passed;
+		if (n > c->count) {
+			n = c->count;
+		}
+		if (n > queuelen - c->head) {
+			n = queuelen - c->head;
+		}
+		got = submitter (&c->queue [c->head], n);
+		c->head = (c->head + got) % queuelen;
+		c->count -= got;
+		passed += got;
+		if (got < n) {
+			*full = 1;
+			return passed;
+		}
+	}
+	return passed;
+}
+
+
+int fairq_submit (uid_t uid, struct job *jobs, int count) {
+	struct client *c = client_find (uid);
+	unsigned int tail;
+	int i;
+	if (c == NULL) {
+		return 0;
+	}
+	if (c->queue == NULL) {
+		c->queue = calloc (queuelen, sizeof (struct job));
+		if (c->queue == NULL) {
+			return 0;
+		}
+	}
+	if (count > queuelen - c->count - c->heapcount) {
+		count = queuelen - c->count - c->heapcount;
+	}
+	for (i = 0; i < count; i++) {
+		if (jobs [i].deadline == 0) {
+			tail = c->head + c->count++;
+			memcpy (&c->queue [tail % queuelen], &jobs [i], sizeof (struct job));
+			continue;
+		}
+		if (c->heap == NULL) {
+			c->heap = calloc (queuelen, sizeof (struct job));
+			if (c->heap == NULL) {
+				count = i;
+				break;
+			}
+		}
+		fairq_push (c, &jobs [i]);
+	}
+	if ((count > 0) && !c->active) {
+		c->active = 1;
+		c->anext = NULL;
+		if (acttail != NULL) {
+			acttail->anext = c;
+		} else {
+			acthead = c;
+		}
+		acttail = c;
+		numactive++;
+	}
+	return count;
+}
+
+
+void fairq_dispatch (void) {
+	struct metrics_shard *metrics;
+	struct client *c;
+	unsigned int idle = 0;
+	unsigned int want, got;
+	uint64_t now;
+	int full;
+	if (numactive == 0) {
+		fairq_timer (0);
+		return;
+	}
+	metrics = metrics_shard (0);
+	now = metrics_now ();
+	if (pacecost > 0) {
+		fairq_refill (&pacecredit, &pacerefilled, pacemax, now);
+	}
+	while ((c = acthead) != NULL) {
+		//
+		// Drop the jobs whose deadline passed while they waited
+		fairq_expire (c, now, metrics);
+		//
+		// Start a turn with a fresh quantum
+		if (!c->turn) {
+			c->deficit = FAIRQ_QUANTUM * c->weight;
+			c->turn = 1;
+			if (cost > 0) {
+				fairq_refill (&c->credit, &c->refilled, maxcredit, now);
+			}
+		}
+		//
+		// Pass as many jobs as the deficit and tokens allow
+		want = c->count + c->heapcount;
+		if (want > c->deficit) {
+			want = c->deficit;
+		}
+		if ((cost > 0) && (want > c->credit / cost)) {
+			want = c->credit / cost;
+		}
+		if ((pacecost > 0) && (want > pacecredit / pacecost)) {
+			want = pacecredit / pacecost;
+		}
+		full = 0;
+		got = (want > 0) ? fairq_pass (c, want, &full) : 0;
+		c->deficit -= got;
+		c->credit -= got * cost;
+		pacecredit -= got * pacecost;
+		if (full) {
+			//
+			// The workers are full; try again on the next tick
+			break;
+		}
+		if (c->count + c->heapcount == 0) {
+			acthead = c->anext;
+			if (acthead == NULL) {
+				acttail = NULL;
+			}
+			c->active = 0;
+			c->turn = 0;
+			numactive--;
+			idle = 0;
+			continue;
+		}
+		if ((pacecost > 0) && (pacecredit < pacecost)) {
+			metrics_add (&metrics->paced, 1);
+			break;
+		}
+		//
+		// End the turn, and move to the back of the line
+		if (c->deficit > 0) {
+			metrics_add (&metrics->throttled, 1);
+		}
+		c->turn = 0;
+		if (c->anext != NULL) {
+			acthead = c->anext;
+			c->anext = NULL;
+			acttail->anext = c;
+			acttail = c;
+		}
+		idle = (got > 0) ? 0 : idle + 1;
+		if (idle >= numactive) {
+			break;
+		}
+	}
+	fairq_timer (numactive > 0);
+}
@@ -0,0 +1,200 @@
+/* hopcache.c -- Look up learned hop limits in the cache of synergy.d
+ *
+ * The cache is a file that synergy.d writes, with a trie of destination
+ * prefixes that map to the hop limit ranges that it learned; see the
+ * format in libsynergy.h.  Every process maps it read-only on first use,
+ * and looks up addresses with a walk over a few nodes, without a lock or
+ * a system call.  The daemon changes the cache in place, so the mapping
+ * stays valid over its restarts, and is inherited over fork().
+ *
+ * When the cache is not there, this is tried again once a second, so that
+ * a process that started before the daemon will still find it.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <sys/socketsynergy.h>
+
+#include "libsynergy.h"
+
+
+/* The number of times that a reader retries while the daemon writes.
+ */
+#define HOPCACHE_TRIES 64
+
+
+static pthread_mutex_t hopcachelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t hopcacheonce = PTHREAD_ONCE_INIT;
+static const struct synergy_hopcache *hopcache = NULL;
+static time_t hopcache_tried = 0;
+
+
+/* The lock is only tried, never waited for, so a child of fork() simply
+ * gets a fresh one, in case another thread held it.
+ */
+static void hopcachelock_child (void) {
+	pthread_mutex_init (&hopcachelock, NULL);
+}
+
+static void hopcachelock_setup (void) {
+	pthread_atfork (NULL, NULL, hopcachelock_child);
+}
+
+
+/* Test whether an address falls under a prefix, and which way it goes on
+ * after the given number of bits.
+ */
+static int hopcache_match (const struct in6_addr *prefix, const struct in6_addr *addr, unsigned int plen) {
+	unsigned int full = plen / 8;
+	if (memcmp (prefix->s6_addr, addr->s6_addr, full) != 0) {
+		return 0;
+	}
+	if ((plen % 8) == 0) {
+		return 1;
+	}
+	return ((prefix->s6_addr [full] ^ addr->s6_addr [full]) & (0xff00 >> (plen % 8))) == 0;
+}
+
+static int hopcache_bit (const struct in6_addr *addr, unsigned int bit) {
+	return (addr->s6_addr [bit / 8] >> (7 - (bit % 8))) & 1;
+}
+
+
+int synergy_hopcache_lookup (const struct synergy_hopcache *hc, const struct in6_addr *addr, uint8_t *minhop, uint8_t *maxhop) {
+	const struct synergy_hopcache_node *n;
+	uint32_t now = time (NULL);
+	uint32_t seq, idx, expires;
+	uint8_t foundlo = 0, foundhi = 0;
+	uint8_t plen, lo, hi;
+	int tries, depth, found;
+	for (tries = 0; tries < HOPCACHE_TRIES; tries++) {
+		seq = __atomic_load_n (&hc->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			continue;
+		}
+		//
+		// Walk down as long as the prefixes match, keeping the last range
+		found = 0;
+		idx = 0;
+		for (depth = 0; depth <= 128; depth++) {
+			n = &hc->node [idx];
+			plen = n->prefixlen;
+			if ((plen > 128) || !hopcache_match (&n->prefix, addr, plen)) {
+				break;
+			}
+			lo = n->minhop;
+			hi = n->maxhop;
+			expires = n->expires;
+			if (((lo | hi) != 0) && (expires > now)) {
+				foundlo = lo;
+				foundhi = hi;
+				found = 1;
+			}
+			if (plen == 128) {
+				break;
+			}
+			idx = n->child [hopcache_bit (addr, plen)];
+			if ((idx == 0) || (idx >= SYNERGY_HOPCACHE_NODES)) {
+				break;
+			}
+		}
+		//
+		// Only trust what we read when the writer left it alone
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
+		if (__atomic_load_n (&hc->seq, __ATOMIC_RELAXED) != seq) {
+			continue;
+		}
+		if (!found) {
+			errno = ENOENT;
+			return -1;
+		}
+		*minhop = foundlo;
+		*maxhop = foundhi;
+		return 0;
+	}
+	errno = EAGAIN;
+	return -1;
+}
+
+
+/* Map the cache read-only, when it looks like one.  This is tried once a
+ * second at most, and skipped when another thread is trying it already.
+ */
+static const struct synergy_hopcache *synergy_hopcache_map (void) {
+	struct synergy_hopcache *hc;
+	struct timespec ts;
+	struct stat st;
+	const char *path;
+	int fd;
+	pthread_once (&hopcacheonce, hopcachelock_setup);
+	clock_gettime (CLOCK_MONOTONIC_COARSE, &ts);
+	if ((__atomic_load_n (&hopcache_tried, __ATOMIC_RELAXED) == ts.tv_sec)
+			|| (pthread_mutex_trylock (&hopcachelock) != 0)) {
+		return NULL;
+	}
+	hc = (struct synergy_hopcache *) hopcache;
+	if ((hc != NULL) || (hopcache_tried == ts.tv_sec)) {
+		pthread_mutex_unlock (&hopcachelock);
+		return hc;
+	}
+	__atomic_store_n (&hopcache_tried, ts.tv_sec, __ATOMIC_RELAXED);
+	path = getenv ("SYNERGY_HOPCACHE");
+	fd = open ((path != NULL) ? path : SYNERGY_HOPCACHE_PATH, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		pthread_mutex_unlock (&hopcachelock);
+		return NULL;
+	}
+	if ((fstat (fd, &st) == -1) || (st.st_size < SYNERGY_HOPCACHE_SIZE)) {
+		close (fd);
+		pthread_mutex_unlock (&hopcachelock);
+		return NULL;
+	}
+	hc = mmap (NULL, SYNERGY_HOPCACHE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+	if (hc == MAP_FAILED) {
+		pthread_mutex_unlock (&hopcachelock);
+		return NULL;
+	}
+	if ((hc->magic != SYNERGY_HOPCACHE_MAGIC) || (hc->nodes != SYNERGY_HOPCACHE_NODES)) {
+		munmap (hc, SYNERGY_HOPCACHE_SIZE);
+		pthread_mutex_unlock (&hopcachelock);
+		return NULL;
+	}
+	__atomic_store_n (&hopcache, hc, __ATOMIC_RELEASE);
+	pthread_mutex_unlock (&hopcachelock);
+	return hc;
+}
+
+
+int synergy_hoprange (const struct in6_addr *addr, uint8_t *minhop, uint8_t *maxhop) {
+	const struct synergy_hopcache *hc = __atomic_load_n (&hopcache, __ATOMIC_ACQUIRE);
+	if ((hc == NULL) && ((hc = synergy_hopcache_map ()) == NULL)) {
+		errno = ENOENT;
+		return -1;
+	}
+	return synergy_hopcache_lookup (hc, addr, minhop, maxhop);
+}
+
+
+uint8_t synergy_hopauto (const struct sockaddr_in6 *symcli) {
+	uint8_t minhop, maxhop;
+	if ((symcli == NULL) || (synergy_hoprange (&symcli->sin6_addr, &minhop, &maxhop) == -1)) {
+		return 0;
+	}
+	return (maxhop != 0) ? maxhop : minhop;
+}
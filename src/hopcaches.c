@@ -0,0 +1,282 @@
+/* hopcaches.c -- Keep the hop cache that libsynergy reads
+ *
+ * The hop limit ranges that the daemon learns are written into a file that
+ * every process maps, so that synergy() can pick a hop limit for a peer
+ * without asking the daemon; see the format in libsynergy.h.  The file is
+ * kept in place when the daemon restarts, so what it learned survives,
+ * and processes that mapped it keep reading the same trie.
+ *
+ * Ranges are stored for the destination prefix of the peer, by default a
+ * /48 as for learning from TCP RST replies.  A RST only lowers the maximum;
+ * a probe replaces the bounds that it learned.  Ranges expire after a
+ * while, to cater for changes in routing.  Nodes are never freed one by
+ * one; when the array is full, the trie is rebuilt from the live ranges.
+ *
+ * The main loop and the probe threads write, so writes take a lock among
+ * them; readers, including the daemon itself, only follow the seq.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "daemon.h"
+
+
+/* The time for which a learned range is trusted.
+ */
+#define HOPCACHE_TTL 3600
+
+
+static struct synergy_hopcache *cache = NULL;
+static pthread_mutex_t cachelock = PTHREAD_MUTEX_INITIALIZER;
+static int cachepfx = HOPLEARN_PREFIXLEN_DEFAULT;
+
+
+static int hopcache_bit (const struct in6_addr *addr, unsigned int bit) {
+	return (addr->s6_addr [bit / 8] >> (7 - (bit % 8))) & 1;
+}
+
+
+/* The number of leading bits that two addresses share, up to a maximum.
+ */
+static unsigned int hopcache_common (const struct in6_addr *a, const struct in6_addr *b, unsigned int maxlen) {
+	unsigned int bits = 0;
+	int i;
+	for (i = 0; (i < 16) && (bits < maxlen); i++) {
+		uint8_t diff = a->s6_addr [i] ^ b->s6_addr [i];
+		if (diff != 0) {
+			bits += __builtin_clz (diff) - 24;
+			break;
+		}
+		bits += 8;
+	}
+	return (bits < maxlen) ? bits : maxlen;
+}
+
+
+/* Make the seq odd while the trie changes, and even again after.
+ */
+static void hopcache_begin (void) {
+	__atomic_store_n (&cache->seq, cache->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+}
+
+static void hopcache_end (void) {
+	__atomic_store_n (&cache->seq, cache->seq + 1, __ATOMIC_RELEASE);
+}
+
+
+/* Empty the trie, down to the node for ::/0.  This is called between
+ * hopcache_begin() and hopcache_end().
+ */
+static void hopcache_reset (void) {
+	memset (cache->node, 0, SYNERGY_HOPCACHE_NODES * sizeof (struct synergy_hopcache_node));
+	cache->used = 1;
+}
+
+
+/* Allocate a node for a prefix, and link it in.  Returns NULL when the
+ * array is full.
+ */
+static struct synergy_hopcache_node *hopcache_node (uint32_t *link, const struct in6_addr *pfx, unsigned int plen) {
+	struct synergy_hopcache_node *n;
+	unsigned int i;
+	if (cache->used >= SYNERGY_HOPCACHE_NODES) {
+		return NULL;
+	}
+	n = &cache->node [cache->used];
+	memset (n, 0, sizeof (*n));
+	for (i = 0; i < plen; i += 8) {
+		n->prefix.s6_addr [i / 8] = pfx->s6_addr [i / 8] & ((plen - i >= 8) ? 0xff : (0xff00 >> (plen - i)));
+	}
+	n->prefixlen = plen;
+	*link = cache->used++;
+	return n;
+}
+
+
+/* Find the node for a prefix, and insert it when it is not there yet.  A
+ * child whose prefix only partly matches is split, by putting a node for
+ * their common bits in between.  Returns NULL when the array is full.
+ */
+static struct synergy_hopcache_node *hopcache_insert (const struct in6_addr *pfx, unsigned int plen) {
+	struct synergy_hopcache_node *n = &cache->node [0];
+	struct synergy_hopcache_node *c, *x;
+	unsigned int common;
+	uint32_t *link;
+	uint32_t child;
+	int depth;
+	for (depth = 0; depth <= 128; depth++) {
+		if (n->prefixlen == plen) {
+			return n;
+		}
+		link = &n->child [hopcache_bit (pfx, n->prefixlen)];
+		if (*link == 0) {
+			return hopcache_node (link, pfx, plen);
+		}
+		if (*link >= cache->used) {
+			return NULL;
+		}
+		c = &cache->node [*link];
+		common = hopcache_common (&c->prefix, pfx, (c->prefixlen < plen) ? c->prefixlen : plen);
+		if (common == c->prefixlen) {
+			n = c;
+			continue;
+		}
+		//
+		// Split off the common bits, with the old child under them
+		child = *link;
+		x = hopcache_node (link, pfx, common);
+		if (x == NULL) {
+			return NULL;
+		}
+		x->child [hopcache_bit (&c->prefix, common)] = child;
+		if (common == plen) {
+			return x;
+		}
+		return hopcache_node (&x->child [hopcache_bit (pfx, common)], pfx, plen);
+	}
+	return NULL;
+}
+
+
+/* Rebuild the trie from the ranges that are still live.  This is called
+ * between hopcache_begin() and hopcache_end().
+ */
+static void hopcache_compact (uint32_t now) {
+	struct synergy_hopcache_node *live, *n;
+	unsigned int count = 0;
+	unsigned int i;
+	live = malloc (SYNERGY_HOPCACHE_NODES * sizeof (struct synergy_hopcache_node));
+	if (live == NULL) {
+		return;
+	}
+	for (i = 0; i < cache->used; i++) {
+		n = &cache->node [i];
+		if (((n->minhop | n->maxhop) != 0) && (n->expires > now)) {
+			memcpy (&live [count++], n, sizeof (*n));
+		}
+	}
+	hopcache_reset ();
+	for (i = 0; i < count; i++) {
+		n = hopcache_insert (&live [i].prefix, live [i].prefixlen);
+		if (n != NULL) {
+			n->minhop = live [i].minhop;
+			n->maxhop = live [i].maxhop;
+			n->expires = live [i].expires;
+		}
+	}
+	free (live);
+}
+
+
+int hopcache_open (const char *path, int prefixlen) {
+	struct synergy_hopcache *hc;
+	struct stat st;
+	int fresh;
+	int fd;
+	if (prefixlen > 0) {
+		cachepfx = prefixlen;
+	}
+	fd = open (path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd == -1) {
+		return -1;
+	}
+	if ((fstat (fd, &st) == -1) || (fchmod (fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) == -1)) {
+		int sverr = errno;
+		close (fd);
+		errno = sverr;
+		return -1;
+	}
+	fresh = (st.st_size != SYNERGY_HOPCACHE_SIZE);
+	if (fresh && (ftruncate (fd, SYNERGY_HOPCACHE_SIZE) == -1)) {
+		int sverr = errno;
+		close (fd);
+		errno = sverr;
+		return -1;
+	}
+	hc = mmap (NULL, SYNERGY_HOPCACHE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close (fd);
+	if (hc == MAP_FAILED) {
+		return -1;
+	}
+	cache = hc;
+	//
+	// Start afresh when the file is new, foreign, or was left mid-write
+	if (fresh || (hc->magic != SYNERGY_HOPCACHE_MAGIC) || (hc->nodes != SYNERGY_HOPCACHE_NODES)
+			|| (hc->seq & 1) || (hc->used == 0) || (hc->used > SYNERGY_HOPCACHE_NODES)
+			|| (hc->node [0].prefixlen != 0)) {
+		__atomic_store_n (&hc->seq, hc->seq | 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence (__ATOMIC_RELEASE);
+		hopcache_reset ();
+		hc->nodes = SYNERGY_HOPCACHE_NODES;
+		hc->magic = SYNERGY_HOPCACHE_MAGIC;
+		hopcache_end ();
+	}
+	return 0;
+}
+
+
+int hopcache_lookup (const struct in6_addr *addr, uint8_t *minhop, uint8_t *maxhop) {
+	if (cache == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+	return synergy_hopcache_lookup (cache, addr, minhop, maxhop);
+}
+
+
+void hopcache_learned (const struct in6_addr *addr, uint8_t minhop, uint8_t maxhop) {
+	struct synergy_hopcache_node *n;
+	uint32_t now = time (NULL);
+	if ((cache == NULL) || ((minhop | maxhop) == 0)) {
+		return;
+	}
+	pthread_mutex_lock (&cachelock);
+	hopcache_begin ();
+	n = hopcache_insert (addr, cachepfx);
+	if (n == NULL) {
+		hopcache_compact (now);
+		n = hopcache_insert (addr, cachepfx);
+	}
+	if (n != NULL) {
+		//
+		// Forget an expired range, then merge in what was learned
+		if (n->expires <= now) {
+			n->minhop = 0;
+			n->maxhop = 0;
+		}
+		if ((maxhop != 0) && ((minhop != 0) || (n->maxhop == 0) || (maxhop < n->maxhop))) {
+			n->maxhop = maxhop;
+		}
+		if (minhop != 0) {
+			n->minhop = minhop;
+		}
+		if ((n->maxhop != 0) && (n->minhop > n->maxhop)) {
+			if (maxhop != 0) {
+				n->minhop = 0;
+			} else {
+				n->maxhop = 0;
+			}
+		}
+		n->expires = now + HOPCACHE_TTL;
+	}
+	hopcache_end ();
+	pthread_mutex_unlock (&cachelock);
+}
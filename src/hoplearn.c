@@ -0,0 +1,268 @@
+/* hoplearn.c -- Incremental learning of hop limits from TCP RST replies
+ *
+ * This implements the "Incremental learning" procedure of the draft.  When
+ * a TCP punch is answered with a RST, it travelled far enough to reach a
+ * remote firewall or host, so the hop limit was too high.  The hop limit
+ * minus one is then the maximum permissible hop limit for that route.
+ *
+ * Routes are approximated by destination prefixes, by default a /48.  The
+ * maximum learned for a prefix is applied to later requests towards it,
+ * unless the operator's minimum hop limit is higher; learned values expire
+ * after a while, to cater for changes in routing.
+ *
+ * The learned maximum hop limits are also passed to the eBPF program, when
+ * it runs, for requests that leave the hop limit to the daemon, and they
+ * are written into the hop cache, where they outlive the daemon.
+ *
+ * To recognise RSTs, the hop limit of every punch is logged under its
+ * remote address and port.  A RAW TCP socket receives the replies, with a
+ * kernel filter that only passes RST packets acknowledging sequence
+ * number 0, which is what our SYN punches use.
+ *
+ * All of this runs in the main loop, so there is no locking.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <linux/filter.h>
+
+#include "daemon.h"
+
+
+/* The number of recent punches that are remembered, the time that a RST
+ * may take to arrive, and the number of learned prefixes.
+ */
+#define PUNCHLOG_SIZE 4096
+#define PUNCHLOG_WINDOW 10
+#define PREFIXES_SIZE 4096
+#define PREFIXES_PROBE 8
+
+
+/* The time for which a learned maximum hop limit is trusted.
+ */
+#define HOPLEARN_TTL 3600
+
+
+struct punchlog {
+	struct in6_addr addr;
+	uint16_t port;
+	uint8_t hoplimit;
+	time_t sent;
+};
+
+struct prefix {
+	struct in6_addr prefix;
+	uint8_t maxhop;
+	time_t learned;
+};
+
+
+static struct punchlog punchlog [PUNCHLOG_SIZE];
+static struct prefix prefixes [PREFIXES_SIZE];
+static int prefixlen = 0;
+static struct evhandler rstlistener;
+
+
+static time_t hoplearn_now (void) {
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec;
+}
+
+
+static uint32_t hoplearn_hash (const struct in6_addr *addr, uint16_t port) {
+	const uint32_t *w = (const uint32_t *) addr->s6_addr;
+	uint32_t h = port;
+	int i;
+	for (i = 0; i < 4; i++) {
+		h = (h ^ w [i]) * 0x9e3779b1;
+	}
+	return h ^ (h >> 16);
+}
+
+
+/* Reduce an address to its prefix.
+ */
+static void hoplearn_prefix (struct in6_addr *pfx, const struct in6_addr *addr) {
+	int i;
+	for (i = 0; i < 16; i++) {
+		int bits = prefixlen - 8 * i;
+		if (bits >= 8) {
+			pfx->s6_addr [i] = addr->s6_addr [i];
+		} else if (bits > 0) {
+			pfx->s6_addr [i] = addr->s6_addr [i] & (0xff00 >> bits);
+		} else {
+			pfx->s6_addr [i] = 0;
+		}
+	}
+}
+
+
+/* Find the slot for a prefix.  When it is not found, a free or expired slot
+ * is returned if create is set, or otherwise NULL.
+ */
+static struct prefix *hoplearn_find (const struct in6_addr *addr, int create, time_t now) {
+	struct in6_addr pfx;
+	struct prefix *victim = NULL;
+	uint32_t h;
+	int i;
+	hoplearn_prefix (&pfx, addr);
+	h = hoplearn_hash (&pfx, 0);
+	for (i = 0; i < PREFIXES_PROBE; i++) {
+		struct prefix *p = &prefixes [(h + i) % PREFIXES_SIZE];
+		int live = (p->maxhop != 0) && (now - p->learned < HOPLEARN_TTL);
+		if (live && (memcmp (&p->prefix, &pfx, sizeof (pfx)) == 0)) {
+			return p;
+		}
+		if (!live && (victim == NULL)) {
+			victim = p;
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
+	if (victim == NULL) {
+		victim = &prefixes [h % PREFIXES_SIZE];
+	}
+	if (victim->maxhop != 0) {
+		bpfpunch_learned (&victim->prefix, prefixlen, 0);
+	}
+	memcpy (&victim->prefix, &pfx, sizeof (pfx));
+	victim->maxhop = 0;
+	victim->learned = now;
+	return victim;
+}
+
+
+uint8_t hoplearn_apply (struct sockaddr_in6 *symcli, uint8_t hoplimit) {
+	struct metrics_shard *metrics = metrics_shard (0);
+	struct prefix *p = NULL;
+	time_t now = 0;
+	uint8_t clamped, minhop, maxhop;
+	if (prefixlen > 0) {
+		now = hoplearn_now ();
+		p = hoplearn_find (&symcli->sin6_addr, 0, now);
+		if ((p != NULL) && ((hoplimit == 0) || (hoplimit > p->maxhop))) {
+			hoplimit = p->maxhop;
+			metrics_add (&metrics->learned, 1);
+		}
+	}
+	//
+	// Fall back on the hop cache, which also knows what probes learned,
+	// and what was learned before a restart
+	if ((p == NULL) && (hopcache_lookup (&symcli->sin6_addr, &minhop, &maxhop) == 0)) {
+		if (hoplimit == 0) {
+			hoplimit = (maxhop != 0) ? maxhop : minhop;
+			metrics_add (&metrics->learned, 1);
+		} else if ((maxhop != 0) && (hoplimit > maxhop)) {
+			hoplimit = maxhop;
+			metrics_add (&metrics->learned, 1);
+		}
+	}
+	clamped = clamp_hoplimit (hoplimit);
+	if (clamped != hoplimit) {
+		hoplimit = clamped;
+		metrics_add (&metrics->clamped, 1);
+	}
+	if (prefixlen > 0) {
+		struct punchlog *pl;
+		pl = &punchlog [hoplearn_hash (&symcli->sin6_addr, symcli->sin6_port) % PUNCHLOG_SIZE];
+		memcpy (&pl->addr, &symcli->sin6_addr, sizeof (pl->addr));
+		pl->port = symcli->sin6_port;
+		pl->hoplimit = hoplimit;
+		pl->sent = now;
+	}
+	return hoplimit;
+}
+
+
+/* Process the RSTs that passed the filter.  The source of the RST is the
+ * remote end of a punch; its source port is the remote port.
+ */
+static void hoplearn_handle (struct evhandler *evh, uint32_t events) {
+	struct sockaddr_in6 from;
+	socklen_t fromlen;
+	struct tcphdr tcp;
+	ssize_t len;
+	while (1) {
+		fromlen = sizeof (from);
+		len = recvfrom (evh->fd, &tcp, sizeof (tcp), MSG_DONTWAIT,
+				(struct sockaddr *) &from, &fromlen);
+		if (len == -1) {
+			return;
+		}
+		if ((len < sizeof (tcp)) || !tcp.rst) {
+			continue;
+		}
+		time_t now = hoplearn_now ();
+		struct punchlog *pl;
+		pl = &punchlog [hoplearn_hash (&from.sin6_addr, tcp.source) % PUNCHLOG_SIZE];
+		if ((pl->port != tcp.source) || (now - pl->sent > PUNCHLOG_WINDOW)
+				|| (memcmp (&pl->addr, &from.sin6_addr, sizeof (pl->addr)) != 0)) {
+			continue;
+		}
+		//
+		// The hop limit was too high; lower the maximum for the prefix
+		uint8_t maxhop = (pl->hoplimit > 1) ? pl->hoplimit - 1 : 1;
+		pl->sent = 0;
+		struct prefix *p = hoplearn_find (&from.sin6_addr, 1, now);
+		if ((p->maxhop == 0) || (maxhop < p->maxhop)) {
+			p->maxhop = maxhop;
+			p->learned = now;
+			bpfpunch_learned (&p->prefix, prefixlen, maxhop);
+			hopcache_learned (&p->prefix, 0, maxhop);
+		}
+	}
+}
+
+
+int hoplearn_start (int pfxlen) {
+	static struct sock_filter rstonly [] = {
+		BPF_STMT (BPF_LD  | BPF_B   | BPF_ABS, 13),		/* TCP flags */
+		BPF_JUMP (BPF_JMP | BPF_JSET | BPF_K, 0x04, 0, 3),	/* RST set? */
+		BPF_STMT (BPF_LD  | BPF_W   | BPF_ABS, 8),		/* Ack number */
+		BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, 1, 0, 1),		/* Acks SYN 0? */
+		BPF_STMT (BPF_RET | BPF_K, sizeof (struct tcphdr)),
+		BPF_STMT (BPF_RET | BPF_K, 0),
+	};
+	static const struct sock_fprog rstprog = {
+		.len = sizeof (rstonly) / sizeof (rstonly [0]),
+		.filter = rstonly,
+	};
+	if (pfxlen <= 0) {
+		return 0;
+	}
+	if (pfxlen > 128) {
+		errno = EINVAL;
+		return -1;
+	}
+	prefixlen = pfxlen;
+	rstlistener.handle = hoplearn_handle;
+	rstlistener.fd = socket (PF_INET6, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+	if (rstlistener.fd == -1) {
+		return -1;
+	}
+	if (setsockopt (rstlistener.fd, SOL_SOCKET, SO_ATTACH_FILTER,
+				&rstprog, sizeof (rstprog)) == -1) {
+		close (rstlistener.fd);
+		return -1;
+	}
+	return evloop_add (&rstlistener, EPOLLIN);
+}
@@ -0,0 +1,252 @@
+/* libsynergy.h -- Internal interfaces between the parts of libsynergy
+ *
+ * These functions are shared between the source files of the library,
+ * but they are not part of the API in <sys/socketsynergy.h>.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+#ifndef SYNERGY_LIBSYNERGY_H
+#define SYNERGY_LIBSYNERGY_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <netinet/in.h>
+
+#include <sys/socketsynergy.h>
+
+
+/* Determine whether this process can send RAW packets itself, as root or
+ * with CAP_NET_RAW.  The outcome is cached until synergy_fini().
+ */
+int synergy_rawable (void);
+
+/* Close the persistent session with synergy.d, if any, and drop all
+ * completions that were not reaped yet.  Called from synergy_fini().
+ */
+void synergy_async_fini (void);
+
+/* Connect a session with synergy.d, with extra socket flags such as
+ * SOCK_NONBLOCK, and send one request with its socket over a session.
+ * Both return -1 with errno set on failure.
+ */
+int synergy_session_connect (int sockflags);
+int synergy_session_request (int sox, struct synergy_session_request *req, int sockfd);
+
+/* Send one request over a private session with synergy.d, and wait up to
+ * timeout_ms plus a grace period for its completion.  Fails with errno set
+ * to the error in the completion, if any.
+ */
+int synergy_session_call (struct synergy_session_request *req, int sockfd, int timeout_ms, struct synergy_completion *cpl);
+
+
+/* What a punch needs to know about its socket, besides the peer: the
+ * protocol, and the local address, port and scope in network byte order.
+ * A proto of 0 means that nothing is known.  An unspecified local address
+ * is replaced by a route lookup when the punch is built.
+ *
+ * synergy_describe() asks the kernel, and synergy_wire_fill() does that
+ * for a request to synergy.d, after finding the peer when symcli is NULL.
+ */
+struct synergy_hint {
+	struct in6_addr local;
+	uint32_t scope;
+	uint16_t localport;
+	uint8_t proto;
+};
+
+int synergy_describe (int sockfd, struct synergy_hint *hint);
+int synergy_wire_fill (struct synergy_wire_request *wr, int sockfd, uint8_t hoplimit, struct sockaddr_in6 *symcli);
+
+/* Variants of synergy_packet() and synergy_rawset_many() that trust the
+ * given hints instead of asking the kernel.  The hints run parallel to the
+ * punches, and may be NULL; hints without a proto are looked up as usual.
+ * With a hint, symcli must not be NULL.
+ */
+ssize_t synergy_packet_hinted (int sockfd, const struct synergy_hint *hint, uint8_t hoplimit, struct sockaddr_in6 *symcli, void *buf, size_t buflen);
+int synergy_rawset_hinted (struct synergy_rawset *rs, struct synergy_punch *punches, const struct synergy_hint *hints, unsigned int count);
+
+/* Send a message with one socket over a session, as synergy_session_request()
+ * does for the first version of the request format.
+ */
+int synergy_session_message (int sox, const void *msg, size_t len, int sockfd);
+
+
+/* Send a burst of marked probes for hop limits 1 to maxhop.  The marker of
+ * each probe is the base plus its hop limit.
+ */
+int synergy_probe_send (int sockfd, struct sockaddr_in6 *symcli, uint8_t maxhop, uint32_t base);
+
+/* A probe in progress: the sockets that receive its replies, or -1, the
+ * addresses that it probes between, and the base of its markers.  The
+ * replies are received from synergy_probe_open() onward, so the probes go
+ * out after it; synergy_probe_collect() waits up to timeout_ms for them,
+ * and closes the sockets, as does synergy_probe_close().
+ */
+struct synergy_prober {
+	int fds [2];
+	struct sockaddr_in6 local;
+	struct sockaddr_in6 remote;
+	uint32_t base;
+	uint8_t maxhop;
+};
+
+int synergy_probe_open (struct synergy_prober *pr, int sockfd, struct sockaddr_in6 *symcli, uint8_t maxhop);
+int synergy_probe_collect (struct synergy_prober *pr, int timeout_ms, uint8_t *lower, uint8_t *upper);
+void synergy_probe_close (struct synergy_prober *pr);
+
+/* Send a single probe with a marker, for a punch that has a hint.  The
+ * hint must have a proto, or else the socket of the punch is described by
+ * the kernel after all.  The probe goes out on the RAW sockets of the
+ * library, not on the rawset of the caller, because it is sent alone.  The
+ * status and proto of the punch are set as by synergy_rawset_hinted().
+ */
+int synergy_marked_hinted (struct synergy_punch *punch, const struct synergy_hint *hint, uint32_t marker);
+
+/* The kernel filter that synergy_reply_open() attaches to its ICMPv6
+ * socket.  It accepts a message by returning the length that it keeps.
+ */
+struct sock_fprog;
+extern const struct sock_fprog synergy_reply_filter;
+
+
+/* Checksums for punches.  Words in network byte order are added to a wide
+ * running sum, which is folded to 16 bits in host byte order at the end.
+ * The partial sum over the addresses of the IPv6 pseudo header is cached
+ * per thread.  The CRC32c for SCTP is returned as a value to store
+ * little-endian.  synergy_crc32c_portable() always uses the table, even
+ * when the CPU has an instruction for it, so the two can be compared.
+ */
+uint64_t synergy_csum_add (uint64_t sum, const void *data, size_t len);
+uint16_t synergy_csum_fold (uint64_t sum);
+uint32_t synergy_csum_addrs (const struct in6_addr *src, const struct in6_addr *dst);
+uint32_t synergy_crc32c (const void *data, size_t len);
+uint32_t synergy_crc32c_portable (const void *data, size_t len);
+
+
+/* The hop cache is a file that synergy.d maps to share the hop limits that
+ * it learned per destination prefix, and that every process maps to read
+ * them.  It holds a binary trie with path compression, in an array of
+ * nodes of half a cache line, of which the first is ::/0.  Each node has
+ * a prefix and the indexes of its children, with longer prefixes that go
+ * on with a 0 or 1 bit; index 0 stands for none.  Nodes with a minhop or
+ * maxhop hold a learned range until it expires, in seconds since the
+ * epoch; other nodes only branch.
+ *
+ * The daemon is the only writer, and makes the seq odd while it changes
+ * the trie.  Readers retry when it was odd or changed while they looked,
+ * and never follow more links than a prefix has bits, so a trie that
+ * changes under them cannot lead them astray.  synergy_hopcache_lookup()
+ * returns -1 with ENOENT when no live range covers the address, or with
+ * EAGAIN when the writer kept it busy.
+ */
+#define SYNERGY_HOPCACHE_MAGIC 0x53594843
+#define SYNERGY_HOPCACHE_NODES 16384
+
+struct synergy_hopcache_node {
+	struct in6_addr prefix;
+	uint32_t child [2];
+	uint32_t expires;
+	uint8_t prefixlen;
+	uint8_t minhop;
+	uint8_t maxhop;
+	uint8_t reserved;
+};
+
+struct synergy_hopcache {
+	uint32_t magic;
+	uint32_t nodes;
+	uint32_t seq;
+	uint32_t used;
+	uint8_t pad [48];
+	struct synergy_hopcache_node node [];
+};
+
+#define SYNERGY_HOPCACHE_SIZE (sizeof (struct synergy_hopcache) \
+		+ SYNERGY_HOPCACHE_NODES * sizeof (struct synergy_hopcache_node))
+
+int synergy_hopcache_lookup (const struct synergy_hopcache *hc, const struct in6_addr *addr, uint8_t *minhop, uint8_t *maxhop);
+
+/* Pick a hop limit for a request that left it to us, with a hoplimit of 0,
+ * from the hop cache: the learned maximum, or else the learned minimum.
+ * Returns 0 when the cache has neither.
+ */
+uint8_t synergy_hopauto (const struct sockaddr_in6 *symcli);
+
+
+/* Tracing writes a fixed-size binary record for every punch into a ring
+ * of the calling thread, in a shared memory segment per process that is
+ * named SYNERGY_TRACE_SHM_PREFIX followed by the process id.  The rings
+ * have a single writer, and the sequence number of a record is written
+ * last, so synergytrace can tell a complete record from one that is being
+ * overwritten.  The segment remains after the process exits, for a look
+ * at what happened before; synergytrace removes stale ones on request.
+ *
+ * Tracing is on unless $SYNERGY_TRACE is set to 0, and then
+ * $SYNERGY_TRACE_SAMPLE=n records only every n-th event of a thread.
+ * Tracing leaves errno as it was.
+ * Addresses and ports that are unknown are zero, and so is the protocol
+ * of requests relayed to synergy.d.  The time is CLOCK_REALTIME.
+ */
+#define SYNERGY_TRACE_SHM_PREFIX "/synergy.trace."
+#define SYNERGY_TRACE_MAGIC 0x53595452
+#define SYNERGY_TRACE_VERSION 1
+#define SYNERGY_TRACE_RINGS 128
+#define SYNERGY_TRACE_RECORDS 1024
+
+#define SYNERGY_TRACE_PRIVILEGED 1
+#define SYNERGY_TRACE_DAEMONISED 2
+#define SYNERGY_TRACE_PROBE      3
+#define SYNERGY_TRACE_RING       4
+#define SYNERGY_TRACE_URING      5
+#define SYNERGY_TRACE_SOCKOPT    6
+#define SYNERGY_TRACE_CONNECT    7
+
+struct synergy_trace_record {
+	uint64_t seq;
+	uint64_t time_ns;
+	struct in6_addr src;
+	struct in6_addr dst;
+	uint16_t sport;
+	uint16_t dport;
+	uint8_t proto;
+	uint8_t hoplimit;
+	uint8_t event;
+	uint8_t reserved;
+	int32_t error;
+	uint32_t reserved2;
+};
+
+struct synergy_trace_ring {
+	int32_t tid;
+	uint32_t reserved;
+	uint64_t head;
+	uint8_t pad [48];
+	struct synergy_trace_record record [SYNERGY_TRACE_RECORDS];
+};
+
+struct synergy_trace_header {
+	uint32_t magic;
+	uint32_t version;
+	int32_t pid;
+	uint32_t sample;
+	uint32_t rings;
+	uint32_t lost;
+	char comm [16];
+	uint8_t pad [24];
+	struct synergy_trace_ring ring [SYNERGY_TRACE_RINGS];
+};
+
+/* Trace a punch with the given addresses and ports in network byte order,
+ * any of which may be NULL or 0, or trace a complete IPv6 packet that
+ * starts with the ports after its fixed header, as punches do.
+ */
+void synergy_trace (uint8_t event, const struct in6_addr *src, uint16_t sport,
+			const struct in6_addr *dst, uint16_t dport,
+			uint8_t proto, uint8_t hoplimit, int error);
+void synergy_trace_packet (uint8_t event, const void *packet, int error);
+
+
+#endif /* SYNERGY_LIBSYNERGY_H */
@@ -3,7 +3,7 @@
  * This is a simple demonstration tool that will listen with synergy.
  * That is, it will punch a hole in the firewalls that normally
  * protect it against attacks.
- * 
+ *
  * Parameters:
  *  1. The word "sctp", "tcp" or "udp" to signify the protocol to use
  *  2. The listening IPv6 address
@@ -16,22 +16,62 @@
  * traffic will be dumped on stdout.  Given a properly tuned (that
  * is, minimal-but-effective) hop limit, this should always work.
  *
+ * Options:
+ *  -r peerfile  Relay for all peers in the file, instead of parameters 4-6
+ *  -i seconds   Report on the peers every so many seconds while relaying
+ *
+ * In relay mode, the peer file holds a remote IPv6 address, a remote port
+ * and an optional hop limit on every line.  All peers are punched for at
+ * once, and everything that they send is reflected back to them, so a
+ * remote load generator can measure round trips through the firewalls.
+ * TCP connections are accepted from any of the peers, and their bytes are
+ * moved with splice() through a pipe, without copying them to user space.
+ * UDP datagrams and SCTP messages are received and returned in batches,
+ * with recvmmsg() and sendmmsg().  Traffic from others is not reflected.
+ *
+ * The relay prints a line of JSON for every peer when the interval passes
+ * and when it is stopped with SIGINT or SIGTERM, with the bytes and messages
+ * in both directions, the throughput since the previous report, and the
+ * latency from the punch to the first byte from the peer.
+ *
  * From: Rick van Rein <rick@openfortress.nl>
  */
 
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 
 #include <arpa/inet.h>
 #include <netinet/ip6.h>
 
+#include <sys/socketsynergy.h>
+
+
+/* The batch of datagrams for recvmmsg() and sendmmsg(), the largest
+ * datagram that is reflected in full, the capacity that is asked for the
+ * pipe of every TCP connection, and the socket buffers of the relay.
+ */
+#define RELAY_BATCH 64
+#define RELAY_DGRAM 9216
+#define RELAY_PIPE (1 << 20)
+#define RELAY_SOCKBUF (4 << 20)
+
 
 /*
  * Global variables
@@ -42,7 +82,436 @@ struct sockaddr_in6 local, remot;
 int hoplimit = 3;
 
 
+/* A peer from the peer file, with its counters.  The peers are found by
+ * address and port in a hash table.
+ */
+struct peer {
+	struct peer *hnext;
+	struct sockaddr_in6 addr;
+	uint8_t hoplimit;
+	int error;
+	struct timespec first;
+	uint64_t bytesin, bytesout;
+	uint64_t msgsin, msgsout;
+	uint64_t lastin, lastout;
+	uint32_t connections;
+};
+
+
+/* A TCP connection, with the pipe that its bytes pass through, and the
+ * events that it currently waits for.
+ */
+struct conn {
+	int fd;
+	int pipe [2];
+	size_t inpipe;
+	uint32_t events;
+	struct peer *peer;
+};
+
+
+struct peer *peers = NULL;
+unsigned int peercount = 0;
+struct peer **buckets = NULL;
+unsigned int bucketmask = 0;
+uint64_t strangers = 0;
+struct timespec punched;
+struct timespec lastreport;
+int epfd;
+//
+// Markers for the epoll events that are not connections
+char evlisten, evsignal, evtimer;
+
+
+static double elapsed (const struct timespec *from, const struct timespec *to) {
+	return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+
+static unsigned int peer_hash (const struct sockaddr_in6 *sa) {
+	const uint32_t *w = (const uint32_t *) &sa->sin6_addr;
+	uint32_t h = sa->sin6_port;
+	int i;
+	for (i = 0; i < 4; i++) {
+		h = (h ^ w [i]) * 0x9e3779b1U;
+	}
+	return (h >> 7) & bucketmask;
+}
+
+
+static struct peer *peer_find (const struct sockaddr_in6 *sa) {
+	struct peer *p = buckets [peer_hash (sa)];
+	while ((p != NULL) && ((p->addr.sin6_port != sa->sin6_port)
+			|| (memcmp (&p->addr.sin6_addr, &sa->sin6_addr, sizeof (sa->sin6_addr)) != 0))) {
+		p = p->hnext;
+	}
+	return p;
+}
+
+
+/* Note that a peer sent some bytes, and when it was the first time.
+ * Messages are only counted for UDP and SCTP.
+ */
+static void peer_received (struct peer *p, size_t bytes) {
+	if (p->first.tv_sec == 0) {
+		clock_gettime (CLOCK_MONOTONIC, &p->first);
+	}
+	p->bytesin += bytes;
+}
+
+
+/* Load the peer file, with a remote address, port and optional hop limit
+ * on every line, into the peers and their hash table.
+ */
+static void peers_load (char *progname, char *peerfile) {
+	FILE *pf = fopen (peerfile, "r");
+	char line [256];
+	char addr [INET6_ADDRSTRLEN + 1];
+	long port, hop;
+	unsigned int lineno = 0;
+	unsigned int alloc = 0;
+	unsigned int i, h;
+	int fields;
+	if (pf == NULL) {
+		fprintf (stderr, "%s: Failed to open peer file %s: %s\n",
+				progname, peerfile, strerror (errno));
+		exit (1);
+	}
+	while (fgets (line, sizeof (line), pf) != NULL) {
+		lineno++;
+		if ((line [strspn (line, " \t\r\n")] == '\0') || (line [strspn (line, " \t")] == '#')) {
+			continue;
+		}
+		hop = hoplimit;
+		fields = sscanf (line, "%46s %ld %ld", addr, &port, &hop);
+		if (peercount == alloc) {
+			alloc = alloc ? 2 * alloc : 64;
+			peers = realloc (peers, alloc * sizeof (struct peer));
+			if (peers == NULL) {
+				fprintf (stderr, "%s: Out of memory for peers\n", progname);
+				exit (1);
+			}
+		}
+		struct peer *p = &peers [peercount];
+		memset (p, 0, sizeof (*p));
+		p->addr.sin6_family = AF_INET6;
+		if ((fields < 2) || (inet_pton (AF_INET6, addr, &p->addr.sin6_addr) <= 0)
+				|| (port <= 0) || (port >= 65536) || (hop <= 0) || (hop >= 256)) {
+			fprintf (stderr, "%s: Peer file %s has no valid address, port and hop limit on line %u\n",
+					progname, peerfile, lineno);
+			exit (1);
+		}
+		p->addr.sin6_port = htons (port);
+		p->hoplimit = hop;
+		peercount++;
+	}
+	fclose (pf);
+	if (peercount == 0) {
+		fprintf (stderr, "%s: Peer file %s lists no peers\n", progname, peerfile);
+		exit (1);
+	}
+	//
+	// Hash the peers, which do not move anymore
+	for (bucketmask = 1; bucketmask < 2 * peercount; bucketmask <<= 1) {
+		;
+	}
+	buckets = calloc (bucketmask--, sizeof (struct peer *));
+	if (buckets == NULL) {
+		fprintf (stderr, "%s: Out of memory for peers\n", progname);
+		exit (1);
+	}
+	for (i = 0; i < peercount; i++) {
+		h = peer_hash (&peers [i].addr);
+		peers [i].hnext = buckets [h];
+		buckets [h] = &peers [i];
+	}
+}
+
+
+/* Punch for all peers at once, and take the time from there.
+ */
+static void peers_punch (int sox) {
+	struct synergy_punch *punches = calloc (peercount, sizeof (struct synergy_punch));
+	unsigned int i;
+	if (punches == NULL) {
+		fprintf (stderr, "Out of memory for punches\n");
+		exit (1);
+	}
+	for (i = 0; i < peercount; i++) {
+		punches [i].sockfd = sox;
+		punches [i].hoplimit = peers [i].hoplimit;
+		punches [i].symcli = &peers [i].addr;
+	}
+	synergy_many (punches, peercount);
+	clock_gettime (CLOCK_MONOTONIC, &punched);
+	lastreport = punched;
+	for (i = 0; i < peercount; i++) {
+		peers [i].error = punches [i].status;
+	}
+	free (punches);
+}
+
+
+/* Print a line of JSON for every peer, with the throughput since the last
+ * report, and one with the totals.
+ */
+static void peers_report (void) {
+	char addr [INET6_ADDRSTRLEN];
+	struct timespec now;
+	double secs;
+	unsigned int i;
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	secs = elapsed (&lastreport, &now);
+	for (i = 0; i < peercount; i++) {
+		struct peer *p = &peers [i];
+		inet_ntop (AF_INET6, &p->addr.sin6_addr, addr, sizeof (addr));
+		printf ("{\"peer\":\"[%s]:%d\",\"hoplimit\":%d,\"punch_error\":%d,\"connections\":%u,"
+				"\"bytes_in\":%llu,\"bytes_out\":%llu,\"messages_in\":%llu,\"messages_out\":%llu,",
+				addr, ntohs (p->addr.sin6_port), p->hoplimit, p->error, p->connections,
+				(unsigned long long) p->bytesin, (unsigned long long) p->bytesout,
+				(unsigned long long) p->msgsin, (unsigned long long) p->msgsout);
+		printf ("\"bytes_in_per_sec\":%.1f,\"bytes_out_per_sec\":%.1f,",
+				(secs > 0) ? (p->bytesin  - p->lastin ) / secs : 0.0,
+				(secs > 0) ? (p->bytesout - p->lastout) / secs : 0.0);
+		if (p->first.tv_sec != 0) {
+			printf ("\"first_byte_us\":%.0f}\n", elapsed (&punched, &p->first) * 1e6);
+		} else {
+			printf ("\"first_byte_us\":null}\n");
+		}
+		p->lastin = p->bytesin;
+		p->lastout = p->bytesout;
+	}
+	printf ("{\"peers\":%u,\"strangers\":%llu,\"seconds\":%.3f}\n",
+			peercount, (unsigned long long) strangers, elapsed (&punched, &now));
+	fflush (stdout);
+	lastreport = now;
+}
+
+
+static void conn_close (struct conn *c) {
+	close (c->fd);
+	close (c->pipe [0]);
+	close (c->pipe [1]);
+	free (c);
+}
+
+
+/* Move the bytes of a TCP connection from the socket into its pipe, and
+ * back out to the socket.  While the socket cannot take more, reading
+ * stops, so the peer is slowed down instead of the pipe growing.
+ */
+static void conn_relay (struct conn *c) {
+	struct epoll_event ev;
+	uint32_t want = EPOLLIN;
+	ssize_t len;
+	while (1) {
+		if (c->inpipe > 0) {
+			len = splice (c->pipe [0], NULL, c->fd, NULL, c->inpipe,
+					SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if ((len == -1) && (errno == EAGAIN)) {
+				want = EPOLLOUT;
+				break;
+			}
+			if (len <= 0) {
+				conn_close (c);
+				return;
+			}
+			c->inpipe -= len;
+			c->peer->bytesout += len;
+			continue;
+		}
+		len = splice (c->fd, NULL, c->pipe [1], NULL, RELAY_PIPE,
+				SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if ((len == -1) && (errno == EAGAIN)) {
+			break;
+		}
+		if (len <= 0) {
+			conn_close (c);
+			return;
+		}
+		peer_received (c->peer, len);
+		c->inpipe += len;
+	}
+	if (want != c->events) {
+		ev.events = want;
+		ev.data.ptr = c;
+		epoll_ctl (epfd, EPOLL_CTL_MOD, c->fd, &ev);
+		c->events = want;
+	}
+}
+
+
+/* Accept TCP connections from the peers, and turn others away.
+ */
+static void conn_accept (int sox) {
+	struct sockaddr_in6 from;
+	socklen_t fromlen = sizeof (from);
+	struct epoll_event ev;
+	struct peer *p;
+	struct conn *c;
+	int fd;
+	while ((fd = accept4 (sox, (struct sockaddr *) &from, &fromlen, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		fromlen = sizeof (from);
+		p = peer_find (&from);
+		c = (p != NULL) ? calloc (1, sizeof (struct conn)) : NULL;
+		if (c == NULL) {
+			strangers += (p == NULL);
+			close (fd);
+			continue;
+		}
+		if (pipe2 (c->pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+			close (fd);
+			free (c);
+			continue;
+		}
+		fcntl (c->pipe [1], F_SETPIPE_SZ, RELAY_PIPE);
+		c->fd = fd;
+		c->peer = p;
+		c->events = EPOLLIN;
+		p->connections++;
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		if (epoll_ctl (epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+			conn_close (c);
+		}
+	}
+}
+
+
+/* Reflect UDP datagrams or SCTP messages back to the peers that sent them,
+ * a batch at a time.  Whatever the socket cannot take is dropped, as
+ * the network might have done.
+ */
+static void dgram_relay (int sox) {
+	static uint8_t bufs [RELAY_BATCH][RELAY_DGRAM];
+	static struct sockaddr_in6 from [RELAY_BATCH];
+	static struct iovec iovs [RELAY_BATCH];
+	static struct mmsghdr msgs [RELAY_BATCH];
+	static struct mmsghdr back [RELAY_BATCH];
+	static struct peer *sender [RELAY_BATCH];
+	int got, sent, i, n;
+	do {
+		for (i = 0; i < RELAY_BATCH; i++) {
+			iovs [i].iov_base = bufs [i];
+			iovs [i].iov_len = RELAY_DGRAM;
+			memset (&msgs [i].msg_hdr, 0, sizeof (msgs [i].msg_hdr));
+			msgs [i].msg_hdr.msg_name = &from [i];
+			msgs [i].msg_hdr.msg_namelen = sizeof (from [i]);
+			msgs [i].msg_hdr.msg_iov = &iovs [i];
+			msgs [i].msg_hdr.msg_iovlen = 1;
+		}
+		got = recvmmsg (sox, msgs, RELAY_BATCH, MSG_DONTWAIT, NULL);
+		if (got <= 0) {
+			return;
+		}
+		//
+		// Collect the messages from peers, with their own length
+		n = 0;
+		for (i = 0; i < got; i++) {
+			struct peer *p = peer_find (&from [i]);
+			if (p == NULL) {
+				strangers++;
+				continue;
+			}
+			peer_received (p, msgs [i].msg_len);
+			p->msgsin++;
+			iovs [i].iov_len = msgs [i].msg_len;
+			memcpy (&back [n].msg_hdr, &msgs [i].msg_hdr, sizeof (back [n].msg_hdr));
+			back [n].msg_hdr.msg_flags = 0;
+			sender [n++] = p;
+		}
+		//
+		// Send them back in one go
+		sent = (n > 0) ? sendmmsg (sox, back, n, MSG_DONTWAIT) : 0;
+		for (i = 0; i < sent; i++) {
+			sender [i]->bytesout += back [i].msg_len;
+			sender [i]->msgsout++;
+		}
+	} while (got == RELAY_BATCH);
+}
+
+
+/* Relay for all peers on the bound socket, until a signal ends it.
+ */
+static void relay (char *progname, int sox, int interval) {
+	struct epoll_event ev;
+	struct epoll_event evs [RELAY_BATCH];
+	struct itimerspec its;
+	sigset_t stop;
+	int bufsize = RELAY_SOCKBUF;
+	int sigfd, timfd = -1;
+	int i, n;
+	//
+	// Listen, punch, and add everything to the event loop
+	if (((cnxtp == SOCK_STREAM) || (cnxtp == SOCK_SEQPACKET)) && (listen (sox, 128) == -1)) {
+		fprintf (stderr, "%s: Failed to listen to socket: %s\n",
+			progname, strerror (errno));
+		exit (1);
+	}
+	fcntl (sox, F_SETFL, fcntl (sox, F_GETFL) | O_NONBLOCK);
+	setsockopt (sox, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof (bufsize));
+	setsockopt (sox, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof (bufsize));
+	sigemptyset (&stop);
+	sigaddset (&stop, SIGINT);
+	sigaddset (&stop, SIGTERM);
+	sigprocmask (SIG_BLOCK, &stop, NULL);
+	sigfd = signalfd (-1, &stop, SFD_CLOEXEC);
+	epfd = epoll_create1 (EPOLL_CLOEXEC);
+	if ((sigfd == -1) || (epfd == -1)) {
+		fprintf (stderr, "%s: Failed to setup the event loop: %s\n",
+			progname, strerror (errno));
+		exit (1);
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = &evlisten;
+	epoll_ctl (epfd, EPOLL_CTL_ADD, sox, &ev);
+	ev.data.ptr = &evsignal;
+	epoll_ctl (epfd, EPOLL_CTL_ADD, sigfd, &ev);
+	if (interval > 0) {
+		timfd = timerfd_create (CLOCK_MONOTONIC, TFD_CLOEXEC);
+		memset (&its, 0, sizeof (its));
+		its.it_value.tv_sec = interval;
+		its.it_interval.tv_sec = interval;
+		timerfd_settime (timfd, 0, &its, NULL);
+		ev.data.ptr = &evtimer;
+		epoll_ctl (epfd, EPOLL_CTL_ADD, timfd, &ev);
+	}
+	peers_punch (sox);
+	//
+	// Relay until stopped, and report on the way out
+	while (1) {
+		n = epoll_wait (epfd, evs, RELAY_BATCH, -1);
+		if ((n == -1) && (errno != EINTR)) {
+			fprintf (stderr, "%s: Failed to wait for events: %s\n",
+				progname, strerror (errno));
+			exit (1);
+		}
+		for (i = 0; i < n; i++) {
+			void *ptr = evs [i].data.ptr;
+			if (ptr == &evsignal) {
+				peers_report ();
+				exit (0);
+			} else if (ptr == &evtimer) {
+				uint64_t expirations;
+				read (timfd, &expirations, sizeof (expirations));
+				peers_report ();
+			} else if ((ptr == &evlisten) && (cnxtp == SOCK_STREAM)) {
+				conn_accept (sox);
+			} else if (ptr == &evlisten) {
+				dgram_relay (sox);
+			} else {
+				conn_relay ((struct conn *) ptr);
+			}
+		}
+	}
+}
+
+
 int main (int argc, char *argv []) {
+	char *peerfile = NULL;
+	int interval = 0;
+	char **arg;
+	int opt;
 	//
 	// Initialise
 	memset (&local, 0, sizeof (local));
@@ -51,57 +520,78 @@ int main (int argc, char *argv []) {
 	remot.sin6_family = AF_INET6;
 
 	//
-	// Parse parameters
-	if (argc != 7) {
-		fprintf (stderr, "Usage: %s sctp|tcp|udp local-addr local-port remote-addr remote-port hoplimit\n", argv [0]);
+	// Parse options and parameters
+	while ((opt = getopt (argc, argv, "r:i:")) != -1) {
+		switch (opt) {
+		case 'r':
+			peerfile = optarg;
+			break;
+		case 'i':
+			interval = atoi (optarg);
+			break;
+		default:
+			argc = 0;
+			break;
+		}
+	}
+	arg = argv + optind - 1;
+	if ((argc == 0) || (interval < 0) || (argc - optind != ((peerfile != NULL) ? 3 : 6))) {
+		fprintf (stderr, "Usage: %s sctp|tcp|udp local-addr local-port remote-addr remote-port hoplimit\n"
+				"       %s -r peerfile [-i seconds] sctp|tcp|udp local-addr local-port\n",
+				argv [0], argv [0]);
 		exit (1);
 	}
-	if (strcmp (argv [1], "sctp") == 0) {
+	if (strcmp (arg [1], "sctp") == 0) {
 		cnxtp = SOCK_SEQPACKET;
 		proto = IPPROTO_SCTP;
-	} else if (strcmp (argv [1], "tcp") == 0) {
+	} else if (strcmp (arg [1], "tcp") == 0) {
 		cnxtp = SOCK_STREAM;
 		proto = 0;
-	} else if (strcmp (argv [1], "udp") == 0) {
+	} else if (strcmp (arg [1], "udp") == 0) {
 		cnxtp = SOCK_DGRAM;
 		proto = 0;
 	} else {
 		fprintf (stderr, "%s: First parameter should be sctp, tcp or udp, not '%s'\n",
-				argv [0], argv [1]);
+				argv [0], arg [1]);
 		exit (1);
 	}
 	errno = EINVAL; // Cover retval 0 from inet_pton()
-	if (inet_pton (AF_INET6, argv [2], &local.sin6_addr) <= 0) {
+	if (inet_pton (AF_INET6, arg [2], &local.sin6_addr) <= 0) {
 		fprintf (stderr, "%s: Failed to parse '%s' as a local IPv6 address\n",
-				argv [0], argv [2]);
-		exit (1);
-	}
-	if (inet_pton (AF_INET6, argv [4], &remot.sin6_addr) <= 0) {
-		fprintf (stderr, "%s: Failed to parse '%s' as a remote IPv6 address\n",
-				argv [0], argv [2]);
+				argv [0], arg [2]);
 		exit (1);
 	}
 	errno = 0;
 	long intval;
-	intval = atol (argv [3]);
+	intval = atol (arg [3]);
 	if ((intval <= 0) || (intval >= 65536)) {
 		fprintf (stderr, "%s: Local port %s is not valid\n",
-				argv [0], argv [3]);
+				argv [0], arg [3]);
 		exit (1);
 	}
 	local.sin6_port = htons (intval);
-	intval = atol (argv [5]);
-	if ((intval <= 0) || (intval >= 65536)) {
-		fprintf (stderr, "%s: Remote port %s is not valid\n",
-				argv [0], argv [5]);
-		exit (1);
-	}
-	remot.sin6_port = htons (intval);
-	intval = atol (argv [6]);
-	if ((intval <= 0) || (intval >= 256)) {
-		fprintf (stderr, "%s: Hop limit %s is not in the valid range 0..255\n",
-				argv [0], argv [6]);
-		exit (1);
+	if (peerfile != NULL) {
+		peers_load (argv [0], peerfile);
+	} else {
+		if (inet_pton (AF_INET6, arg [4], &remot.sin6_addr) <= 0) {
+			fprintf (stderr, "%s: Failed to parse '%s' as a remote IPv6 address\n",
+					argv [0], arg [4]);
+			exit (1);
+		}
+		intval = atol (arg [5]);
+		if ((intval <= 0) || (intval >= 65536)) {
+			fprintf (stderr, "%s: Remote port %s is not valid\n",
+					argv [0], arg [5]);
+			exit (1);
+		}
+		remot.sin6_port = htons (intval);
+		intval = atol (arg [6]);
+		if ((intval <= 0) || (intval >= 256)) {
+			fprintf (stderr, "%s: Hop limit %s is not in the valid range 0..255\n",
+					argv [0], arg [6]);
+			exit (1);
+		}
+		hoplimit = intval;
 	}
 
 	//
@@ -118,6 +608,12 @@ int main (int argc, char *argv []) {
 		exit (1);
 	}
 
+	//
+	// Relay for many peers, if so requested
+	if (peerfile != NULL) {
+		relay (argv [0], sox, interval);
+	}
+
 	//
 	// Handle TCP and SCTP over IPv6 with listen/synergy/accept
 	if ((cnxtp == SOCK_STREAM) || (cnxtp == SOCK_SEQPACKET)) {
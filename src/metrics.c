@@ -0,0 +1,126 @@
+/* metrics.c -- Counters and latency histograms of synergy.d
+ *
+ * The metrics live in a POSIX shared memory segment, which is created
+ * when the daemon starts and removed when it exits.  It can be read by
+ * anyone, but only the daemon can write it.  Every thread counts into its
+ * own shard, so the hot paths never contend for a cache line or a lock.
+ *
+ * When the segment cannot be created, the daemon runs without it, and the
+ * shards are kept in private memory where nobody reads them.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <netinet/in.h>
+
+#include "daemon.h"
+
+
+static struct metrics_shard privshards [METRICS_SHARDS];
+static struct metrics *segment = NULL;
+
+
+static void metrics_close (void) {
+	shm_unlink (METRICS_SHM_NAME);
+}
+
+
+int metrics_open (int numworkers) {
+	struct metrics *seg;
+	int fd = shm_open (METRICS_SHM_NAME, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+				S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd == -1) {
+		return -1;
+	}
+	if (ftruncate (fd, sizeof (struct metrics)) == -1) {
+		int sverr = errno;
+		close (fd);
+		metrics_close ();
+		errno = sverr;
+		return -1;
+	}
+	seg = mmap (NULL, sizeof (struct metrics), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close (fd);
+	if (seg == MAP_FAILED) {
+		int sverr = errno;
+		metrics_close ();
+		errno = sverr;
+		return -1;
+	}
+	seg->version = METRICS_VERSION;
+	seg->pid = getpid ();
+	seg->shards = 1 + numworkers;
+	seg->started = time (NULL);
+	__atomic_store_n (&seg->magic, METRICS_MAGIC, __ATOMIC_RELEASE);
+	segment = seg;
+	atexit (metrics_close);
+	return 0;
+}
+
+
+struct metrics_shard *metrics_shard (int idx) {
+	if (segment != NULL) {
+		return &segment->shard [idx];
+	} else {
+		return &privshards [idx];
+	}
+}
+
+
+uint64_t metrics_now (void) {
+	struct timespec now;
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return ((uint64_t) now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+
+void metrics_punch (struct metrics_shard *ms, uint8_t proto, int error, uint64_t latency_ns) {
+	int pidx, bucket;
+	switch (proto) {
+	case IPPROTO_TCP:
+		pidx = METRICS_PROTO_TCP;
+		break;
+	case IPPROTO_UDP:
+		pidx = METRICS_PROTO_UDP;
+		break;
+	case IPPROTO_SCTP:
+		pidx = METRICS_PROTO_SCTP;
+		break;
+	default:
+		pidx = METRICS_PROTO_OTHER;
+		break;
+	}
+	if (error != 0) {
+		if ((error < 0) || (error >= METRICS_ERRNOS)) {
+			error = METRICS_ERRNOS - 1;
+		}
+		metrics_add (&ms->failed, 1);
+		metrics_add (&ms->proto_failed [pidx], 1);
+		metrics_add (&ms->errors [error], 1);
+		return;
+	}
+	//
+	// Bucket b holds latencies from 2^(b-1) up to 2^b nanoseconds
+	bucket = (latency_ns == 0) ? 0 : 64 - __builtin_clzll (latency_ns);
+	if (bucket >= METRICS_LATENCY_BUCKETS) {
+		bucket = METRICS_LATENCY_BUCKETS - 1;
+	}
+	metrics_add (&ms->sent, 1);
+	metrics_add (&ms->proto_sent [pidx], 1);
+	metrics_add (&ms->latency [bucket], 1);
+	metrics_add (&ms->latency_ns, latency_ns);
+}
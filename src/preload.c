@@ -0,0 +1,491 @@
+/* preload.c -- Apply synergy to unmodified applications with LD_PRELOAD
+ *
+ * This library wraps listen() and connect() of the programs that it is
+ * preloaded into, and punches for the sockets that match a rule, much like
+ * listendemo.c does by hand.  The rules are read from the file named in
+ * $SYNERGY_PRELOAD, or else from /etc/synergy/preload.rules, one per line:
+ *
+ *	listen   tcp  2001:db8:420a:1::11/128  4444  3      2001:db8:420a:1::5  5555
+ *	connect  udp  2001:db8::/32            *     guess
+ *
+ * A listen rule matches the bound address and port of TCP and SCTP sockets
+ * on which listen() succeeds, including one-to-many SCTP sockets, and then
+ * punches towards the peer at the end of the line.  All matching listen
+ * rules punch, so a service may open up to several peers.  A connect rule
+ * matches the peer address and port of UDP sockets on which connect()
+ * succeeds, and the first that matches punches towards that peer.  The
+ * protocol and port may be "*" to match any, the address may be "*" for
+ * ::/0, and the hop limit may be "guess" for SYNERGY_HOPLIMIT_GUESS.  TCP
+ * and SCTP need no punch on connect(), as their first packet opens the
+ * local firewall by itself.
+ *
+ * The rules are compiled when the library loads, into a bitmap of the ports
+ * that any rule names, and an array of masked prefixes.  A connect() to a
+ * port that is not in the bitmap costs a single bit test, and no system
+ * call.  A listen() first learns its port with getsockname(), which is no
+ * burden for a call that a service makes once per socket.
+ * Punches are not sent by the wrapped call, but by a helper thread that
+ * takes a duplicate of the socket from a queue, and passes batches of them
+ * to synergy_many().  The thread starts with the first punch, and blocks
+ * all signals, so it does not disturb the application.  A child after
+ * fork() starts its own thread.  Punches that do not fit in the queue are
+ * dropped, as are punches that fail, since nobody could act on them.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <dlfcn.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <sys/socketsynergy.h>
+
+
+#ifndef IPPROTO_SCTP
+#define IPPROTO_SCTP 132
+#endif
+
+
+/* The default location of the rules, and the number of punches that may
+ * wait for the helper thread.
+ */
+#define PRELOAD_RULES_PATH "/etc/synergy/preload.rules"
+#define PRELOAD_QUEUE 256
+
+
+/* A rule holds a masked prefix as two 64-bit words, a port in network byte
+ * order or 0 for any, and a protocol or 0 for any.  Listen rules also hold
+ * the peer to punch towards.
+ */
+struct rule {
+	uint64_t net [2];
+	uint64_t mask [2];
+	uint16_t port;
+	uint8_t proto;
+	uint8_t hoplimit;
+	struct sockaddr_in6 peer;
+};
+
+
+/* The rules for listen() or connect(), with a bit for every port that they
+ * name, in host byte order, and a flag for rules that match any port.
+ */
+struct ruleset {
+	uint8_t ports [65536 / 8];
+	int anyport;
+	unsigned int count;
+	struct rule *rules;
+};
+
+
+/* A punch that waits for the helper thread, with its own socket.
+ */
+struct pending {
+	int sockfd;
+	uint8_t hoplimit;
+	struct sockaddr_in6 peer;
+};
+
+
+static struct ruleset listens;
+static struct ruleset connects;
+static int (*real_listen) (int, int) = NULL;
+static int (*real_connect) (int, const struct sockaddr *, socklen_t) = NULL;
+//
+// The queue of the helper thread
+static pthread_mutex_t queuelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queuecond = PTHREAD_COND_INITIALIZER;
+static struct pending queue [PRELOAD_QUEUE];
+static unsigned int queuehead = 0;
+static unsigned int queuecount = 0;
+static int started = 0;
+
+
+static void preload_resolve (void) {
+	if (real_listen == NULL) {
+		real_listen = dlsym (RTLD_NEXT, "listen");
+	}
+	if (real_connect == NULL) {
+		real_connect = dlsym (RTLD_NEXT, "connect");
+	}
+}
+
+
+/* Compare an address to the masked prefix of a rule.
+ */
+static int rule_match (const struct rule *r, const struct in6_addr *addr, uint16_t port, uint8_t proto) {
+	uint64_t a [2];
+	if ((r->port != 0) && (r->port != port)) {
+		return 0;
+	}
+	if ((r->proto != 0) && (r->proto != proto)) {
+		return 0;
+	}
+	memcpy (a, addr, sizeof (a));
+	return (((a [0] & r->mask [0]) == r->net [0])
+			&& ((a [1] & r->mask [1]) == r->net [1]));
+}
+
+
+/* The fast path: does any rule name this port, in network byte order?
+ */
+static inline int ruleset_port (const struct ruleset *rs, uint16_t port) {
+	uint16_t p = ntohs (port);
+	return rs->anyport || (rs->ports [p >> 3] & (1 << (p & 7)));
+}
+
+
+/* Parse an address with an optional prefix length, or "*" for ::/0.
+ */
+static int parse_prefix (char *word, struct rule *r) {
+	struct in6_addr addr;
+	uint8_t mask [16];
+	char *slash;
+	long len = 128;
+	int i;
+	if (strcmp (word, "*") == 0) {
+		memset (r->net,  0, sizeof (r->net));
+		memset (r->mask, 0, sizeof (r->mask));
+		return 0;
+	}
+	slash = strchr (word, '/');
+	if (slash != NULL) {
+		*slash++ = '\0';
+		len = strtol (slash, &slash, 10);
+		if ((*slash != '\0') || (len < 0) || (len > 128)) {
+			return -1;
+		}
+	}
+	if (inet_pton (AF_INET6, word, &addr) != 1) {
+		return -1;
+	}
+	for (i = 0; i < 16; i++) {
+		mask [i] = (len >= 8 * (i + 1)) ? 0xff : (len > 8 * i) ? (0xff00 >> (len - 8 * i)) : 0x00;
+		addr.s6_addr [i] &= mask [i];
+	}
+	memcpy (r->net,  &addr, sizeof (r->net));
+	memcpy (r->mask, mask,  sizeof (r->mask));
+	return 0;
+}
+
+
+/* Parse a port number, or "*" for any when that is allowed.
+ */
+static int parse_port (char *word, int any, uint16_t *port) {
+	char *end;
+	long val;
+	if (any && (strcmp (word, "*") == 0)) {
+		*port = 0;
+		return 0;
+	}
+	val = strtol (word, &end, 10);
+	if ((*end != '\0') || (val <= 0) || (val >= 65536)) {
+		return -1;
+	}
+	*port = htons (val);
+	return 0;
+}
+
+
+/* Parse one line of the rule file into the rule, and return its ruleset,
+ * or NULL when it is malformed.
+ */
+static struct ruleset *parse_rule (char *line, struct rule *r) {
+	char *word [8];
+	char *save;
+	unsigned int words = 0;
+	struct ruleset *rs;
+	char *end;
+	long hop;
+	while ((words < 8) && ((word [words] = strtok_r ((words == 0) ? line : NULL, " \t\r\n", &save)) != NULL)) {
+		words++;
+	}
+	memset (r, 0, sizeof (*r));
+	if ((words == 7) && (strcmp (word [0], "listen") == 0)) {
+		rs = &listens;
+	} else if ((words == 5) && (strcmp (word [0], "connect") == 0)) {
+		rs = &connects;
+	} else {
+		return NULL;
+	}
+	//
+	// The protocol must be one that the call can punch for
+	if (strcmp (word [1], "*") == 0) {
+		r->proto = 0;
+	} else if ((rs == &listens) && (strcmp (word [1], "tcp") == 0)) {
+		r->proto = IPPROTO_TCP;
+	} else if ((rs == &listens) && (strcmp (word [1], "sctp") == 0)) {
+		r->proto = IPPROTO_SCTP;
+	} else if ((rs == &connects) && (strcmp (word [1], "udp") == 0)) {
+		r->proto = IPPROTO_UDP;
+	} else {
+		return NULL;
+	}
+	if ((parse_prefix (word [2], r) == -1) || (parse_port (word [3], 1, &r->port) == -1)) {
+		return NULL;
+	}
+	if (strcmp (word [4], "guess") == 0) {
+		hop = SYNERGY_HOPLIMIT_GUESS;
+	} else {
+		hop = strtol (word [4], &end, 10);
+		if ((*end != '\0') || (hop <= 0) || (hop >= 256)) {
+			return NULL;
+		}
+	}
+	r->hoplimit = hop;
+	//
+	// Listen rules name the peer to punch towards
+	if (rs == &listens) {
+		r->peer.sin6_family = AF_INET6;
+		if ((inet_pton (AF_INET6, word [5], &r->peer.sin6_addr) != 1)
+				|| (parse_port (word [6], 0, &r->peer.sin6_port) == -1)) {
+			return NULL;
+		}
+	}
+	return rs;
+}
+
+
+/* Read the rules, and compile them into their rulesets.  Lines that cannot
+ * be parsed are reported and skipped.  A missing rule file is only reported
+ * when it was named explicitly.
+ */
+static void preload_rules (void) {
+	const char *path = getenv ("SYNERGY_PRELOAD");
+	char line [512];
+	unsigned int lineno = 0;
+	struct ruleset *rs;
+	struct rule r, *more;
+	uint16_t p;
+	FILE *rf;
+	char *hash;
+	rf = fopen ((path != NULL) ? path : PRELOAD_RULES_PATH, "re");
+	if (rf == NULL) {
+		if (path != NULL) {
+			fprintf (stderr, "synergy preload: Cannot read %s: %s\n", path, strerror (errno));
+		}
+		return;
+	}
+	if (path == NULL) {
+		path = PRELOAD_RULES_PATH;
+	}
+	while (fgets (line, sizeof (line), rf) != NULL) {
+		lineno++;
+		hash = strchr (line, '#');
+		if (hash != NULL) {
+			*hash = '\0';
+		}
+		if (line [strspn (line, " \t\r\n")] == '\0') {
+			continue;
+		}
+		rs = parse_rule (line, &r);
+		if (rs == NULL) {
+			fprintf (stderr, "synergy preload: Skipping malformed rule on %s:%u\n", path, lineno);
+			continue;
+		}
+		more = realloc (rs->rules, (rs->count + 1) * sizeof (struct rule));
+		if (more == NULL) {
+			break;
+		}
+		rs->rules = more;
+		memcpy (&rs->rules [rs->count++], &r, sizeof (r));
+		if (r.port == 0) {
+			rs->anyport = 1;
+		} else {
+			p = ntohs (r.port);
+			rs->ports [p >> 3] |= 1 << (p & 7);
+		}
+	}
+	fclose (rf);
+}
+
+
+/* The helper thread takes batches of punches from the queue, and sends
+ * them as the process is allowed to.  The outcome is not reported.
+ */
+static void *preload_thread (void *arg) {
+	struct pending batch [SYNERGY_BATCH_MAX];
+	struct synergy_punch punches [SYNERGY_BATCH_MAX];
+	unsigned int count, i;
+	while (1) {
+		pthread_mutex_lock (&queuelock);
+		while (queuecount == 0) {
+			pthread_cond_wait (&queuecond, &queuelock);
+		}
+		for (count = 0; (count < SYNERGY_BATCH_MAX) && (queuecount > 0); count++) {
+			memcpy (&batch [count], &queue [queuehead], sizeof (struct pending));
+			queuehead = (queuehead + 1) % PRELOAD_QUEUE;
+			queuecount--;
+		}
+		pthread_mutex_unlock (&queuelock);
+		for (i = 0; i < count; i++) {
+			punches [i].sockfd = batch [i].sockfd;
+			punches [i].hoplimit = batch [i].hoplimit;
+			punches [i].symcli = &batch [i].peer;
+		}
+		synergy_many (punches, count);
+		for (i = 0; i < count; i++) {
+			close (batch [i].sockfd);
+		}
+	}
+	return NULL;
+}
+
+
+/* Queue a punch for the helper thread, and start it when needed.  The
+ * thread is created with all signals blocked.  Called with queuelock held.
+ */
+static void preload_queue (int sockfd, uint8_t hoplimit, const struct sockaddr_in6 *peer) {
+	struct pending *pd;
+	pthread_attr_t attr;
+	pthread_t thread;
+	sigset_t all, old;
+	int dupfd;
+	if (queuecount >= PRELOAD_QUEUE) {
+		return;
+	}
+	if (!started) {
+		sigfillset (&all);
+		pthread_sigmask (SIG_SETMASK, &all, &old);
+		pthread_attr_init (&attr);
+		pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+		started = (pthread_create (&thread, &attr, preload_thread, NULL) == 0);
+		pthread_attr_destroy (&attr);
+		pthread_sigmask (SIG_SETMASK, &old, NULL);
+		if (!started) {
+			return;
+		}
+	}
+	dupfd = fcntl (sockfd, F_DUPFD_CLOEXEC, 0);
+	if (dupfd == -1) {
+		return;
+	}
+	pd = &queue [(queuehead + queuecount) % PRELOAD_QUEUE];
+	pd->sockfd = dupfd;
+	pd->hoplimit = hoplimit;
+	memcpy (&pd->peer, peer, sizeof (pd->peer));
+	queuecount++;
+	pthread_cond_signal (&queuecond);
+}
+
+
+static void queuelock_prepare (void) {
+	pthread_mutex_lock (&queuelock);
+}
+
+static void queuelock_parent (void) {
+	pthread_mutex_unlock (&queuelock);
+}
+
+/* The child has no helper thread, and leaves the queued punches to its
+ * parent.
+ */
+static void queuelock_child (void) {
+	while (queuecount > 0) {
+		close (queue [queuehead].sockfd);
+		queuehead = (queuehead + 1) % PRELOAD_QUEUE;
+		queuecount--;
+	}
+	started = 0;
+	pthread_cond_init (&queuecond, NULL);
+	pthread_mutex_unlock (&queuelock);
+}
+
+
+__attribute__((constructor))
+static void preload_init (void) {
+	preload_resolve ();
+	preload_rules ();
+	pthread_atfork (queuelock_prepare, queuelock_parent, queuelock_child);
+}
+
+
+int listen (int sockfd, int backlog) {
+	struct sockaddr_in6 local;
+	socklen_t len = sizeof (local);
+	int proto;
+	socklen_t protolen = sizeof (proto);
+	unsigned int i;
+	int retval;
+	int err;
+	if (real_listen == NULL) {
+		preload_resolve ();
+	}
+	retval = real_listen (sockfd, backlog);
+	if ((retval == -1) || (listens.count == 0)) {
+		return retval;
+	}
+	//
+	// Find the bound address, port and protocol of the socket
+	err = errno;
+	if ((getsockname (sockfd, (struct sockaddr *) &local, &len) == -1)
+			|| (local.sin6_family != AF_INET6)
+			|| !ruleset_port (&listens, local.sin6_port)
+			|| (getsockopt (sockfd, SOL_SOCKET, SO_PROTOCOL, &proto, &protolen) == -1)) {
+		errno = err;
+		return retval;
+	}
+	//
+	// Punch towards the peer of every rule that matches
+	pthread_mutex_lock (&queuelock);
+	for (i = 0; i < listens.count; i++) {
+		struct rule *r = &listens.rules [i];
+		if (rule_match (r, &local.sin6_addr, local.sin6_port, proto)) {
+			preload_queue (sockfd, r->hoplimit, &r->peer);
+		}
+	}
+	pthread_mutex_unlock (&queuelock);
+	errno = err;
+	return retval;
+}
+
+
+int connect (int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+	const struct sockaddr_in6 *peer = (const struct sockaddr_in6 *) addr;
+	int proto;
+	socklen_t protolen = sizeof (proto);
+	unsigned int i;
+	int retval;
+	int err;
+	if (real_connect == NULL) {
+		preload_resolve ();
+	}
+	retval = real_connect (sockfd, addr, addrlen);
+	if ((retval == -1) || (addrlen < sizeof (*peer)) || (addr->sa_family != AF_INET6)
+			|| !ruleset_port (&connects, peer->sin6_port)) {
+		return retval;
+	}
+	//
+	// Only UDP sockets are punched, by the first rule that matches
+	err = errno;
+	if ((getsockopt (sockfd, SOL_SOCKET, SO_PROTOCOL, &proto, &protolen) == 0)
+			&& (proto == IPPROTO_UDP)) {
+		for (i = 0; i < connects.count; i++) {
+			struct rule *r = &connects.rules [i];
+			if (rule_match (r, &peer->sin6_addr, peer->sin6_port, proto)) {
+				pthread_mutex_lock (&queuelock);
+				preload_queue (sockfd, r->hoplimit, peer);
+				pthread_mutex_unlock (&queuelock);
+				break;
+			}
+		}
+	}
+	errno = err;
+	return retval;
+}
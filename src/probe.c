@@ -0,0 +1,333 @@
+/* probe.c -- Explicit learning of the hop limit range for a destination
+ *
+ * Rather than trying one hop limit per round trip, a burst of probes is
+ * sent with every hop limit from 1 up to a maximum.  Each probe carries a
+ * marker, from which the hop limit is recovered when a reply quotes the
+ * probe.  The firewall boundary then shows up in about one round trip.
+ *
+ * Time Exceeded messages tell how far each probe got.  The first probe
+ * that expired in a router outside the local site has passed all local
+ * firewalls, so its hop limit is the lower bound.  A TCP RST or an ICMPv6
+ * Destination Unreachable shows that a probe reached the remote end, so
+ * one below the lowest such hop limit is the upper bound.
+ *
+ * Processes without RAW privileges have synergy.d run the probes.  The
+ * daemon queues the probes like other punches, so it opens the reply
+ * sockets and collects the replies separately from sending.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/random.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <linux/filter.h>
+
+#include <sys/socketsynergy.h>
+
+#include "libsynergy.h"
+
+
+/* Open a RAW TCP socket that only receives RST packets.  The replies are
+ * matched on their acknowledgement number, which is the probe marker
+ * plus one.
+ */
+static int synergy_probe_rstsocket (void) {
+	static struct sock_filter rstonly [] = {
+		BPF_STMT (BPF_LD  | BPF_B   | BPF_ABS, 13),		/* TCP flags */
+		BPF_JUMP (BPF_JMP | BPF_JSET | BPF_K, 0x04, 0, 1),	/* RST set? */
+		BPF_STMT (BPF_RET | BPF_K, sizeof (struct tcphdr)),
+		BPF_STMT (BPF_RET | BPF_K, 0),
+	};
+	static const struct sock_fprog rstprog = {
+		.len = sizeof (rstonly) / sizeof (rstonly [0]),
+		.filter = rstonly,
+	};
+	int sox = socket (PF_INET6, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+	if (sox == -1) {
+		return -1;
+	}
+	if (setsockopt (sox, SOL_SOCKET, SO_ATTACH_FILTER, &rstprog, sizeof (rstprog)) == -1) {
+		int err = errno;
+		close (sox);
+		errno = err;
+		return -1;
+	}
+	return sox;
+}
+
+
+/* Read one RST from the RAW TCP socket, in the form of a reply.  Returns
+ * 1 for a reply, 0 when none are waiting, or -1 on error.
+ */
+static int synergy_probe_rstread (int sox, struct synergy_reply *reply) {
+	struct sockaddr_in6 from;
+	socklen_t fromlen;
+	struct tcphdr tcp;
+	ssize_t len;
+	while (1) {
+		fromlen = sizeof (from);
+		len = recvfrom (sox, &tcp, sizeof (tcp), MSG_DONTWAIT,
+				(struct sockaddr *) &from, &fromlen);
+		if (len == -1) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				return 0;
+			}
+			return -1;
+		}
+		if ((len < sizeof (tcp)) || !tcp.rst || !tcp.ack) {
+			continue;
+		}
+		memset (reply, 0, sizeof (*reply));
+		reply->kind = SYNERGY_REPLY_RST;
+		reply->proto = IPPROTO_TCP;
+		memcpy (&reply->remote,   &from.sin6_addr, 16);
+		memcpy (&reply->reporter, &from.sin6_addr, 16);
+		reply->localport = tcp.dest;
+		reply->remoteport = tcp.source;
+		reply->marker = ntohl (tcp.ack_seq) - 1;
+		return 1;
+	}
+}
+
+
+/* Test whether two addresses share the site prefix.
+ */
+static int synergy_probe_samesite (const struct in6_addr *a, const struct in6_addr *b) {
+	int bytes = SYNERGY_PROBE_SITEPREFIX / 8;
+	int bits = SYNERGY_PROBE_SITEPREFIX % 8;
+	if (memcmp (a, b, bytes) != 0) {
+		return 0;
+	}
+	if (bits == 0) {
+		return 1;
+	}
+	return ((a->s6_addr [bytes] ^ b->s6_addr [bytes]) & (0xff00 >> bits)) == 0;
+}
+
+
+static int64_t synergy_probe_now_ms (void) {
+	struct timespec now;
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return ((int64_t) now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+}
+
+
+void synergy_probe_close (struct synergy_prober *pr) {
+	int i;
+	for (i = 0; i < 2; i++) {
+		if (pr->fds [i] != -1) {
+			close (pr->fds [i]);
+			pr->fds [i] = -1;
+		}
+	}
+}
+
+
+int synergy_probe_open (struct synergy_prober *pr, int sockfd, struct sockaddr_in6 *symcli, uint8_t maxhop) {
+	socklen_t namesz;
+	int type;
+	int err;
+	pr->fds [0] = -1;
+	pr->fds [1] = -1;
+	pr->maxhop = maxhop;
+	//
+	// Learn about the socket, and pick a marker base that is never
+	// mistaken for a normal punch, whose marker is 0
+	namesz = sizeof (pr->local);
+	if (getsockname (sockfd, (struct sockaddr *) &pr->local, &namesz)) {
+		return -1;
+	}
+	if (symcli != NULL) {
+		memcpy (&pr->remote, symcli, sizeof (pr->remote));
+	} else {
+		namesz = sizeof (pr->remote);
+		if (getpeername (sockfd, (struct sockaddr *) &pr->remote, &namesz)) {
+			return -1;
+		}
+	}
+	namesz = sizeof (type);
+	if (getsockopt (sockfd, SOL_SOCKET, SO_TYPE, &type, &namesz)) {
+		return -1;
+	}
+	if (getrandom (&pr->base, sizeof (pr->base), GRND_NONBLOCK) != sizeof (pr->base)) {
+		pr->base = (uint32_t) synergy_probe_now_ms () * 0x9e3779b1;
+	}
+	pr->base = (pr->base & 0x7fffff00) | 0x100;
+	//
+	// Listen for replies before the probes go out
+	pr->fds [0] = synergy_reply_open ();
+	if (pr->fds [0] == -1) {
+		return -1;
+	}
+	if (type == SOCK_STREAM) {
+		pr->fds [1] = synergy_probe_rstsocket ();
+		if (pr->fds [1] == -1) {
+			err = errno;
+			synergy_probe_close (pr);
+			errno = err;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+int synergy_probe_collect (struct synergy_prober *pr, int timeout_ms, uint8_t *lower, uint8_t *upper) {
+	struct pollfd pfd [2];
+	struct synergy_reply reply;
+	uint8_t answered [256];
+	unsigned int outside = 0;
+	unsigned int reached = 0;
+	int64_t deadline, now;
+	int i, got;
+	int err;
+	for (i = 0; i < 2; i++) {
+		pfd [i].fd = pr->fds [i];
+		pfd [i].events = POLLIN;
+	}
+	//
+	// Collect replies until the boundary is clear, or time runs out
+	memset (answered, 0, sizeof (answered));
+	deadline = synergy_probe_now_ms () + timeout_ms;
+	while ((now = synergy_probe_now_ms ()) < deadline) {
+		if (poll (pfd, 2, deadline - now) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			goto fail;
+		}
+		for (i = 0; i < 2; i++) {
+			while (1) {
+				if (pfd [i].fd == -1) {
+					break;
+				}
+				got = (i == 0) ? synergy_reply_read (pfd [i].fd, &reply)
+				               : synergy_probe_rstread (pfd [i].fd, &reply);
+				if (got == -1) {
+					goto fail;
+				}
+				if (got == 0) {
+					break;
+				}
+				unsigned int hop = reply.marker - pr->base;
+				if ((hop < 1) || (hop > pr->maxhop) || answered [hop]
+						|| (reply.localport != pr->local.sin6_port)
+						|| (reply.remoteport != pr->remote.sin6_port)
+						|| (memcmp (&reply.remote, &pr->remote.sin6_addr, 16) != 0)) {
+					continue;
+				}
+				answered [hop] = 1;
+				if (reply.kind != SYNERGY_REPLY_TIMEEXCEEDED) {
+					if ((reached == 0) || (hop < reached)) {
+						reached = hop;
+					}
+				} else if (!synergy_probe_samesite (&reply.reporter, &reply.local)) {
+					if ((outside == 0) || (hop < outside)) {
+						outside = hop;
+					}
+				}
+			}
+		}
+		//
+		// Stop early when all probes below the remote end have answered
+		if (reached != 0) {
+			unsigned int hop = 1;
+			while ((hop < reached) && answered [hop]) {
+				hop++;
+			}
+			if (hop == reached) {
+				break;
+			}
+		}
+	}
+	synergy_probe_close (pr);
+	*lower = outside;
+	*upper = (reached > 0) ? reached - 1 : 0;
+	if ((outside == 0) && (reached == 0)) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	return 0;
+fail:
+	err = errno;
+	synergy_probe_close (pr);
+	errno = err;
+	return -1;
+}
+
+
+/* Privileged processes send the probes, and collect the replies.
+ */
+static int synergy_probe_privileged (int sockfd, struct sockaddr_in6 *symcli, uint8_t maxhop, int timeout_ms, uint8_t *lower, uint8_t *upper) {
+	struct synergy_prober pr;
+	int err;
+	if (synergy_probe_open (&pr, sockfd, symcli, maxhop) == -1) {
+		return -1;
+	}
+	if (synergy_probe_send (sockfd, &pr.remote, maxhop, pr.base) == -1) {
+		err = errno;
+		synergy_probe_close (&pr);
+		errno = err;
+		return -1;
+	}
+	return synergy_probe_collect (&pr, timeout_ms, lower, upper);
+}
+
+
+/* Others have synergy.d run the probes, over a private session.
+ */
+static int synergy_probe_daemonised (int sockfd, struct sockaddr_in6 *symcli, uint8_t maxhop, int timeout_ms, uint8_t *lower, uint8_t *upper) {
+	struct synergy_session_request req;
+	struct synergy_completion cpl;
+	struct sockaddr_in6 remot;
+	socklen_t namesz = sizeof (remot);
+	if (symcli == NULL) {
+		if (getpeername (sockfd, (struct sockaddr *) &remot, &namesz)) {
+			return -1;
+		}
+		symcli = &remot;
+	}
+	if (timeout_ms > 65535) {
+		timeout_ms = 65535;
+	}
+	memset (&req, 0, sizeof (req));
+	req.hoplimit = maxhop;
+	req.flags = SYNERGY_SESSION_PROBE;
+	req.timeout_ms = timeout_ms;
+	memcpy (&req.symcli, symcli, sizeof (req.symcli));
+	if (synergy_session_call (&req, sockfd, timeout_ms, &cpl) == -1) {
+		return -1;
+	}
+	*lower = cpl.lower;
+	*upper = cpl.upper;
+	return 0;
+}
+
+
+int synergy_probe (int sockfd, struct sockaddr_in6 *symcli, uint8_t maxhop, int timeout_ms, uint8_t *lower, uint8_t *upper) {
+	if ((maxhop < 1) || (timeout_ms <= 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+	*lower = 0;
+	*upper = 0;
+	if (synergy_rawable ()) {
+		return synergy_probe_privileged (sockfd, symcli, maxhop, timeout_ms, lower, upper);
+	} else {
+		return synergy_probe_daemonised (sockfd, symcli, maxhop, timeout_ms, lower, upper);
+	}
+}
@@ -0,0 +1,150 @@
+/* probes.c -- Hop limit probes on behalf of sessions of synergy.d
+ *
+ * The probes are punches with a marker, one for every hop limit up to the
+ * maximum that the client asked for, which is clamped like any other hop
+ * limit.  They are queued under the user id of the session, so the same
+ * fairness and rate limits apply to them as to the punches of that user.
+ *
+ * A probe waits for replies for up to its timeout, which does not fit in
+ * the main loop or in the workers.  Every probe therefore collects its
+ * replies on a thread of its own, which completes the session request with
+ * the bounds that it learned, and that keeps them in the hop cache.  The
+ * number of concurrent probes is limited, to keep clients from exhausting
+ * the daemon; excess requests complete with EAGAIN.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/socketsynergy.h>
+
+#include "daemon.h"
+
+
+/* The maximum number of probes that run at the same time.
+ */
+#define PROBES_MAX 16
+
+
+struct probe {
+	struct session *session;
+	uint64_t tag;
+	int sockfd;
+	struct synergy_prober pr;
+	int timeout_ms;
+};
+
+
+static int running = 0;
+
+
+static void *probe_main (void *arg) {
+	struct probe *pb = arg;
+	struct synergy_completion cpl;
+	memset (&cpl, 0, sizeof (cpl));
+	cpl.tag = pb->tag;
+	if (synergy_probe_collect (&pb->pr, pb->timeout_ms, &cpl.lower, &cpl.upper) == -1) {
+		cpl.error = errno;
+	} else {
+		hopcache_learned (&pb->pr.remote.sin6_addr, cpl.lower, cpl.upper);
+	}
+	close (pb->sockfd);
+	session_deliver (pb->session, &cpl);
+	free (pb);
+	__atomic_sub_fetch (&running, 1, __ATOMIC_ACQ_REL);
+	return NULL;
+}
+
+
+/* Queue a marked job for every hop limit up to the maximum, which expire
+ * when the probe stops waiting for replies.  Their deadlines rise by a
+ * nanosecond per hop, so they go out in order.  The queue takes the lower
+ * hop limits first, so the maximum of the probe drops to what it took.
+ */
+static int probe_queue (struct session *ses, struct probe *pb, int sockfd) {
+	static struct job jobs [255];
+	struct synergy_hint hint;
+	uint64_t now = metrics_now ();
+	unsigned int hop;
+	int got;
+	if (synergy_describe (sockfd, &hint) == -1) {
+		return -1;
+	}
+	if (hint.proto == 0) {
+		errno = EPROTONOSUPPORT;
+		return -1;
+	}
+	for (hop = 1; hop <= pb->pr.maxhop; hop++) {
+		struct job *job = &jobs [hop - 1];
+		memset (job, 0, sizeof (*job));
+		memcpy (&job->symcli, &pb->pr.remote, sizeof (job->symcli));
+		job->sockfd = -1;
+		job->hoplimit = hop;
+		job->received = now;
+		job->deadline = now + pb->timeout_ms * 1000000ULL + hop;
+		job->marker = pb->pr.base + hop;
+		memcpy (&job->hint, &hint, sizeof (job->hint));
+	}
+	got = fairq_submit (ses->uid, jobs, pb->pr.maxhop);
+	if (got == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	pb->pr.maxhop = got;
+	return 0;
+}
+
+
+int probe_start (struct session *ses, uint64_t tag, int sockfd, struct sockaddr_in6 *symcli, uint8_t maxhop, int timeout_ms) {
+	pthread_attr_t attr;
+	pthread_t thread;
+	struct probe *pb;
+	int err;
+	if (__atomic_add_fetch (&running, 1, __ATOMIC_ACQ_REL) > PROBES_MAX) {
+		__atomic_sub_fetch (&running, 1, __ATOMIC_ACQ_REL);
+		errno = EAGAIN;
+		return -1;
+	}
+	pb = malloc (sizeof (struct probe));
+	if (pb == NULL) {
+		__atomic_sub_fetch (&running, 1, __ATOMIC_ACQ_REL);
+		return -1;
+	}
+	pb->session = ses;
+	pb->tag = tag;
+	pb->sockfd = sockfd;
+	pb->timeout_ms = timeout_ms;
+	if (synergy_probe_open (&pb->pr, sockfd, symcli, maxhop) == -1) {
+		err = errno;
+		goto fail;
+	}
+	if (probe_queue (ses, pb, sockfd) == -1) {
+		err = errno;
+		synergy_probe_close (&pb->pr);
+		goto fail;
+	}
+	pthread_attr_init (&attr);
+	pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+	err = pthread_create (&thread, &attr, probe_main, pb);
+	pthread_attr_destroy (&attr);
+	if (err != 0) {
+		synergy_probe_close (&pb->pr);
+		goto fail;
+	}
+	return 0;
+fail:
+	free (pb);
+	__atomic_sub_fetch (&running, 1, __ATOMIC_ACQ_REL);
+	errno = err;
+	return -1;
+}
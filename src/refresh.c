@@ -0,0 +1,381 @@
+/* refresh.c -- Refresh punches for registered sockets of sessions
+ *
+ * Firewalls forget a hole when no traffic passes it for a while, so long
+ * lived sockets need to be punched again.  Clients register their sockets
+ * over their session, and the main loop punches them again at the interval
+ * that they asked for.
+ *
+ * The registrations are kept in a hierarchical timer wheel, with four
+ * levels of 256 slots and a tick of REFRESH_TICK_MS.  The first level holds
+ * what is due in the next 256 ticks, one slot per tick; every next level
+ * has slots that are 256 times as wide, and they are cascaded into the
+ * lower level when the time comes.  Adding, removing and expiring are all
+ * constant time, regardless of the number of registrations.  The levels
+ * span 2^32 ticks, which is more than the longest interval.  A timerfd
+ * ticks while there are registrations.
+ *
+ * Everything that is due in a tick is queued for the workers in batches,
+ * so their punches go out in few system calls.  What the queue of the user
+ * cannot take is tried again on the next tick.  Before punching, kcmp() checks
+ * that the client still has the socket open under the number that it
+ * registered; if not, the registration is dropped.  When kcmp() cannot
+ * tell, the registration lasts until the session ends.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include <linux/kcmp.h>
+
+#include <netinet/in.h>
+
+#include <sys/socketsynergy.h>
+
+#include "daemon.h"
+
+
+/* The tick of the timer wheel, its levels and slots, and the number of
+ * hash buckets to find registrations by session and client socket.
+ */
+#define REFRESH_TICK_MS 100
+#define REFRESH_LEVELS 4
+#define REFRESH_SLOTBITS 8
+#define REFRESH_SLOTS (1 << REFRESH_SLOTBITS)
+#define REFRESH_BUCKETS 65536
+
+
+/* A registration is linked into a slot of the wheel, into the list of its
+ * session, and into a hash bucket.  The first two lists are doubly linked
+ * through a pointer to the previous pointer, so that unlinking needs no
+ * search.
+ */
+struct refresh {
+	struct refresh *next, **pprev;
+	struct refresh *snext, **spprev;
+	struct refresh *hnext;
+	struct session *session;
+	int sockfd;
+	int clientfd;
+	struct sockaddr_in6 symcli;
+	uint8_t hoplimit;
+	uint32_t interval;
+	uint64_t due;
+};
+
+
+static struct refresh *wheel [REFRESH_LEVELS] [REFRESH_SLOTS];
+static struct refresh *buckets [REFRESH_BUCKETS];
+static uint64_t tick = 0;
+static unsigned int registered = 0;
+static struct evhandler ticker = { .fd = -1 };
+static struct job jobs [SYNERGY_BATCH_MAX];
+static struct refresh *batch [SYNERGY_BATCH_MAX];
+static int batchcnt = 0;
+static pid_t self;
+
+
+static unsigned int refresh_hash (struct session *ses, int clientfd) {
+	uint64_t h = (((uintptr_t) ses) ^ ((uint64_t) clientfd << 32)) * 0x9e3779b97f4a7c15ULL;
+	return (h >> 32) % REFRESH_BUCKETS;
+}
+
+
+/* Run the timer while there are registrations, and stop it otherwise.
+ */
+static void refresh_timer (int run) {
+	struct itimerspec its;
+	memset (&its, 0, sizeof (its));
+	if (run) {
+		its.it_value.tv_nsec = REFRESH_TICK_MS * 1000000;
+		its.it_interval.tv_nsec = REFRESH_TICK_MS * 1000000;
+	}
+	timerfd_settime (ticker.fd, 0, &its, NULL);
+}
+
+
+/* Put a registration in the slot for its due tick, on the lowest level
+ * that reaches that far from now.
+ */
+static void refresh_schedule (struct refresh *r) {
+	uint64_t delta = (r->due > tick) ? r->due - tick : 0;
+	struct refresh **slot;
+	int level = 0;
+	while ((level < REFRESH_LEVELS - 1) && (delta >> (REFRESH_SLOTBITS * (level + 1)))) {
+		level++;
+	}
+	slot = &wheel [level] [(r->due >> (REFRESH_SLOTBITS * level)) & (REFRESH_SLOTS - 1)];
+	r->next = *slot;
+	r->pprev = slot;
+	if (*slot != NULL) {
+		(*slot)->pprev = &r->next;
+	}
+	*slot = r;
+}
+
+
+static void refresh_unschedule (struct refresh *r) {
+	if (r->pprev == NULL) {
+		return;
+	}
+	*r->pprev = r->next;
+	if (r->next != NULL) {
+		r->next->pprev = r->pprev;
+	}
+	r->pprev = NULL;
+}
+
+
+/* Remove a registration from everywhere, and close its socket.
+ */
+static void refresh_drop (struct refresh *r) {
+	struct refresh **hp = &buckets [refresh_hash (r->session, r->clientfd)];
+	refresh_unschedule (r);
+	*r->spprev = r->snext;
+	if (r->snext != NULL) {
+		r->snext->spprev = r->spprev;
+	}
+	while (*hp != r) {
+		hp = &(*hp)->hnext;
+	}
+	*hp = r->hnext;
+	close (r->sockfd);
+	free (r);
+	metrics_add (&metrics_shard (0)->unregistered, 1);
+	if (--registered == 0) {
+		refresh_timer (0);
+	}
+}
+
+
+static struct refresh *refresh_find (struct session *ses, int clientfd) {
+	struct refresh *r = buckets [refresh_hash (ses, clientfd)];
+	while ((r != NULL) && ((r->session != ses) || (r->clientfd != clientfd))) {
+		r = r->hnext;
+	}
+	return r;
+}
+
+
+/* See whether the client still has our socket open under its number.
+ */
+static int refresh_alive (struct refresh *r) {
+	int cmp = syscall (SYS_kcmp, r->session->pid, self, KCMP_FILE,
+				r->clientfd, r->sockfd);
+	if (cmp == -1) {
+		return (errno != EBADF) && (errno != ESRCH);
+	}
+	return cmp == 0;
+}
+
+
+/* Queue the batch for the workers, each job with a duplicate of the socket
+ * for them to close, in runs of the same user.  What cannot be queued is
+ * due again on the next tick.
+ */
+static void refresh_flush (void) {
+	uint8_t taken [SYNERGY_BATCH_MAX];
+	int start, end, accepted, i;
+	if (batchcnt == 0) {
+		return;
+	}
+	for (start = 0; start < batchcnt; start = end) {
+		uid_t uid = batch [start]->session->uid;
+		end = start + 1;
+		while ((end < batchcnt) && (batch [end]->session->uid == uid)) {
+			end++;
+		}
+		accepted = fairq_submit (uid, jobs + start, end - start);
+		metrics_add (&metrics_shard (0)->refreshed, accepted);
+		for (i = start; i < end; i++) {
+			taken [i] = (i < start + accepted);
+		}
+	}
+	for (i = 0; i < batchcnt; i++) {
+		struct refresh *r = batch [i];
+		if (taken [i]) {
+			r->due += r->interval;
+		} else {
+			close (jobs [i].sockfd);
+		}
+		if (r->due <= tick) {
+			r->due = tick + 1;
+		}
+		refresh_schedule (r);
+	}
+	batchcnt = 0;
+}
+
+
+/* Take a due registration into the batch, or drop it when its socket was
+ * closed by the client.  It is scheduled again when the batch is flushed.
+ */
+static void refresh_due (struct refresh *r, uint64_t now) {
+	struct job *job;
+	int fd;
+	refresh_unschedule (r);
+	if (!refresh_alive (r)) {
+		refresh_drop (r);
+		return;
+	}
+	fd = fcntl (r->sockfd, F_DUPFD_CLOEXEC, 0);
+	if (fd == -1) {
+		r->due = tick + 1;
+		refresh_schedule (r);
+		return;
+	}
+	job = &jobs [batchcnt];
+	memcpy (&job->symcli, &r->symcli, sizeof (job->symcli));
+	job->sockfd = fd;
+	job->hoplimit = hoplearn_apply (&job->symcli, r->hoplimit);
+	job->session = NULL;
+	job->confirm = NULL;
+	job->reply = NULL;
+	job->tag = 0;
+	job->received = now;
+	job->deadline = 0;
+	job->marker = 0;
+	job->hint.proto = 0;
+	batch [batchcnt++] = r;
+	if (batchcnt == SYNERGY_BATCH_MAX) {
+		refresh_flush ();
+	}
+}
+
+
+/* Move the registrations in a slot of a higher level down the wheel.
+ */
+static void refresh_cascade (int level) {
+	struct refresh **slot = &wheel [level] [(tick >> (REFRESH_SLOTBITS * level)) & (REFRESH_SLOTS - 1)];
+	struct refresh *r = *slot;
+	*slot = NULL;
+	while (r != NULL) {
+		struct refresh *next = r->next;
+		refresh_schedule (r);
+		r = next;
+	}
+}
+
+
+/* Advance the wheel by the ticks that passed, and punch what is due.
+ */
+static void ticker_handle (struct evhandler *evh, uint32_t events) {
+	struct refresh **slot;
+	uint64_t ticks;
+	uint64_t now;
+	int level;
+	if (read (evh->fd, &ticks, sizeof (ticks)) != sizeof (ticks)) {
+		return;
+	}
+	now = metrics_now ();
+	while ((ticks-- > 0) && (registered > 0)) {
+		tick++;
+		for (level = 1; level < REFRESH_LEVELS; level++) {
+			if (tick & ((1ULL << (REFRESH_SLOTBITS * level)) - 1)) {
+				break;
+			}
+			refresh_cascade (level);
+		}
+		slot = &wheel [0] [tick & (REFRESH_SLOTS - 1)];
+		while (*slot != NULL) {
+			refresh_due (*slot, now);
+		}
+		refresh_flush ();
+	}
+}
+
+
+int refresh_register (struct session *ses, int sockfd, int clientfd, struct sockaddr_in6 *symcli, uint8_t hoplimit, uint32_t interval_ms) {
+	struct refresh *r;
+	unsigned int h;
+	if (ticker.fd == -1) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	if (interval_ms == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	r = refresh_find (ses, clientfd);
+	if (r != NULL) {
+		refresh_drop (r);
+	}
+	r = calloc (1, sizeof (struct refresh));
+	if (r == NULL) {
+		return -1;
+	}
+	r->session = ses;
+	r->sockfd = sockfd;
+	r->clientfd = clientfd;
+	memcpy (&r->symcli, symcli, sizeof (r->symcli));
+	r->hoplimit = hoplimit;
+	r->interval = (interval_ms + REFRESH_TICK_MS - 1) / REFRESH_TICK_MS;
+	r->due = tick + r->interval;
+	refresh_schedule (r);
+	r->snext = ses->refreshes;
+	r->spprev = &ses->refreshes;
+	if (ses->refreshes != NULL) {
+		ses->refreshes->spprev = &r->snext;
+	}
+	ses->refreshes = r;
+	h = refresh_hash (ses, clientfd);
+	r->hnext = buckets [h];
+	buckets [h] = r;
+	metrics_add (&metrics_shard (0)->registered, 1);
+	if (registered++ == 0) {
+		refresh_timer (1);
+	}
+	return 0;
+}
+
+
+int refresh_cancel (struct session *ses, int clientfd) {
+	struct refresh *r = refresh_find (ses, clientfd);
+	if (r == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+	refresh_drop (r);
+	return 0;
+}
+
+
+void refresh_end (struct session *ses) {
+	while (ses->refreshes != NULL) {
+		refresh_drop (ses->refreshes);
+	}
+}
+
+
+/* Start the timer, and allow for a socket per registration.
+ */
+int refresh_start (void) {
+	struct rlimit rl;
+	self = getpid ();
+	if (getrlimit (RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit (RLIMIT_NOFILE, &rl);
+	}
+	ticker.handle = ticker_handle;
+	ticker.fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (ticker.fd == -1) {
+		return -1;
+	}
+	return evloop_add (&ticker, EPOLLIN);
+}
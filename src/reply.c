@@ -0,0 +1,147 @@
+/* reply.c -- Receive the replies that punches draw from the network
+ *
+ * A punch runs out of hops in a router beyond the local firewalls, which
+ * then returns an ICMPv6 Time Exceeded message.  That message quotes the
+ * start of the punch, so it tells which punch it was and confirms that
+ * the punch passed the firewalls.  A punch that travels too far may draw
+ * a Destination Unreachable message from the remote firewall or host.
+ *
+ * The RAW ICMPv6 socket is guarded by the ICMPv6 type filter and by a
+ * kernel BPF filter, so it only queues these two messages, and only when
+ * they quote a TCP, UDP or SCTP packet without any extension headers,
+ * which is what we send.  A RAW IPv6 socket presents the ICMPv6 message
+ * without the IPv6 header to the filter.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+
+#include <linux/filter.h>
+
+#include <sys/socketsynergy.h>
+
+#include "libsynergy.h"
+
+
+/* The offsets into a Time Exceeded message; the quoted IPv6 header follows
+ * the ICMPv6 header, and the quoted transport header follows that.
+ */
+#define QUOTE_IP6 8
+#define QUOTE_NXT (QUOTE_IP6 + 6)
+#define QUOTE_SRC (QUOTE_IP6 + 8)
+#define QUOTE_DST (QUOTE_IP6 + 24)
+#define QUOTE_TRANSPORT (QUOTE_IP6 + 40)
+
+/* The offsets of the probe markers in the quoted transport header; see
+ * synergy_mark() for how they are set.
+ */
+#define MARKER_TCP  (QUOTE_TRANSPORT + 4)
+#define MARKER_UDP  (QUOTE_TRANSPORT + 8)
+#define MARKER_SCTP (QUOTE_TRANSPORT + 28)
+
+/* The part of the message that is needed for parsing.
+ */
+#define QUOTE_NEEDED (QUOTE_TRANSPORT + 32)
+
+
+/* The kernel filter on the socket.  Jump offsets count from the next
+ * instruction; messages of other types or with other quotes end at the
+ * final return of 0, which drops them.
+ */
+static struct sock_filter quotesours [] = {
+	BPF_STMT (BPF_LD  | BPF_B   | BPF_ABS, 0),		/* ICMPv6 type */
+	BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, ICMP6_DST_UNREACH, 3, 0),
+	BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, ICMP6_TIME_EXCEEDED, 0, 7),
+	BPF_STMT (BPF_LD  | BPF_B   | BPF_ABS, 1),		/* ICMPv6 code */
+	BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, ICMP6_TIME_EXCEED_TRANSIT, 0, 5),
+	BPF_STMT (BPF_LD  | BPF_B   | BPF_ABS, QUOTE_NXT),	/* Quoted protocol */
+	BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP,  2, 0),
+	BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP,  1, 0),
+	BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_SCTP, 0, 1),
+	BPF_STMT (BPF_RET | BPF_K, QUOTE_NEEDED),
+	BPF_STMT (BPF_RET | BPF_K, 0),
+};
+
+const struct sock_fprog synergy_reply_filter = {
+	.len = sizeof (quotesours) / sizeof (quotesours [0]),
+	.filter = quotesours,
+};
+
+
+int synergy_reply_open (void) {
+	struct icmp6_filter icmpflt;
+	int sox = socket (PF_INET6, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_ICMPV6);
+	if (sox == -1) {
+		return -1;
+	}
+	ICMP6_FILTER_SETBLOCKALL (&icmpflt);
+	ICMP6_FILTER_SETPASS (ICMP6_TIME_EXCEEDED, &icmpflt);
+	ICMP6_FILTER_SETPASS (ICMP6_DST_UNREACH, &icmpflt);
+	if ((setsockopt (sox, IPPROTO_ICMPV6, ICMP6_FILTER, &icmpflt, sizeof (icmpflt)) == -1)
+			|| (setsockopt (sox, SOL_SOCKET, SO_ATTACH_FILTER, &synergy_reply_filter, sizeof (synergy_reply_filter)) == -1)) {
+		int err = errno;
+		close (sox);
+		errno = err;
+		return -1;
+	}
+	return sox;
+}
+
+
+int synergy_reply_read (int sox, struct synergy_reply *reply) {
+	uint8_t buf [QUOTE_NEEDED];
+	struct sockaddr_in6 from;
+	socklen_t fromlen;
+	ssize_t len;
+	while (1) {
+		fromlen = sizeof (from);
+		len = recvfrom (sox, buf, sizeof (buf), MSG_DONTWAIT,
+				(struct sockaddr *) &from, &fromlen);
+		if (len == -1) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				return 0;
+			}
+			return -1;
+		}
+		//
+		// Skip anything that is too short to quote the ports
+		if (len < QUOTE_TRANSPORT + 4) {
+			continue;
+		}
+		memset (reply, 0, sizeof (*reply));
+		if (buf [0] == ICMP6_TIME_EXCEEDED) {
+			reply->kind = SYNERGY_REPLY_TIMEEXCEEDED;
+		} else {
+			reply->kind = SYNERGY_REPLY_UNREACHABLE;
+		}
+		reply->proto = buf [QUOTE_NXT];
+		memcpy (&reply->local,    buf + QUOTE_SRC, 16);
+		memcpy (&reply->remote,   buf + QUOTE_DST, 16);
+		memcpy (&reply->reporter, &from.sin6_addr, 16);
+		memcpy (&reply->localport,  buf + QUOTE_TRANSPORT,     2);
+		memcpy (&reply->remoteport, buf + QUOTE_TRANSPORT + 2, 2);
+		//
+		// Pick up the probe marker, if it was quoted
+		int marker = (reply->proto == IPPROTO_TCP) ? MARKER_TCP
+				: (reply->proto == IPPROTO_UDP) ? MARKER_UDP
+				: MARKER_SCTP;
+		if (len >= marker + 4) {
+			memcpy (&reply->marker, buf + marker, 4);
+			reply->marker = ntohl (reply->marker);
+		}
+		return 1;
+	}
+}
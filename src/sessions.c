@@ -0,0 +1,308 @@
+/* sessions.c -- Persistent client sessions for asynchronous requests
+ *
+ * Clients that use the asynchronous API connect once to a SOCK_SEQPACKET
+ * socket, and then pipeline their tagged requests over that connection.
+ * Every request is one message with one socket passed as SCM_RIGHTS.
+ * After the worker has sent the punch, it returns a completion with the
+ * tag and the errno value of the send, or 0 for success.  Requests that
+ * ask for confirmation complete later, as described in confirms.c, and
+ * probes complete with the bounds that they learned, see probes.c.  Refresh
+ * requests are longer; they register the socket with refresh.c and punch
+ * right away, or they cancel a registration.  Messages in the second version
+ * of the request format, see wire.c, may carry many requests and sockets,
+ * and every request completes on its own.
+ *
+ * Completions are sent without blocking.  A client that does not reap
+ * its completions will lose those that do not fit in the socket buffer.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+
+#include <sys/socketsynergy.h>
+
+#include "daemon.h"
+
+
+static struct evhandler listener;
+
+
+void session_release (struct session *ses) {
+	if (__atomic_sub_fetch (&ses->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		close (ses->evh.fd);
+		free (ses);
+	}
+}
+
+
+void session_deliver (struct session *ses, struct synergy_completion *cpl) {
+	send (ses->evh.fd, cpl, sizeof (*cpl), MSG_DONTWAIT | MSG_NOSIGNAL);
+	session_release (ses);
+}
+
+
+void session_complete (struct session *ses, uint64_t tag, int error, uint32_t latency_us) {
+	struct synergy_completion cpl;
+	memset (&cpl, 0, sizeof (cpl));
+	cpl.tag = tag;
+	cpl.error = error;
+	cpl.latency_us = latency_us;
+	session_deliver (ses, &cpl);
+}
+
+
+/* Queue a job of a session for the workers, or complete it as busy.  The
+ * job takes a reference to the session, which a confirmation takes over
+ * when the request asks for one.
+ */
+static void session_submit (struct session *ses, struct job *job, uint8_t flags, uint16_t timeout_ms) {
+	struct metrics_shard *metrics = metrics_shard (0);
+	job->session = ses;
+	job->confirm = NULL;
+	job->reply = NULL;
+	__atomic_add_fetch (&ses->refs, 1, __ATOMIC_ACQ_REL);
+	if ((flags & SYNERGY_SESSION_CONFIRM) && (timeout_ms > 0)) {
+		job->confirm = confirm_new (ses, job->tag, job->sockfd, &job->symcli, timeout_ms);
+		if (job->confirm == NULL) {
+			close (job->sockfd);
+			session_complete (ses, job->tag, errno, 0);
+			return;
+		}
+	}
+	if (fairq_submit (ses->uid, job, 1) == 0) {
+		metrics_add (&metrics->dropped, 1);
+		close (job->sockfd);
+		if (job->confirm != NULL) {
+			confirm_sent (job->confirm, EAGAIN);
+		} else {
+			session_complete (ses, job->tag, EAGAIN, 0);
+		}
+	}
+}
+
+
+/* Handle a message in the second version of the request format, whose
+ * requests complete one by one.  Only confirmation is supported as a flag.
+ */
+static void session_wire (struct session *ses, void *msg, ssize_t len, int *fds, int fdcnt) {
+	static struct job jobs [SYNERGY_BATCH_MAX];
+	static struct synergy_wire_request reqs [SYNERGY_BATCH_MAX];
+	struct metrics_shard *metrics = metrics_shard (0);
+	uint8_t flags;
+	int reqcnt;
+	int i;
+	reqcnt = wire_parse (msg, len, fds, fdcnt, jobs, reqs, &flags);
+	if (reqcnt == -1) {
+		if (errno == EPROTO) {
+			metrics_add (&metrics->malformed, 1);
+		} else {
+			metrics_add (&metrics->dropped, 1);
+		}
+		return;
+	}
+	metrics_add (&metrics->received, reqcnt);
+	for (i = 0; i < reqcnt; i++) {
+		if (reqs [i].flags & ~SYNERGY_SESSION_CONFIRM) {
+			close (jobs [i].sockfd);
+			__atomic_add_fetch (&ses->refs, 1, __ATOMIC_ACQ_REL);
+			session_complete (ses, jobs [i].tag, EINVAL, 0);
+			continue;
+		}
+		session_submit (ses, &jobs [i], reqs [i].flags, reqs [i].timeout_ms);
+	}
+}
+
+
+/* Read the requests that are waiting on a session, and pass them on to the
+ * workers.  When the client hangs up, the session is removed from the main
+ * loop, but it lives on until all its jobs have completed.  Messages in the
+ * second version of the request format may hold many requests and sockets.
+ */
+static void session_handle (struct evhandler *evh, uint32_t events) {
+	static uint64_t msgbuf [(SYNERGY_WIRE_MAX + 7) / 8];
+	static char anc [CMSG_SPACE (sizeof (int) * SYNERGY_BATCH_MAX)];
+	struct session *ses = (struct session *) evh;
+	struct synergy_refresh_request *rr = (struct synergy_refresh_request *) msgbuf;
+	struct synergy_wire_header *hdr = (struct synergy_wire_header *) msgbuf;
+	struct synergy_ring_request *ring = (struct synergy_ring_request *) msgbuf;
+	int fds [SYNERGY_BATCH_MAX];
+	int fdcnt;
+	struct iovec iov;
+	struct msghdr mgh;
+	struct cmsghdr *cmg;
+	struct metrics_shard *metrics = metrics_shard (0);
+	struct job job;
+	ssize_t len;
+	while (1) {
+		memset (&mgh, 0, sizeof (mgh));
+		iov.iov_base = msgbuf;
+		iov.iov_len = sizeof (msgbuf);
+		mgh.msg_iov = &iov;
+		mgh.msg_iovlen = 1;
+		mgh.msg_control = &anc;
+		mgh.msg_controllen = sizeof (anc);
+		len = recvmsg (ses->evh.fd, &mgh, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+		if ((len == -1) && ((errno == EAGAIN) || (errno == EINTR))) {
+			return;
+		}
+		if (len <= 0) {
+			evloop_del (&ses->evh);
+			refresh_end (ses);
+			shmrings_end (ses);
+			session_release (ses);
+			return;
+		}
+		//
+		// Take in the sockets; only ring requests may come without any
+		cmg = CMSG_FIRSTHDR (&mgh);
+		fdcnt = 0;
+		if ((cmg != NULL) && (cmg->cmsg_level == SOL_SOCKET) && (cmg->cmsg_type == SCM_RIGHTS)) {
+			fdcnt = (cmg->cmsg_len - CMSG_LEN (0)) / sizeof (int);
+			memcpy (fds, CMSG_DATA (cmg), sizeof (int) * fdcnt);
+		}
+		if ((fdcnt > 0) && (len >= sizeof (*hdr)) && (hdr->magic == SYNERGY_WIRE_MAGIC)
+					&& !(mgh.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+			session_wire (ses, msgbuf, len, fds, fdcnt);
+			continue;
+		}
+		if ((len == sizeof (*ring)) && (ring->req.flags & SYNERGY_SESSION_RING)
+					&& !(mgh.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+			int64_t handle = shmrings_request (ses, ring, fds, fdcnt);
+			__atomic_add_fetch (&ses->refs, 1, __ATOMIC_ACQ_REL);
+			session_complete (ses, (handle == -1) ? 0 : handle, (handle == -1) ? errno : 0, 0);
+			continue;
+		}
+		if ((fdcnt != 1)
+					|| (len != ((rr->req.flags & SYNERGY_SESSION_REFRESH) ? sizeof (*rr) : sizeof (rr->req)))
+					|| (mgh.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+			metrics_add (&metrics->malformed, 1);
+			while (fdcnt-- > 0) {
+				close (fds [fdcnt]);
+			}
+			continue;
+		}
+		job.sockfd = fds [0];
+		metrics_add (&metrics->received, 1);
+		//
+		// Probes run on their own, with the hop limit as the maximum
+		if (rr->req.flags & SYNERGY_SESSION_PROBE) {
+			__atomic_add_fetch (&ses->refs, 1, __ATOMIC_ACQ_REL);
+			if (probe_start (ses, rr->req.tag, job.sockfd, &rr->req.symcli,
+					clamp_hoplimit (rr->req.hoplimit), rr->req.timeout_ms) == -1) {
+				close (job.sockfd);
+				session_complete (ses, rr->req.tag, errno, 0);
+			}
+			continue;
+		}
+		//
+		// Cancel a refresh, or register the socket and punch it as usual
+		if ((rr->req.flags & SYNERGY_SESSION_REFRESH) && (rr->interval_ms == 0)) {
+			close (job.sockfd);
+			__atomic_add_fetch (&ses->refs, 1, __ATOMIC_ACQ_REL);
+			session_complete (ses, rr->req.tag,
+					refresh_cancel (ses, rr->sockfd) ? errno : 0, 0);
+			continue;
+		}
+		if (rr->req.flags & SYNERGY_SESSION_REFRESH) {
+			int keep = fcntl (job.sockfd, F_DUPFD_CLOEXEC, 0);
+			if ((keep == -1) || (refresh_register (ses, keep, rr->sockfd,
+					&rr->req.symcli, rr->req.hoplimit, rr->interval_ms) == -1)) {
+				int err = errno;
+				if (keep != -1) {
+					close (keep);
+				}
+				close (job.sockfd);
+				__atomic_add_fetch (&ses->refs, 1, __ATOMIC_ACQ_REL);
+				session_complete (ses, rr->req.tag, err, 0);
+				continue;
+			}
+		}
+		//
+		// Queue the job for the workers, or complete it as busy
+		memcpy (&job.symcli, &rr->req.symcli, sizeof (job.symcli));
+		job.hoplimit = hoplearn_apply (&job.symcli, rr->req.hoplimit);
+		job.tag = rr->req.tag;
+		job.received = metrics_now ();
+		job.deadline = 0;
+		job.marker = 0;
+		job.hint.proto = 0;
+		session_submit (ses, &job, rr->req.flags, rr->req.timeout_ms);
+	}
+}
+
+
+/* Accept new sessions, and add them to the main loop.
+ */
+static void listener_handle (struct evhandler *evh, uint32_t events) {
+	struct ucred cred;
+	socklen_t credsz;
+	int sox;
+	while ((sox = accept4 (evh->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		struct session *ses = calloc (1, sizeof (struct session));
+		if (ses == NULL) {
+			close (sox);
+			continue;
+		}
+		ses->evh.handle = session_handle;
+		ses->evh.fd = sox;
+		ses->refs = 1;
+		ses->uid = (uid_t) -1;
+		credsz = sizeof (cred);
+		if (getsockopt (sox, SOL_SOCKET, SO_PEERCRED, &cred, &credsz) == 0) {
+			ses->pid = cred.pid;
+			ses->uid = cred.uid;
+		}
+		if (evloop_add (&ses->evh, EPOLLIN) == -1) {
+			close (sox);
+			free (ses);
+		}
+	}
+}
+
+
+int sessions_open (void) {
+	int lsox = socket (PF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (lsox == -1) {
+		return -1;
+	}
+	struct sockaddr_un socket_path;
+	memset (&socket_path, 0, sizeof (socket_path));
+	socket_path.sun_family = PF_UNIX;
+	strncpy (socket_path.sun_path, SYNERGY_DAEMON_SESSION_PATH,
+				sizeof (socket_path.sun_path));
+	if (bind (lsox, (struct sockaddr *) &socket_path,
+				sizeof (socket_path)) == -1) {
+		close (lsox);
+		return -1;
+	}
+	if ((chmod (SYNERGY_DAEMON_SESSION_PATH, S_IRWXU | S_IRWXG | S_IRWXO) == -1)
+				|| (listen (lsox, 128) == -1)) {
+		close (lsox);
+		unlink (SYNERGY_DAEMON_SESSION_PATH);
+		return -1;
+	}
+	return lsox;
+}
+
+
+int sessions_start (int lsox) {
+	listener.handle = listener_handle;
+	listener.fd = lsox;
+	return evloop_add (&listener, EPOLLIN);
+}
@@ -0,0 +1,249 @@
+/* shmring.c -- Punch requests through a ring in memory shared with synergy.d
+ *
+ * The ring lives in a memfd that the process shares with synergy.d over a
+ * private session.  Sockets are registered over that session once, each
+ * with a round trip, and from then on a punch is an entry in the ring,
+ * which costs a few atomic operations and no system call.  Only when the
+ * daemon has gone idle does the producer that finds it so write to the
+ * eventfd that serves as the doorbell.
+ *
+ * The session and the ring are per process.  After fork() the child drops
+ * the ring of its parent, and sets up its own when it registers a socket.
+ * The handles of the parent are then unknown in the child.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include <sys/socketsynergy.h>
+
+#include "libsynergy.h"
+
+
+#define SYNERGY_RING_SIZE (sizeof (struct synergy_ring) \
+			+ SYNERGY_RING_ENTRIES * sizeof (struct synergy_ring_entry))
+
+
+static pthread_mutex_t ringlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t ringonce = PTHREAD_ONCE_INIT;
+static struct synergy_ring *ring = NULL;
+static int ringses = -1;
+static int bellfd = -1;
+
+
+/* Drop the ring and its session.  This is called with ringlock held, or in
+ * the child after fork().
+ */
+static void synergy_ring_reset (void) {
+	if (ring != NULL) {
+		munmap (ring, SYNERGY_RING_SIZE);
+		ring = NULL;
+	}
+	if (ringses >= 0) {
+		close (ringses);
+		ringses = -1;
+	}
+	if (bellfd >= 0) {
+		close (bellfd);
+		bellfd = -1;
+	}
+}
+
+
+static void ringlock_prepare (void) {
+	pthread_mutex_lock (&ringlock);
+}
+
+static void ringlock_parent (void) {
+	pthread_mutex_unlock (&ringlock);
+}
+
+static void ringlock_child (void) {
+	synergy_ring_reset ();
+	pthread_mutex_unlock (&ringlock);
+}
+
+static void ringlock_setup (void) {
+	pthread_atfork (ringlock_prepare, ringlock_parent, ringlock_child);
+}
+
+
+/* Send a ring request with its descriptors over the ring session, and wait
+ * for its completion.  Returns the tag of the completion, or -1 with errno
+ * set.  This is called with ringlock held.
+ */
+static int64_t synergy_ring_call (uint32_t op, uint32_t handle, int *fds, int fdcnt) {
+	char anc [CMSG_SPACE (2 * sizeof (int))];
+	struct synergy_ring_request req;
+	struct synergy_completion cpl;
+	struct iovec iov;
+	struct msghdr mgh;
+	struct cmsghdr *cmg;
+	ssize_t len;
+	memset (&req, 0, sizeof (req));
+	memset (&mgh, 0, sizeof (mgh));
+	memset (anc, 0, sizeof (anc));
+	req.req.flags = SYNERGY_SESSION_RING;
+	req.op = op;
+	req.handle = handle;
+	iov.iov_base = &req;
+	iov.iov_len = sizeof (req);
+	mgh.msg_iov = &iov;
+	mgh.msg_iovlen = 1;
+	if (fdcnt > 0) {
+		mgh.msg_control = anc;
+		mgh.msg_controllen = CMSG_SPACE (fdcnt * sizeof (int));
+		cmg = CMSG_FIRSTHDR (&mgh);
+		cmg->cmsg_level = SOL_SOCKET;
+		cmg->cmsg_type = SCM_RIGHTS;
+		cmg->cmsg_len = CMSG_LEN (fdcnt * sizeof (int));
+		memcpy (CMSG_DATA (cmg), fds, fdcnt * sizeof (int));
+	}
+	if (sendmsg (ringses, &mgh, MSG_NOSIGNAL) == -1) {
+		return -1;
+	}
+	len = recv (ringses, &cpl, sizeof (cpl), 0);
+	if (len != sizeof (cpl)) {
+		errno = (len == -1) ? errno : ECONNRESET;
+		return -1;
+	}
+	if (cpl.error != 0) {
+		errno = cpl.error;
+		return -1;
+	}
+	return cpl.tag;
+}
+
+
+/* Create the ring in a sealed memfd, with every entry free, and attach it
+ * to synergy.d over a new session.  This is called with ringlock held.
+ */
+static int synergy_ring_attach (void) {
+	int fds [2];
+	int memfd;
+	int err;
+	unsigned int i;
+	memfd = memfd_create ("synergy.ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd == -1) {
+		return -1;
+	}
+	if ((ftruncate (memfd, SYNERGY_RING_SIZE) == -1)
+			|| (fcntl (memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1)) {
+		goto fail;
+	}
+	ring = mmap (NULL, SYNERGY_RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (ring == MAP_FAILED) {
+		ring = NULL;
+		goto fail;
+	}
+	ring->magic = SYNERGY_RING_MAGIC;
+	ring->entries = SYNERGY_RING_ENTRIES;
+	for (i = 0; i < SYNERGY_RING_ENTRIES; i++) {
+		ring->entry [i].seq = i;
+	}
+	bellfd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	ringses = synergy_session_connect (0);
+	if ((bellfd == -1) || (ringses == -1)) {
+		goto fail;
+	}
+	fds [0] = memfd;
+	fds [1] = bellfd;
+	if (synergy_ring_call (SYNERGY_RING_ATTACH, 0, fds, 2) == -1) {
+		goto fail;
+	}
+	close (memfd);
+	return 0;
+fail:
+	err = errno;
+	close (memfd);
+	synergy_ring_reset ();
+	errno = err;
+	return -1;
+}
+
+
+int synergy_ring_register (int sockfd) {
+	int64_t handle;
+	pthread_once (&ringonce, ringlock_setup);
+	pthread_mutex_lock (&ringlock);
+	if ((ring == NULL) && (synergy_ring_attach () == -1)) {
+		pthread_mutex_unlock (&ringlock);
+		return -1;
+	}
+	handle = synergy_ring_call (SYNERGY_RING_REGISTER, 0, &sockfd, 1);
+	pthread_mutex_unlock (&ringlock);
+	return handle;
+}
+
+
+int synergy_ring_unregister (int handle) {
+	int64_t retval = -1;
+	pthread_once (&ringonce, ringlock_setup);
+	pthread_mutex_lock (&ringlock);
+	if (ring == NULL) {
+		errno = ENOENT;
+	} else {
+		retval = synergy_ring_call (SYNERGY_RING_UNREGISTER, handle, NULL, 0);
+	}
+	pthread_mutex_unlock (&ringlock);
+	return (retval == -1) ? -1 : 0;
+}
+
+
+/* Claim a position at the tail, fill in its entry, and publish it.  The
+ * ring is full when the entry at the tail has not been taken yet.
+ */
+int synergy_ring_submit (int handle, uint8_t hoplimit, struct sockaddr_in6 *symcli) {
+	struct synergy_ring *r = __atomic_load_n (&ring, __ATOMIC_ACQUIRE);
+	struct synergy_ring_entry *e;
+	uint64_t pos, seq;
+	uint64_t one = 1;
+	if (r == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+	pos = __atomic_load_n (&r->tail, __ATOMIC_RELAXED);
+	while (1) {
+		e = &r->entry [pos & (SYNERGY_RING_ENTRIES - 1)];
+		seq = __atomic_load_n (&e->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n (&r->tail, &pos, pos + 1, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if ((int64_t) (seq - pos) < 0) {
+			errno = EAGAIN;
+			return -1;
+		} else {
+			pos = __atomic_load_n (&r->tail, __ATOMIC_RELAXED);
+		}
+	}
+	e->handle = handle;
+	e->hoplimit = hoplimit;
+	if (symcli != NULL) {
+		memcpy (&e->symcli, symcli, sizeof (e->symcli));
+	} else {
+		e->symcli.sin6_family = 0;
+	}
+	__atomic_store_n (&e->seq, pos + 1, __ATOMIC_SEQ_CST);
+	//
+	// Ring the doorbell if the daemon went idle, and nobody else rang
+	if (__atomic_load_n (&r->idle, __ATOMIC_SEQ_CST)
+			&& __atomic_exchange_n (&r->idle, 0, __ATOMIC_SEQ_CST)) {
+		write (bellfd, &one, sizeof (one));
+	}
+	return 0;
+}
@@ -0,0 +1,325 @@
+/* shmrings.c -- Take punch requests from rings in memory shared with clients
+ *
+ * A client attaches a ring on a session of its own, see shmring.c, and
+ * registers its sockets over that session.  The daemon keeps a duplicate
+ * of every registered socket, which holds on to its local address and
+ * port, and describes it once.  The jobs that it makes of ring entries
+ * then carry that description as their hint and no socket, like the jobs
+ * of the eBPF program, so an entry costs the daemon no system call either.
+ * A handle is only valid in the ring of the session that registered it.
+ *
+ * The rings are drained from the main loop after every round of events,
+ * a batch at a time, into the queue of the client's user id.  Entries that
+ * do not fit in that queue stay in the ring, which is then stalled and
+ * retried before the main loop waits.  The queue is full while a ring
+ * stays stalled, so its timer wakes the main loop for the next retry.
+ * Before the main loop waits, it marks all other rings idle;
+ * a ring that has entries in spite of that keeps the main loop from waiting.
+ * The client rings the doorbell when it finds its ring idle.
+ *
+ * The memory is shared with a client that need not be trusted, so entries
+ * are copied out before they are checked, and only the sequence number of
+ * an entry tells whether it is ready.  A client that corrupts its ring can
+ * only stall its own punches.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+
+#include <sys/socketsynergy.h>
+
+#include "daemon.h"
+
+
+#define SHMRING_SIZE (sizeof (struct synergy_ring) \
+			+ SYNERGY_RING_ENTRIES * sizeof (struct synergy_ring_entry))
+
+
+/* A registered socket, with its description, and the peer that it was
+ * connected to, if any.
+ */
+struct regsock {
+	int sockfd;
+	struct synergy_hint hint;
+	struct sockaddr_in6 peer;
+};
+
+
+/* The ring of a session, with its doorbell in the main loop.  The head
+ * is kept here, where the client cannot change it.
+ */
+struct shmring {
+	struct evhandler evh;
+	struct shmring *next;
+	struct session *ses;
+	struct synergy_ring *ring;
+	uint64_t head;
+	int stalled;
+	struct regsock *socks;
+	unsigned int numsocks;
+};
+
+
+static struct shmring *rings = NULL;
+
+
+static void shmring_bell (struct evhandler *evh, uint32_t events) {
+	uint64_t rung;
+	read (evh->fd, &rung, sizeof (rung));
+}
+
+
+/* Take a batch of ready entries from a ring, and queue them as jobs.
+ * Entries are only released up to the first job that was not queued;
+ * invalid entries are released and counted as malformed.
+ */
+static void shmring_drain (struct shmring *sr) {
+	static struct job jobs [SYNERGY_BATCH_MAX];
+	static unsigned int jobpos [SYNERGY_BATCH_MAX];
+	struct metrics_shard *metrics = metrics_shard (0);
+	struct synergy_ring_entry ent;
+	struct synergy_ring_entry *e;
+	struct regsock *rs;
+	struct job *job;
+	unsigned int scanned, count, got, release, i;
+	uint64_t now = metrics_now ();
+	uint64_t pos;
+	do {
+		count = 0;
+		for (scanned = 0, pos = sr->head; scanned < SYNERGY_BATCH_MAX; scanned++, pos++) {
+			e = &sr->ring->entry [pos & (SYNERGY_RING_ENTRIES - 1)];
+			if (__atomic_load_n (&e->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+				break;
+			}
+			memcpy (&ent, e, sizeof (ent));
+			//
+			// Check the handle against the registrations of the session
+			rs = (ent.handle < sr->numsocks) ? &sr->socks [ent.handle] : NULL;
+			if ((rs == NULL) || (rs->sockfd == -1)
+					|| ((ent.symcli.sin6_family != AF_INET6) && (rs->peer.sin6_family != AF_INET6))) {
+				continue;
+			}
+			jobpos [count] = scanned;
+			job = &jobs [count++];
+			memset (job, 0, sizeof (*job));
+			memcpy (&job->symcli, (ent.symcli.sin6_family == AF_INET6) ? &ent.symcli : &rs->peer,
+					sizeof (job->symcli));
+			job->sockfd = -1;
+			job->hoplimit = hoplearn_apply (&job->symcli, ent.hoplimit);
+			job->received = now;
+			memcpy (&job->hint, &rs->hint, sizeof (job->hint));
+		}
+		got = (count > 0) ? fairq_submit (sr->ses->uid, jobs, count) : 0;
+		sr->stalled = (got < count);
+		release = sr->stalled ? jobpos [got] : scanned;
+		metrics_add (&metrics->received, release);
+		metrics_add (&metrics->malformed, release - got);
+		for (i = 0; i < release; i++) {
+			e = &sr->ring->entry [sr->head & (SYNERGY_RING_ENTRIES - 1)];
+			__atomic_store_n (&e->seq, sr->head + SYNERGY_RING_ENTRIES, __ATOMIC_RELEASE);
+			sr->head++;
+		}
+	} while (!sr->stalled && (scanned == SYNERGY_BATCH_MAX));
+}
+
+
+void shmrings_poll (void) {
+	struct shmring *sr;
+	for (sr = rings; sr != NULL; sr = sr->next) {
+		shmring_drain (sr);
+	}
+}
+
+
+int shmrings_idle (void) {
+	struct shmring *sr;
+	struct synergy_ring_entry *e;
+	uint64_t head;
+	int idle = 1;
+	for (sr = rings; sr != NULL; sr = sr->next) {
+		//
+		// Retry a stalled ring; if it stays stuck, the queue ticks
+		if (sr->stalled) {
+			head = sr->head;
+			shmring_drain (sr);
+			if (sr->head != head) {
+				idle = 0;
+				continue;
+			}
+			if (sr->stalled) {
+				continue;
+			}
+		}
+		__atomic_store_n (&sr->ring->idle, 1, __ATOMIC_SEQ_CST);
+		e = &sr->ring->entry [sr->head & (SYNERGY_RING_ENTRIES - 1)];
+		if (__atomic_load_n (&e->seq, __ATOMIC_SEQ_CST) == sr->head + 1) {
+			__atomic_store_n (&sr->ring->idle, 0, __ATOMIC_RELAXED);
+			idle = 0;
+		}
+	}
+	return idle;
+}
+
+
+/* Map a ring from its sealed memfd, and add its doorbell to the main loop.
+ */
+static int shmring_attach (struct session *ses, int memfd, int bellfd) {
+	struct shmring *sr;
+	struct stat st;
+	int seals = fcntl (memfd, F_GET_SEALS);
+	int flags = fcntl (bellfd, F_GETFL);
+	if (ses->ring != NULL) {
+		errno = EBUSY;
+		return -1;
+	}
+	if ((seals == -1) || !(seals & F_SEAL_SHRINK) || (fstat (memfd, &st) == -1)
+			|| (st.st_size < SHMRING_SIZE) || (flags == -1) || !(flags & O_NONBLOCK)) {
+		errno = EINVAL;
+		return -1;
+	}
+	sr = calloc (1, sizeof (struct shmring));
+	if (sr == NULL) {
+		return -1;
+	}
+	sr->ring = mmap (NULL, SHMRING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (sr->ring == MAP_FAILED) {
+		free (sr);
+		return -1;
+	}
+	if ((sr->ring->magic != SYNERGY_RING_MAGIC) || (sr->ring->entries != SYNERGY_RING_ENTRIES)) {
+		munmap (sr->ring, SHMRING_SIZE);
+		free (sr);
+		errno = EINVAL;
+		return -1;
+	}
+	sr->evh.handle = shmring_bell;
+	sr->evh.fd = bellfd;
+	if (evloop_add (&sr->evh, EPOLLIN) == -1) {
+		munmap (sr->ring, SHMRING_SIZE);
+		free (sr);
+		return -1;
+	}
+	sr->ses = ses;
+	sr->next = rings;
+	rings = sr;
+	ses->ring = sr;
+	return 0;
+}
+
+
+/* Register a socket in the first free slot, after describing it.
+ */
+static int shmring_register (struct shmring *sr, int sockfd) {
+	struct regsock *more;
+	struct regsock *rs;
+	socklen_t peersz;
+	unsigned int h;
+	for (h = 0; (h < sr->numsocks) && (sr->socks [h].sockfd != -1); h++) {
+		;
+	}
+	if (h == sr->numsocks) {
+		more = realloc (sr->socks, (sr->numsocks + 16) * sizeof (struct regsock));
+		if (more == NULL) {
+			return -1;
+		}
+		sr->socks = more;
+		for (; sr->numsocks < h + 16; sr->numsocks++) {
+			sr->socks [sr->numsocks].sockfd = -1;
+		}
+	}
+	rs = &sr->socks [h];
+	if ((synergy_describe (sockfd, &rs->hint) == -1) || (rs->hint.proto == 0)) {
+		return -1;
+	}
+	if (rs->hint.localport == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	peersz = sizeof (rs->peer);
+	if ((getpeername (sockfd, (struct sockaddr *) &rs->peer, &peersz) == -1)
+			|| (peersz != sizeof (rs->peer))) {
+		rs->peer.sin6_family = 0;
+	}
+	rs->sockfd = sockfd;
+	return h;
+}
+
+
+int shmrings_request (struct session *ses, struct synergy_ring_request *req, int *fds, int fdcnt) {
+	struct shmring *sr = ses->ring;
+	int retval = -1;
+	int used = 0;
+	errno = EINVAL;
+	switch (req->op) {
+	case SYNERGY_RING_ATTACH:
+		if (fdcnt == 2) {
+			retval = shmring_attach (ses, fds [0], fds [1]);
+			used = (retval == 0) ? 2 : 0;
+			if (used) {
+				close (fds [0]);
+			}
+		}
+		break;
+	case SYNERGY_RING_REGISTER:
+		if ((fdcnt == 1) && (sr != NULL)) {
+			retval = shmring_register (sr, fds [0]);
+			used = (retval >= 0) ? 1 : 0;
+		}
+		break;
+	case SYNERGY_RING_UNREGISTER:
+		if ((fdcnt == 0) && (sr != NULL) && (req->handle < sr->numsocks)
+				&& (sr->socks [req->handle].sockfd != -1)) {
+			close (sr->socks [req->handle].sockfd);
+			sr->socks [req->handle].sockfd = -1;
+			retval = 0;
+		} else {
+			errno = ENOENT;
+		}
+		break;
+	}
+	while (fdcnt > used) {
+		close (fds [--fdcnt]);
+	}
+	return retval;
+}
+
+
+void shmrings_end (struct session *ses) {
+	struct shmring *sr = ses->ring;
+	struct shmring **srp;
+	unsigned int h;
+	if (sr == NULL) {
+		return;
+	}
+	for (srp = &rings; *srp != sr; srp = &(*srp)->next) {
+		;
+	}
+	*srp = sr->next;
+	evloop_del (&sr->evh);
+	close (sr->evh.fd);
+	for (h = 0; h < sr->numsocks; h++) {
+		if (sr->socks [h].sockfd != -1) {
+			close (sr->socks [h].sockfd);
+		}
+	}
+	free (sr->socks);
+	munmap (sr->ring, SHMRING_SIZE);
+	free (sr);
+	ses->ring = NULL;
+}
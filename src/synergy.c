@@ -40,14 +40,22 @@
  */
 
 
+#define _GNU_SOURCE
+
 #include <string.h>
 #include <errno.h>
+#include <endian.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/un.h>
 
+#include <linux/capability.h>
+#include <linux/filter.h>
+
 #include <netinet/in.h>
 #include <netinet/ip6.h>
 #include <netinet/udp.h>
@@ -56,6 +64,8 @@
 
 #include <sys/socketsynergy.h>
 
+#include "libsynergy.h"
+
 
 /* These definitions are not widely available; we define it locally to be a
  * header with one chunk (the INIT chunk).
@@ -83,6 +93,7 @@ struct sctphdr {
 union rawmsg {
 	struct udpmsg {
 		struct udphdr hdr;
+		uint32_t marker;
 	} udppkt;
 	struct tcpmsg {
 		struct tcphdr hdr;
@@ -93,24 +104,400 @@ union rawmsg {
 	} sctppkt;
 };
 
-typedef char hoplimiter [CMSG_SPACE (sizeof(int))];
+/* The control data of a punch sets the hop limit, and the source address
+ * that the checksum was computed for.
+ */
+typedef char hoplimiter [CMSG_SPACE (sizeof(int)) + CMSG_SPACE (sizeof (struct in6_pktinfo))];
 
 
-/* The privileged version of our API call directly works on a RAW socket; this
- * is also the version used inside the daemon.
+/* The privileged batch call prepares this many punches at a time.
  */
-int synergy_privileged (int sockfd, uint8_t hoplimit, struct sockaddr_in6 *symcli) {
-	struct sockaddr_in6 local, remot;
-	struct sockaddr_in6 rawnm;
-	int type;
+#define SYNERGY_PRIVILEGED_CHUNK 64
+
+
+/* RAW sockets are kept open between calls, one per protocol.  They are
+ * opened lazily by synergy_rawsocket() or upfront by synergy_init(), and
+ * they are only closed by synergy_fini().  Readers pick up an open socket
+ * without locking; opening and closing is done under rawlock.
+ *
+ * The sockets are opened with close-on-exec, so they never leak into
+ * programs that we exec.  After fork() they are shared with the child,
+ * which is harmless for sending; the atfork handlers merely ensure that
+ * the child does not inherit rawlock in a locked state.
+ *
+ * The rawable flag caches whether this process may open RAW sockets;
+ * it is 0 when unknown, 1 when we may and -1 when we may not.  The
+ * sockoptable flag does the same for SYNERGY_SO_PUNCH.
+ *
+ * In the header-including mode, the sockets are IPPROTO_RAW sockets that
+ * take the IPv6 header from us, for all protocols.  The mode is set by
+ * synergy_init_flags(), which drops the sockets when it changes.
+ */
+static const int rawproto [3] = { IPPROTO_TCP, IPPROTO_UDP, IPPROTO_SCTP };
+static int rawcache [3] = { -1, -1, -1 };
+static int rawable = 0;
+static int sockoptable = 0;
+static int rawhdrincl = 0;
+static pthread_mutex_t rawlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t rawonce = PTHREAD_ONCE_INIT;
+
+static void rawlock_prepare (void) {
+	pthread_mutex_lock (&rawlock);
+}
+
+static void rawlock_release (void) {
+	pthread_mutex_unlock (&rawlock);
+}
+
+static void rawlock_setup (void) {
+	pthread_atfork (rawlock_prepare, rawlock_release, rawlock_release);
+}
+
+
+/* Determine if we may open RAW sockets, either as root or because we
+ * hold CAP_NET_RAW in our effective set.  The latter is queried with the
+ * capget() system call, so there is no dependency on libcap.
+ */
+static int synergy_may_raw (void) {
+	struct __user_cap_header_struct caphdr;
+	struct __user_cap_data_struct capdat [_LINUX_CAPABILITY_U32S_3];
+	if (geteuid () == 0) {
+		return 1;
+	}
+	memset (&caphdr, 0, sizeof (caphdr));
+	memset (&capdat, 0, sizeof (capdat));
+	caphdr.version = _LINUX_CAPABILITY_VERSION_3;
+	caphdr.pid = 0;
+	if (syscall (SYS_capget, &caphdr, capdat) == -1) {
+		return 0;
+	}
+	return (capdat [CAP_TO_INDEX (CAP_NET_RAW)].effective
+				& CAP_TO_MASK (CAP_NET_RAW)) != 0;
+}
+
+
+/* Open a RAW socket for sending only.  A RAW socket receives a copy of all
+ * incoming packets of its protocol, which is useless work for us; so a
+ * filter is attached that drops everything before it is queued.
+ */
+static int synergy_rawopen (int proto) {
+	static struct sock_filter dropall [] = {
+		BPF_STMT (BPF_RET | BPF_K, 0),
+	};
+	static const struct sock_fprog dropprog = {
+		.len = sizeof (dropall) / sizeof (dropall [0]),
+		.filter = dropall,
+	};
+	if (__atomic_load_n (&rawhdrincl, __ATOMIC_ACQUIRE)) {
+		proto = IPPROTO_RAW;
+	}
+	int sox = socket (PF_INET6, SOCK_RAW | SOCK_CLOEXEC, proto);
+	if (sox >= 0) {
+		setsockopt (sox, SOL_SOCKET, SO_ATTACH_FILTER, &dropprog, sizeof (dropprog));
+	}
+	return sox;
+}
+
+
+/* Return the index of a protocol in rawcache[], or -1 if it is not known.
+ */
+static int synergy_rawindex (int proto) {
+	int i;
+	for (i = 0; i < 3; i++) {
+		if (rawproto [i] == proto) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+
+/* Return the cached RAW socket for a protocol, opening it when needed.
+ * On failure, -1 is returned with errno set.
+ */
+static int synergy_rawsocket (int proto) {
+	int idx = synergy_rawindex (proto);
+	int sox;
+	int err;
+	if (idx < 0) {
+		errno = EPROTONOSUPPORT;
+		return -1;
+	}
+	sox = __atomic_load_n (&rawcache [idx], __ATOMIC_ACQUIRE);
+	if (sox >= 0) {
+		return sox;
+	}
+	pthread_once (&rawonce, rawlock_setup);
+	pthread_mutex_lock (&rawlock);
+	sox = rawcache [idx];
+	if (sox < 0) {
+		sox = synergy_rawopen (proto);
+		if (sox >= 0) {
+			__atomic_store_n (&rawcache [idx], sox, __ATOMIC_RELEASE);
+		}
+	}
+	err = errno;
+	pthread_mutex_unlock (&rawlock);
+	errno = err;
+	return sox;
+}
+
+
+/* Determine whether synergy() can take the privileged path, which is the
+ * case for root and for holders of CAP_NET_RAW.  The outcome is cached.
+ */
+int synergy_rawable (void) {
+	int able = __atomic_load_n (&rawable, __ATOMIC_ACQUIRE);
+	if (able == 0) {
+		able = synergy_may_raw () ? 1 : -1;
+		__atomic_store_n (&rawable, able, __ATOMIC_RELEASE);
+	}
+	return able > 0;
+}
+
+
+/* Explicitly setup the RAW sockets for all protocols.  Processes that
+ * cannot open RAW sockets succeed without opening anything; they will
+ * use the daemon.  This call is optional, as sockets are also opened
+ * on first use.
+ */
+int synergy_init (void) {
+	return synergy_init_flags (0);
+}
+
+
+/* Setup the RAW sockets as synergy_init() does, in the mode that the flags
+ * select.  When the mode changes, the cached sockets are closed first.
+ */
+int synergy_init_flags (unsigned int flags) {
+	int hdrincl = (flags & SYNERGY_INIT_HDRINCL) ? 1 : 0;
+	int i;
+	if (flags & ~SYNERGY_INIT_HDRINCL) {
+		errno = EINVAL;
+		return -1;
+	}
+	pthread_once (&rawonce, rawlock_setup);
+	pthread_mutex_lock (&rawlock);
+	if (rawhdrincl != hdrincl) {
+		for (i = 0; i < 3; i++) {
+			if (rawcache [i] >= 0) {
+				close (rawcache [i]);
+				__atomic_store_n (&rawcache [i], -1, __ATOMIC_RELEASE);
+			}
+		}
+		__atomic_store_n (&rawhdrincl, hdrincl, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock (&rawlock);
+	if (!synergy_rawable ()) {
+		return 0;
+	}
+	for (i = 0; i < 3; i++) {
+		if (synergy_rawsocket (rawproto [i]) == -1) {
+			int err = errno;
+			synergy_fini ();
+			errno = err;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+/* Close the RAW sockets and forget about privileges, and close the session
+ * for asynchronous requests.  This must not be called while other threads
+ * are still invoking synergy().
+ */
+void synergy_fini (void) {
+	int i;
+	pthread_once (&rawonce, rawlock_setup);
+	pthread_mutex_lock (&rawlock);
+	for (i = 0; i < 3; i++) {
+		if (rawcache [i] >= 0) {
+			close (rawcache [i]);
+			__atomic_store_n (&rawcache [i], -1, __ATOMIC_RELEASE);
+		}
+	}
+	__atomic_store_n (&rawable, 0, __ATOMIC_RELEASE);
+	__atomic_store_n (&sockoptable, 0, __ATOMIC_RELEASE);
+	pthread_mutex_unlock (&rawlock);
+	synergy_async_fini ();
+}
+
+
+/* A prepared punch holds the RAW packet and the message to send it.  The
+ * message refers to the other fields, so it should not be moved about;
+ * copies are relinked with synergy_link().  The IPv6 header is only sent
+ * in the header-including mode; otherwise the kernel constructs it, with
+ * the hop limit and source address from the control data.
+ */
+struct punch {
 	int proto;
-	int rawsox;
+	int hdrincl;
+	uint32_t addrsum;
+	struct ip6_hdr ip6;
 	union rawmsg rawmsg;
-	socklen_t namesz = sizeof (local);
-	socklen_t typesz = sizeof (type);
+	struct sockaddr_in6 rawnm;
+	struct iovec io [2];
+	hoplimiter hlm;
+	struct msghdr mgh;
+};
 
+
+/* Templates hold the constant part of the punch for each protocol, in the
+ * order of rawproto[].  Their sum includes the pseudo header's protocol
+ * and length, so only the ports, addresses and marker need to be added to
+ * find the Internet checksum.  The CRC32c of SCTP is not additive and is
+ * computed over the whole packet.
+ */
+struct template {
+	union rawmsg rawmsg;
+	size_t len;
+	uint32_t sum;
+};
+
+static struct template rawtmpl [3];
+static pthread_once_t tmplonce = PTHREAD_ONCE_INIT;
+
+
+static void synergy_template_setup (void) {
+	union rawmsg *rawmsg;
 	//
-	// Fetch information, and ensure that it is proper
+	// TCP sends a bare SYN
+	rawmsg = &rawtmpl [0].rawmsg;
+	rawmsg->tcppkt.hdr.doff   = 5;
+	rawmsg->tcppkt.hdr.syn    = 1; // Sending SYN is the main purpose
+	rawtmpl [0].len = sizeof (rawmsg->tcppkt);
+	//
+	// UDP sends an empty datagram, unless it carries a probe marker
+	rawmsg = &rawtmpl [1].rawmsg;
+	rawmsg->udppkt.hdr.len    = htons (sizeof (rawmsg->udppkt.hdr));
+	rawtmpl [1].len = sizeof (rawmsg->udppkt.hdr);
+	//
+	// SCTP sends an INIT chunk
+	rawmsg = &rawtmpl [2].rawmsg;
+	rawmsg->sctppkt.hdr.vfytag = 0;      /* Because we send INIT */
+	rawmsg->sctppkt.hdr.cksum  = 0;    /* Set by synergy_checksum() */
+	rawmsg->sctppkt.ch1.type   = 1;                      /* INIT */
+	rawmsg->sctppkt.ch1.flags  = 0;                  /* No flags */
+	rawmsg->sctppkt.ch1.length = htons (sizeof (rawmsg->sctppkt.ch1));
+	rawmsg->sctppkt.ch1.val.initag = 0;  /* Illegal, would ABORT */
+	rawmsg->sctppkt.ch1.val.advwin = htonl (1024);  /* Arbitrary */
+	rawmsg->sctppkt.ch1.val.numout = htons (1);     /* Arbitrary */
+	rawmsg->sctppkt.ch1.val.numin  = htons (1);     /* Arbitrary */
+	rawmsg->sctppkt.ch1.val.initsn = 0;             /* Arbitrary */
+	rawtmpl [2].len = sizeof (rawmsg->sctppkt);
+	//
+	// Sum the constant parts for the Internet checksum
+	rawtmpl [0].sum = synergy_csum_add (rawtmpl [0].len + IPPROTO_TCP,
+			&rawtmpl [0].rawmsg.tcppkt, rawtmpl [0].len);
+	rawtmpl [1].sum = synergy_csum_add (rawtmpl [1].len + IPPROTO_UDP,
+			&rawtmpl [1].rawmsg.udppkt.hdr, rawtmpl [1].len);
+}
+
+
+/* Find the source address that routing would use towards a destination,
+ * for sockets that are bound to the unspecified address.  Connecting a UDP
+ * socket performs the route lookup without sending anything.
+ */
+static int synergy_route_source (struct sockaddr_in6 *symcli, struct in6_addr *src) {
+	struct sockaddr_in6 probe, found;
+	socklen_t namesz = sizeof (found);
+	int sox = socket (PF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (sox == -1) {
+		return -1;
+	}
+	memcpy (&probe, symcli, sizeof (probe));
+	if (probe.sin6_port == 0) {
+		probe.sin6_port = htons (9);	/* Any port will do */
+	}
+	if ((connect (sox, (struct sockaddr *) &probe, sizeof (probe)) == -1)
+			|| (getsockname (sox, (struct sockaddr *) &found, &namesz) == -1)) {
+		int err = errno;
+		close (sox);
+		errno = err;
+		return -1;
+	}
+	close (sox);
+	memcpy (src, &found.sin6_addr, sizeof (*src));
+	return 0;
+}
+
+
+/* Fill in the checksum of a prepared punch.  The Internet checksum starts
+ * from the template sum, and adds what was patched into the template.
+ */
+static void synergy_checksum (struct punch *pk) {
+	union rawmsg *rawmsg = &pk->rawmsg;
+	uint64_t sum = pk->addrsum;
+	uint16_t csum;
+	switch (pk->proto) {
+	case IPPROTO_TCP:
+		sum += rawtmpl [0].sum;
+		sum = synergy_csum_add (sum, &rawmsg->tcppkt.hdr.source, 8);
+		rawmsg->tcppkt.hdr.check = htons (~synergy_csum_fold (sum));
+		break;
+	case IPPROTO_UDP:
+		sum += rawtmpl [1].sum;
+		sum = synergy_csum_add (sum, &rawmsg->udppkt.hdr.source, 4);
+		if (pk->io [1].iov_len > rawtmpl [1].len) {
+			sum += 2 * sizeof (rawmsg->udppkt.marker);
+			sum = synergy_csum_add (sum, &rawmsg->udppkt.marker, 4);
+		}
+		csum = ~synergy_csum_fold (sum);
+		//
+		// UDP cannot send an all-zero checksum over IPv6; both forms
+		// of zero are the same in ones-complement arithmetic
+		rawmsg->udppkt.hdr.check = htons (csum ? csum : 0xffff);
+		break;
+	case IPPROTO_SCTP:
+		rawmsg->sctppkt.hdr.cksum = 0;
+		rawmsg->sctppkt.hdr.cksum = htole32 (synergy_crc32c (
+				&rawmsg->sctppkt, pk->io [1].iov_len));
+		break;
+	}
+}
+
+
+/* Point the message of a punch to its own fields, after it was copied.
+ */
+static void synergy_link (struct punch *pk) {
+	pk->io [0].iov_base = &pk->ip6;
+	pk->io [1].iov_base = &pk->rawmsg;
+	pk->mgh.msg_name = &pk->rawnm;
+	if (pk->hdrincl) {
+		pk->mgh.msg_iov = &pk->io [0];
+		pk->mgh.msg_iovlen = 2;
+		pk->mgh.msg_control = NULL;
+		pk->mgh.msg_controllen = 0;
+	} else {
+		pk->mgh.msg_iov = &pk->io [1];
+		pk->mgh.msg_iovlen = 1;
+		pk->mgh.msg_control = &pk->hlm;
+		pk->mgh.msg_controllen = sizeof (pk->hlm);
+	}
+}
+
+
+/* Set the hop limit of a prepared punch, in its IPv6 header and, unless we
+ * send that header, in the control data for the kernel.
+ */
+static void synergy_hoplimit (struct punch *pk, uint8_t hoplimit) {
+	pk->ip6.ip6_hlim = hoplimit;
+	if (!pk->hdrincl) {
+		* (int *) CMSG_DATA (CMSG_FIRSTHDR (&pk->mgh)) = hoplimit;
+	}
+}
+
+
+/* Describe a socket for its punches: the protocol, which follows from its
+ * type, and the local address and port.  The address is left as it is,
+ * even when the socket is not bound to one yet.
+ */
+int synergy_describe (int sockfd, struct synergy_hint *hint) {
+	struct sockaddr_in6 local;
+	int type;
+	socklen_t namesz = sizeof (local);
+	socklen_t typesz = sizeof (type);
 	if (getsockname (sockfd, (struct sockaddr *) &local, &namesz)) {
 		return -1;
 	}
@@ -118,144 +505,504 @@ int synergy_privileged (int sockfd, uint8_t hoplimit, struct sockaddr_in6 *symcl
 		errno = EAFNOSUPPORT;
 		return -1;
 	}
-	if (symcli == NULL) {
-		if (getpeername (sockfd, (struct sockaddr *) &remot, &namesz)) {
-			return -1;
-		}
-		symcli = &remot;
-	}
 	if (getsockopt (sockfd, SOL_SOCKET, SO_TYPE, &type, &typesz)) {
 		return -1;
 	}
 	if (type == SOCK_STREAM) {
-		proto = IPPROTO_TCP;
+		hint->proto = IPPROTO_TCP;
 	} else if (type == SOCK_DGRAM) {
-		proto = IPPROTO_UDP;
+		hint->proto = IPPROTO_UDP;
 	} else if (type == SOCK_SEQPACKET) {
-		proto = IPPROTO_SCTP;
+		hint->proto = IPPROTO_SCTP;
 	} else {
 		errno = EBADF;
 		return -1;
 	}
+	memcpy (&hint->local, &local.sin6_addr, sizeof (hint->local));
+	hint->scope = local.sin6_scope_id;
+	hint->localport = local.sin6_port;
+	return 0;
+}
 
-	// Clean resources and initialise the raw message
-	rawsox = socket (PF_INET6, SOCK_RAW, proto);
-	if (rawsox == -1) {
+
+/* Prepare a punch for a socket, but do not send it yet.  This collects the
+ * addresses and the protocol from the socket, unless hints provide them,
+ * and patches them into the template for the protocol.
+ */
+static int synergy_prepare (struct punch *pk, int sockfd, uint8_t hoplimit, struct sockaddr_in6 *symcli, const struct synergy_hint *hint) {
+	struct sockaddr_in6 local, remot;
+	struct synergy_hint found;
+	int idx;
+	socklen_t namesz = sizeof (remot);
+
+	//
+	// Fetch information, and ensure that it is proper
+	if ((hint == NULL) || (hint->proto == 0)) {
+		if (synergy_describe (sockfd, &found) == -1) {
+			return -1;
+		}
+		hint = &found;
+	}
+	if (symcli == NULL) {
+		if (getpeername (sockfd, (struct sockaddr *) &remot, &namesz)) {
+			return -1;
+		}
+		symcli = &remot;
+	}
+	memset (&local, 0, sizeof (local));
+	memcpy (&local.sin6_addr, &hint->local, sizeof (local.sin6_addr));
+	local.sin6_port = hint->localport;
+	local.sin6_scope_id = hint->scope;
+	if (IN6_IS_ADDR_UNSPECIFIED (&local.sin6_addr)) {
+		if (synergy_route_source (symcli, &local.sin6_addr) == -1) {
+			return -1;
+		}
+	}
+	pk->proto = hint->proto;
+	if (synergy_rawindex (pk->proto) < 0) {
+		errno = EPROTONOSUPPORT;
 		return -1;
 	}
-	memset (&rawmsg, 0, sizeof (rawmsg));
 
 	//
-	// Construct TCP or UDP header
-	struct iovec io [1];
-	switch (proto) {
+	// Start from the template, and patch in the ports; TCP, UDP and
+	// SCTP all start with the source and destination port
+	pthread_once (&tmplonce, synergy_template_setup);
+	idx = synergy_rawindex (pk->proto);
+	memcpy (&pk->rawmsg, &rawtmpl [idx].rawmsg, sizeof (pk->rawmsg));
+	pk->rawmsg.tcppkt.hdr.source = local.sin6_port;
+	pk->rawmsg.tcppkt.hdr.dest   = symcli->sin6_port;
+	pk->io [1].iov_len = rawtmpl [idx].len;
+
+	memcpy (&pk->rawnm, symcli, sizeof (struct sockaddr_in6));
+	pk->rawnm.sin6_port = htons (0);	/* Socket defines IPPROTO_xxx */
+
+	pk->hdrincl = __atomic_load_n (&rawhdrincl, __ATOMIC_ACQUIRE);
+	pk->mgh.msg_namelen = sizeof (pk->rawnm);
+	pk->mgh.msg_flags = 0;
+	synergy_link (pk);
+
+	//
+	// Construct the IPv6 header, which is only sent in some modes
+	pk->io [0].iov_len = sizeof (pk->ip6);
+	pk->ip6.ip6_flow = htonl (0x60000000);
+	pk->ip6.ip6_plen = htons (pk->io [1].iov_len);
+	pk->ip6.ip6_nxt  = pk->proto;
+	memcpy (&pk->ip6.ip6_src, &local.sin6_addr, sizeof (pk->ip6.ip6_src));
+	memcpy (&pk->ip6.ip6_dst, &symcli->sin6_addr, sizeof (pk->ip6.ip6_dst));
+	if (!pk->hdrincl) {
+		//
+		// Have the kernel set the hop limit, and send from the address
+		// that the checksum covers
+		struct msghdr *mgh = &pk->mgh;
+		struct cmsghdr *cmg;
+		struct in6_pktinfo *pki;
+		memset (&pk->hlm, 0, sizeof (pk->hlm));
+		cmg = CMSG_FIRSTHDR (mgh);
+		cmg->cmsg_len = CMSG_LEN (sizeof (int));
+		cmg->cmsg_level = IPPROTO_IPV6;
+		cmg->cmsg_type = IPV6_HOPLIMIT;
+		cmg = CMSG_NXTHDR (mgh, cmg);
+		cmg->cmsg_len = CMSG_LEN (sizeof (struct in6_pktinfo));
+		cmg->cmsg_level = IPPROTO_IPV6;
+		cmg->cmsg_type = IPV6_PKTINFO;
+		pki = (struct in6_pktinfo *) CMSG_DATA (cmg);
+		memcpy (&pki->ipi6_addr, &local.sin6_addr, sizeof (pki->ipi6_addr));
+		if (IN6_IS_ADDR_LINKLOCAL (&local.sin6_addr)) {
+			pki->ipi6_ifindex = local.sin6_scope_id;
+		}
+	}
+	synergy_hoplimit (pk, hoplimit);
+
+	pk->addrsum = synergy_csum_addrs (&local.sin6_addr, &symcli->sin6_addr);
+	synergy_checksum (pk);
+
+	return 0;
+}
+
+
+/* Trace a prepared punch, or a request that could not be prepared.
+ */
+static void synergy_trace_punch (uint8_t event, struct punch *pk, int error) {
+	synergy_trace (event, &pk->ip6.ip6_src, pk->rawmsg.tcppkt.hdr.source,
+			&pk->ip6.ip6_dst, pk->rawmsg.tcppkt.hdr.dest,
+			pk->proto, pk->ip6.ip6_hlim, error);
+}
+
+static void synergy_trace_request (uint8_t event, struct sockaddr_in6 *symcli, uint8_t hoplimit, int error) {
+	if (symcli == NULL) {
+		synergy_trace (event, NULL, 0, NULL, 0, 0, hoplimit, error);
+	} else {
+		synergy_trace (event, NULL, 0, &symcli->sin6_addr, symcli->sin6_port, 0, hoplimit, error);
+	}
+}
+
+
+/* Set the marker and hop limit of a copy of a prepared punch, and point its
+ * message to its own fields.  The marker goes into the TCP sequence number,
+ * the SCTP initial TSN, or a UDP payload word; these are all quoted in the
+ * ICMPv6 errors that the punch draws, and the TCP marker returns in the
+ * acknowledgement of a RST.
+ */
+static void synergy_mark (struct punch *pk, uint8_t hoplimit, uint32_t marker) {
+	union rawmsg *rawmsg = &pk->rawmsg;
+	switch (pk->proto) {
 	case IPPROTO_TCP:
-		rawmsg.tcppkt.hdr.source = local.sin6_port;
-		rawmsg.tcppkt.hdr.dest   = symcli->sin6_port;
-		rawmsg.tcppkt.hdr.doff   = 5;
-		rawmsg.tcppkt.hdr.syn    = 1; // Sending SYN is the main purpose
-		io->iov_base = &rawmsg.tcppkt;
-		io->iov_len = sizeof (rawmsg.tcppkt);
+		rawmsg->tcppkt.hdr.seq = htonl (marker);
 		break;
 	case IPPROTO_UDP:
-		// TODO: Checksum not calculated by kernel?
-		rawmsg.udppkt.hdr.source = local.sin6_port;
-		rawmsg.udppkt.hdr.dest   = symcli->sin6_port;
-		rawmsg.udppkt.hdr.len    = htons (8);
-		io->iov_base = &rawmsg.udppkt;
-		io->iov_len = sizeof (rawmsg.udppkt);
+		rawmsg->udppkt.marker = htonl (marker);
+		rawmsg->udppkt.hdr.len = htons (sizeof (rawmsg->udppkt));
+		pk->io [1].iov_len = sizeof (rawmsg->udppkt);
+		pk->ip6.ip6_plen = htons (sizeof (rawmsg->udppkt));
 		break;
 	case IPPROTO_SCTP:
-		rawmsg.sctppkt.hdr.source = local.sin6_port;
-		rawmsg.sctppkt.hdr.dest   = symcli->sin6_port;
-		rawmsg.sctppkt.hdr.vfytag = 0;      /* Because we send INIT */
-		rawmsg.sctppkt.hdr.cksum  = 0;  /* Assume offload to kernel */
-		rawmsg.sctppkt.ch1.type   = 1;                      /* INIT */
-		rawmsg.sctppkt.ch1.flags  = 0;                  /* No flags */
-		rawmsg.sctppkt.ch1.length = htons (sizeof (rawmsg.sctppkt.ch1));
-		rawmsg.sctppkt.ch1.val.initag = 0;  /* Illegal, would ABORT */
-		rawmsg.sctppkt.ch1.val.advwin = htonl (1024);  /* Arbitrary */
-		rawmsg.sctppkt.ch1.val.numout = htons (1);     /* Arbitrary */
-		rawmsg.sctppkt.ch1.val.numin  = htons (1);     /* Arbitrary */
-		rawmsg.sctppkt.ch1.val.initsn = 0;             /* Arbitrary */
-		io->iov_base = &rawmsg.sctppkt;
-		io->iov_len = sizeof (rawmsg.sctppkt);
+		rawmsg->sctppkt.ch1.val.initsn = htonl (marker);
 		break;
 	}
+	synergy_link (pk);
+	synergy_hoplimit (pk, hoplimit);
+	synergy_checksum (pk);
+}
 
-	memcpy (&rawnm, symcli, sizeof (struct sockaddr_in6));
-	rawnm.sin6_port = htons (0);	/* Socket defines IPPROTO_xxx */
 
-	struct msghdr mgh;
-	hoplimiter hlm;
-	mgh.msg_name = &rawnm;
-	mgh.msg_namelen = sizeof (rawnm);
-	mgh.msg_iov = io;
-	mgh.msg_iovlen = 1;
-	mgh.msg_control = &hlm;
-	mgh.msg_controllen = sizeof (hlm);
-	mgh.msg_flags = MSG_NOSIGNAL;
-
-	memset (&hlm, 0, sizeof (hlm));
-	struct cmsghdr *cmg;
-	cmg = CMSG_FIRSTHDR (&mgh);
-	cmg->cmsg_len = CMSG_LEN (sizeof (int));
-	cmg->cmsg_level = IPPROTO_IPV6;
-	cmg->cmsg_type = IPV6_HOPLIMIT;
-	* (int *) CMSG_DATA (cmg) = hoplimit;
+/* Send a burst of probes for hop limits 1 to maxhop, each marked with the
+ * given base plus its hop limit.  This is the sending half of synergy_probe().
+ */
+int synergy_probe_send (int sockfd, struct sockaddr_in6 *symcli, uint8_t maxhop, uint32_t base) {
+	struct punch proto;
+	struct punch pk [SYNERGY_PRIVILEGED_CHUNK];
+	struct mmsghdr mm [SYNERGY_PRIVILEGED_CHUNK];
+	unsigned int hop, chunk, i;
+	int rawsox;
+	int sent;
+	if (synergy_prepare (&proto, sockfd, 1, symcli, NULL) == -1) {
+		synergy_trace_request (SYNERGY_TRACE_PROBE, symcli, maxhop, errno);
+		return -1;
+	}
+	rawsox = synergy_rawsocket (proto.proto);
+	if (rawsox == -1) {
+		synergy_trace_punch (SYNERGY_TRACE_PROBE, &proto, errno);
+		return -1;
+	}
+	for (hop = 1; hop <= maxhop; hop += chunk) {
+		chunk = maxhop + 1 - hop;
+		if (chunk > SYNERGY_PRIVILEGED_CHUNK) {
+			chunk = SYNERGY_PRIVILEGED_CHUNK;
+		}
+		for (i = 0; i < chunk; i++) {
+			memcpy (&pk [i], &proto, sizeof (proto));
+			synergy_mark (&pk [i], hop + i, base + hop + i);
+			memcpy (&mm [i].msg_hdr, &pk [i].mgh, sizeof (struct msghdr));
+			mm [i].msg_len = 0;
+		}
+		i = 0;
+		while (i < chunk) {
+			sent = sendmmsg (rawsox, &mm [i], chunk - i, MSG_NOSIGNAL);
+			if (sent == -1) {
+				synergy_trace_punch (SYNERGY_TRACE_PROBE, &pk [i], errno);
+				return -1;
+			}
+			while (sent-- > 0) {
+				synergy_trace_punch (SYNERGY_TRACE_PROBE, &pk [i++], 0);
+			}
+		}
+	}
+	return 0;
+}
+
+
+/* Send one probe that is marked, at the hop limit of the punch, from the
+ * local end in the hint.  This is how the workers of synergy.d send the
+ * probes that they interleave with punches.
+ */
+int synergy_marked_hinted (struct synergy_punch *punch, const struct synergy_hint *hint, uint32_t marker) {
+	struct punch pk;
+	int rawsox;
+	if (synergy_prepare (&pk, punch->sockfd, 1, punch->symcli, hint) == -1) {
+		punch->status = errno;
+		punch->proto = 0;
+		synergy_trace_request (SYNERGY_TRACE_PROBE, punch->symcli, punch->hoplimit, errno);
+		return -1;
+	}
+	punch->proto = pk.proto;
+	synergy_mark (&pk, punch->hoplimit, marker);
+	rawsox = synergy_rawsocket (pk.proto);
+	if ((rawsox == -1) || (sendmsg (rawsox, &pk.mgh, MSG_NOSIGNAL) == -1)) {
+		punch->status = errno;
+		synergy_trace_punch (SYNERGY_TRACE_PROBE, &pk, errno);
+		return -1;
+	}
+	punch->status = 0;
+	synergy_trace_punch (SYNERGY_TRACE_PROBE, &pk, 0);
+	return 0;
+}
+
+
+/* Build a punch as a complete IPv6 packet, for transmit paths that do not
+ * use the RAW sockets.  The buffer must hold at least SYNERGY_PACKET_MAX
+ * bytes.
+ */
+ssize_t synergy_packet (int sockfd, uint8_t hoplimit, struct sockaddr_in6 *symcli, void *buf, size_t buflen) {
+	return synergy_packet_hinted (sockfd, NULL, hoplimit, symcli, buf, buflen);
+}
+
+ssize_t synergy_packet_hinted (int sockfd, const struct synergy_hint *hint, uint8_t hoplimit, struct sockaddr_in6 *symcli, void *buf, size_t buflen) {
+	struct punch pk;
+	if (buflen < SYNERGY_PACKET_MAX) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if (synergy_prepare (&pk, sockfd, hoplimit, symcli, hint) == -1) {
+		return -1;
+	}
+	memcpy (buf, &pk.ip6, sizeof (pk.ip6));
+	memcpy ((uint8_t *) buf + sizeof (pk.ip6), &pk.rawmsg, pk.io [1].iov_len);
+	return sizeof (pk.ip6) + pk.io [1].iov_len;
+}
+
+
+/* The privileged version of our API call directly works on a RAW socket; this
+ * is also the version used inside the daemon.
+ */
+int synergy_privileged (int sockfd, uint8_t hoplimit, struct sockaddr_in6 *symcli) {
+	struct punch pk;
+	int rawsox;
+
+	//
+	// Construct the packet and find the cached raw socket
+	if (synergy_prepare (&pk, sockfd, hoplimit, symcli, NULL) == -1) {
+		synergy_trace_request (SYNERGY_TRACE_PRIVILEGED, symcli, hoplimit, errno);
+		return -1;
+	}
+	rawsox = synergy_rawsocket (pk.proto);
+	if (rawsox == -1) {
+		synergy_trace_punch (SYNERGY_TRACE_PRIVILEGED, &pk, errno);
+		return -1;
+	}
 
 	//
-	// Have checksums calculated by the kernel and send the message
-	if (sendmsg (rawsox, &mgh, MSG_NOSIGNAL) == -1) {
+	// Send the message, with the checksum already in place
+	if (sendmsg (rawsox, &pk.mgh, MSG_NOSIGNAL) == -1) {
+		synergy_trace_punch (SYNERGY_TRACE_PRIVILEGED, &pk, errno);
 		return -1;
 	}
 
-	close (rawsox);
+	synergy_trace_punch (SYNERGY_TRACE_PRIVILEGED, &pk, 0);
 	return 0;
 }
 
 
-/* The daemonised version of the API call will forward the request to a daemon
- * process that runs privileged.  It will not receive feedback on success or
- * failure of the actual RAW send, but may yield feedback on asking the daemon.
+/* Send a number of prepared punches of one protocol with sendmmsg().  The
+ * kernel stops at the first failing message; that one is marked with the
+ * error and sending continues after it.
  */
-int synergy_daemonised (int sockfd, uint8_t hoplimit, struct sockaddr_in6 *symcli) {
+static void synergy_sendmany (int rawsox, struct punch *pk, struct synergy_punch *punches, int *todo, unsigned int todocnt) {
+	struct mmsghdr mm [SYNERGY_PRIVILEGED_CHUNK];
+	unsigned int i;
+	int sent;
+	if (rawsox == -1) {
+		for (i = 0; i < todocnt; i++) {
+			punches [todo [i]].status = errno;
+		}
+		return;
+	}
+	for (i = 0; i < todocnt; i++) {
+		memcpy (&mm [i].msg_hdr, &pk [todo [i]].mgh, sizeof (struct msghdr));
+		mm [i].msg_len = 0;
+	}
+	i = 0;
+	while (i < todocnt) {
+		sent = sendmmsg (rawsox, &mm [i], todocnt - i, MSG_NOSIGNAL);
+		if (sent == -1) {
+			punches [todo [i]].status = errno;
+			i++;
+			continue;
+		}
+		while (sent-- > 0) {
+			punches [todo [i++]].status = 0;
+		}
+	}
+}
+
+
+/* The privileged version of the batch call constructs all packets, and then
+ * sends them with one sendmmsg() call per protocol.  This is done in chunks
+ * to keep the work on the stack.  The RAW sockets are taken from the given
+ * set or, when it is NULL, from the process-wide cache.  The hints, if any,
+ * run parallel to the punches.
+ */
+static int synergy_privileged_many_on (struct synergy_rawset *rs, struct synergy_punch *punches, const struct synergy_hint *hints, unsigned int count) {
+	struct punch pk [SYNERGY_PRIVILEGED_CHUNK];
+	int todo [3] [SYNERGY_PRIVILEGED_CHUNK];
+	unsigned int todocnt [3];
+	unsigned int base, chunk, i;
+	int failed = 0;
+	for (base = 0; base < count; base += chunk) {
+		chunk = count - base;
+		if (chunk > SYNERGY_PRIVILEGED_CHUNK) {
+			chunk = SYNERGY_PRIVILEGED_CHUNK;
+		}
+		//
+		// Prepare all punches, and sort them by protocol
+		memset (todocnt, 0, sizeof (todocnt));
+		for (i = 0; i < chunk; i++) {
+			struct synergy_punch *p = &punches [base + i];
+			p->proto = 0;
+			if (synergy_prepare (&pk [i], p->sockfd, p->hoplimit, p->symcli,
+					(hints != NULL) ? &hints [base + i] : NULL) == -1) {
+				p->status = errno;
+				continue;
+			}
+			p->proto = pk [i].proto;
+			int idx = synergy_rawindex (pk [i].proto);
+			todo [idx] [todocnt [idx]++] = i;
+		}
+		//
+		// Send the punches per protocol, and collect the results
+		for (i = 0; i < 3; i++) {
+			if (todocnt [i] == 0) {
+				continue;
+			}
+			int rawsox;
+			if (rs != NULL) {
+				rawsox = rs->sox [i];
+				errno = EBADF;
+			} else {
+				rawsox = synergy_rawsocket (rawproto [i]);
+			}
+			synergy_sendmany (rawsox, pk, punches + base,
+					todo [i], todocnt [i]);
+		}
+		//
+		// Trace the punches of this chunk, including those not prepared
+		for (i = 0; i < chunk; i++) {
+			struct synergy_punch *p = &punches [base + i];
+			if (p->proto == 0) {
+				synergy_trace_request (SYNERGY_TRACE_PRIVILEGED, p->symcli, p->hoplimit, p->status);
+			} else {
+				synergy_trace_punch (SYNERGY_TRACE_PRIVILEGED, &pk [i], p->status);
+			}
+		}
+	}
 	//
-	// When no symcli address is provided, find it from
-	struct sockaddr_in6 remot;
-	socklen_t namesz = sizeof (remot);
-	if (symcli == NULL) {
-		if (getpeername (sockfd, (struct sockaddr *) &remot, &namesz)) {
+	// Report the first error, if any
+	for (i = 0; i < count; i++) {
+		if (punches [i].status != 0) {
+			errno = punches [i].status;
+			failed = 1;
+			break;
+		}
+	}
+	return failed ? -1 : 0;
+}
+
+
+int synergy_privileged_many (struct synergy_punch *punches, unsigned int count) {
+	return synergy_privileged_many_on (NULL, punches, NULL, count);
+}
+
+
+/* Open a private set of RAW sockets, one per protocol.  This is useful
+ * for threads that would rather not share the process-wide cache.
+ */
+int synergy_rawset_open (struct synergy_rawset *rs) {
+	int i;
+	for (i = 0; i < 3; i++) {
+		rs->sox [i] = -1;
+	}
+	for (i = 0; i < 3; i++) {
+		rs->sox [i] = synergy_rawopen (rawproto [i]);
+		if (rs->sox [i] == -1) {
+			int err = errno;
+			synergy_rawset_close (rs);
+			errno = err;
 			return -1;
 		}
-		symcli = &remot;
 	}
+	return 0;
+}
+
+
+void synergy_rawset_close (struct synergy_rawset *rs) {
+	int i;
+	for (i = 0; i < 3; i++) {
+		if (rs->sox [i] >= 0) {
+			close (rs->sox [i]);
+			rs->sox [i] = -1;
+		}
+	}
+}
+
+
+/* The batch call on a private set of RAW sockets.
+ */
+int synergy_rawset_many (struct synergy_rawset *rs, struct synergy_punch *punches, unsigned int count) {
+	return synergy_privileged_many_on (rs, punches, NULL, count);
+}
+
+int synergy_rawset_hinted (struct synergy_rawset *rs, struct synergy_punch *punches, const struct synergy_hint *hints, unsigned int count) {
+	return synergy_privileged_many_on (rs, punches, hints, count);
+}
+
+
+/* Fill in a request to the daemon, with the hints that save it from
+ * asking the kernel.  When no symcli address is provided, it is found from
+ * the socket.
+ */
+int synergy_wire_fill (struct synergy_wire_request *wr, int sockfd, uint8_t hoplimit, struct sockaddr_in6 *symcli) {
+	struct synergy_hint hint;
+	socklen_t namesz = sizeof (wr->symcli);
+	memset (wr, 0, sizeof (*wr));
+	if (synergy_describe (sockfd, &hint) == -1) {
+		return -1;
+	}
+	if (symcli != NULL) {
+		memcpy (&wr->symcli, symcli, sizeof (wr->symcli));
+	} else if (getpeername (sockfd, (struct sockaddr *) &wr->symcli, &namesz)) {
+		return -1;
+	}
+	memcpy (&wr->local, &hint.local, sizeof (wr->local));
+	wr->localport = hint.localport;
+	wr->proto = hint.proto;
+	wr->hoplimit = hoplimit;
+	return 0;
+}
+
+
+/* Send a number of requests with their sockets in one message to the daemon.
+ * At most SYNERGY_BATCH_MAX requests and sockets can be sent at once.
+ */
+static int synergy_daemon_send (struct synergy_wire_request *req, unsigned int count, int *fds, unsigned int fdcnt) {
 	//
-	// Construct the request
-	char anc [CMSG_SPACE (sizeof (int))];
-	struct synergy_request_message req;
-	struct iovec iov;
+	// Construct the message
+	char anc [CMSG_SPACE (sizeof (int) * SYNERGY_BATCH_MAX)];
+	struct synergy_wire_header hdr;
+	struct iovec iov [2];
 	struct msghdr mgh;
 	struct cmsghdr *cmg;
 	memset (&anc, 0, sizeof (anc));
-	memset (&req, 0, sizeof (req));
-	memset (&iov, 0, sizeof (iov));
+	memset (&hdr, 0, sizeof (hdr));
 	memset (&mgh, 0, sizeof (mgh));
-	iov.iov_len = sizeof (req);
-	iov.iov_base = &req;
-	mgh.msg_iovlen = 1;
-	mgh.msg_iov = &iov;
-	mgh.msg_controllen = sizeof (anc);
+	hdr.magic = SYNERGY_WIRE_MAGIC;
+	hdr.version = SYNERGY_WIRE_VERSION;
+	hdr.count = count;
+	hdr.entsize = sizeof (*req);
+	iov [0].iov_base = &hdr;
+	iov [0].iov_len = sizeof (hdr);
+	iov [1].iov_base = req;
+	iov [1].iov_len = sizeof (*req) * count;
+	mgh.msg_iovlen = 2;
+	mgh.msg_iov = iov;
+	mgh.msg_controllen = CMSG_SPACE (sizeof (int) * fdcnt);
 	mgh.msg_control = &anc;
 	//
-	// Fill the request data fields
+	// Attach the sockets as ancillary data
 	cmg = CMSG_FIRSTHDR (&mgh);
 	cmg->cmsg_level = SOL_SOCKET;
 	cmg->cmsg_type = SCM_RIGHTS;
-	cmg->cmsg_len = CMSG_LEN (sizeof (int));
-	* (int *) CMSG_DATA (cmg) = sockfd;
-	req.hoplimit = hoplimit;
-	memcpy (&req.symcli, symcli, sizeof (req.symcli));
+	cmg->cmsg_len = CMSG_LEN (sizeof (int) * fdcnt);
+	memcpy (CMSG_DATA (cmg), fds, sizeof (int) * fdcnt);
 	//
 	// Send the message to the daemon
 	int sox = socket (PF_UNIX, SOCK_DGRAM, 0);
@@ -283,14 +1030,186 @@ int synergy_daemonised (int sockfd, uint8_t hoplimit, struct sockaddr_in6 *symcl
 }
 
 
+/* Ask the kernel to pass a punch to synergy.d, through the eBPF program that
+ * the daemon attached to our cgroup.  A process outside such a cgroup learns
+ * so from its first attempt, and does not try again until synergy_fini().
+ */
+static int synergy_sockopt (int sockfd, uint8_t hoplimit, struct sockaddr_in6 *symcli) {
+	struct synergy_sockopt_punch sop;
+	if (__atomic_load_n (&sockoptable, __ATOMIC_ACQUIRE) < 0) {
+		errno = ENOPROTOOPT;
+		return -1;
+	}
+	memset (&sop, 0, sizeof (sop));
+	if (symcli != NULL) {
+		memcpy (&sop.symcli, symcli, sizeof (sop.symcli));
+	}
+	sop.hoplimit = hoplimit;
+	if (setsockopt (sockfd, SOL_SYNERGY, SYNERGY_SO_PUNCH, &sop, sizeof (sop)) == -1) {
+		if (errno == ENOPROTOOPT) {
+			__atomic_store_n (&sockoptable, -1, __ATOMIC_RELEASE);
+		}
+		return -1;
+	}
+	__atomic_store_n (&sockoptable, 1, __ATOMIC_RELEASE);
+	synergy_trace_request (SYNERGY_TRACE_SOCKOPT, symcli, hoplimit, 0);
+	return 0;
+}
+
+
+/* The daemonised version of the API call will forward the request to a daemon
+ * process that runs privileged.  It will not receive feedback on success or
+ * failure of the actual RAW send, but may yield feedback on asking the daemon.
+ */
+int synergy_daemonised (int sockfd, uint8_t hoplimit, struct sockaddr_in6 *symcli) {
+	struct synergy_wire_request req;
+	int retval;
+	//
+	// Construct the request with its hints, and send it
+	if (synergy_wire_fill (&req, sockfd, hoplimit, symcli) == -1) {
+		synergy_trace_request (SYNERGY_TRACE_DAEMONISED, symcli, hoplimit, errno);
+		return -1;
+	}
+	retval = synergy_daemon_send (&req, 1, &sockfd, 1);
+	synergy_trace_request (SYNERGY_TRACE_DAEMONISED, &req.symcli, hoplimit, retval ? errno : 0);
+	return retval;
+}
+
+
+/* The daemonised version of the batch call sends up to SYNERGY_BATCH_MAX
+ * requests in each message to the daemon.  The status only reflects whether
+ * the request was delivered, as the daemon does not respond.  A socket that
+ * occurs more than once is passed once, and is described only once.  All
+ * requests get the same deadline, if any.
+ */
+static int synergy_daemonised_batch (struct synergy_punch *punches, unsigned int count, uint16_t deadline_ms) {
+	struct synergy_wire_request req [SYNERGY_BATCH_MAX];
+	int fds [SYNERGY_BATCH_MAX];
+	unsigned int base, i, j, reqcnt, fdcnt;
+	int idx [SYNERGY_BATCH_MAX];
+	int failed = 0;
+	for (base = 0; base < count; base += SYNERGY_BATCH_MAX) {
+		//
+		// Collect the requests, describing every socket once
+		reqcnt = 0;
+		fdcnt = 0;
+		for (i = base; (i < count) && (i < base + SYNERGY_BATCH_MAX); i++) {
+			struct synergy_punch *p = &punches [i];
+			struct synergy_wire_request *wr = &req [reqcnt];
+			p->status = 0;
+			p->proto = 0;
+			for (j = 0; j < fdcnt; j++) {
+				if (fds [j] == p->sockfd) {
+					break;
+				}
+			}
+			if (j < fdcnt) {
+				//
+				// Reuse the hints of the socket, but not its peer
+				unsigned int k = 0;
+				socklen_t namesz = sizeof (wr->symcli);
+				while (req [k].fdindex != j) {
+					k++;
+				}
+				memcpy (wr, &req [k], sizeof (*wr));
+				wr->hoplimit = p->hoplimit;
+				if (p->symcli != NULL) {
+					memcpy (&wr->symcli, p->symcli, sizeof (wr->symcli));
+				} else if (getpeername (p->sockfd, (struct sockaddr *) &wr->symcli, &namesz)) {
+					p->status = errno;
+					synergy_trace_request (SYNERGY_TRACE_DAEMONISED, p->symcli, p->hoplimit, errno);
+					continue;
+				}
+			} else if (synergy_wire_fill (wr, p->sockfd, p->hoplimit, p->symcli) == -1) {
+				p->status = errno;
+				synergy_trace_request (SYNERGY_TRACE_DAEMONISED, p->symcli, p->hoplimit, errno);
+				continue;
+			} else {
+				fds [fdcnt++] = p->sockfd;
+			}
+			wr->fdindex = j;
+			wr->deadline_ms = deadline_ms;
+			idx [reqcnt] = i;
+			reqcnt++;
+		}
+		//
+		// Send the collected requests in one message; the sockets were
+		// all described, so a failure applies to the whole message
+		if ((reqcnt > 0) && (synergy_daemon_send (req, reqcnt, fds, fdcnt) == -1)) {
+			int err = errno;
+			for (i = 0; i < reqcnt; i++) {
+				punches [idx [i]].status = err;
+			}
+		}
+		for (i = 0; i < reqcnt; i++) {
+			synergy_trace_request (SYNERGY_TRACE_DAEMONISED, &req [i].symcli,
+					req [i].hoplimit, punches [idx [i]].status);
+		}
+	}
+	//
+	// Report the first error, if any
+	for (i = 0; i < count; i++) {
+		if (punches [i].status != 0) {
+			errno = punches [i].status;
+			failed = 1;
+			break;
+		}
+	}
+	return failed ? -1 : 0;
+}
+
+
+int synergy_daemonised_many (struct synergy_punch *punches, unsigned int count) {
+	return synergy_daemonised_batch (punches, count, 0);
+}
+
+
 /* The normal API call checks whether it can use the privileged version or
- * must go through the daemon, and do precisely that.
+ * must go through the daemon, and do precisely that.  Processes that hold
+ * CAP_NET_RAW without being root also take the privileged path.  Others
+ * first try to reach the daemon through the kernel, with SYNERGY_SO_PUNCH.
+ * A hoplimit of 0 is looked up in the hop cache first; when that has
+ * nothing, the daemon chooses, or we guess.
  */
 int synergy (int sockfd, uint8_t hoplimit, struct sockaddr_in6 *symcli) {
-	if (geteuid () == 0) {
+	if (hoplimit == 0) {
+		hoplimit = synergy_hopauto (symcli);
+	}
+	if (synergy_rawable ()) {
+		if (hoplimit == 0) {
+			hoplimit = SYNERGY_HOPLIMIT_GUESS;
+		}
 		return synergy_privileged (sockfd, hoplimit, symcli);
+	} else if (synergy_sockopt (sockfd, hoplimit, symcli) == 0) {
+		return 0;
 	} else {
 		return synergy_daemonised (sockfd, hoplimit, symcli);
 	}
 }
 
+
+/* The batch API call makes the same choice as synergy(), but then for a
+ * whole array of punches at once.  Hop limits of 0 are filled in, in the
+ * punches themselves.  Only synergy.d has a use for the deadline.
+ */
+int synergy_many (struct synergy_punch *punches, unsigned int count) {
+	return synergy_many_deadline (punches, count, 0);
+}
+
+int synergy_many_deadline (struct synergy_punch *punches, unsigned int count, uint16_t deadline_ms) {
+	int raw = synergy_rawable ();
+	unsigned int i;
+	for (i = 0; i < count; i++) {
+		if (punches [i].hoplimit == 0) {
+			punches [i].hoplimit = synergy_hopauto (punches [i].symcli);
+			if ((punches [i].hoplimit == 0) && raw) {
+				punches [i].hoplimit = SYNERGY_HOPLIMIT_GUESS;
+			}
+		}
+	}
+	if (raw) {
+		return synergy_privileged_many (punches, count);
+	} else {
+		return synergy_daemonised_batch (punches, count, deadline_ms);
+	}
+}
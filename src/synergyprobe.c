@@ -0,0 +1,106 @@
+/* synergyprobe.c -- Learn the hop limit range towards a destination
+ *
+ * This tool runs synergy_probe() to learn explicitly which hop limits open
+ * the local firewalls without reaching the remote end.  It prints the
+ * lower and upper bound, where 0 stands for a bound that was not learned.
+ *
+ * Parameters:
+ *  1. The word "sctp", "tcp" or "udp" to signify the protocol to use
+ *  2. The local IPv6 address, or :: to leave it to routing
+ *  3. The local port, or 0 for a fresh one
+ *  4. The remote IPv6 address
+ *  5. The remote port
+ *  6. Optionally, the maximum hop limit to probe
+ *  7. Optionally, the time to wait for replies in milliseconds
+ *
+ * Probes punch holes for the local port, so it is best not to use one
+ * that serves other traffic.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <sys/socketsynergy.h>
+
+
+int main (int argc, char *argv []) {
+	struct sockaddr_in6 local, remot;
+	int cnxtp, proto;
+	int maxhop = SYNERGY_PROBE_MAXHOP;
+	int timeout_ms = 1000;
+	uint8_t lower, upper;
+	int sox;
+	//
+	// Parse parameters
+	memset (&local, 0, sizeof (local));
+	memset (&remot, 0, sizeof (remot));
+	local.sin6_family = AF_INET6;
+	remot.sin6_family = AF_INET6;
+	if ((argc < 6) || (argc > 8)) {
+		fprintf (stderr, "Usage: %s sctp|tcp|udp local-addr local-port remote-addr remote-port [maxhop [timeout_ms]]\n", argv [0]);
+		exit (1);
+	}
+	if (strcmp (argv [1], "sctp") == 0) {
+		cnxtp = SOCK_SEQPACKET;
+		proto = IPPROTO_SCTP;
+	} else if (strcmp (argv [1], "tcp") == 0) {
+		cnxtp = SOCK_STREAM;
+		proto = 0;
+	} else if (strcmp (argv [1], "udp") == 0) {
+		cnxtp = SOCK_DGRAM;
+		proto = 0;
+	} else {
+		fprintf (stderr, "%s: First parameter should be sctp, tcp or udp, not '%s'\n",
+				argv [0], argv [1]);
+		exit (1);
+	}
+	if ((inet_pton (AF_INET6, argv [2], &local.sin6_addr) <= 0)
+			|| (inet_pton (AF_INET6, argv [4], &remot.sin6_addr) <= 0)) {
+		fprintf (stderr, "%s: Failed to parse IPv6 addresses\n", argv [0]);
+		exit (1);
+	}
+	local.sin6_port = htons (atoi (argv [3]));
+	remot.sin6_port = htons (atoi (argv [5]));
+	if (argc > 6) {
+		maxhop = atoi (argv [6]);
+	}
+	if (argc > 7) {
+		timeout_ms = atoi (argv [7]);
+	}
+	if ((maxhop < 1) || (maxhop > 255) || (timeout_ms < 1)) {
+		fprintf (stderr, "%s: Maximum hop limit or timeout out of range\n", argv [0]);
+		exit (1);
+	}
+	//
+	// Bind the socket, so it has a local port to probe with
+	sox = socket (AF_INET6, cnxtp, proto);
+	if (sox == -1) {
+		perror ("Failed to allocate socket");
+		exit (1);
+	}
+	if (bind (sox, (struct sockaddr *) &local, sizeof (local)) == -1) {
+		perror ("Failed to bind socket");
+		exit (1);
+	}
+	//
+	// Probe, and report the bounds
+	if (synergy_probe (sox, &remot, maxhop, timeout_ms, &lower, &upper) == -1) {
+		perror ("Failed to probe hop limits");
+		exit (1);
+	}
+	printf ("lower %d upper %d\n", lower, upper);
+	close (sox);
+	return 0;
+}
@@ -0,0 +1,273 @@
+/* synergystat.c -- Show the metrics of a running synergy.d
+ *
+ * This tool maps the shared memory segment of synergy.d read-only, so it
+ * does not disturb the daemon, and adds up the shards of all its threads.
+ * It prints the requests and punches, the failures by protocol and errno,
+ * and the latency from receipt to send as percentiles.  The latency is
+ * taken from power-of-two buckets, so a percentile is the upper bound of
+ * its bucket.
+ *
+ * Options:
+ *  -j           Print one line of JSON instead of text
+ *  -s           Print every shard, instead of only their sum
+ *  -i seconds   Print the increments every so many seconds, forever
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include "daemon.h"
+
+
+static const char *protonames [METRICS_PROTOS] = {
+	"tcp", "udp", "sctp", "other"
+};
+
+static int json = 0;
+
+
+/* Copy a shard, one counter at a time, with the loads the daemon expects.
+ */
+static void stat_copy (struct metrics_shard *dst, const struct metrics_shard *src) {
+	const uint64_t *s = (const uint64_t *) src;
+	uint64_t *d = (uint64_t *) dst;
+	size_t i;
+	for (i = 0; i < offsetof (struct metrics_shard, latency_ns) / 8 + 1; i++) {
+		d [i] = __atomic_load_n (&s [i], __ATOMIC_RELAXED);
+	}
+}
+
+
+static void stat_add (struct metrics_shard *sum, const struct metrics_shard *ms, int sign) {
+	const uint64_t *s = (const uint64_t *) ms;
+	uint64_t *d = (uint64_t *) sum;
+	size_t i;
+	for (i = 0; i < offsetof (struct metrics_shard, latency_ns) / 8 + 1; i++) {
+		d [i] += sign * s [i];
+	}
+}
+
+
+/* The upper bound in nanoseconds of the bucket that holds a percentile.
+ */
+static uint64_t stat_percentile (const struct metrics_shard *ms, unsigned int pct) {
+	uint64_t want, seen = 0;
+	int b;
+	if (ms->sent == 0) {
+		return 0;
+	}
+	want = (ms->sent * pct + 99) / 100;
+	for (b = 0; b < METRICS_LATENCY_BUCKETS; b++) {
+		seen += ms->latency [b];
+		if (seen >= want) {
+			break;
+		}
+	}
+	return (b == 0) ? 0 : (1ULL << b);
+}
+
+
+static void stat_print (const char *name, const struct metrics_shard *ms, double secs) {
+	const char *sep = "";
+	int i;
+	double mean = (ms->sent > 0) ? ((double) ms->latency_ns) / ms->sent : 0.0;
+	if (json) {
+		printf ("{\"shard\":\"%s\",\"seconds\":%.3f,\"received\":%llu,\"malformed\":%llu,"
+				"\"dropped\":%llu,\"clamped\":%llu,\"learned\":%llu,"
+				"\"registered\":%llu,\"unregistered\":%llu,\"refreshed\":%llu,"
+				"\"throttled\":%llu,\"paced\":%llu,\"expired\":%llu,"
+				"\"sent\":%llu,\"failed\":%llu,\"protocols\":{",
+				name, secs,
+				(unsigned long long) ms->received, (unsigned long long) ms->malformed,
+				(unsigned long long) ms->dropped, (unsigned long long) ms->clamped,
+				(unsigned long long) ms->learned,
+				(unsigned long long) ms->registered, (unsigned long long) ms->unregistered,
+				(unsigned long long) ms->refreshed,
+				(unsigned long long) ms->throttled, (unsigned long long) ms->paced,
+				(unsigned long long) ms->expired,
+				(unsigned long long) ms->sent, (unsigned long long) ms->failed);
+		for (i = 0; i < METRICS_PROTOS; i++) {
+			printf ("%s\"%s\":{\"sent\":%llu,\"failed\":%llu}", (i > 0) ? "," : "",
+					protonames [i],
+					(unsigned long long) ms->proto_sent [i],
+					(unsigned long long) ms->proto_failed [i]);
+		}
+		printf ("},\"errors\":{");
+		for (i = 0; i < METRICS_ERRNOS; i++) {
+			if (ms->errors [i] > 0) {
+				printf ("%s\"%s\":%llu", sep, (i < METRICS_ERRNOS - 1) ? strerror (i) : "other",
+						(unsigned long long) ms->errors [i]);
+				sep = ",";
+			}
+		}
+		printf ("},\"latency_ns\":{\"mean\":%.0f,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"max\":%llu}}\n",
+				mean,
+				(unsigned long long) stat_percentile (ms, 50),
+				(unsigned long long) stat_percentile (ms, 90),
+				(unsigned long long) stat_percentile (ms, 99),
+				(unsigned long long) stat_percentile (ms, 100));
+		return;
+	}
+	printf ("%s, over %.3f seconds:\n", name, secs);
+	printf ("  requests  %12llu received  %12llu malformed  %12llu dropped\n",
+			(unsigned long long) ms->received, (unsigned long long) ms->malformed,
+			(unsigned long long) ms->dropped);
+	printf ("  hoplimits %12llu clamped   %12llu learned\n",
+			(unsigned long long) ms->clamped, (unsigned long long) ms->learned);
+	if (ms->registered + ms->unregistered > 0) {
+		printf ("  refresh   %12llu added     %12llu ended      %12llu punched\n",
+				(unsigned long long) ms->registered, (unsigned long long) ms->unregistered,
+				(unsigned long long) ms->refreshed);
+	}
+	if (ms->throttled + ms->paced > 0) {
+		printf ("  fairness  %12llu throttled %12llu paced\n",
+				(unsigned long long) ms->throttled, (unsigned long long) ms->paced);
+	}
+	if (ms->expired > 0) {
+		printf ("  deadlines %12llu expired\n",
+				(unsigned long long) ms->expired);
+	}
+	printf ("  punches   %12llu sent      %12llu failed\n",
+			(unsigned long long) ms->sent, (unsigned long long) ms->failed);
+	for (i = 0; i < METRICS_PROTOS; i++) {
+		if (ms->proto_sent [i] + ms->proto_failed [i] > 0) {
+			printf ("  %-9s %12llu sent      %12llu failed\n", protonames [i],
+					(unsigned long long) ms->proto_sent [i],
+					(unsigned long long) ms->proto_failed [i]);
+		}
+	}
+	for (i = 0; i < METRICS_ERRNOS; i++) {
+		if (ms->errors [i] > 0) {
+			printf ("  failed    %12llu times with %s\n", (unsigned long long) ms->errors [i],
+					(i < METRICS_ERRNOS - 1) ? strerror (i) : "another error");
+		}
+	}
+	if (ms->sent > 0) {
+		printf ("  latency   mean %.0f ns, p50 <%llu ns, p90 <%llu ns, p99 <%llu ns, max <%llu ns\n",
+				mean,
+				(unsigned long long) stat_percentile (ms, 50),
+				(unsigned long long) stat_percentile (ms, 90),
+				(unsigned long long) stat_percentile (ms, 99),
+				(unsigned long long) stat_percentile (ms, 100));
+	}
+}
+
+
+/* Take a snapshot of the shards, and of their sum in the last one.
+ */
+static void stat_snapshot (const struct metrics *seg, struct metrics_shard *snap, unsigned int shards) {
+	unsigned int i;
+	memset (&snap [shards], 0, sizeof (snap [shards]));
+	for (i = 0; i < shards; i++) {
+		stat_copy (&snap [i], &seg->shard [i]);
+		stat_add (&snap [shards], &snap [i], 1);
+	}
+}
+
+
+static void stat_report (struct metrics_shard *snap, unsigned int shards, int pershard, double secs) {
+	char name [32];
+	unsigned int i;
+	if (pershard) {
+		for (i = 0; i < shards; i++) {
+			if (i == 0) {
+				snprintf (name, sizeof (name), "main");
+			} else {
+				snprintf (name, sizeof (name), "worker%u", i - 1);
+			}
+			stat_print (name, &snap [i], secs);
+		}
+	}
+	stat_print ("total", &snap [shards], secs);
+	fflush (stdout);
+}
+
+
+int main (int argc, char *argv []) {
+	static struct metrics_shard snap [METRICS_SHARDS + 1];
+	static struct metrics_shard prev [METRICS_SHARDS + 1];
+	static struct metrics_shard delta [METRICS_SHARDS + 1];
+	const struct metrics *seg;
+	unsigned int shards, i;
+	int pershard = 0;
+	int interval = 0;
+	int opt, fd;
+	//
+	// Parse the options
+	while ((opt = getopt (argc, argv, "jsi:")) != -1) {
+		switch (opt) {
+		case 'j':
+			json = 1;
+			break;
+		case 's':
+			pershard = 1;
+			break;
+		case 'i':
+			interval = atoi (optarg);
+			if (interval < 1) {
+				argc = 0;
+			}
+			break;
+		default:
+			argc = 0;
+			break;
+		}
+	}
+	if ((argc == 0) || (optind != argc)) {
+		fprintf (stderr, "Usage: %s [-j] [-s] [-i seconds]\n", argv [0]);
+		exit (1);
+	}
+	//
+	// Map the metrics of synergy.d, and check that they are alive
+	fd = shm_open (METRICS_SHM_NAME, O_RDONLY | O_CLOEXEC, 0);
+	if (fd == -1) {
+		fprintf (stderr, "%s: No metrics of synergy.d found: %s\n", argv [0], strerror (errno));
+		exit (1);
+	}
+	seg = mmap (NULL, sizeof (struct metrics), PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+	if (seg == MAP_FAILED) {
+		fprintf (stderr, "%s: Failed to map the metrics of synergy.d: %s\n", argv [0], strerror (errno));
+		exit (1);
+	}
+	if ((__atomic_load_n (&seg->magic, __ATOMIC_ACQUIRE) != METRICS_MAGIC)
+			|| (seg->version != METRICS_VERSION) || (seg->shards > METRICS_SHARDS)) {
+		fprintf (stderr, "%s: The metrics of synergy.d are not in a known format\n", argv [0]);
+		exit (1);
+	}
+	if (kill (seg->pid, 0) == -1) {
+		fprintf (stderr, "%s: Warning: synergy.d process %d is gone, these metrics are stale\n",
+				argv [0], seg->pid);
+	}
+	shards = seg->shards;
+	//
+	// Print the totals since the start, or increments every interval
+	stat_snapshot (seg, snap, shards);
+	if (interval == 0) {
+		stat_report (snap, shards, pershard, (double) (time (NULL) - seg->started));
+		return 0;
+	}
+	while (1) {
+		memcpy (prev, snap, sizeof (snap));
+		sleep (interval);
+		stat_snapshot (seg, snap, shards);
+		for (i = 0; i <= shards; i++) {
+			delta [i] = snap [i];
+			stat_add (&delta [i], &prev [i], -1);
+		}
+		stat_report (delta, shards, pershard, interval);
+	}
+}
@@ -0,0 +1,358 @@
+/* synergytrace.c -- Decode the binary traces of punches
+ *
+ * Processes that use libsynergy, including synergy.d, trace their punches
+ * into a shared memory segment each, unless $SYNERGY_TRACE is 0.
+ * This tool maps those segments read-only, collects the complete records
+ * from the rings of all threads, and prints them in the order of time.
+ * The segments outlive their processes, so a trace can be read after a
+ * crash; they are only removed with -c.
+ *
+ * Options:
+ *  -p pid       Only decode the trace of this process
+ *  -l           List the traces, instead of decoding their records
+ *  -j           Print lines of JSON instead of text
+ *  -f           Follow the traces, printing new records as they appear
+ *  -c           Remove the traces of processes that are gone
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include <arpa/inet.h>
+
+#include "libsynergy.h"
+
+
+#define TRACE_MAX 256
+
+struct trace {
+	char name [NAME_MAX + 2];
+	const struct synergy_trace_header *seg;
+	uint64_t seen [SYNERGY_TRACE_RINGS];
+};
+
+struct entry {
+	struct synergy_trace_record rec;
+	const struct trace *trc;
+	int32_t tid;
+};
+
+static struct trace traces [TRACE_MAX];
+static int numtraces = 0;
+static int json = 0;
+
+
+static const char *trace_event (uint8_t event) {
+	switch (event) {
+	case SYNERGY_TRACE_PRIVILEGED:
+		return "privileged";
+	case SYNERGY_TRACE_DAEMONISED:
+		return "daemonised";
+	case SYNERGY_TRACE_PROBE:
+		return "probe";
+	case SYNERGY_TRACE_RING:
+		return "ring";
+	case SYNERGY_TRACE_URING:
+		return "uring";
+	case SYNERGY_TRACE_SOCKOPT:
+		return "sockopt";
+	case SYNERGY_TRACE_CONNECT:
+		return "connect";
+	default:
+		return "unknown";
+	}
+}
+
+
+static const char *trace_proto (uint8_t proto) {
+	switch (proto) {
+	case IPPROTO_TCP:
+		return "tcp";
+	case IPPROTO_UDP:
+		return "udp";
+	case IPPROTO_SCTP:
+		return "sctp";
+	case 0:
+		return "-";
+	default:
+		return "other";
+	}
+}
+
+
+/* Map the trace segment with the given name in /dev/shm, if it is sane.
+ */
+static int trace_open (const char *name) {
+	const struct synergy_trace_header *seg;
+	char path [NAME_MAX + 2];
+	int fd;
+	if (numtraces >= TRACE_MAX) {
+		errno = ENFILE;
+		return -1;
+	}
+	snprintf (path, sizeof (path), "/%s", name);
+	fd = shm_open (path, O_RDONLY | O_CLOEXEC, 0);
+	if (fd == -1) {
+		return -1;
+	}
+	seg = mmap (NULL, sizeof (*seg), PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+	if (seg == MAP_FAILED) {
+		return -1;
+	}
+	if ((__atomic_load_n (&seg->magic, __ATOMIC_ACQUIRE) != SYNERGY_TRACE_MAGIC)
+			|| (seg->version != SYNERGY_TRACE_VERSION)) {
+		munmap ((void *) seg, sizeof (*seg));
+		errno = EPROTO;
+		return -1;
+	}
+	memset (&traces [numtraces], 0, sizeof (traces [numtraces]));
+	snprintf (traces [numtraces].name, sizeof (traces [numtraces].name), "%s", path);
+	traces [numtraces].seg = seg;
+	numtraces++;
+	return 0;
+}
+
+
+/* Find the trace segments in /dev/shm, for all processes or just one.
+ */
+static int trace_find (const char *prog, int pid) {
+	DIR *dir;
+	struct dirent *de;
+	const char *prefix = SYNERGY_TRACE_SHM_PREFIX + 1;
+	dir = opendir ("/dev/shm");
+	if (dir == NULL) {
+		return -1;
+	}
+	while ((de = readdir (dir)) != NULL) {
+		if (strncmp (de->d_name, prefix, strlen (prefix)) != 0) {
+			continue;
+		}
+		if ((pid > 0) && (atoi (de->d_name + strlen (prefix)) != pid)) {
+			continue;
+		}
+		if (trace_open (de->d_name) == -1) {
+			fprintf (stderr, "%s: Skipping trace %s: %s\n", prog, de->d_name, strerror (errno));
+		}
+	}
+	closedir (dir);
+	return 0;
+}
+
+
+static int trace_alive (const struct trace *trc) {
+	return (kill (trc->seg->pid, 0) == 0) || (errno == EPERM);
+}
+
+
+/* Collect the complete records that were not seen before from all rings.
+ * A record that changes while it is copied is being overwritten, and
+ * any record that fell off a ring was lost to the reader.
+ */
+static size_t trace_collect (struct entry **entries, size_t *size) {
+	size_t num = 0;
+	int t;
+	unsigned int r, rings;
+	for (t = 0; t < numtraces; t++) {
+		struct trace *trc = &traces [t];
+		rings = __atomic_load_n (&trc->seg->rings, __ATOMIC_ACQUIRE);
+		if (rings > SYNERGY_TRACE_RINGS) {
+			rings = SYNERGY_TRACE_RINGS;
+		}
+		for (r = 0; r < rings; r++) {
+			const struct synergy_trace_ring *ring = &trc->seg->ring [r];
+			uint64_t head = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+			uint64_t idx = trc->seen [r];
+			if (head > SYNERGY_TRACE_RECORDS + idx) {
+				idx = head - SYNERGY_TRACE_RECORDS;
+			}
+			for (; idx < head; idx++) {
+				const struct synergy_trace_record *rec = &ring->record [idx % SYNERGY_TRACE_RECORDS];
+				struct entry *ent;
+				uint64_t seq;
+				if (num == *size) {
+					*size = (*size == 0) ? 4096 : 2 * *size;
+					*entries = realloc (*entries, *size * sizeof (**entries));
+					if (*entries == NULL) {
+						perror ("Out of memory");
+						exit (1);
+					}
+				}
+				ent = &(*entries) [num];
+				seq = __atomic_load_n (&rec->seq, __ATOMIC_ACQUIRE);
+				memcpy (&ent->rec, rec, sizeof (ent->rec));
+				__atomic_thread_fence (__ATOMIC_ACQUIRE);
+				if ((seq != idx + 1) || (__atomic_load_n (&rec->seq, __ATOMIC_RELAXED) != seq)) {
+					continue;
+				}
+				ent->trc = trc;
+				ent->tid = ring->tid;
+				num++;
+			}
+			trc->seen [r] = head;
+		}
+	}
+	return num;
+}
+
+
+static int trace_cmp (const void *a, const void *b) {
+	const struct entry *ea = a;
+	const struct entry *eb = b;
+	if (ea->rec.time_ns != eb->rec.time_ns) {
+		return (ea->rec.time_ns < eb->rec.time_ns) ? -1 : 1;
+	}
+	return 0;
+}
+
+
+static void trace_print (const struct entry *ent) {
+	const struct synergy_trace_record *rec = &ent->rec;
+	char src [INET6_ADDRSTRLEN], dst [INET6_ADDRSTRLEN];
+	char stamp [32];
+	struct tm tm;
+	time_t secs = rec->time_ns / 1000000000;
+	inet_ntop (AF_INET6, &rec->src, src, sizeof (src));
+	inet_ntop (AF_INET6, &rec->dst, dst, sizeof (dst));
+	if (json) {
+		printf ("{\"time_ns\":%llu,\"pid\":%d,\"tid\":%d,\"comm\":\"%.16s\",\"event\":\"%s\","
+				"\"proto\":\"%s\",\"src\":\"%s\",\"sport\":%u,\"dst\":\"%s\",\"dport\":%u,"
+				"\"hoplimit\":%u,\"errno\":%d}\n",
+				(unsigned long long) rec->time_ns, ent->trc->seg->pid, ent->tid,
+				ent->trc->seg->comm, trace_event (rec->event), trace_proto (rec->proto),
+				src, ntohs (rec->sport), dst, ntohs (rec->dport),
+				rec->hoplimit, rec->error);
+		return;
+	}
+	localtime_r (&secs, &tm);
+	strftime (stamp, sizeof (stamp), "%Y-%m-%d %H:%M:%S", &tm);
+	printf ("%s.%09llu %d/%d %-10s %-4s [%s]:%u > [%s]:%u hop %u %s\n",
+			stamp, (unsigned long long) (rec->time_ns % 1000000000),
+			ent->trc->seg->pid, ent->tid,
+			trace_event (rec->event), trace_proto (rec->proto),
+			src, ntohs (rec->sport), dst, ntohs (rec->dport),
+			rec->hoplimit, (rec->error == 0) ? "ok" : strerror (rec->error));
+}
+
+
+static void trace_list (void) {
+	int t;
+	for (t = 0; t < numtraces; t++) {
+		const struct synergy_trace_header *seg = traces [t].seg;
+		unsigned int rings = seg->rings;
+		if (rings > SYNERGY_TRACE_RINGS) {
+			rings = SYNERGY_TRACE_RINGS;
+		}
+		if (json) {
+			printf ("{\"pid\":%d,\"comm\":\"%.16s\",\"alive\":%s,\"threads\":%u,\"sample\":%u,\"lost\":%u}\n",
+					seg->pid, seg->comm, trace_alive (&traces [t]) ? "true" : "false",
+					rings, seg->sample, seg->lost);
+		} else {
+			printf ("%d %.16s%s, %u threads, sampling 1 in %u, %u events lost\n",
+					seg->pid, seg->comm, trace_alive (&traces [t]) ? "" : " (gone)",
+					rings, seg->sample, seg->lost);
+		}
+	}
+}
+
+
+int main (int argc, char *argv []) {
+	struct entry *entries = NULL;
+	size_t size = 0;
+	size_t num, i;
+	int pid = 0;
+	int list = 0;
+	int follow = 0;
+	int clean = 0;
+	int opt, t;
+	//
+	// Parse the options
+	while ((opt = getopt (argc, argv, "p:ljfc")) != -1) {
+		switch (opt) {
+		case 'p':
+			pid = atoi (optarg);
+			if (pid < 1) {
+				argc = 0;
+			}
+			break;
+		case 'l':
+			list = 1;
+			break;
+		case 'j':
+			json = 1;
+			break;
+		case 'f':
+			follow = 1;
+			break;
+		case 'c':
+			clean = 1;
+			break;
+		default:
+			argc = 0;
+			break;
+		}
+	}
+	if ((argc == 0) || (optind != argc) || (list + follow + clean > 1)) {
+		fprintf (stderr, "Usage: %s [-p pid] [-j] [-l | -f | -c]\n", argv [0]);
+		exit (1);
+	}
+	if (trace_find (argv [0], pid) == -1) {
+		fprintf (stderr, "%s: Cannot look for traces: %s\n", argv [0], strerror (errno));
+		exit (1);
+	}
+	if (numtraces == 0) {
+		fprintf (stderr, "%s: No traces found\n", argv [0]);
+		exit (1);
+	}
+	//
+	// List the traces, or remove those of processes that are gone
+	if (list) {
+		trace_list ();
+		return 0;
+	}
+	if (clean) {
+		for (t = 0; t < numtraces; t++) {
+			if (!trace_alive (&traces [t]) && (shm_unlink (traces [t].name) == -1)) {
+				fprintf (stderr, "%s: Failed to remove %s: %s\n", argv [0],
+						traces [t].name, strerror (errno));
+			}
+		}
+		return 0;
+	}
+	//
+	// Print the records in the order of time, and repeat when following
+	while (1) {
+		num = trace_collect (&entries, &size);
+		qsort (entries, num, sizeof (*entries), trace_cmp);
+		for (i = 0; i < num; i++) {
+			trace_print (&entries [i]);
+		}
+		fflush (stdout);
+		if (!follow) {
+			break;
+		}
+		usleep (100000);
+	}
+	for (t = 0; t < numtraces; t++) {
+		if (traces [t].seg->lost > 0) {
+			fprintf (stderr, "%s: Process %d lost %u events for lack of rings\n",
+					argv [0], traces [t].seg->pid, traces [t].seg->lost);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,247 @@
+/* trace.c -- Binary event tracing of punches
+ *
+ * Every thread that punches claims a ring of fixed-size records in a
+ * shared memory segment of its process, and writes there without locks
+ * or system calls; only the timestamp comes from the vDSO.  The segment
+ * is created on the first event, and is left behind when the process
+ * exits, so synergytrace can show what happened to it.
+ *
+ * A record is written like a seqlock with a single writer: its sequence
+ * number is cleared, the fields are filled in, and the sequence number is
+ * set to the ring position plus one.  A reader that finds the same
+ * non-zero sequence number before and after copying has a whole record.
+ *
+ * Tracing is on unless $SYNERGY_TRACE is 0, so failures of applications
+ * are recorded without preparation.  The environment is read once.  Errors
+ * in tracing never change errno, which callers report right after.
+ *
+ * A child process after fork() starts its own segment, with rings that its
+ * threads claim afresh.  Threads beyond SYNERGY_TRACE_RINGS are not traced,
+ * but they are counted as lost.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+
+#include "libsynergy.h"
+
+
+_Static_assert (sizeof (struct synergy_trace_record) == 64, "Trace records should fill a cache line");
+_Static_assert (sizeof (struct synergy_trace_ring) % 64 == 0, "Trace rings should be cache aligned");
+_Static_assert (offsetof (struct synergy_trace_header, ring) == 64, "Trace rings should be cache aligned");
+
+
+static pthread_once_t traceonce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t tracelock = PTHREAD_MUTEX_INITIALIZER;
+static int tracing = 0;
+static uint32_t sampling = 1;
+static struct synergy_trace_header *segment = NULL;
+static unsigned int generation = 1;
+
+/* The state of a thread is kept together, to find it with one lookup.
+ */
+struct tracer {
+	struct synergy_trace_ring *ring;
+	unsigned int generation;
+	uint32_t count;
+};
+
+static __thread struct tracer me;
+
+
+static void trace_prepare (void) {
+	pthread_mutex_lock (&tracelock);
+}
+
+static void trace_parent (void) {
+	pthread_mutex_unlock (&tracelock);
+}
+
+/* The child keeps tracing into a segment of its own, and drops the one of
+ * its parent, which the parent still writes to.
+ */
+static void trace_child (void) {
+	if (segment != NULL) {
+		munmap (segment, sizeof (*segment));
+		segment = NULL;
+	}
+	generation++;
+	pthread_mutex_unlock (&tracelock);
+}
+
+
+static void trace_setup (void) {
+	const char *env = getenv ("SYNERGY_TRACE");
+	const char *smp = getenv ("SYNERGY_TRACE_SAMPLE");
+	if ((env != NULL) && (strcmp (env, "0") == 0)) {
+		return;
+	}
+	if ((smp != NULL) && (atoi (smp) > 1)) {
+		sampling = atoi (smp);
+	}
+	pthread_atfork (trace_prepare, trace_parent, trace_child);
+	__atomic_store_n (&tracing, 1, __ATOMIC_RELEASE);
+}
+
+
+/* Create the segment for this process.  Called with the lock held.
+ */
+static struct synergy_trace_header *trace_segment (void) {
+	struct synergy_trace_header *seg;
+	char name [40];
+	int fd;
+	snprintf (name, sizeof (name), SYNERGY_TRACE_SHM_PREFIX "%d", (int) getpid ());
+	fd = shm_open (name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (fd == -1) {
+		return NULL;
+	}
+	if (ftruncate (fd, sizeof (*seg)) == -1) {
+		close (fd);
+		shm_unlink (name);
+		return NULL;
+	}
+	seg = mmap (NULL, sizeof (*seg), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close (fd);
+	if (seg == MAP_FAILED) {
+		shm_unlink (name);
+		return NULL;
+	}
+	seg->version = SYNERGY_TRACE_VERSION;
+	seg->pid = getpid ();
+	seg->sample = sampling;
+	strncpy (seg->comm, program_invocation_short_name, sizeof (seg->comm) - 1);
+	__atomic_store_n (&seg->magic, SYNERGY_TRACE_MAGIC, __ATOMIC_RELEASE);
+	return seg;
+}
+
+
+/* Claim a ring for the current thread, creating the segment if need be.
+ * When that fails, tracing stops for the whole process.
+ */
+static struct synergy_trace_ring *trace_claim (struct tracer *my) {
+	struct synergy_trace_header *seg;
+	uint32_t idx;
+	pthread_mutex_lock (&tracelock);
+	if (segment == NULL) {
+		segment = trace_segment ();
+		if (segment == NULL) {
+			__atomic_store_n (&tracing, 0, __ATOMIC_RELAXED);
+		}
+	}
+	seg = segment;
+	my->generation = generation;
+	pthread_mutex_unlock (&tracelock);
+	my->ring = NULL;
+	if (seg == NULL) {
+		return NULL;
+	}
+	idx = __atomic_fetch_add (&seg->rings, 1, __ATOMIC_RELAXED);
+	if (idx >= SYNERGY_TRACE_RINGS) {
+		__atomic_store_n (&seg->rings, SYNERGY_TRACE_RINGS, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	my->ring = &seg->ring [idx];
+	__atomic_store_n (&my->ring->tid, (int32_t) syscall (SYS_gettid), __ATOMIC_RELEASE);
+	return my->ring;
+}
+
+
+static void trace_record (uint8_t event, const struct in6_addr *src, uint16_t sport,
+			const struct in6_addr *dst, uint16_t dport,
+			uint8_t proto, uint8_t hoplimit, int error) {
+	struct tracer *my = &me;
+	struct synergy_trace_ring *ring;
+	struct synergy_trace_record *rec;
+	struct timespec now;
+	uint64_t head;
+	//
+	// Skip quickly when tracing is off, or this event is not sampled
+	pthread_once (&traceonce, trace_setup);
+	if (!__atomic_load_n (&tracing, __ATOMIC_RELAXED)) {
+		return;
+	}
+	if ((sampling > 1) && ((my->count++ % sampling) != 0)) {
+		return;
+	}
+	ring = my->ring;
+	if ((ring == NULL) || (my->generation != generation)) {
+		if (my->generation == generation) {
+			if (segment != NULL) {
+				__atomic_fetch_add (&segment->lost, 1, __ATOMIC_RELAXED);
+			}
+			return;
+		}
+		ring = trace_claim (my);
+		if (ring == NULL) {
+			if (segment != NULL) {
+				__atomic_fetch_add (&segment->lost, 1, __ATOMIC_RELAXED);
+			}
+			return;
+		}
+	}
+	//
+	// Invalidate the oldest record, overwrite it, and validate it again
+	clock_gettime (CLOCK_REALTIME, &now);
+	head = ring->head;
+	rec = &ring->record [head % SYNERGY_TRACE_RECORDS];
+	__atomic_store_n (&rec->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+	rec->time_ns = ((uint64_t) now.tv_sec) * 1000000000 + now.tv_nsec;
+	if (src != NULL) {
+		memcpy (&rec->src, src, sizeof (rec->src));
+	} else {
+		memset (&rec->src, 0, sizeof (rec->src));
+	}
+	if (dst != NULL) {
+		memcpy (&rec->dst, dst, sizeof (rec->dst));
+	} else {
+		memset (&rec->dst, 0, sizeof (rec->dst));
+	}
+	rec->sport = sport;
+	rec->dport = dport;
+	rec->proto = proto;
+	rec->hoplimit = hoplimit;
+	rec->event = event;
+	rec->reserved = 0;
+	rec->error = error;
+	rec->reserved2 = 0;
+	__atomic_store_n (&rec->seq, head + 1, __ATOMIC_RELEASE);
+	__atomic_store_n (&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+
+void synergy_trace (uint8_t event, const struct in6_addr *src, uint16_t sport,
+			const struct in6_addr *dst, uint16_t dport,
+			uint8_t proto, uint8_t hoplimit, int error) {
+	int sverr = errno;
+	trace_record (event, src, sport, dst, dport, proto, hoplimit, error);
+	errno = sverr;
+}
+
+
+void synergy_trace_packet (uint8_t event, const void *packet, int error) {
+	const struct ip6_hdr *ip6 = packet;
+	const uint16_t *ports = (const uint16_t *) (ip6 + 1);
+	synergy_trace (event, &ip6->ip6_src, ports [0], &ip6->ip6_dst, ports [1],
+			ip6->ip6_nxt, ip6->ip6_hlim, error);
+}
@@ -0,0 +1,658 @@
+/* txring.c -- Memory-mapped transmit rings for the workers of synergy.d
+ *
+ * The RAW sockets take one sendmmsg() per batch, but the kernel still
+ * routes, neighbours and queues every packet on its own.  At high rates,
+ * a worker can instead write complete Ethernet frames into a ring that it
+ * shares with the kernel, and flush the whole batch with one system call.
+ * Two kinds of rings are supported: the PACKET_TX_RING of an AF_PACKET
+ * socket, and the TX ring of an AF_XDP socket with its own UMEM.
+ *
+ * Frames need a next hop.  The route towards a destination and the link
+ * address of its next hop are looked up over rtnetlink, and cached for a
+ * short while.  The neighbour table is only read, never fed; so when the
+ * next hop is not known yet, or when the interface is not Ethernet, the
+ * punch is left to the RAW sockets of the worker.  Their sending triggers
+ * Neighbour Discovery, so the next punch can take the ring.
+ *
+ * Every worker has its own rings, one per interface that it sends on.
+ * AF_XDP binds to the queue with the number of the worker; when that fails,
+ * the interface falls back to a PACKET_TX_RING, and when that fails too, to
+ * the RAW sockets.  A punch counts as sent when its frame is in the ring.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <netinet/in.h>
+
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/if_xdp.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/neighbour.h>
+
+#include <sys/socketsynergy.h>
+
+#include "daemon.h"
+#include "libsynergy.h"
+
+
+/* The number of interfaces that one worker can send on with rings, and the
+ * number of next hops that it caches.  Known next hops are cached longer
+ * than unknown ones, which may be learnt soon through the RAW sockets.
+ */
+#define TXRING_IFMAX 8
+#define TXRING_HOPS 256
+#define TXRING_HOP_MS 1000
+#define TXRING_MISS_MS 100
+
+/* The number of frames in each ring.  PACKET_TX_RING frames are small, and
+ * fill whole pages; AF_XDP needs chunks of at least 2048 bytes.
+ */
+#define TXRING_FRAMES 512
+#define TXRING_PACKET_FRAMESZ 256
+#define TXRING_XDP_FRAMESZ 2048
+
+/* The neighbour states in which the link address can be used.
+ */
+#define TXRING_NUD_VALID (NUD_PERMANENT | NUD_NOARP | NUD_REACHABLE \
+			| NUD_STALE | NUD_DELAY | NUD_PROBE)
+
+
+/* An AF_XDP ring, with our own producer or consumer index.  The index is
+ * only published to the kernel when a batch is flushed.
+ */
+struct xdpring {
+	uint32_t *producer;
+	uint32_t *consumer;
+	uint32_t *flags;
+	void *desc;
+	void *map;
+	size_t maplen;
+	uint32_t size;
+	uint32_t head;
+};
+
+
+/* An interface that a worker sends on.  The kind is the backend that
+ * serves it, which may be TXBACKEND_RAW when no ring could be setup.
+ */
+struct txif {
+	int ifindex;
+	int kind;
+	int fd;
+	uint8_t mac [ETH_ALEN];
+	uint8_t *area;
+	size_t arealen;
+	unsigned int next;
+	int pending;
+	struct xdpring tx;
+	struct xdpring cq;
+	uint64_t freeframes [TXRING_FRAMES];
+	unsigned int numfree;
+};
+
+
+/* A cached next hop, found on an interface in ifs[], or -1 for RAW.
+ */
+struct txhop {
+	struct in6_addr dst;
+	int64_t expires_ms;
+	int ifidx;
+	uint8_t mac [ETH_ALEN];
+};
+
+
+struct txring {
+	int backend;
+	int queue;
+	int nlsox;
+	uint32_t nlseq;
+	int numifs;
+	struct txif ifs [TXRING_IFMAX];
+	struct txhop hops [TXRING_HOPS];
+};
+
+
+static int64_t txring_now_ms (void) {
+	struct timespec now;
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return ((int64_t) now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+}
+
+
+/* Add an attribute to a netlink request.
+ */
+static void txring_addattr (struct nlmsghdr *nlh, int type, const void *data, int len) {
+	struct rtattr *rta = (struct rtattr *) (((uint8_t *) nlh) + NLMSG_ALIGN (nlh->nlmsg_len));
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH (len);
+	memcpy (RTA_DATA (rta), data, len);
+	nlh->nlmsg_len = NLMSG_ALIGN (nlh->nlmsg_len) + RTA_ALIGN (rta->rta_len);
+}
+
+
+/* Send a netlink request to the kernel, and receive the reply to it.
+ * Returns the reply, or NULL with errno set.
+ */
+static struct nlmsghdr *txring_netlink (struct txring *txr, struct nlmsghdr *req, void *buf, size_t buflen) {
+	struct nlmsghdr *nlh;
+	ssize_t len;
+	req->nlmsg_flags = NLM_F_REQUEST;
+	req->nlmsg_seq = ++txr->nlseq;
+	if (send (txr->nlsox, req, req->nlmsg_len, 0) == -1) {
+		return NULL;
+	}
+	while (1) {
+		len = recv (txr->nlsox, buf, buflen, 0);
+		if (len == -1) {
+			return NULL;
+		}
+		for (nlh = buf; NLMSG_OK (nlh, len); nlh = NLMSG_NEXT (nlh, len)) {
+			if (nlh->nlmsg_seq != txr->nlseq) {
+				continue;
+			}
+			if (nlh->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *nle = NLMSG_DATA (nlh);
+				errno = (nle->error < 0) ? -nle->error : EPROTO;
+				return NULL;
+			}
+			return nlh;
+		}
+	}
+}
+
+
+/* Find the interface and next hop for a destination in the routing table.
+ * Only unicast routes are used; local and unreachable destinations fail.
+ */
+static int txring_route (struct txring *txr, struct sockaddr_in6 *dst, int *ifindex, struct in6_addr *nexthop) {
+	struct {
+		struct nlmsghdr nlh;
+		struct rtmsg rtm;
+		uint8_t attrs [64];
+	} req;
+	uint8_t buf [8192];
+	struct nlmsghdr *nlh;
+	struct rtmsg *rtm;
+	struct rtattr *rta;
+	int rtalen;
+	memset (&req, 0, sizeof (req));
+	req.nlh.nlmsg_len = NLMSG_LENGTH (sizeof (req.rtm));
+	req.nlh.nlmsg_type = RTM_GETROUTE;
+	req.rtm.rtm_family = AF_INET6;
+	req.rtm.rtm_dst_len = 128;
+	txring_addattr (&req.nlh, RTA_DST, &dst->sin6_addr, 16);
+	if (dst->sin6_scope_id != 0) {
+		uint32_t oif = dst->sin6_scope_id;
+		txring_addattr (&req.nlh, RTA_OIF, &oif, sizeof (oif));
+	}
+	nlh = txring_netlink (txr, &req.nlh, buf, sizeof (buf));
+	if (nlh == NULL) {
+		return -1;
+	}
+	rtm = NLMSG_DATA (nlh);
+	if ((nlh->nlmsg_type != RTM_NEWROUTE) || (rtm->rtm_type != RTN_UNICAST)) {
+		errno = ENETUNREACH;
+		return -1;
+	}
+	*ifindex = 0;
+	memcpy (nexthop, &dst->sin6_addr, sizeof (*nexthop));
+	rtalen = RTM_PAYLOAD (nlh);
+	for (rta = RTM_RTA (rtm); RTA_OK (rta, rtalen); rta = RTA_NEXT (rta, rtalen)) {
+		if ((rta->rta_type == RTA_OIF) && (RTA_PAYLOAD (rta) == sizeof (uint32_t))) {
+			*ifindex = * (uint32_t *) RTA_DATA (rta);
+		} else if ((rta->rta_type == RTA_GATEWAY) && (RTA_PAYLOAD (rta) == 16)) {
+			memcpy (nexthop, RTA_DATA (rta), 16);
+		}
+	}
+	if (*ifindex == 0) {
+		errno = ENETUNREACH;
+		return -1;
+	}
+	return 0;
+}
+
+
+/* Find the link address of a next hop in the neighbour table.  This fails
+ * with EHOSTUNREACH when the neighbour is not resolved.
+ */
+static int txring_neigh (struct txring *txr, int ifindex, struct in6_addr *nexthop, uint8_t *mac) {
+	struct {
+		struct nlmsghdr nlh;
+		struct ndmsg ndm;
+		uint8_t attrs [64];
+	} req;
+	uint8_t buf [1024];
+	struct nlmsghdr *nlh;
+	struct ndmsg *ndm;
+	struct rtattr *rta;
+	int rtalen;
+	memset (&req, 0, sizeof (req));
+	req.nlh.nlmsg_len = NLMSG_LENGTH (sizeof (req.ndm));
+	req.nlh.nlmsg_type = RTM_GETNEIGH;
+	req.ndm.ndm_family = AF_INET6;
+	req.ndm.ndm_ifindex = ifindex;
+	txring_addattr (&req.nlh, NDA_DST, nexthop, 16);
+	nlh = txring_netlink (txr, &req.nlh, buf, sizeof (buf));
+	if (nlh == NULL) {
+		return -1;
+	}
+	ndm = NLMSG_DATA (nlh);
+	if ((nlh->nlmsg_type != RTM_NEWNEIGH) || !(ndm->ndm_state & TXRING_NUD_VALID)) {
+		errno = EHOSTUNREACH;
+		return -1;
+	}
+	rtalen = nlh->nlmsg_len - NLMSG_LENGTH (sizeof (*ndm));
+	for (rta = (struct rtattr *) (((uint8_t *) ndm) + NLMSG_ALIGN (sizeof (*ndm)));
+				RTA_OK (rta, rtalen); rta = RTA_NEXT (rta, rtalen)) {
+		if ((rta->rta_type == NDA_LLADDR) && (RTA_PAYLOAD (rta) == ETH_ALEN)) {
+			memcpy (mac, RTA_DATA (rta), ETH_ALEN);
+			return 0;
+		}
+	}
+	errno = EHOSTUNREACH;
+	return -1;
+}
+
+
+/* Setup a PACKET_TX_RING on an interface.  The socket is never bound to a
+ * protocol, so it receives nothing; the interface and protocol are given
+ * when the ring is flushed.  Malformed frames are skipped rather than that
+ * they would block the ring.
+ */
+static int txring_packet_open (struct txif *ti) {
+	struct tpacket_req treq;
+	int version = TPACKET_V2;
+	int one = 1;
+	ti->fd = socket (AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, 0);
+	if (ti->fd == -1) {
+		return -1;
+	}
+	memset (&treq, 0, sizeof (treq));
+	treq.tp_block_size = getpagesize ();
+	treq.tp_frame_size = TXRING_PACKET_FRAMESZ;
+	treq.tp_frame_nr = TXRING_FRAMES;
+	treq.tp_block_nr = TXRING_FRAMES / (treq.tp_block_size / TXRING_PACKET_FRAMESZ);
+	if ((setsockopt (ti->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof (version)) == -1)
+			|| (setsockopt (ti->fd, SOL_PACKET, PACKET_LOSS, &one, sizeof (one)) == -1)
+			|| (setsockopt (ti->fd, SOL_PACKET, PACKET_TX_RING, &treq, sizeof (treq)) == -1)) {
+		return -1;
+	}
+	setsockopt (ti->fd, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof (one));
+	ti->arealen = treq.tp_block_size * treq.tp_block_nr;
+	ti->area = mmap (NULL, ti->arealen, PROT_READ | PROT_WRITE, MAP_SHARED, ti->fd, 0);
+	if (ti->area == MAP_FAILED) {
+		ti->area = NULL;
+		return -1;
+	}
+	ti->next = 0;
+	ti->kind = TXBACKEND_RING;
+	return 0;
+}
+
+
+/* Map one of the rings of an AF_XDP socket.
+ */
+static int txring_xdp_map (struct txif *ti, struct xdpring *xr, struct xdp_ring_offset *off, size_t descsz, off_t pgoff) {
+	xr->size = TXRING_FRAMES;
+	xr->maplen = off->desc + TXRING_FRAMES * descsz;
+	xr->map = mmap (NULL, xr->maplen, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ti->fd, pgoff);
+	if (xr->map == MAP_FAILED) {
+		xr->map = NULL;
+		return -1;
+	}
+	xr->producer = (uint32_t *) ((uint8_t *) xr->map + off->producer);
+	xr->consumer = (uint32_t *) ((uint8_t *) xr->map + off->consumer);
+	xr->flags    = (uint32_t *) ((uint8_t *) xr->map + off->flags);
+	xr->desc     = (uint8_t *) xr->map + off->desc;
+	return 0;
+}
+
+
+/* Setup an AF_XDP socket on a queue of an interface, with a UMEM for the
+ * frames and only a TX ring.  The kernel insists on a fill ring as well,
+ * which is never used.  The kernel picks zero-copy mode when the driver
+ * supports it, and copy mode otherwise.
+ */
+static int txring_xdp_open (struct txif *ti, int queue) {
+	struct xdp_umem_reg umr;
+	struct xdp_mmap_offsets off;
+	struct sockaddr_xdp sxdp;
+	socklen_t offlen = sizeof (off);
+	int ringsz = TXRING_FRAMES;
+	unsigned int i;
+	ti->fd = socket (AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+	if (ti->fd == -1) {
+		return -1;
+	}
+	ti->arealen = TXRING_FRAMES * TXRING_XDP_FRAMESZ;
+	ti->area = mmap (NULL, ti->arealen, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (ti->area == MAP_FAILED) {
+		ti->area = NULL;
+		return -1;
+	}
+	memset (&umr, 0, sizeof (umr));
+	umr.addr = (uintptr_t) ti->area;
+	umr.len = ti->arealen;
+	umr.chunk_size = TXRING_XDP_FRAMESZ;
+	if ((setsockopt (ti->fd, SOL_XDP, XDP_UMEM_REG, &umr, sizeof (umr)) == -1)
+			|| (setsockopt (ti->fd, SOL_XDP, XDP_UMEM_FILL_RING, &ringsz, sizeof (ringsz)) == -1)
+			|| (setsockopt (ti->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ringsz, sizeof (ringsz)) == -1)
+			|| (setsockopt (ti->fd, SOL_XDP, XDP_TX_RING, &ringsz, sizeof (ringsz)) == -1)
+			|| (getsockopt (ti->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &offlen) == -1)) {
+		return -1;
+	}
+	if ((txring_xdp_map (ti, &ti->tx, &off.tx, sizeof (struct xdp_desc), XDP_PGOFF_TX_RING) == -1)
+			|| (txring_xdp_map (ti, &ti->cq, &off.cr, sizeof (uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) == -1)) {
+		return -1;
+	}
+	memset (&sxdp, 0, sizeof (sxdp));
+	sxdp.sxdp_family = AF_XDP;
+	sxdp.sxdp_ifindex = ti->ifindex;
+	sxdp.sxdp_queue_id = queue;
+	sxdp.sxdp_flags = XDP_USE_NEED_WAKEUP;
+	if (bind (ti->fd, (struct sockaddr *) &sxdp, sizeof (sxdp)) == -1) {
+		return -1;
+	}
+	ti->tx.head = __atomic_load_n (ti->tx.producer, __ATOMIC_ACQUIRE);
+	ti->cq.head = __atomic_load_n (ti->cq.consumer, __ATOMIC_ACQUIRE);
+	for (i = 0; i < TXRING_FRAMES; i++) {
+		ti->freeframes [i] = i * TXRING_XDP_FRAMESZ;
+	}
+	ti->numfree = TXRING_FRAMES;
+	ti->kind = TXBACKEND_XDP;
+	return 0;
+}
+
+
+/* Undo a partial setup of a ring, to try another kind.
+ */
+static void txring_iface_close (struct txif *ti) {
+	if (ti->tx.map != NULL) {
+		munmap (ti->tx.map, ti->tx.maplen);
+	}
+	if (ti->cq.map != NULL) {
+		munmap (ti->cq.map, ti->cq.maplen);
+	}
+	if (ti->area != NULL) {
+		munmap (ti->area, ti->arealen);
+	}
+	if (ti->fd >= 0) {
+		close (ti->fd);
+	}
+	memset (&ti->tx, 0, sizeof (ti->tx));
+	memset (&ti->cq, 0, sizeof (ti->cq));
+	ti->area = NULL;
+	ti->fd = -1;
+	ti->kind = TXBACKEND_RAW;
+}
+
+
+/* Find an interface in ifs[], or set it up with the best ring that works.
+ * Interfaces without Ethernet framing are left to the RAW sockets.  Returns
+ * -1 when the table is full, or with ENAMETOOLONG for a name that does not
+ * fit in an ifreq; the punches then also go to the RAW sockets.
+ */
+static int txring_iface (struct txring *txr, int ifindex) {
+	char ifname [IF_NAMESIZE];
+	struct ifreq ifr;
+	struct txif *ti;
+	int i;
+	for (i = 0; i < txr->numifs; i++) {
+		if (txr->ifs [i].ifindex == ifindex) {
+			return i;
+		}
+	}
+	if (txr->numifs == TXRING_IFMAX) {
+		return -1;
+	}
+	ti = &txr->ifs [txr->numifs];
+	memset (ti, 0, sizeof (*ti));
+	ti->ifindex = ifindex;
+	ti->fd = -1;
+	ti->kind = TXBACKEND_RAW;
+	if (if_indextoname (ifindex, ifname) == NULL) {
+		return txr->numifs++;
+	}
+	memset (&ifr, 0, sizeof (ifr));
+	if (snprintf (ifr.ifr_name, IFNAMSIZ, "%s", ifname) >= IFNAMSIZ) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if ((ioctl (txr->nlsox, SIOCGIFHWADDR, &ifr) == -1)
+			|| (ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER)) {
+		return txr->numifs++;
+	}
+	memcpy (ti->mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+	if (txr->backend == TXBACKEND_XDP) {
+		if (txring_xdp_open (ti, txr->queue) == 0) {
+			return txr->numifs++;
+		}
+		fprintf (stderr, "No AF_XDP on %s queue %d, trying PACKET_TX_RING: %s\n",
+				ifname, txr->queue, strerror (errno));
+		txring_iface_close (ti);
+	}
+	if (txring_packet_open (ti) == -1) {
+		fprintf (stderr, "No PACKET_TX_RING on %s, using RAW sockets: %s\n",
+				ifname, strerror (errno));
+		txring_iface_close (ti);
+	}
+	return txr->numifs++;
+}
+
+
+/* Find the interface and link address for a destination, from the cache or
+ * from the kernel.  Failures are cached too, as a hop on ifs [-1].
+ */
+static struct txhop *txring_hop (struct txring *txr, struct sockaddr_in6 *dst, int64_t now) {
+	const uint32_t *w = (const uint32_t *) dst->sin6_addr.s6_addr;
+	struct in6_addr nexthop;
+	struct txhop *hop;
+	uint32_t h = dst->sin6_scope_id;
+	int ifindex;
+	int i;
+	for (i = 0; i < 4; i++) {
+		h = (h ^ w [i]) * 0x9e3779b1;
+	}
+	hop = &txr->hops [(h >> 16) % TXRING_HOPS];
+	if ((hop->expires_ms > now)
+			&& (memcmp (&hop->dst, &dst->sin6_addr, sizeof (hop->dst)) == 0)) {
+		return hop;
+	}
+	memcpy (&hop->dst, &dst->sin6_addr, sizeof (hop->dst));
+	hop->ifidx = -1;
+	hop->expires_ms = now + TXRING_MISS_MS;
+	if ((txring_route (txr, dst, &ifindex, &nexthop) == -1)
+			|| (txring_neigh (txr, ifindex, &nexthop, hop->mac) == -1)) {
+		return hop;
+	}
+	hop->ifidx = txring_iface (txr, ifindex);
+	hop->expires_ms = now + TXRING_HOP_MS;
+	return hop;
+}
+
+
+/* Return the next free frame in the ring of an interface, or NULL when the
+ * ring is full.  The frame is only queued by txring_commit().
+ */
+static uint8_t *txring_slot (struct txif *ti) {
+	if (ti->kind == TXBACKEND_RING) {
+		struct tpacket2_hdr *tph = (struct tpacket2_hdr *) (ti->area + ti->next * TXRING_PACKET_FRAMESZ);
+		uint32_t status = __atomic_load_n (&tph->tp_status, __ATOMIC_ACQUIRE);
+		if ((status != TP_STATUS_AVAILABLE) && (status != TP_STATUS_WRONG_FORMAT)) {
+			return NULL;
+		}
+		return ((uint8_t *) tph) + TPACKET2_HDRLEN - sizeof (struct sockaddr_ll);
+	}
+	//
+	// Recycle the frames that the kernel has completed
+	if (ti->numfree == 0) {
+		uint32_t prod = __atomic_load_n (ti->cq.producer, __ATOMIC_ACQUIRE);
+		uint64_t *addrs = ti->cq.desc;
+		while ((ti->cq.head != prod) && (ti->numfree < TXRING_FRAMES)) {
+			ti->freeframes [ti->numfree++] = addrs [ti->cq.head++ & (ti->cq.size - 1)];
+		}
+		__atomic_store_n (ti->cq.consumer, ti->cq.head, __ATOMIC_RELEASE);
+	}
+	if ((ti->numfree == 0) || (ti->tx.head - __atomic_load_n (ti->tx.consumer, __ATOMIC_ACQUIRE) >= ti->tx.size)) {
+		return NULL;
+	}
+	return ti->area + ti->freeframes [ti->numfree - 1];
+}
+
+
+/* Queue the frame from txring_slot() with the given length.
+ */
+static void txring_commit (struct txif *ti, size_t len) {
+	if (ti->kind == TXBACKEND_RING) {
+		struct tpacket2_hdr *tph = (struct tpacket2_hdr *) (ti->area + ti->next * TXRING_PACKET_FRAMESZ);
+		tph->tp_len = len;
+		__atomic_store_n (&tph->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+		ti->next = (ti->next + 1) % TXRING_FRAMES;
+	} else {
+		struct xdp_desc *desc = ti->tx.desc;
+		desc += ti->tx.head++ & (ti->tx.size - 1);
+		desc->addr = ti->freeframes [--ti->numfree];
+		desc->len = len;
+		desc->options = 0;
+	}
+	ti->pending++;
+}
+
+
+/* Have the kernel send the frames that were queued on an interface.
+ */
+static void txring_flush (struct txif *ti) {
+	if (ti->kind == TXBACKEND_RING) {
+		struct sockaddr_ll sll;
+		memset (&sll, 0, sizeof (sll));
+		sll.sll_family = AF_PACKET;
+		sll.sll_protocol = htons (ETH_P_IPV6);
+		sll.sll_ifindex = ti->ifindex;
+		sll.sll_halen = ETH_ALEN;
+		sendto (ti->fd, NULL, 0, MSG_DONTWAIT, (struct sockaddr *) &sll, sizeof (sll));
+	} else {
+		__atomic_store_n (ti->tx.producer, ti->tx.head, __ATOMIC_RELEASE);
+		if (__atomic_load_n (ti->tx.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP) {
+			sendto (ti->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+		}
+	}
+	ti->pending = 0;
+}
+
+
+struct txring *txring_open (int backend, int queue) {
+	struct txring *txr;
+	int sox;
+	//
+	// Check that the backend is supported at all
+	sox = socket ((backend == TXBACKEND_XDP) ? AF_XDP : AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, 0);
+	if ((sox == -1) && (backend == TXBACKEND_XDP)) {
+		backend = TXBACKEND_RING;
+		sox = socket (AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, 0);
+	}
+	if (sox == -1) {
+		return NULL;
+	}
+	close (sox);
+	txr = calloc (1, sizeof (struct txring));
+	if (txr == NULL) {
+		return NULL;
+	}
+	txr->backend = backend;
+	txr->queue = queue;
+	txr->nlsox = socket (AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (txr->nlsox == -1) {
+		free (txr);
+		return NULL;
+	}
+	return txr;
+}
+
+
+void txring_many (struct txring *txr, struct synergy_punch *punches, const struct synergy_hint *hints, unsigned int count) {
+	struct sockaddr_in6 remot;
+	socklen_t namesz;
+	int64_t now = txring_now_ms ();
+	unsigned int i;
+	for (i = 0; i < count; i++) {
+		struct synergy_punch *p = &punches [i];
+		struct sockaddr_in6 *symcli = p->symcli;
+		struct txhop *hop;
+		struct txif *ti;
+		struct ethhdr *eth;
+		uint8_t *frame;
+		ssize_t len;
+		if (p->status != TXRING_FALLBACK) {
+			continue;
+		}
+		if (symcli == NULL) {
+			namesz = sizeof (remot);
+			if (getpeername (p->sockfd, (struct sockaddr *) &remot, &namesz) == -1) {
+				continue;
+			}
+			symcli = &remot;
+		}
+		//
+		// Find the ring and link address, or leave it to RAW sockets
+		hop = txring_hop (txr, symcli, now);
+		if (hop->ifidx < 0) {
+			continue;
+		}
+		ti = &txr->ifs [hop->ifidx];
+		if (ti->kind == TXBACKEND_RAW) {
+			continue;
+		}
+		//
+		// Construct the frame in the ring, and queue it
+		frame = txring_slot (ti);
+		if (frame == NULL) {
+			p->status = EAGAIN;
+			continue;
+		}
+		len = synergy_packet_hinted (p->sockfd, (hints != NULL) ? &hints [i] : NULL,
+				p->hoplimit, symcli, frame + ETH_HLEN, SYNERGY_PACKET_MAX);
+		if (len == -1) {
+			p->status = errno;
+			synergy_trace (SYNERGY_TRACE_RING, NULL, 0, &symcli->sin6_addr,
+					symcli->sin6_port, 0, p->hoplimit, errno);
+			continue;
+		}
+		p->proto = frame [ETH_HLEN + 6];
+		synergy_trace_packet (SYNERGY_TRACE_RING, frame + ETH_HLEN, 0);
+		eth = (struct ethhdr *) frame;
+		memcpy (eth->h_dest, hop->mac, ETH_ALEN);
+		memcpy (eth->h_source, ti->mac, ETH_ALEN);
+		eth->h_proto = htons (ETH_P_IPV6);
+		txring_commit (ti, ETH_HLEN + len);
+		p->status = 0;
+	}
+	//
+	// Send the whole batch, with one system call per interface
+	for (i = 0; i < txr->numifs; i++) {
+		if (txr->ifs [i].pending > 0) {
+			txring_flush (&txr->ifs [i]);
+		}
+	}
+}
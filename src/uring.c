@@ -0,0 +1,485 @@
+/* uring.c -- The io_uring engine for the datagram requests of synergy.d
+ *
+ * In the classic main loop, every punch costs a share of a recvmmsg(),
+ * then a sendmsg() in a worker and a close() of the socket that was passed
+ * in, besides the getsockname() and getsockopt() that construct the punch.
+ * This engine moves the receiving, sending and closing into an io_uring:
+ *
+ *  - A multishot recvmsg() on the datagram socket keeps delivering requests
+ *    with their SCM_RIGHTS into buffers from a provided buffer ring, so it
+ *    needs no new submission while buffers last.
+ *  - Every punch is a sendmsg() of a complete IPv6 packet on an IPPROTO_RAW
+ *    socket, hard-linked to the close() of the socket that was passed in,
+ *    so that socket is closed whether or not the send succeeds.
+ *  - The submissions of a burst enter the kernel together, in the same
+ *    io_uring_enter() that waits for the next completions.
+ *
+ * The epoll instance of the main loop is polled through the ring as well,
+ * so sessions, learning and confirmations keep running as event handlers.
+ * Session requests and probes still go to the workers, and so do datagram
+ * requests when the ring runs out of slots.  The address of the sender is
+ * received along with each datagram, for requests that ask for a reply.
+ *
+ * The system calls are made directly, so there is no dependency on liburing.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+
+#include <netinet/in.h>
+
+#include <linux/io_uring.h>
+
+#include <sys/socketsynergy.h>
+
+#include "daemon.h"
+#include "libsynergy.h"
+
+
+/* The sizes of the submission and completion queues, the number of punches
+ * that can be in flight, and the number of receive buffers.  A buffer holds
+ * the largest datagram with its sockets.
+ */
+#define URING_ENTRIES 512
+#define URING_CQ_ENTRIES 4096
+#define URING_SLOTS 1024
+#define URING_BUFS 64
+#define URING_BGID 0
+
+#define URING_CONTROL (CMSG_SPACE (sizeof (struct ucred)) + CMSG_SPACE (sizeof (int) * SYNERGY_BATCH_MAX))
+#define URING_BUFSZ (sizeof (struct io_uring_recvmsg_out) + sizeof (struct sockaddr_un) \
+		+ URING_CONTROL + SYNERGY_WIRE_MAX)
+
+/* The kind of submission is in the upper half of its user data, and the
+ * slot of a punch in the lower half.
+ */
+#define URING_RECV  1ULL
+#define URING_EPOLL 2ULL
+#define URING_SEND  3ULL
+#define URING_CLOSE 4ULL
+
+
+/* A punch in flight, with the message that sends it.
+ */
+struct uring_slot {
+	struct msghdr mgh;
+	struct iovec iov;
+	struct sockaddr_in6 dst;
+	uint64_t received;
+	struct wire_reply *reply;
+	uint16_t replyidx;
+	uint8_t packet [SYNERGY_PACKET_MAX];
+};
+
+
+struct uring {
+	int fd;
+	int sox;
+	int epfd;
+	int rawsox;
+	//
+	// The submission queue, with our own tail until it is published
+	uint32_t *sqhead;
+	uint32_t *sqtail;
+	uint32_t *sqmask;
+	uint32_t *sqarray;
+	uint32_t sqentries;
+	struct io_uring_sqe *sqes;
+	uint32_t sqlocal;
+	uint32_t sqsubmitted;
+	//
+	// The completion queue
+	uint32_t *cqhead;
+	uint32_t *cqtail;
+	uint32_t *cqmask;
+	struct io_uring_cqe *cqes;
+	//
+	// The receive buffers, and the message that describes their layout
+	struct io_uring_buf_ring *bufring;
+	uint8_t *bufs;
+	uint16_t buftail;
+	struct msghdr recvmsg;
+	//
+	// The punches in flight
+	struct uring_slot *slots;
+	int *freeslots;
+	int numfree;
+};
+
+static struct uring ur;
+
+
+static int uring_enter (unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+	return syscall (__NR_io_uring_enter, ur.fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+
+/* Submit what was queued, and optionally wait for completions.
+ */
+static int uring_submit_wait (unsigned int min_complete) {
+	int done;
+	__atomic_store_n (ur.sqtail, ur.sqlocal, __ATOMIC_RELEASE);
+	done = uring_enter (ur.sqlocal - ur.sqsubmitted, min_complete,
+			(min_complete > 0) ? IORING_ENTER_GETEVENTS : 0);
+	if (done > 0) {
+		ur.sqsubmitted += done;
+	}
+	return done;
+}
+
+
+/* Get submission queue entries, flushing the queue when fewer than the
+ * given number are free.  Entries that are used together, such as linked
+ * ones, must be taken together.  Returns NULL when the kernel is behind.
+ */
+static struct io_uring_sqe *uring_sqe (int needed) {
+	struct io_uring_sqe *sqe;
+	uint32_t idx;
+	if (ur.sqlocal - __atomic_load_n (ur.sqhead, __ATOMIC_ACQUIRE) + needed > ur.sqentries) {
+		uring_submit_wait (0);
+		if (ur.sqlocal - __atomic_load_n (ur.sqhead, __ATOMIC_ACQUIRE) + needed > ur.sqentries) {
+			return NULL;
+		}
+	}
+	idx = ur.sqlocal & *ur.sqmask;
+	sqe = &ur.sqes [idx];
+	memset (sqe, 0, sizeof (*sqe));
+	ur.sqarray [idx] = idx;
+	ur.sqlocal++;
+	return sqe;
+}
+
+
+/* Return a receive buffer to the provided buffer ring.
+ */
+static void uring_buffer (uint16_t bid) {
+	struct io_uring_buf *buf = &ur.bufring->bufs [ur.buftail & (URING_BUFS - 1)];
+	buf->addr = (uintptr_t) (ur.bufs + bid * URING_BUFSZ);
+	buf->len = URING_BUFSZ;
+	buf->bid = bid;
+	ur.buftail++;
+	__atomic_store_n (&ur.bufring->tail, ur.buftail, __ATOMIC_RELEASE);
+}
+
+
+/* Arm the multishot receive on the datagram socket, and the multishot poll
+ * on the epoll instance.  They stay armed until they run out of buffers or
+ * hit an error.
+ */
+static int uring_arm_recv (void) {
+	struct io_uring_sqe *sqe = uring_sqe (1);
+	if (sqe == NULL) {
+		return -1;
+	}
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = ur.sox;
+	sqe->addr = (uintptr_t) &ur.recvmsg;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = URING_RECV << 32;
+	return 0;
+}
+
+static int uring_arm_epoll (void) {
+	struct io_uring_sqe *sqe = uring_sqe (1);
+	if (sqe == NULL) {
+		return -1;
+	}
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = ur.epfd;
+	sqe->poll32_events = EPOLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = URING_EPOLL << 32;
+	return 0;
+}
+
+
+/* Close a passed socket through the ring, or directly when it is full.
+ */
+static void uring_close (int sockfd) {
+	struct io_uring_sqe *sqe;
+	if (sockfd == -1) {
+		return;
+	}
+	sqe = uring_sqe (1);
+	if (sqe == NULL) {
+		close (sockfd);
+		return;
+	}
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = sockfd;
+	sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+	sqe->user_data = URING_CLOSE << 32;
+}
+
+
+int uring_submit (struct job *jobs, int count) {
+	struct io_uring_sqe *sqe;
+	struct uring_slot *slot;
+	ssize_t len;
+	int i, s;
+	for (i = 0; i < count; i++) {
+		struct job *job = &jobs [i];
+		if ((job->session != NULL) || (job->marker != 0)) {
+			//
+			// Sessions are completed by the workers, who also mark probes
+			if (workers_submit (job, 1) == 0) {
+				break;
+			}
+			continue;
+		}
+		if (ur.numfree == 0) {
+			break;
+		}
+		s = ur.freeslots [ur.numfree - 1];
+		slot = &ur.slots [s];
+		len = -1;
+		if (wire_check (job) == 0) {
+			len = synergy_packet_hinted (job->sockfd, &job->hint, job->hoplimit,
+					&job->symcli, slot->packet, sizeof (slot->packet));
+		}
+		if (len == -1) {
+			int err = errno;
+			synergy_trace (SYNERGY_TRACE_URING, NULL, 0, &job->symcli.sin6_addr,
+					job->symcli.sin6_port, 0, job->hoplimit, err);
+			metrics_punch (metrics_shard (0), 0, err, 0);
+			if (job->reply != NULL) {
+				wire_complete (job->reply, job->replyidx, err);
+			}
+			uring_close (job->sockfd);
+			continue;
+		}
+		sqe = uring_sqe ((job->sockfd != -1) ? 2 : 1);
+		if (sqe == NULL) {
+			break;
+		}
+		ur.numfree--;
+		memcpy (&slot->dst, &job->symcli, sizeof (slot->dst));
+		slot->received = job->received;
+		slot->reply = job->reply;
+		slot->replyidx = job->replyidx;
+		slot->dst.sin6_port = htons (0);
+		slot->iov.iov_base = slot->packet;
+		slot->iov.iov_len = len;
+		memset (&slot->mgh, 0, sizeof (slot->mgh));
+		slot->mgh.msg_name = &slot->dst;
+		slot->mgh.msg_namelen = sizeof (slot->dst);
+		slot->mgh.msg_iov = &slot->iov;
+		slot->mgh.msg_iovlen = 1;
+		//
+		// Send the punch, and then close the socket regardless; without
+		// a socket, a hard link would chain onto whatever comes next
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = ur.rawsox;
+		sqe->addr = (uintptr_t) &slot->mgh;
+		sqe->len = 1;
+		sqe->msg_flags = MSG_NOSIGNAL;
+		sqe->flags = (job->sockfd != -1) ? IOSQE_IO_HARDLINK : 0;
+		sqe->user_data = (URING_SEND << 32) | s;
+		uring_close (job->sockfd);
+	}
+	//
+	// Leave what does not fit in the ring to the workers
+	if (i < count) {
+		return i + workers_submit (jobs + i, count - i);
+	}
+	return count;
+}
+
+
+/* Handle a buffer with a datagram from the multishot receive.  The buffer
+ * starts with a description, followed by the control data and the payload.
+ */
+static void uring_datagram (struct io_uring_cqe *cqe) {
+	uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	uint8_t *buf = ur.bufs + bid * URING_BUFSZ;
+	struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *) buf;
+	struct msghdr mgh;
+	struct iovec iov;
+	memset (&mgh, 0, sizeof (mgh));
+	mgh.msg_name = buf + sizeof (*out);
+	mgh.msg_namelen = (out->namelen < ur.recvmsg.msg_namelen) ? out->namelen : ur.recvmsg.msg_namelen;
+	mgh.msg_control = buf + sizeof (*out) + ur.recvmsg.msg_namelen;
+	mgh.msg_controllen = out->controllen;
+	mgh.msg_flags = out->flags;
+	iov.iov_base = (uint8_t *) mgh.msg_control + ur.recvmsg.msg_controllen;
+	iov.iov_len = out->payloadlen;
+	mgh.msg_iov = &iov;
+	mgh.msg_iovlen = 1;
+	handle_datagram (&mgh, out->payloadlen);
+	uring_buffer (bid);
+}
+
+
+int uring_start (int sox, int epfd) {
+	struct io_uring_params params;
+	struct io_uring_buf_reg reg;
+	uint8_t *sqring, *cqring;
+	size_t sqlen, cqlen;
+	int i;
+	memset (&ur, 0, sizeof (ur));
+	ur.sox = sox;
+	ur.epfd = epfd;
+	//
+	// Create the ring, and insist on the features that we use
+	memset (&params, 0, sizeof (params));
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+	params.cq_entries = URING_CQ_ENTRIES;
+	ur.fd = syscall (__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (ur.fd == -1) {
+		return -1;
+	}
+	if ((params.features & (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_CQE_SKIP))
+			!= (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_CQE_SKIP)) {
+		errno = EOPNOTSUPP;
+		goto fail;
+	}
+	//
+	// Map the queues, which share one mapping
+	sqlen = params.sq_off.array + params.sq_entries * sizeof (uint32_t);
+	cqlen = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+	sqring = mmap (NULL, (sqlen > cqlen) ? sqlen : cqlen, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ur.fd, IORING_OFF_SQ_RING);
+	if (sqring == MAP_FAILED) {
+		goto fail;
+	}
+	cqring = sqring;
+	ur.sqes = mmap (NULL, params.sq_entries * sizeof (struct io_uring_sqe), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ur.fd, IORING_OFF_SQES);
+	if (ur.sqes == MAP_FAILED) {
+		goto fail;
+	}
+	ur.sqhead  = (uint32_t *) (sqring + params.sq_off.head);
+	ur.sqtail  = (uint32_t *) (sqring + params.sq_off.tail);
+	ur.sqmask  = (uint32_t *) (sqring + params.sq_off.ring_mask);
+	ur.sqarray = (uint32_t *) (sqring + params.sq_off.array);
+	ur.sqentries = params.sq_entries;
+	ur.sqlocal = *ur.sqtail;
+	ur.sqsubmitted = ur.sqlocal;
+	ur.cqhead  = (uint32_t *) (cqring + params.cq_off.head);
+	ur.cqtail  = (uint32_t *) (cqring + params.cq_off.tail);
+	ur.cqmask  = (uint32_t *) (cqring + params.cq_off.ring_mask);
+	ur.cqes    = (struct io_uring_cqe *) (cqring + params.cq_off.cqes);
+	//
+	// Register the receive buffers
+	ur.bufring = mmap (NULL, URING_BUFS * sizeof (struct io_uring_buf), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	ur.bufs = malloc (URING_BUFS * URING_BUFSZ);
+	if ((ur.bufring == MAP_FAILED) || (ur.bufs == NULL)) {
+		goto fail;
+	}
+	memset (&reg, 0, sizeof (reg));
+	reg.ring_addr = (uintptr_t) ur.bufring;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = URING_BGID;
+	if (syscall (__NR_io_uring_register, ur.fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+		goto fail;
+	}
+	for (i = 0; i < URING_BUFS; i++) {
+		uring_buffer (i);
+	}
+	ur.recvmsg.msg_namelen = sizeof (struct sockaddr_un);
+	ur.recvmsg.msg_controllen = URING_CONTROL;
+	//
+	// Prepare the slots for punches, and the socket to send them on
+	ur.slots = calloc (URING_SLOTS, sizeof (struct uring_slot));
+	ur.freeslots = calloc (URING_SLOTS, sizeof (int));
+	if ((ur.slots == NULL) || (ur.freeslots == NULL)) {
+		goto fail;
+	}
+	for (i = 0; i < URING_SLOTS; i++) {
+		ur.freeslots [ur.numfree++] = i;
+	}
+	ur.rawsox = socket (PF_INET6, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_RAW);
+	if (ur.rawsox == -1) {
+		goto fail;
+	}
+	fairq_pace (ur.rawsox);
+	//
+	// Start receiving, and see that the kernel takes it
+	if ((uring_arm_recv () == -1) || (uring_arm_epoll () == -1)
+			|| (uring_submit_wait (0) == -1)) {
+		goto fail;
+	}
+	return 0;
+fail:
+	i = errno;
+	close (ur.fd);
+	errno = i;
+	return -1;
+}
+
+
+void uring_run (void) {
+	struct metrics_shard *metrics = metrics_shard (0);
+	struct io_uring_cqe *cqe;
+	struct uring_slot *slot;
+	uint32_t head, tail;
+	while (1) {
+		if ((uring_submit_wait (shmrings_idle () ? 1 : 0) == -1) && (errno != EINTR) && (errno != EBUSY)) {
+			perror ("Failed to enter io_uring of synergy.d");
+			exit (1);
+		}
+		head = *ur.cqhead;
+		tail = __atomic_load_n (ur.cqtail, __ATOMIC_ACQUIRE);
+		while (head != tail) {
+			cqe = &ur.cqes [head & *ur.cqmask];
+			switch (cqe->user_data >> 32) {
+			case URING_RECV:
+				if (cqe->flags & IORING_CQE_F_BUFFER) {
+					uring_datagram (cqe);
+				} else if (cqe->res != -ENOBUFS) {
+					fprintf (stderr, "Failed to receive in io_uring of synergy.d: %s\n",
+							strerror (-cqe->res));
+				}
+				if (!(cqe->flags & IORING_CQE_F_MORE)) {
+					uring_arm_recv ();
+				}
+				break;
+			case URING_EPOLL:
+				evloop_poll (0);
+				if (!(cqe->flags & IORING_CQE_F_MORE)) {
+					uring_arm_epoll ();
+				}
+				break;
+			case URING_SEND:
+				slot = &ur.slots [cqe->user_data & 0xffffffff];
+				metrics_punch (metrics, slot->packet [6],
+						(cqe->res < 0) ? -cqe->res : 0,
+						metrics_now () - slot->received);
+				synergy_trace_packet (SYNERGY_TRACE_URING, slot->packet,
+						(cqe->res < 0) ? -cqe->res : 0);
+				if (slot->reply != NULL) {
+					wire_complete (slot->reply, slot->replyidx,
+							(cqe->res < 0) ? -cqe->res : 0);
+				}
+				ur.freeslots [ur.numfree++] = cqe->user_data & 0xffffffff;
+				break;
+			case URING_CLOSE:
+				break;
+			}
+			head++;
+			__atomic_store_n (ur.cqhead, head, __ATOMIC_RELEASE);
+		}
+		shmrings_poll ();
+		fairq_dispatch ();
+	}
+}
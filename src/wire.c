@@ -0,0 +1,271 @@
+/* wire.c -- The second version of the request format for synergy.d
+ *
+ * The first version of the request format carries a peer and a hop limit
+ * per socket, and nothing else.  The daemon then has to ask the kernel for
+ * the protocol and local address of every socket, and it cannot tell the
+ * client how its punches went.  The second version starts with a header
+ * that names its version and the size of its requests, and its requests
+ * carry a request id, hints about their socket, and an index into the
+ * sockets of the message, so requests can share a socket.
+ *
+ * Hints are checked against the socket, because a client that could lie
+ * about them could have punches sent from the ports of others.  The outcome
+ * of the check is cached per thread by the inode of the socket, so that
+ * a socket that is punched again costs one fstat() instead of getsockname()
+ * and getsockopt().  A daemon that only serves trusted clients can be told
+ * to skip the check, which leaves no system calls to construct a punch,
+ * besides a route lookup for sockets that are not bound to an address.
+ *
+ * A datagram that asks for a reply gets one when all its jobs completed,
+ * from whichever thread completed the last one.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <netinet/in.h>
+
+#include <sys/socketsynergy.h>
+
+#include "daemon.h"
+
+
+_Static_assert (sizeof (struct synergy_wire_header) == 8, "Wire headers are 8 bytes");
+_Static_assert (sizeof (struct synergy_wire_request) == 64, "Wire requests are 64 bytes");
+
+
+/* The number of sockets whose hints are remembered per thread.
+ */
+#define WIRE_SEEN 4096
+
+
+/* A reply collects the completions of the jobs of one datagram, and is
+ * sent when the last one is in.
+ */
+struct wire_reply {
+	int refs;
+	socklen_t peerlen;
+	struct sockaddr_un peer;
+	struct synergy_wire_header hdr;
+	struct synergy_completion cpl [];
+};
+
+
+struct wire_seen {
+	dev_t dev;
+	ino_t ino;
+	struct synergy_hint hint;
+};
+
+static __thread struct wire_seen *seen;
+static int wiresox = -1;
+static int wiretrust = 0;
+
+
+void wire_start (int sox, int trusted) {
+	wiresox = sox;
+	wiretrust = trusted;
+}
+
+
+int wire_parse (const void *msg, size_t len, int *fds, int fdcnt,
+			struct job *jobs, struct synergy_wire_request *reqs, uint8_t *flags) {
+	struct synergy_wire_header hdr;
+	uint8_t used [SYNERGY_BATCH_MAX];
+	uint64_t now;
+	int i;
+	//
+	// Validate the structure of the message
+	if (len < sizeof (hdr)) {
+		goto malformed;
+	}
+	memcpy (&hdr, msg, sizeof (hdr));
+	if ((hdr.magic != SYNERGY_WIRE_MAGIC) || (hdr.version < SYNERGY_WIRE_VERSION)
+			|| (hdr.count == 0) || (hdr.count > SYNERGY_BATCH_MAX)
+			|| (hdr.entsize < sizeof (struct synergy_wire_request))
+			|| (len != sizeof (hdr) + (size_t) hdr.count * hdr.entsize)
+			|| (fdcnt > SYNERGY_BATCH_MAX)) {
+		goto malformed;
+	}
+	for (i = 0; i < hdr.count; i++) {
+		memcpy (&reqs [i], (const uint8_t *) msg + sizeof (hdr) + i * hdr.entsize, sizeof (reqs [i]));
+		if (reqs [i].fdindex >= fdcnt) {
+			goto malformed;
+		}
+	}
+	*flags = hdr.flags;
+	//
+	// Give every job a socket of its own, and close those not used
+	memset (used, 0, sizeof (used));
+	for (i = 0; i < hdr.count; i++) {
+		int fd = fds [reqs [i].fdindex];
+		if (used [reqs [i].fdindex]) {
+			fd = fcntl (fd, F_DUPFD_CLOEXEC, 0);
+			if (fd == -1) {
+				int err = errno;
+				while (i-- > 0) {
+					if (jobs [i].sockfd != fds [reqs [i].fdindex]) {
+						close (jobs [i].sockfd);
+					}
+				}
+				for (i = 0; i < fdcnt; i++) {
+					close (fds [i]);
+				}
+				errno = err;
+				return -1;
+			}
+		}
+		used [reqs [i].fdindex] = 1;
+		jobs [i].sockfd = fd;
+	}
+	for (i = 0; i < fdcnt; i++) {
+		if (!used [i]) {
+			close (fds [i]);
+		}
+	}
+	//
+	// Fill in the jobs, with their hints and the hop limits that apply
+	now = metrics_now ();
+	for (i = 0; i < hdr.count; i++) {
+		struct job *job = &jobs [i];
+		struct synergy_wire_request *req = &reqs [i];
+		memcpy (&job->symcli, &req->symcli, sizeof (job->symcli));
+		job->hoplimit = hoplearn_apply (&job->symcli, req->hoplimit);
+		job->session = NULL;
+		job->confirm = NULL;
+		job->reply = NULL;
+		job->replyidx = i;
+		job->tag = req->reqid;
+		job->received = now;
+		job->deadline = (req->deadline_ms != 0) ? now + req->deadline_ms * 1000000ULL : 0;
+		job->marker = 0;
+		memset (&job->hint, 0, sizeof (job->hint));
+		if (req->proto != 0) {
+			memcpy (&job->hint.local, &req->local, sizeof (job->hint.local));
+			job->hint.scope = req->symcli.sin6_scope_id;
+			job->hint.localport = req->localport;
+			job->hint.proto = req->proto;
+		}
+	}
+	return hdr.count;
+malformed:
+	for (i = 0; i < fdcnt; i++) {
+		close (fds [i]);
+	}
+	errno = EPROTO;
+	return -1;
+}
+
+
+int wire_jobs (struct msghdr *mgh, ssize_t len, int *fds, int fdcnt, struct job *jobs) {
+	static struct synergy_wire_request reqs [SYNERGY_BATCH_MAX];
+	struct wire_reply *wr;
+	uint8_t flags;
+	int reqcnt;
+	int i;
+	reqcnt = wire_parse (mgh->msg_iov->iov_base, len, fds, fdcnt, jobs, reqs, &flags);
+	if (reqcnt == -1) {
+		return -1;
+	}
+	//
+	// Setup a reply when asked, and when there is someone to send it to
+	if (!(flags & SYNERGY_WIRE_REPLY) || (mgh->msg_namelen <= sizeof (sa_family_t))) {
+		return reqcnt;
+	}
+	wr = calloc (1, sizeof (*wr) + reqcnt * sizeof (struct synergy_completion));
+	if (wr == NULL) {
+		return reqcnt;
+	}
+	wr->refs = reqcnt;
+	wr->peerlen = mgh->msg_namelen;
+	memcpy (&wr->peer, mgh->msg_name, wr->peerlen);
+	wr->hdr.magic = SYNERGY_WIRE_MAGIC;
+	wr->hdr.version = SYNERGY_WIRE_VERSION;
+	wr->hdr.flags = SYNERGY_WIRE_REPLY;
+	wr->hdr.count = reqcnt;
+	wr->hdr.entsize = sizeof (struct synergy_completion);
+	for (i = 0; i < reqcnt; i++) {
+		wr->cpl [i].tag = reqs [i].reqid;
+		jobs [i].reply = wr;
+	}
+	return reqcnt;
+}
+
+
+void wire_complete (struct wire_reply *wr, uint16_t idx, int error) {
+	struct iovec iov [2];
+	struct msghdr mgh;
+	wr->cpl [idx].error = error;
+	if (__atomic_sub_fetch (&wr->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+		return;
+	}
+	iov [0].iov_base = &wr->hdr;
+	iov [0].iov_len = sizeof (wr->hdr);
+	iov [1].iov_base = wr->cpl;
+	iov [1].iov_len = wr->hdr.count * sizeof (struct synergy_completion);
+	memset (&mgh, 0, sizeof (mgh));
+	mgh.msg_name = &wr->peer;
+	mgh.msg_namelen = wr->peerlen;
+	mgh.msg_iov = iov;
+	mgh.msg_iovlen = 2;
+	sendmsg (wiresox, &mgh, MSG_DONTWAIT | MSG_NOSIGNAL);
+	free (wr);
+}
+
+
+static int wire_same (const struct synergy_hint *a, const struct synergy_hint *b) {
+	return (a->proto == b->proto) && (a->localport == b->localport)
+			&& (memcmp (&a->local, &b->local, sizeof (a->local)) == 0);
+}
+
+
+int wire_check (struct job *job) {
+	struct wire_seen *ws;
+	struct stat st;
+	if ((job->hint.proto == 0) || (job->sockfd == -1) || wiretrust) {
+		return 0;
+	}
+	if (seen == NULL) {
+		seen = calloc (WIRE_SEEN, sizeof (struct wire_seen));
+		if (seen == NULL) {
+			return -1;
+		}
+	}
+	if (fstat (job->sockfd, &st) == -1) {
+		return -1;
+	}
+	ws = &seen [st.st_ino % WIRE_SEEN];
+	if ((ws->ino != st.st_ino) || (ws->dev != st.st_dev) || !wire_same (&ws->hint, &job->hint)) {
+		//
+		// Ask the kernel, and remember the answer for the socket
+		ws->ino = 0;
+		if (synergy_describe (job->sockfd, &ws->hint) == -1) {
+			return -1;
+		}
+		ws->dev = st.st_dev;
+		ws->ino = st.st_ino;
+		if (!wire_same (&ws->hint, &job->hint)) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+	if (ws->hint.scope != 0) {
+		job->hint.scope = ws->hint.scope;
+	}
+	return 0;
+}
@@ -0,0 +1,239 @@
+/* workers.c -- The pool of worker threads that send punches for synergy.d
+ *
+ * Every worker has a bounded queue of jobs and a private set of RAW sockets.
+ * The main loop adds jobs to the queues in a round-robin fashion, one job
+ * per worker per turn, skipping over workers whose queue is full.  Workers
+ * take out as many jobs as fit in one batch, and send them with a single
+ * synergy_rawset_many() call.
+ *
+ * The RAW sockets are non-blocking, so a worker does not stall when the
+ * kernel cannot take in more packets; those punches fail with EAGAIN.
+ *
+ * With a ring backend, the worker writes frames into its rings first, and
+ * only sends the punches that the rings cannot take with its RAW sockets.
+ *
+ * Jobs may come with hints about their socket, which are checked first and
+ * then used to construct the punch, instead of asking the kernel.  Probes
+ * carry a marker, and are sent one by one with the RAW sockets of the
+ * library, as the rings cannot mark them.
+ *
+ * Jobs that reach a worker after their deadline are not sent, but fail
+ * with ETIMEDOUT, and are counted as expired rather than as punches.
+ *
+ * Failures are not logged, but counted in the metrics shard of the worker,
+ * along with the punches and their latency since the main loop took them in.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/socketsynergy.h>
+
+#include "daemon.h"
+
+
+/* The number of jobs that a worker takes out of its queue at once.
+ */
+#define WORKER_BATCH 64
+
+
+struct worker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+	struct synergy_rawset raw;
+	struct txring *tx;
+	struct metrics_shard *metrics;
+	struct job *queue;
+	int queuelen;
+	int head;
+	int count;
+};
+
+static struct worker workers [WORKERS_MAX];
+static int numworkers = 0;
+static int nextworker = 0;
+
+
+/* Take jobs out of the queue and send them, forever.
+ */
+static void *worker_main (void *arg) {
+	struct worker *w = arg;
+	struct job jobs [WORKER_BATCH];
+	struct synergy_punch punches [WORKER_BATCH];
+	struct synergy_punch rawpunches [WORKER_BATCH];
+	struct synergy_hint hints [WORKER_BATCH];
+	struct synergy_hint rawhints [WORKER_BATCH];
+	int rawidx [WORKER_BATCH];
+	uint8_t expired [WORKER_BATCH];
+	uint64_t now;
+	int todo;
+	int rawcnt;
+	int i;
+	while (1) {
+		//
+		// Wait for jobs, and take out as many as we can handle at once
+		pthread_mutex_lock (&w->lock);
+		while (w->count == 0) {
+			pthread_cond_wait (&w->wakeup, &w->lock);
+		}
+		todo = w->count;
+		if (todo > WORKER_BATCH) {
+			todo = WORKER_BATCH;
+		}
+		for (i = 0; i < todo; i++) {
+			jobs [i] = w->queue [w->head];
+			w->head = (w->head + 1) % w->queuelen;
+		}
+		w->count -= todo;
+		pthread_mutex_unlock (&w->lock);
+		//
+		// Check the hints of the clients, and fail the punches that
+		// do not match their socket or that passed their deadline
+		now = metrics_now ();
+		for (i = 0; i < todo; i++) {
+			punches [i].sockfd = jobs [i].sockfd;
+			punches [i].hoplimit = jobs [i].hoplimit;
+			punches [i].symcli = &jobs [i].symcli;
+			punches [i].status = TXRING_FALLBACK;
+			punches [i].proto = 0;
+			expired [i] = (jobs [i].deadline != 0) && (now > jobs [i].deadline);
+			if (expired [i]) {
+				punches [i].status = ETIMEDOUT;
+				metrics_add (&w->metrics->expired, 1);
+			} else if (wire_check (&jobs [i]) == -1) {
+				punches [i].status = errno;
+			} else if (jobs [i].marker != 0) {
+				synergy_marked_hinted (&punches [i], &jobs [i].hint, jobs [i].marker);
+			}
+			hints [i] = jobs [i].hint;
+		}
+		//
+		// Send the punches through our rings, if any, and send the
+		// rest with our own RAW sockets
+		if (w->tx != NULL) {
+			txring_many (w->tx, punches, hints, todo);
+		}
+		rawcnt = 0;
+		for (i = 0; i < todo; i++) {
+			if (punches [i].status == TXRING_FALLBACK) {
+				rawpunches [rawcnt] = punches [i];
+				rawhints [rawcnt] = hints [i];
+				rawidx [rawcnt++] = i;
+			}
+		}
+		if (rawcnt > 0) {
+			synergy_rawset_hinted (&w->raw, rawpunches, rawhints, rawcnt);
+			for (i = 0; i < rawcnt; i++) {
+				punches [rawidx [i]].status = rawpunches [i].status;
+				punches [rawidx [i]].proto = rawpunches [i].proto;
+			}
+		}
+		now = metrics_now ();
+		for (i = 0; i < todo; i++) {
+			if (!expired [i]) {
+				metrics_punch (w->metrics, punches [i].proto, punches [i].status,
+						now - jobs [i].received);
+			}
+		}
+		//
+		// Close the sockets -- we got them as duplicate file handles
+		for (i = 0; i < todo; i++) {
+			if (jobs [i].sockfd != -1) {
+				close (jobs [i].sockfd);
+			}
+		}
+		//
+		// Report the outcome to the sessions that are waiting for it,
+		// to the confirmations that now wait for a reply, or into the
+		// reply to a datagram
+		for (i = 0; i < todo; i++) {
+			if (jobs [i].reply != NULL) {
+				wire_complete (jobs [i].reply, jobs [i].replyidx, punches [i].status);
+			} else if (jobs [i].confirm != NULL) {
+				confirm_sent (jobs [i].confirm, punches [i].status);
+			} else if (jobs [i].session != NULL) {
+				session_complete (jobs [i].session, jobs [i].tag,
+						punches [i].status, 0);
+			}
+		}
+	}
+	return NULL;
+}
+
+
+int workers_start (int count, int queuelen, int txbackend) {
+	int i, j;
+	if ((count < 1) || (count > WORKERS_MAX) || (queuelen < 1)) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		struct worker *w = &workers [i];
+		memset (w, 0, sizeof (*w));
+		w->queuelen = queuelen;
+		w->metrics = metrics_shard (1 + i);
+		w->queue = calloc (queuelen, sizeof (struct job));
+		if (w->queue == NULL) {
+			return -1;
+		}
+		if (synergy_rawset_open (&w->raw) == -1) {
+			return -1;
+		}
+		for (j = 0; j < 3; j++) {
+			fcntl (w->raw.sox [j], F_SETFL, O_NONBLOCK);
+			fairq_pace (w->raw.sox [j]);
+		}
+		if (txbackend != TXBACKEND_RAW) {
+			w->tx = txring_open (txbackend, i);
+			if (w->tx == NULL) {
+				fprintf (stderr, "No transmit rings for worker %d, using RAW sockets: %s\n",
+						i, strerror (errno));
+			}
+		}
+		pthread_mutex_init (&w->lock, NULL);
+		pthread_cond_init (&w->wakeup, NULL);
+		errno = pthread_create (&w->thread, NULL, worker_main, w);
+		if (errno != 0) {
+			return -1;
+		}
+		numworkers++;
+	}
+	return 0;
+}
+
+
+int workers_submit (struct job *jobs, int count) {
+	int done;
+	int tried;
+	for (done = 0; done < count; done++) {
+		//
+		// Give the job to the next worker that has room for it
+		for (tried = 0; tried < numworkers; tried++) {
+			struct worker *w = &workers [nextworker];
+			nextworker = (nextworker + 1) % numworkers;
+			pthread_mutex_lock (&w->lock);
+			if (w->count < w->queuelen) {
+				w->queue [(w->head + w->count) % w->queuelen] = jobs [done];
+				w->count++;
+				pthread_cond_signal (&w->wakeup);
+				pthread_mutex_unlock (&w->lock);
+				break;
+			}
+			pthread_mutex_unlock (&w->lock);
+		}
+		if (tried == numworkers) {
+			break;
+		}
+	}
+	return done;
+}
@@ -0,0 +1,183 @@
+/* checksums.c -- Check the checksums of punches against known values
+ *
+ * The CRC32c is checked against the check value of the Castagnoli CRC and
+ * the vectors of RFC 3720, both with the instruction of the CPU, when it
+ * has one, and with the table.  The Internet checksum is checked against
+ * the TCP and UDP frames in doc/packets, whose checksums were computed
+ * independently, since they were captured without.
+ *
+ * Finally, punches are built for every protocol, and their checksums are
+ * verified with plain implementations from the RFCs.  This needs neither
+ * a socket nor privileges.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+
+#include "../src/libsynergy.h"
+
+
+static int failed = 0;
+
+static void check (const char *what, uint32_t got, uint32_t want) {
+	if (got != want) {
+		fprintf (stderr, "%s: got 0x%08x, want 0x%08x\n", what, got, want);
+		failed++;
+	}
+}
+
+
+/* The Internet checksum of RFC 1071 over the IPv6 pseudo header and the
+ * transport header, one word at a time.
+ */
+static uint16_t reference_csum (const struct ip6_hdr *ip6, const uint8_t *seg, size_t len) {
+	uint32_t sum = 0;
+	size_t i;
+	for (i = 0; i < 16; i += 2) {
+		sum += (ip6->ip6_src.s6_addr [i] << 8) | ip6->ip6_src.s6_addr [i + 1];
+		sum += (ip6->ip6_dst.s6_addr [i] << 8) | ip6->ip6_dst.s6_addr [i + 1];
+	}
+	sum += len + ip6->ip6_nxt;
+	for (i = 0; i < len; i += 2) {
+		sum += (seg [i] << 8) | ((i + 1 < len) ? seg [i + 1] : 0);
+	}
+	while (sum >> 16) {
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+	return ~sum;
+}
+
+/* The CRC32c of RFC 3309, one bit at a time.
+ */
+static uint32_t reference_crc32c (const uint8_t *p, size_t len) {
+	uint32_t crc = ~0U;
+	int bit;
+	while (len-- > 0) {
+		crc ^= *p++;
+		for (bit = 0; bit < 8; bit++) {
+			crc = (crc >> 1) ^ ((crc & 1) ? 0x82f63b78 : 0);
+		}
+	}
+	return ~crc;
+}
+
+
+static void check_crc32c (void) {
+	uint8_t buf [64 + 8];
+	unsigned int len, ofs, i;
+	check ("crc32c check value", synergy_crc32c ("123456789", 9), 0xe3069283);
+	check ("crc32c check value, table", synergy_crc32c_portable ("123456789", 9), 0xe3069283);
+	memset (buf, 0x00, 32);
+	check ("crc32c zeroes", synergy_crc32c (buf, 32), 0x8a9136aa);
+	check ("crc32c zeroes, table", synergy_crc32c_portable (buf, 32), 0x8a9136aa);
+	memset (buf, 0xff, 32);
+	check ("crc32c ones", synergy_crc32c (buf, 32), 0x62a8ab43);
+	check ("crc32c ones, table", synergy_crc32c_portable (buf, 32), 0x62a8ab43);
+	for (i = 0; i < 32; i++) {
+		buf [i] = i;
+	}
+	check ("crc32c incrementing", synergy_crc32c (buf, 32), 0x46dd794e);
+	check ("crc32c incrementing, table", synergy_crc32c_portable (buf, 32), 0x46dd794e);
+	//
+	// Cover every tail of the wide instructions, at every alignment
+	for (i = 0; i < sizeof (buf); i++) {
+		buf [i] = i * 37 + 11;
+	}
+	for (ofs = 0; ofs < 8; ofs++) {
+		for (len = 0; len <= 64; len++) {
+			uint32_t want = reference_crc32c (buf + ofs, len);
+			if ((synergy_crc32c (buf + ofs, len) != want)
+					|| (synergy_crc32c_portable (buf + ofs, len) != want)) {
+				fprintf (stderr, "crc32c of %u bytes at offset %u is wrong\n", len, ofs);
+				failed++;
+			}
+		}
+	}
+}
+
+
+/* The TCP SYN and the UDP datagram in doc/packets, from port 9999 to 7777.
+ */
+static void check_frames (void) {
+	static const uint8_t tcp [20] = {
+		0x27, 0x0f, 0x1e, 0x61, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0x00, 0x00, 0x50, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	};
+	static const uint8_t udp [8] = {
+		0x27, 0x0f, 0x1e, 0x61, 0x00, 0x08, 0x00, 0x00,
+	};
+	struct in6_addr src, dst;
+	uint64_t sum;
+	inet_pton (AF_INET6, "2001:db8:420a:1::11", &src);
+	inet_pton (AF_INET6, "2001:db8:420a:1::5", &dst);
+	sum = synergy_csum_addrs (&src, &dst) + sizeof (tcp) + IPPROTO_TCP;
+	sum = synergy_csum_add (sum, tcp, sizeof (tcp));
+	check ("tcp frame", (uint16_t) ~synergy_csum_fold (sum), 0x8ad4);
+	sum = synergy_csum_addrs (&src, &dst) + sizeof (udp) + IPPROTO_UDP;
+	sum = synergy_csum_add (sum, udp, sizeof (udp));
+	check ("udp frame", (uint16_t) ~synergy_csum_fold (sum), 0xdacf);
+}
+
+
+/* Build a punch for every protocol, and verify it as a receiver would.
+ */
+static void check_punches (void) {
+	static const uint8_t protos [3] = { IPPROTO_TCP, IPPROTO_UDP, IPPROTO_SCTP };
+	uint8_t pkt [SYNERGY_PACKET_MAX];
+	struct synergy_hint hint;
+	struct sockaddr_in6 peer;
+	struct ip6_hdr *ip6 = (struct ip6_hdr *) pkt;
+	uint8_t *seg = pkt + sizeof (*ip6);
+	uint32_t crc;
+	ssize_t len;
+	size_t seglen;
+	int i;
+	memset (&peer, 0, sizeof (peer));
+	peer.sin6_family = AF_INET6;
+	peer.sin6_port = htons (7777);
+	inet_pton (AF_INET6, "2001:db8:420a:1::5", &peer.sin6_addr);
+	for (i = 0; i < 3; i++) {
+		memset (&hint, 0, sizeof (hint));
+		inet_pton (AF_INET6, "2001:db8:420a:1::11", &hint.local);
+		hint.localport = htons (9999);
+		hint.proto = protos [i];
+		len = synergy_packet_hinted (-1, &hint, 3, &peer, pkt, sizeof (pkt));
+		if (len == -1) {
+			fprintf (stderr, "punch for protocol %d: %s\n", protos [i], strerror (errno));
+			failed++;
+			continue;
+		}
+		seglen = len - sizeof (*ip6);
+		if (protos [i] == IPPROTO_SCTP) {
+			memcpy (&crc, seg + 8, 4);
+			memset (seg + 8, 0, 4);
+			check ("sctp punch", le32toh (crc), reference_crc32c (seg, seglen));
+		} else {
+			check ((protos [i] == IPPROTO_TCP) ? "tcp punch" : "udp punch",
+					reference_csum (ip6, seg, seglen), 0);
+		}
+	}
+}
+
+
+int main (int argc, char *argv []) {
+	check_crc32c ();
+	check_frames ();
+	check_punches ();
+	if (failed == 0) {
+		printf ("All checksums are as expected\n");
+	}
+	return (failed == 0) ? 0 : 1;
+}
@@ -0,0 +1,101 @@
+/* replyfilter.c -- Check the kernel filter of synergy_reply_open()
+ *
+ * The filter is attached to one end of a pair of UNIX datagram sockets,
+ * where it sees the datagrams from their first byte, just like it sees the
+ * ICMPv6 messages on a RAW socket.  Sample messages are sent through it,
+ * and those that arrive must be exactly those that should pass: Time
+ * Exceeded in transit and Destination Unreachable, quoting TCP, UDP or
+ * SCTP.  This needs no privileges.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <netinet/icmp6.h>
+
+#include <linux/filter.h>
+
+#include "../src/libsynergy.h"
+
+
+/* The offset of the next header in the IPv6 header that a message quotes.
+ */
+#define QUOTE_NXT 14
+
+
+struct sample {
+	const char *name;
+	uint8_t type;
+	uint8_t code;
+	uint8_t proto;
+	int pass;
+};
+
+static const struct sample samples [] = {
+	{ "time exceeded, tcp",            ICMP6_TIME_EXCEEDED, ICMP6_TIME_EXCEED_TRANSIT, IPPROTO_TCP,  1 },
+	{ "time exceeded, udp",            ICMP6_TIME_EXCEEDED, ICMP6_TIME_EXCEED_TRANSIT, IPPROTO_UDP,  1 },
+	{ "time exceeded, sctp",           ICMP6_TIME_EXCEEDED, ICMP6_TIME_EXCEED_TRANSIT, IPPROTO_SCTP, 1 },
+	{ "time exceeded, icmpv6",         ICMP6_TIME_EXCEEDED, ICMP6_TIME_EXCEED_TRANSIT, IPPROTO_ICMPV6, 0 },
+	{ "time exceeded, extension",      ICMP6_TIME_EXCEEDED, ICMP6_TIME_EXCEED_TRANSIT, IPPROTO_HOPOPTS, 0 },
+	{ "time exceeded in reassembly",   ICMP6_TIME_EXCEEDED, ICMP6_TIME_EXCEED_REASSEMBLY, IPPROTO_TCP, 0 },
+	{ "unreachable, tcp",              ICMP6_DST_UNREACH,   ICMP6_DST_UNREACH_ADMIN,   IPPROTO_TCP,  1 },
+	{ "unreachable, udp",              ICMP6_DST_UNREACH,   ICMP6_DST_UNREACH_NOPORT,  IPPROTO_UDP,  1 },
+	{ "unreachable, icmpv6",           ICMP6_DST_UNREACH,   ICMP6_DST_UNREACH_NOPORT,  IPPROTO_ICMPV6, 0 },
+	{ "packet too big, tcp",           ICMP6_PACKET_TOO_BIG, 0,                        IPPROTO_TCP,  0 },
+	{ "parameter problem, udp",        ICMP6_PARAM_PROB,    0,                         IPPROTO_UDP,  0 },
+	{ "echo reply",                    ICMP6_ECHO_REPLY,    0,                         0,            0 },
+};
+
+
+int main (int argc, char *argv []) {
+	uint8_t msg [128];
+	uint8_t got [sizeof (msg)];
+	unsigned int i;
+	ssize_t len;
+	int failed = 0;
+	int pair [2];
+	if (socketpair (AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0, pair) == -1) {
+		perror ("socketpair");
+		exit (1);
+	}
+	if (setsockopt (pair [1], SOL_SOCKET, SO_ATTACH_FILTER,
+			&synergy_reply_filter, sizeof (synergy_reply_filter)) == -1) {
+		perror ("SO_ATTACH_FILTER");
+		exit (1);
+	}
+	for (i = 0; i < sizeof (samples) / sizeof (samples [0]); i++) {
+		memset (msg, 0, sizeof (msg));
+		msg [0] = samples [i].type;
+		msg [1] = samples [i].code;
+		msg [QUOTE_NXT] = samples [i].proto;
+		if (send (pair [0], msg, sizeof (msg), 0) == -1) {
+			perror ("send");
+			exit (1);
+		}
+		len = recv (pair [1], got, sizeof (got), 0);
+		if ((len == -1) && (errno != EAGAIN)) {
+			perror ("recv");
+			exit (1);
+		}
+		if ((len > 0) != samples [i].pass) {
+			fprintf (stderr, "%s: %s\n", samples [i].name, (len > 0) ? "passed, should drop" : "dropped, should pass");
+			failed++;
+		}
+	}
+	if (failed == 0) {
+		printf ("All %u samples filtered as expected\n", i);
+	}
+	return (failed == 0) ? 0 : 1;
+}
@@ -0,0 +1,134 @@
+/* uringlink.c -- Check the links between the submissions of io_uring
+ *
+ * The engine of src/uring.c is compiled into this test, with the daemon
+ * around it reduced to stubs, and its submission queue in plain memory
+ * without a kernel behind it.  A job without a socket is submitted, then
+ * one with a socket.  The send of the first must not be linked, or it
+ * would chain onto the next submission; the send of the second must be
+ * hard linked to the close of its socket.  This needs no privileges.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include "../src/uring.c"
+
+#include <arpa/inet.h>
+
+
+#define TEST_ENTRIES 8
+
+
+/* The parts of the daemon that the engine calls.
+ */
+int workers_submit (struct job *jobs, int count) {
+	return 0;
+}
+
+int wire_check (struct job *job) {
+	return 0;
+}
+
+void wire_complete (struct wire_reply *wr, uint16_t idx, int error) {
+}
+
+struct metrics_shard *metrics_shard (int idx) {
+	return NULL;
+}
+
+uint64_t metrics_now (void) {
+	return 0;
+}
+
+void metrics_punch (struct metrics_shard *ms, uint8_t proto, int error, uint64_t latency_ns) {
+}
+
+void handle_datagram (struct msghdr *mgh, ssize_t len) {
+}
+
+void evloop_poll (int timeout_ms) {
+}
+
+void shmrings_poll (void) {
+}
+
+int shmrings_idle (void) {
+	return 1;
+}
+
+void fairq_dispatch (void) {
+}
+
+void fairq_pace (int sox) {
+}
+
+
+static int failed = 0;
+
+static void check (const char *what, uint32_t got, uint32_t want) {
+	if (got != want) {
+		fprintf (stderr, "%s: got 0x%x, want 0x%x\n", what, got, want);
+		failed++;
+	}
+}
+
+
+int main (int argc, char *argv []) {
+	static struct io_uring_sqe sqes [TEST_ENTRIES];
+	static uint32_t sqarray [TEST_ENTRIES];
+	uint32_t sqhead = 0, sqtail = 0, sqmask = TEST_ENTRIES - 1;
+	struct job jobs [2];
+	int i, sox;
+	//
+	// Setup the submission queue without a kernel, and a few slots
+	memset (&ur, 0, sizeof (ur));
+	ur.sqhead = &sqhead;
+	ur.sqtail = &sqtail;
+	ur.sqmask = &sqmask;
+	ur.sqarray = sqarray;
+	ur.sqes = sqes;
+	ur.sqentries = TEST_ENTRIES;
+	ur.rawsox = -1;
+	ur.slots = calloc (2, sizeof (struct uring_slot));
+	ur.freeslots = calloc (2, sizeof (int));
+	if ((ur.slots == NULL) || (ur.freeslots == NULL)) {
+		perror ("calloc");
+		exit (1);
+	}
+	ur.freeslots [ur.numfree++] = 0;
+	ur.freeslots [ur.numfree++] = 1;
+	//
+	// The hint describes the local end, so the socket is only closed
+	sox = socket (AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (sox == -1) {
+		perror ("socket");
+		exit (1);
+	}
+	memset (jobs, 0, sizeof (jobs));
+	for (i = 0; i < 2; i++) {
+		jobs [i].symcli.sin6_family = AF_INET6;
+		jobs [i].symcli.sin6_port = htons (7777);
+		inet_pton (AF_INET6, "2001:db8:420a:1::5", &jobs [i].symcli.sin6_addr);
+		inet_pton (AF_INET6, "2001:db8:420a:1::11", &jobs [i].hint.local);
+		jobs [i].hint.localport = htons (9999);
+		jobs [i].hint.proto = IPPROTO_UDP;
+		jobs [i].hoplimit = 3;
+	}
+	jobs [0].sockfd = -1;
+	jobs [1].sockfd = sox;
+	check ("jobs submitted", uring_submit (jobs, 2), 2);
+	//
+	// Expect an unlinked send, a linked send and the close after it
+	check ("entries queued", ur.sqlocal, 3);
+	check ("first opcode", sqes [0].opcode, IORING_OP_SENDMSG);
+	check ("first flags", sqes [0].flags, 0);
+	check ("second opcode", sqes [1].opcode, IORING_OP_SENDMSG);
+	check ("second flags", sqes [1].flags, IOSQE_IO_HARDLINK);
+	check ("third opcode", sqes [2].opcode, IORING_OP_CLOSE);
+	check ("third socket", sqes [2].fd, sox);
+	check ("third flags", sqes [2].flags & IOSQE_IO_HARDLINK, 0);
+	if (failed == 0) {
+		printf ("Only the send with a socket is linked to its close\n");
+	}
+	return (failed == 0) ? 0 : 1;
+}